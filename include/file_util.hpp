@@ -0,0 +1,70 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define GETPID() GetCurrentProcessId()
+#else
+#include <unistd.h>
+#define GETPID() getpid()
+#endif
+
+// 64-bit FNV-1a, used for cache file names since it is stable across
+// implementations and processes, unlike std::hash.
+static inline uint64_t hashString(const std::string& str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : str) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Writes a file by writing a temporary file first and then renaming it, so
+// other threads and processes never read a partially written file.  The
+// temporary file name includes the process id, the thread id, and a
+// timestamp, so concurrent writers never write the same temporary file.
+// The write function writes the file contents to the stream.  Returns false
+// if the file could not be written.
+template<class F>
+static bool writeFileAtomically(
+    const std::string& fileName,
+    F write )
+{
+    const std::string tempFileName = fileName + "." +
+        std::to_string((unsigned long long)GETPID()) + "." +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." +
+        std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+        std::ofstream out(tempFileName, std::ios::binary);
+        write(out);
+        if (!out.good()) {
+            out.close();
+            std::remove(tempFileName.c_str());
+            return false;
+        }
+    }
+
+#if defined(_WIN32)
+    // Renaming a file does not replace an existing file on Windows.
+    std::remove(fileName.c_str());
+#endif
+    if (std::rename(tempFileName.c_str(), fileName.c_str()) != 0) {
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+    return true;
+}
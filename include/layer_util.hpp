@@ -55,6 +55,30 @@ cl_int writeVectorToMemory(
     return CL_SUCCESS;
 }
 
+template<class T>
+cl_int writeArrayToMemory(
+    size_t param_value_size,
+    const T* param,
+    size_t count,
+    size_t *param_value_size_ret,
+    T* pointer )
+{
+    size_t  size = count * sizeof(T);
+
+    if (pointer != nullptr) {
+        if (param_value_size < size) {
+            return CL_INVALID_VALUE;
+        }
+        memcpy(pointer, param, size);
+    }
+
+    if (param_value_size_ret != nullptr) {
+        *param_value_size_ret = size;
+    }
+
+    return CL_SUCCESS;
+}
+
 static inline cl_int writeStringToMemory(
     size_t param_value_size,
     const char* param,
@@ -0,0 +1,88 @@
+/*
+// Copyright (c) 2022-2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+// A simple thread-safe map that is split into shards, each protected by its
+// own mutex, so threads operating on different keys rarely contend.  The
+// number of entries is tracked separately so checking whether the map is
+// empty does not require any locks.
+template<class K, class V, size_t NumShards = 16>
+class CShardedMap
+{
+public:
+    void insert(const K& key, const V& value)
+    {
+        SShard& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        auto result = shard.Map.insert(std::make_pair(key, value));
+        if (result.second) {
+            Size.fetch_add(1, std::memory_order_release);
+        } else {
+            result.first->second = value;
+        }
+    }
+
+    bool find(const K& key, V& value)
+    {
+        SShard& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        auto it = shard.Map.find(key);
+        if (it == shard.Map.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    // Erases the entry for a key, optionally returning its value.
+    bool erase(const K& key, V* value = nullptr)
+    {
+        SShard& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        auto it = shard.Map.find(key);
+        if (it == shard.Map.end()) {
+            return false;
+        }
+        if (value != nullptr) {
+            *value = it->second;
+        }
+        shard.Map.erase(it);
+        Size.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return Size.load(std::memory_order_acquire) == 0;
+    }
+
+private:
+    struct SShard
+    {
+        std::mutex  Mutex;
+        std::unordered_map<K, V>    Map;
+    };
+
+    SShard  Shards[NumShards];
+    std::atomic<size_t> Size{0};
+
+    SShard& getShard(const K& key)
+    {
+        // Keys are often pointers with zeros in the low bits, so mix in the
+        // higher bits before choosing a shard.
+        size_t h = std::hash<K>()(key);
+        h ^= h >> 16;
+        h ^= h >> 8;
+        h ^= h >> 4;
+        return Shards[h % NumShards];
+    }
+};
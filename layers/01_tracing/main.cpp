@@ -0,0 +1,489 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+
+#if defined _WIN32 || defined __CYGWIN__
+#ifdef __GNUC__
+#define CL_API_ENTRY __attribute__((dllexport))
+#else
+#define CL_API_ENTRY __declspec(dllexport)
+#endif
+#else
+#if __GNUC__ >= 4
+#define CL_API_ENTRY __attribute__((visibility("default")))
+#else
+#define CL_API_ENTRY
+#endif
+#endif
+
+#include <CL/cl_layer.h>
+
+#include <cstdlib>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "layer_util.hpp"
+#include "getenv_util.hpp"
+
+#include "tracing.h"
+
+// The trace is written to this file in the Chrome trace event JSON format
+// when the process exits.  The file may be opened with chrome://tracing or
+// the Perfetto UI.
+
+std::string g_FileName = "cltrace.json";
+
+// Collecting device timestamps enables profiling on every command-queue and
+// records the device execution time of each enqueued command, using an event
+// for each command even if the application did not request one.
+
+bool g_DeviceTimestamps = true;
+
+// The ring buffer size is the number of records kept for each thread and for
+// each command-queue.  When a ring buffer is full the oldest records are
+// overwritten.
+
+cl_uint g_RingBufferSize = 65536;
+
+const struct _cl_icd_dispatch* g_pNextDispatch = NULL;
+
+// Traces an API call by timing the call to the next dispatch table.
+template <typename T, T _cl_icd_dispatch::*Member>
+struct STrace;
+
+template <typename R, typename... Args, R (CL_API_CALL *_cl_icd_dispatch::*Member)(Args...)>
+struct STrace<R (CL_API_CALL *)(Args...), Member>
+{
+    static const char* Name;
+
+    static R CL_API_CALL call(Args... args)
+    {
+        CHostCallScope scope(Name);
+        return (g_pNextDispatch->*Member)(args...);
+    }
+};
+
+template <typename R, typename... Args, R (CL_API_CALL *_cl_icd_dispatch::*Member)(Args...)>
+const char* STrace<R (CL_API_CALL *)(Args...), Member>::Name = nullptr;
+
+static inline bool isSuccess(cl_int errorCode)
+{
+    return errorCode == CL_SUCCESS;
+}
+
+static inline bool isSuccess(void* ptr)
+{
+    return ptr != nullptr;
+}
+
+template <typename T>
+static inline cl_kernel getKernel(T)
+{
+    return nullptr;
+}
+
+static inline cl_kernel getKernel(cl_kernel kernel)
+{
+    return kernel;
+}
+
+// Traces an enqueue API call by timing the call to the next dispatch table,
+// and records the device execution time of the command using its event.
+// EventFromEnd is the position of the event parameter, counting from the
+// last parameter.
+template <typename T, T _cl_icd_dispatch::*Member, size_t EventFromEnd>
+struct STraceEnqueue;
+
+template <typename R, typename... Args, R (CL_API_CALL *_cl_icd_dispatch::*Member)(Args...), size_t EventFromEnd>
+struct STraceEnqueue<R (CL_API_CALL *)(Args...), Member, EventFromEnd>
+{
+    typedef std::tuple<Args...> CParams;
+    static constexpr size_t EventIndex = sizeof...(Args) - 1 - EventFromEnd;
+
+    static_assert(std::is_same<
+        typename std::tuple_element<0, CParams>::type,
+        cl_command_queue>::value,
+        "the first parameter must be a command-queue");
+    static_assert(std::is_same<
+        typename std::tuple_element<EventIndex, CParams>::type,
+        cl_event*>::value,
+        "the event parameter must be a cl_event*");
+
+    static const char* Name;
+
+    static R CL_API_CALL call(Args... args)
+    {
+        if (g_DeviceTimestamps == false) {
+            CHostCallScope scope(Name);
+            return (g_pNextDispatch->*Member)(args...);
+        }
+
+        CParams params(args...);
+
+        cl_event*& event = std::get<EventIndex>(params);
+        const bool appEvent = event != nullptr;
+        cl_event layerEvent = nullptr;
+        if (appEvent == false) {
+            event = &layerEvent;
+        }
+
+        const cl_ulong start = getTimestamp();
+        R ret = invoke(params, std::index_sequence_for<Args...>());
+        recordHostCall(Name, start, getTimestamp());
+
+        if (isSuccess(ret)) {
+            traceEvent(
+                Name,
+                std::get<0>(params),
+                getKernel(std::get<1>(params)),
+                start,
+                event[0],
+                appEvent);
+        }
+
+        return ret;
+    }
+
+private:
+    template <size_t... I>
+    static R invoke(CParams& params, std::index_sequence<I...>)
+    {
+        return (g_pNextDispatch->*Member)(std::get<I>(params)...);
+    }
+};
+
+template <typename R, typename... Args, R (CL_API_CALL *_cl_icd_dispatch::*Member)(Args...), size_t EventFromEnd>
+const char* STraceEnqueue<R (CL_API_CALL *)(Args...), Member, EventFromEnd>::Name = nullptr;
+
+static cl_command_queue CL_API_CALL
+clCreateCommandQueue_layer(
+    cl_context                  context,
+    cl_device_id                device,
+    cl_command_queue_properties properties,
+    cl_int*                     errcode_ret)
+{
+    CHostCallScope scope("clCreateCommandQueue");
+
+    if (g_DeviceTimestamps && !(properties & CL_QUEUE_ON_DEVICE)) {
+        properties |= CL_QUEUE_PROFILING_ENABLE;
+    }
+
+    return g_pNextDispatch->clCreateCommandQueue(
+        context,
+        device,
+        properties,
+        errcode_ret);
+}
+
+static cl_command_queue CL_API_CALL
+clCreateCommandQueueWithProperties_layer(
+    cl_context                  context,
+    cl_device_id                device,
+    const cl_queue_properties*  properties,
+    cl_int*                     errcode_ret)
+{
+    CHostCallScope scope("clCreateCommandQueueWithProperties");
+
+    if (g_DeviceTimestamps == false) {
+        return g_pNextDispatch->clCreateCommandQueueWithProperties(
+            context,
+            device,
+            properties,
+            errcode_ret);
+    }
+
+    std::vector<cl_queue_properties> newProperties;
+    bool found = false;
+    if (properties) {
+        for (auto check = properties; check[0] != 0; check += 2) {
+            cl_queue_properties value = check[1];
+            if (check[0] == CL_QUEUE_PROPERTIES) {
+                if (!(value & CL_QUEUE_ON_DEVICE)) {
+                    value |= CL_QUEUE_PROFILING_ENABLE;
+                }
+                found = true;
+            }
+            newProperties.push_back(check[0]);
+            newProperties.push_back(value);
+        }
+    }
+    if (found == false) {
+        newProperties.push_back(CL_QUEUE_PROPERTIES);
+        newProperties.push_back(CL_QUEUE_PROFILING_ENABLE);
+    }
+    newProperties.push_back(0);
+
+    return g_pNextDispatch->clCreateCommandQueueWithProperties(
+        context,
+        device,
+        newProperties.data(),
+        errcode_ret);
+}
+
+static cl_int CL_API_CALL
+clReleaseCommandQueue_layer(
+    cl_command_queue command_queue)
+{
+    CHostCallScope scope("clReleaseCommandQueue");
+
+    // Device commands are only recorded for command-queues when device
+    // timestamps are enabled.
+    cl_uint refCount = 0;
+    if (g_DeviceTimestamps) {
+        g_pNextDispatch->clGetCommandQueueInfo(
+            command_queue,
+            CL_QUEUE_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+    }
+
+    cl_int retVal = g_pNextDispatch->clReleaseCommandQueue(command_queue);
+    if (retVal == CL_SUCCESS && refCount == 1) {
+        releaseQueue(command_queue);
+    }
+    return retVal;
+}
+
+#define TRACE(_name)                                                        \
+    STrace<decltype(dispatch._name), &_cl_icd_dispatch::_name>::Name =      \
+        #_name;                                                             \
+    dispatch._name =                                                        \
+        STrace<decltype(dispatch._name), &_cl_icd_dispatch::_name>::call;
+
+#define TRACE_ENQUEUE(_name, _eventFromEnd)                                 \
+    STraceEnqueue<decltype(dispatch._name), &_cl_icd_dispatch::_name,       \
+        _eventFromEnd>::Name = #_name;                                      \
+    dispatch._name =                                                        \
+        STraceEnqueue<decltype(dispatch._name), &_cl_icd_dispatch::_name,   \
+            _eventFromEnd>::call;
+
+static struct _cl_icd_dispatch dispatch;
+static void _init_dispatch()
+{
+    // Platforms and devices.
+    TRACE(clGetPlatformIDs);
+    TRACE(clGetPlatformInfo);
+    TRACE(clGetDeviceIDs);
+    TRACE(clGetDeviceInfo);
+    TRACE(clCreateSubDevices);
+    TRACE(clRetainDevice);
+    TRACE(clReleaseDevice);
+    TRACE(clSetDefaultDeviceCommandQueue);
+    TRACE(clGetDeviceAndHostTimer);
+    TRACE(clGetHostTimer);
+    TRACE(clGetExtensionFunctionAddress);
+    TRACE(clGetExtensionFunctionAddressForPlatform);
+
+    // Contexts.
+    TRACE(clCreateContext);
+    TRACE(clCreateContextFromType);
+    TRACE(clRetainContext);
+    TRACE(clReleaseContext);
+    TRACE(clGetContextInfo);
+    TRACE(clSetContextDestructorCallback);
+
+    // Command-queues.
+    dispatch.clCreateCommandQueue = clCreateCommandQueue_layer;
+    dispatch.clCreateCommandQueueWithProperties = clCreateCommandQueueWithProperties_layer;
+    TRACE(clRetainCommandQueue);
+    dispatch.clReleaseCommandQueue = clReleaseCommandQueue_layer;
+    TRACE(clGetCommandQueueInfo);
+    TRACE(clSetCommandQueueProperty);
+    TRACE(clFlush);
+    TRACE(clFinish);
+
+    // Memory objects.
+    TRACE(clCreateBuffer);
+    TRACE(clCreateBufferWithProperties);
+    TRACE(clCreateSubBuffer);
+    TRACE(clCreateImage);
+    TRACE(clCreateImageWithProperties);
+    TRACE(clCreateImage2D);
+    TRACE(clCreateImage3D);
+    TRACE(clCreatePipe);
+    TRACE(clRetainMemObject);
+    TRACE(clReleaseMemObject);
+    TRACE(clGetSupportedImageFormats);
+    TRACE(clGetMemObjectInfo);
+    TRACE(clGetImageInfo);
+    TRACE(clGetPipeInfo);
+    TRACE(clSetMemObjectDestructorCallback);
+    TRACE(clSVMAlloc);
+    TRACE(clSVMFree);
+
+    // Samplers.
+    TRACE(clCreateSampler);
+    TRACE(clCreateSamplerWithProperties);
+    TRACE(clRetainSampler);
+    TRACE(clReleaseSampler);
+    TRACE(clGetSamplerInfo);
+
+    // Programs.
+    TRACE(clCreateProgramWithSource);
+    TRACE(clCreateProgramWithBinary);
+    TRACE(clCreateProgramWithBuiltInKernels);
+    TRACE(clCreateProgramWithIL);
+    TRACE(clRetainProgram);
+    TRACE(clReleaseProgram);
+    TRACE(clBuildProgram);
+    TRACE(clCompileProgram);
+    TRACE(clLinkProgram);
+    TRACE(clSetProgramReleaseCallback);
+    TRACE(clSetProgramSpecializationConstant);
+    TRACE(clUnloadPlatformCompiler);
+    TRACE(clUnloadCompiler);
+    TRACE(clGetProgramInfo);
+    TRACE(clGetProgramBuildInfo);
+
+    // Kernels.
+    TRACE(clCreateKernel);
+    TRACE(clCreateKernelsInProgram);
+    TRACE(clCloneKernel);
+    TRACE(clRetainKernel);
+    TRACE(clReleaseKernel);
+    TRACE(clSetKernelArg);
+    TRACE(clSetKernelArgSVMPointer);
+    TRACE(clSetKernelExecInfo);
+    TRACE(clGetKernelInfo);
+    TRACE(clGetKernelArgInfo);
+    TRACE(clGetKernelWorkGroupInfo);
+    TRACE(clGetKernelSubGroupInfo);
+
+    // Events.
+    TRACE(clWaitForEvents);
+    TRACE(clGetEventInfo);
+    TRACE(clCreateUserEvent);
+    TRACE(clRetainEvent);
+    TRACE(clReleaseEvent);
+    TRACE(clSetUserEventStatus);
+    TRACE(clSetEventCallback);
+    TRACE(clGetEventProfilingInfo);
+
+    // Enqueues.
+    TRACE_ENQUEUE(clEnqueueReadBuffer, 0);
+    TRACE_ENQUEUE(clEnqueueReadBufferRect, 0);
+    TRACE_ENQUEUE(clEnqueueWriteBuffer, 0);
+    TRACE_ENQUEUE(clEnqueueWriteBufferRect, 0);
+    TRACE_ENQUEUE(clEnqueueFillBuffer, 0);
+    TRACE_ENQUEUE(clEnqueueCopyBuffer, 0);
+    TRACE_ENQUEUE(clEnqueueCopyBufferRect, 0);
+    TRACE_ENQUEUE(clEnqueueReadImage, 0);
+    TRACE_ENQUEUE(clEnqueueWriteImage, 0);
+    TRACE_ENQUEUE(clEnqueueFillImage, 0);
+    TRACE_ENQUEUE(clEnqueueCopyImage, 0);
+    TRACE_ENQUEUE(clEnqueueCopyImageToBuffer, 0);
+    TRACE_ENQUEUE(clEnqueueCopyBufferToImage, 0);
+    TRACE_ENQUEUE(clEnqueueMapBuffer, 1);
+    TRACE_ENQUEUE(clEnqueueMapImage, 1);
+    TRACE_ENQUEUE(clEnqueueUnmapMemObject, 0);
+    TRACE_ENQUEUE(clEnqueueMigrateMemObjects, 0);
+    TRACE_ENQUEUE(clEnqueueNDRangeKernel, 0);
+    TRACE_ENQUEUE(clEnqueueTask, 0);
+    TRACE_ENQUEUE(clEnqueueNativeKernel, 0);
+    TRACE_ENQUEUE(clEnqueueMarker, 0);
+    TRACE_ENQUEUE(clEnqueueMarkerWithWaitList, 0);
+    TRACE_ENQUEUE(clEnqueueBarrierWithWaitList, 0);
+    TRACE_ENQUEUE(clEnqueueSVMFree, 0);
+    TRACE_ENQUEUE(clEnqueueSVMMemcpy, 0);
+    TRACE_ENQUEUE(clEnqueueSVMMemFill, 0);
+    TRACE_ENQUEUE(clEnqueueSVMMap, 0);
+    TRACE_ENQUEUE(clEnqueueSVMUnmap, 0);
+    TRACE_ENQUEUE(clEnqueueSVMMigrateMem, 0);
+    TRACE(clEnqueueWaitForEvents);
+    TRACE(clEnqueueBarrier);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetLayerInfo(
+    cl_layer_info  param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    switch (param_name) {
+    case CL_LAYER_API_VERSION:
+        {
+            auto ptr = (cl_layer_api_version*)param_value;
+            auto value = cl_layer_api_version{CL_LAYER_API_VERSION_100};
+            return writeParamToMemory(
+                param_value_size,
+                value,
+                param_value_size_ret,
+                ptr);
+        }
+        break;
+#if defined(CL_LAYER_NAME)
+    case CL_LAYER_NAME:
+        {
+            auto ptr = (char*)param_value;
+            return writeStringToMemory(
+                param_value_size,
+                "Tracing Layer",
+                param_value_size_ret,
+                ptr);
+        }
+        break;
+#endif
+    default:
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clInitLayerWithProperties(
+    cl_uint num_entries,
+    const struct _cl_icd_dispatch* target_dispatch,
+    cl_uint* num_entries_out,
+    const struct _cl_icd_dispatch** layer_dispatch_ret,
+    const cl_layer_properties* properties)
+{
+    const size_t dispatchTableSize =
+        sizeof(dispatch) / sizeof(dispatch.clGetPlatformIDs);
+
+    if (target_dispatch == nullptr ||
+        num_entries_out == nullptr ||
+        layer_dispatch_ret == nullptr) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (num_entries < dispatchTableSize) {
+        return CL_INVALID_VALUE;
+    }
+
+    getControl("TRACING_FileName", g_FileName);
+    getControl("TRACING_DeviceTimestamps", g_DeviceTimestamps);
+    getControl("TRACING_RingBufferSize", g_RingBufferSize);
+
+    _init_dispatch();
+
+    g_pNextDispatch = target_dispatch;
+
+    *layer_dispatch_ret = &dispatch;
+    *num_entries_out = dispatchTableSize;
+
+    static bool registered = false;
+    if (registered == false) {
+        atexit(writeTrace);
+        registered = true;
+    }
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clInitLayer(
+    cl_uint num_entries,
+    const struct _cl_icd_dispatch* target_dispatch,
+    cl_uint* num_entries_out,
+    const struct _cl_icd_dispatch** layer_dispatch_ret)
+{
+    return clInitLayerWithProperties(
+        num_entries,
+        target_dispatch,
+        num_entries_out,
+        layer_dispatch_ret,
+        nullptr);
+}
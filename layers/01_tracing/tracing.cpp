@@ -0,0 +1,409 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+
+#include <CL/cl_layer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "tracing.h"
+
+struct SRecord
+{
+    const char* Name;
+    cl_ulong    Start;
+    cl_ulong    End;
+};
+
+// A ring buffer of records.  When the buffer is full the oldest records are
+// overwritten, so the trace contains the most recent records.  Records are
+// allocated in chunks as they are needed, so threads and command-queues that
+// record few calls or commands only use a small amount of memory.  Records
+// are added and read with the buffer lock held.
+struct SRecordBuffer
+{
+    static constexpr size_t cChunkSize = 1024;
+
+    SRecordBuffer(size_t size) : Size(size ? size : 1) {}
+
+    void add(const char* name, cl_ulong start, cl_ulong end)
+    {
+        // Records are added in order, so a new chunk is only needed when
+        // the first record in the chunk is added.
+        const size_t index = Count % Size;
+        const size_t chunk = index / cChunkSize;
+        if (chunk == Chunks.size()) {
+            const size_t remaining = Size - index;
+            Chunks.emplace_back(
+                new SRecord[remaining < cChunkSize ? remaining : cChunkSize]);
+        }
+
+        SRecord& record = Chunks[chunk][index % cChunkSize];
+        record.Name = name;
+        record.Start = start;
+        record.End = end;
+        Count++;
+    }
+
+    const SRecord& get(cl_ulong i) const
+    {
+        const size_t index = i % Size;
+        return Chunks[index / cChunkSize][index % cChunkSize];
+    }
+
+    mutable std::mutex  Mutex;
+    const size_t        Size;
+    std::vector<std::unique_ptr<SRecord[]>> Chunks;
+    cl_ulong            Count = 0;
+};
+
+struct STraceContext
+{
+    std::mutex  Mutex;
+    bool        Written = false;
+
+    // Host API calls, one buffer per thread.  Buffers for threads that have
+    // exited are reused by new threads.
+    std::vector<std::unique_ptr<SRecordBuffer>> ThreadBuffers;
+    std::vector<SRecordBuffer*> FreeThreadBuffers;
+
+    // Device commands, one buffer per command-queue, in the order the
+    // command-queues were first seen.  Device commands are recorded from
+    // event callbacks, so these buffers are only accessed with the lock.
+    std::map<cl_command_queue, size_t>  QueueIndices;
+    std::vector<std::pair<cl_command_queue, std::unique_ptr<SRecordBuffer>>>
+        QueueBuffers;
+
+    // Storage for kernel names.
+    std::set<std::string>   KernelNames;
+};
+
+static STraceContext& getTraceContext()
+{
+    // The trace context is never destroyed, since event callbacks may still
+    // record device commands while the process is exiting.
+    static STraceContext* context = new STraceContext();
+    return *context;
+}
+
+// Set when the trace is written, so host API calls are no longer recorded.
+static std::atomic<bool> g_Stopped{false};
+
+// The buffer for host API calls on a thread.  The buffer is created when the
+// thread makes its first host API call, and it is returned to the trace
+// context when the thread exits, so the number of buffers is the number of
+// threads that made host API calls at the same time.
+struct CThreadBuffer
+{
+    ~CThreadBuffer()
+    {
+        if (Buffer) {
+            auto& context = getTraceContext();
+            std::lock_guard<std::mutex> lock(context.Mutex);
+            context.FreeThreadBuffers.push_back(Buffer);
+            Buffer = nullptr;
+        }
+    }
+
+    SRecordBuffer* get()
+    {
+        if (Buffer == nullptr) {
+            auto& context = getTraceContext();
+            std::lock_guard<std::mutex> lock(context.Mutex);
+            if (!context.FreeThreadBuffers.empty()) {
+                Buffer = context.FreeThreadBuffers.back();
+                context.FreeThreadBuffers.pop_back();
+            } else {
+                context.ThreadBuffers.emplace_back(
+                    new SRecordBuffer(g_RingBufferSize));
+                Buffer = context.ThreadBuffers.back().get();
+            }
+        }
+        return Buffer;
+    }
+
+    SRecordBuffer* Buffer = nullptr;
+};
+
+static thread_local CThreadBuffer t_ThreadBuffer;
+
+void recordHostCall(
+    const char* name,
+    cl_ulong start,
+    cl_ulong end)
+{
+    if (g_Stopped.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // The buffer lock is only contended when the trace is written.
+    SRecordBuffer* buffer = t_ThreadBuffer.get();
+    std::lock_guard<std::mutex> lock(buffer->Mutex);
+    buffer->add(name, start, end);
+}
+
+struct SEventData
+{
+    const char*         Name;
+    cl_command_queue    Queue;
+    cl_kernel           Kernel;
+    cl_ulong            HostStart;
+};
+
+static void recordDeviceCommand(
+    const SEventData* data,
+    cl_ulong start,
+    cl_ulong end)
+{
+    std::string kernelName;
+    if (data->Kernel) {
+        size_t size = 0;
+        g_pNextDispatch->clGetKernelInfo(
+            data->Kernel,
+            CL_KERNEL_FUNCTION_NAME,
+            0,
+            nullptr,
+            &size);
+        if (size) {
+            kernelName.resize(size);
+            g_pNextDispatch->clGetKernelInfo(
+                data->Kernel,
+                CL_KERNEL_FUNCTION_NAME,
+                size,
+                &kernelName[0],
+                nullptr);
+            kernelName.pop_back();
+        }
+    }
+
+    auto& context = getTraceContext();
+    std::lock_guard<std::mutex> lock(context.Mutex);
+
+    const char* name = data->Name;
+    if (!kernelName.empty()) {
+        name = context.KernelNames.insert(kernelName).first->c_str();
+    }
+
+    auto it = context.QueueIndices.find(data->Queue);
+    if (it == context.QueueIndices.end()) {
+        it = context.QueueIndices.emplace(
+            data->Queue, context.QueueBuffers.size()).first;
+        context.QueueBuffers.emplace_back(
+            data->Queue, std::unique_ptr<SRecordBuffer>(
+                new SRecordBuffer(g_RingBufferSize)));
+    }
+
+    SRecordBuffer& buffer = *context.QueueBuffers[it->second].second;
+    std::lock_guard<std::mutex> bufferLock(buffer.Mutex);
+    buffer.add(name, start, end);
+}
+
+void releaseQueue(
+    cl_command_queue queue)
+{
+    // The buffer for the command-queue is kept so its records are written,
+    // but a new command-queue with the same handle gets a new buffer.
+    auto& context = getTraceContext();
+    std::lock_guard<std::mutex> lock(context.Mutex);
+    context.QueueIndices.erase(queue);
+}
+
+static void CL_CALLBACK eventCallback(
+    cl_event event,
+    cl_int status,
+    void* user_data)
+{
+    SEventData* data = (SEventData*)user_data;
+
+    // Device timestamps are in the device timebase, so they are placed
+    // relative to the start of the host API call that enqueued the command,
+    // which corresponds to the time the command was queued.
+    cl_ulong queued = 0;
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+    if (status == CL_COMPLETE &&
+        g_pNextDispatch->clGetEventProfilingInfo(
+            event,
+            CL_PROFILING_COMMAND_QUEUED,
+            sizeof(queued),
+            &queued,
+            nullptr) == CL_SUCCESS &&
+        g_pNextDispatch->clGetEventProfilingInfo(
+            event,
+            CL_PROFILING_COMMAND_START,
+            sizeof(start),
+            &start,
+            nullptr) == CL_SUCCESS &&
+        g_pNextDispatch->clGetEventProfilingInfo(
+            event,
+            CL_PROFILING_COMMAND_END,
+            sizeof(end),
+            &end,
+            nullptr) == CL_SUCCESS &&
+        start >= queued && end >= start) {
+        recordDeviceCommand(
+            data,
+            data->HostStart + (start - queued),
+            data->HostStart + (end - queued));
+    }
+
+    if (data->Kernel) {
+        g_pNextDispatch->clReleaseKernel(data->Kernel);
+    }
+    g_pNextDispatch->clReleaseEvent(event);
+    delete data;
+}
+
+void traceEvent(
+    const char* name,
+    cl_command_queue queue,
+    cl_kernel kernel,
+    cl_ulong hostStart,
+    cl_event event,
+    bool retainEvent)
+{
+    if (retainEvent) {
+        g_pNextDispatch->clRetainEvent(event);
+    }
+    if (kernel) {
+        g_pNextDispatch->clRetainKernel(kernel);
+    }
+
+    SEventData* data = new SEventData{name, queue, kernel, hostStart};
+    cl_int errorCode = g_pNextDispatch->clSetEventCallback(
+        event,
+        CL_COMPLETE,
+        eventCallback,
+        data);
+    if (errorCode != CL_SUCCESS) {
+        if (kernel) {
+            g_pNextDispatch->clReleaseKernel(kernel);
+        }
+        g_pNextDispatch->clReleaseEvent(event);
+        delete data;
+    }
+}
+
+static cl_ulong getRecordRange(
+    const SRecordBuffer& buffer,
+    cl_ulong& begin)
+{
+    const cl_ulong count = buffer.Count;
+    const cl_ulong size = buffer.Size;
+    begin = count > size ? count - size : 0;
+    return count;
+}
+
+static void writeRecords(
+    FILE* fp,
+    const SRecordBuffer& buffer,
+    int pid,
+    size_t tid,
+    cl_ulong base)
+{
+    std::lock_guard<std::mutex> lock(buffer.Mutex);
+    cl_ulong begin = 0;
+    const cl_ulong end = getRecordRange(buffer, begin);
+    for (cl_ulong i = begin; i < end; i++) {
+        const SRecord& record = buffer.get(i);
+        const cl_ulong start = record.Start > base ? record.Start - base : 0;
+        const cl_ulong duration =
+            record.End > record.Start ? record.End - record.Start : 0;
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%zu,"
+            "\"ts\":%.3f,\"dur\":%.3f}",
+            record.Name, pid, tid, start / 1000.0, duration / 1000.0);
+    }
+}
+
+void writeTrace()
+{
+    // Host API calls on other threads may still be recorded while the trace
+    // is written, so recording is stopped first, and each buffer is read
+    // with its lock held.
+    g_Stopped.store(true, std::memory_order_relaxed);
+
+    auto& context = getTraceContext();
+    std::lock_guard<std::mutex> lock(context.Mutex);
+
+    if (context.Written) {
+        return;
+    }
+    context.Written = true;
+
+    if (context.ThreadBuffers.empty() && context.QueueBuffers.empty()) {
+        return;
+    }
+
+    FILE* fp = fopen(g_FileName.c_str(), "w");
+    if (fp == nullptr) {
+        fprintf(stderr, "Tracing Layer: couldn't open trace file %s!\n",
+            g_FileName.c_str());
+        return;
+    }
+
+    // Timestamps in the trace are relative to the earliest record, and
+    // records that were overwritten are counted so they can be reported.
+    cl_ulong base = ~(cl_ulong)0;
+    cl_ulong dropped = 0;
+    auto scan = [&](const SRecordBuffer& buffer) {
+        std::lock_guard<std::mutex> lock(buffer.Mutex);
+        cl_ulong begin = 0;
+        const cl_ulong end = getRecordRange(buffer, begin);
+        for (cl_ulong i = begin; i < end; i++) {
+            const SRecord& record = buffer.get(i);
+            base = std::min(base, record.Start);
+        }
+        dropped += begin;
+    };
+    for (const auto& buffer : context.ThreadBuffers) {
+        scan(*buffer);
+    }
+    for (const auto& queueBuffer : context.QueueBuffers) {
+        scan(*queueBuffer.second);
+    }
+
+    const int hostPid = 1;
+    const int devicePid = 2;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"args\":{\"name\":\"Host API Calls\"}},\n", hostPid);
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"args\":{\"name\":\"Device Commands\"}}", devicePid);
+    for (size_t tid = 0; tid < context.ThreadBuffers.size(); tid++) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%zu,\"args\":{\"name\":\"Thread %zu\"}}",
+            hostPid, tid, tid);
+    }
+    for (size_t tid = 0; tid < context.QueueBuffers.size(); tid++) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%zu,\"args\":{\"name\":\"Queue %zu (%p)\"}}",
+            devicePid, tid, tid, (void*)context.QueueBuffers[tid].first);
+    }
+
+    for (size_t tid = 0; tid < context.ThreadBuffers.size(); tid++) {
+        writeRecords(fp, *context.ThreadBuffers[tid], hostPid, tid, base);
+    }
+    for (size_t tid = 0; tid < context.QueueBuffers.size(); tid++) {
+        writeRecords(fp, *context.QueueBuffers[tid].second, devicePid, tid, base);
+    }
+
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(fp);
+
+    if (dropped) {
+        fprintf(stderr, "Tracing Layer: %llu records were overwritten, "
+            "increase TRACING_RingBufferSize to keep them.\n",
+            (unsigned long long)dropped);
+    }
+}
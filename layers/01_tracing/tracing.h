@@ -0,0 +1,63 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+
+#include <CL/cl.h>
+
+#include <chrono>
+#include <string>
+
+extern const struct _cl_icd_dispatch* g_pNextDispatch;
+
+extern std::string g_FileName;
+extern bool g_DeviceTimestamps;
+extern cl_uint g_RingBufferSize;
+
+static inline cl_ulong getTimestamp()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records a host API call on the calling thread.  The name must remain valid
+// until the trace is written.
+void recordHostCall(
+    const char* name,
+    cl_ulong start,
+    cl_ulong end);
+
+// Records the device execution time for an enqueued command when the event
+// is complete.  If retainEvent is false, the event is owned by the layer and
+// released when the device execution time is recorded.
+void traceEvent(
+    const char* name,
+    cl_command_queue queue,
+    cl_kernel kernel,
+    cl_ulong hostStart,
+    cl_event event,
+    bool retainEvent);
+
+// Called when a command-queue is released for the last time, so a new
+// command-queue with the same handle is traced separately.
+void releaseQueue(
+    cl_command_queue queue);
+
+// Writes the trace file.  Called once, when the process exits.
+void writeTrace();
+
+// Times a host API call from construction to destruction.
+struct CHostCallScope
+{
+    CHostCallScope(const char* name) :
+        Name(name),
+        Start(getTimestamp()) {}
+    ~CHostCallScope()
+    {
+        recordHostCall(Name, Start, getTimestamp());
+    }
+
+    const char* const Name;
+    const cl_ulong Start;
+};
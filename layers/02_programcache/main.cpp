@@ -0,0 +1,399 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+
+#if defined _WIN32 || defined __CYGWIN__
+#ifdef __GNUC__
+#define CL_API_ENTRY __attribute__((dllexport))
+#else
+#define CL_API_ENTRY __declspec(dllexport)
+#endif
+#else
+#if __GNUC__ >= 4
+#define CL_API_ENTRY __attribute__((visibility("default")))
+#else
+#define CL_API_ENTRY
+#endif
+#endif
+
+#include <CL/cl_layer.h>
+
+#include "layer_util.hpp"
+#include "getenv_util.hpp"
+
+#include "programcache.h"
+
+// Program binaries are cached in this directory.  Programs created from
+// source are built from the cached binaries when the source, build options,
+// device, and driver match a previous build.  When no cache directory is
+// set, the layer does nothing.
+
+std::string g_CacheDir;
+
+const struct _cl_icd_dispatch* g_pNextDispatch = NULL;
+
+static cl_program CL_API_CALL
+clCreateProgramWithSource_layer(
+    cl_context      context,
+    cl_uint         count,
+    const char**    strings,
+    const size_t*   lengths,
+    cl_int*         errcode_ret)
+{
+    if (g_CacheDir.empty()) {
+        return g_pNextDispatch->clCreateProgramWithSource(
+            context,
+            count,
+            strings,
+            lengths,
+            errcode_ret);
+    }
+
+    return clCreateProgramWithSource_override(
+        context,
+        count,
+        strings,
+        lengths,
+        errcode_ret);
+}
+
+static cl_program CL_API_CALL
+clCreateProgramWithBinary_layer(
+    cl_context                      context,
+    cl_uint                         num_devices,
+    const cl_device_id*             device_list,
+    const size_t*                   lengths,
+    const unsigned char**           binaries,
+    cl_int*                         binary_status,
+    cl_int*                         errcode_ret)
+{
+    cl_program program = g_pNextDispatch->clCreateProgramWithBinary(
+        context,
+        num_devices,
+        device_list,
+        lengths,
+        binaries,
+        binary_status,
+        errcode_ret);
+    trackProgram(program);
+    return program;
+}
+
+static cl_program CL_API_CALL
+clCreateProgramWithBuiltInKernels_layer(
+    cl_context          context,
+    cl_uint             num_devices,
+    const cl_device_id* device_list,
+    const char*         kernel_names,
+    cl_int*             errcode_ret)
+{
+    cl_program program = g_pNextDispatch->clCreateProgramWithBuiltInKernels(
+        context,
+        num_devices,
+        device_list,
+        kernel_names,
+        errcode_ret);
+    trackProgram(program);
+    return program;
+}
+
+static cl_program CL_API_CALL
+clCreateProgramWithIL_layer(
+    cl_context      context,
+    const void*     il,
+    size_t          length,
+    cl_int*         errcode_ret)
+{
+    cl_program program = g_pNextDispatch->clCreateProgramWithIL(
+        context,
+        il,
+        length,
+        errcode_ret);
+    trackProgram(program);
+    return program;
+}
+
+static cl_program CL_API_CALL
+clLinkProgram_layer(
+    cl_context          context,
+    cl_uint             num_devices,
+    const cl_device_id* device_list,
+    const char*         options,
+    cl_uint             num_input_programs,
+    const cl_program*   input_programs,
+    void (CL_CALLBACK*  pfn_notify)(cl_program program, void* user_data),
+    void*               user_data,
+    cl_int*             errcode_ret)
+{
+    cl_program program = g_pNextDispatch->clLinkProgram(
+        context,
+        num_devices,
+        device_list,
+        options,
+        num_input_programs,
+        input_programs,
+        pfn_notify,
+        user_data,
+        errcode_ret);
+    trackProgram(program);
+    return program;
+}
+
+static cl_int CL_API_CALL
+clBuildProgram_layer(
+    cl_program          program,
+    cl_uint             num_devices,
+    const cl_device_id* device_list,
+    const char*         options,
+    void (CL_CALLBACK*  pfn_notify)(cl_program program, void* user_data),
+    void*               user_data)
+{
+    return clBuildProgram_override(
+        program,
+        num_devices,
+        device_list,
+        options,
+        pfn_notify,
+        user_data);
+}
+
+static cl_int CL_API_CALL
+clReleaseProgram_layer(
+    cl_program  program)
+{
+    clReleaseProgram_override(program);
+
+    return g_pNextDispatch->clReleaseProgram(program);
+}
+
+static cl_int CL_API_CALL
+clGetProgramInfo_layer(
+    cl_program      program,
+    cl_program_info param_name,
+    size_t          param_value_size,
+    void*           param_value,
+    size_t*         param_value_size_ret)
+{
+    // The reference count and source are properties of the program created
+    // from source.  All other queries, including the binaries and kernel
+    // names, are for the program built from cached binaries.
+    if (param_name != CL_PROGRAM_REFERENCE_COUNT &&
+        param_name != CL_PROGRAM_SOURCE) {
+        program = getBinaryProgram(program);
+    }
+
+    return g_pNextDispatch->clGetProgramInfo(
+        program,
+        param_name,
+        param_value_size,
+        param_value,
+        param_value_size_ret);
+}
+
+static cl_int CL_API_CALL
+clGetProgramBuildInfo_layer(
+    cl_program              program,
+    cl_device_id            device,
+    cl_program_build_info   param_name,
+    size_t                  param_value_size,
+    void*                   param_value,
+    size_t*                 param_value_size_ret)
+{
+    return g_pNextDispatch->clGetProgramBuildInfo(
+        getBinaryProgram(program),
+        device,
+        param_name,
+        param_value_size,
+        param_value,
+        param_value_size_ret);
+}
+
+static cl_kernel CL_API_CALL
+clCreateKernel_layer(
+    cl_program  program,
+    const char* kernel_name,
+    cl_int*     errcode_ret)
+{
+    cl_kernel kernel = g_pNextDispatch->clCreateKernel(
+        getBinaryProgram(program),
+        kernel_name,
+        errcode_ret);
+    if (kernel != nullptr) {
+        trackKernels(program, 1, &kernel);
+    }
+    return kernel;
+}
+
+static cl_int CL_API_CALL
+clCreateKernelsInProgram_layer(
+    cl_program  program,
+    cl_uint     num_kernels,
+    cl_kernel*  kernels,
+    cl_uint*    num_kernels_ret)
+{
+    cl_uint numKernels = 0;
+    cl_int errorCode = g_pNextDispatch->clCreateKernelsInProgram(
+        getBinaryProgram(program),
+        num_kernels,
+        kernels,
+        &numKernels);
+    if (errorCode == CL_SUCCESS && kernels != nullptr) {
+        trackKernels(program, numKernels, kernels);
+    }
+    if (num_kernels_ret) {
+        num_kernels_ret[0] = numKernels;
+    }
+    return errorCode;
+}
+
+static cl_kernel CL_API_CALL
+clCloneKernel_layer(
+    cl_kernel   source_kernel,
+    cl_int*     errcode_ret)
+{
+    cl_kernel kernel = g_pNextDispatch->clCloneKernel(
+        source_kernel,
+        errcode_ret);
+    if (kernel != nullptr) {
+        trackClonedKernel(source_kernel, kernel);
+    }
+    return kernel;
+}
+
+static cl_int CL_API_CALL
+clReleaseKernel_layer(
+    cl_kernel   kernel)
+{
+    return clReleaseKernel_override(kernel);
+}
+
+static cl_int CL_API_CALL
+clGetKernelInfo_layer(
+    cl_kernel       kernel,
+    cl_kernel_info  param_name,
+    size_t          param_value_size,
+    void*           param_value,
+    size_t*         param_value_size_ret)
+{
+    cl_int errorCode = g_pNextDispatch->clGetKernelInfo(
+        kernel,
+        param_name,
+        param_value_size,
+        param_value,
+        param_value_size_ret);
+
+    // Kernels created from a program built from cached binaries return the
+    // program created from source, which the kernel retains.
+    if (errorCode == CL_SUCCESS &&
+        param_name == CL_KERNEL_PROGRAM &&
+        param_value != nullptr &&
+        param_value_size >= sizeof(cl_program)) {
+        cl_program* ptr = (cl_program*)param_value;
+        ptr[0] = getKernelProgram(kernel, ptr[0]);
+    }
+
+    return errorCode;
+}
+
+static struct _cl_icd_dispatch dispatch;
+static void _init_dispatch()
+{
+    dispatch.clBuildProgram = clBuildProgram_layer;
+    dispatch.clCloneKernel = clCloneKernel_layer;
+    dispatch.clCreateKernel = clCreateKernel_layer;
+    dispatch.clCreateKernelsInProgram = clCreateKernelsInProgram_layer;
+    dispatch.clCreateProgramWithBinary = clCreateProgramWithBinary_layer;
+    dispatch.clCreateProgramWithBuiltInKernels = clCreateProgramWithBuiltInKernels_layer;
+    dispatch.clCreateProgramWithIL = clCreateProgramWithIL_layer;
+    dispatch.clCreateProgramWithSource = clCreateProgramWithSource_layer;
+    dispatch.clLinkProgram = clLinkProgram_layer;
+    dispatch.clGetKernelInfo = clGetKernelInfo_layer;
+    dispatch.clGetProgramBuildInfo = clGetProgramBuildInfo_layer;
+    dispatch.clGetProgramInfo = clGetProgramInfo_layer;
+    dispatch.clReleaseKernel = clReleaseKernel_layer;
+    dispatch.clReleaseProgram = clReleaseProgram_layer;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetLayerInfo(
+    cl_layer_info  param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    switch (param_name) {
+    case CL_LAYER_API_VERSION:
+        {
+            auto ptr = (cl_layer_api_version*)param_value;
+            auto value = cl_layer_api_version{CL_LAYER_API_VERSION_100};
+            return writeParamToMemory(
+                param_value_size,
+                value,
+                param_value_size_ret,
+                ptr);
+        }
+        break;
+#if defined(CL_LAYER_NAME)
+    case CL_LAYER_NAME:
+        {
+            auto ptr = (char*)param_value;
+            return writeStringToMemory(
+                param_value_size,
+                "Program Cache Layer",
+                param_value_size_ret,
+                ptr);
+        }
+        break;
+#endif
+    default:
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clInitLayerWithProperties(
+    cl_uint num_entries,
+    const struct _cl_icd_dispatch* target_dispatch,
+    cl_uint* num_entries_out,
+    const struct _cl_icd_dispatch** layer_dispatch_ret,
+    const cl_layer_properties* properties)
+{
+    const size_t dispatchTableSize =
+        sizeof(dispatch) / sizeof(dispatch.clGetPlatformIDs);
+
+    if (target_dispatch == nullptr ||
+        num_entries_out == nullptr ||
+        layer_dispatch_ret == nullptr) {
+        return CL_INVALID_VALUE;
+    }
+
+    if (num_entries < dispatchTableSize) {
+        return CL_INVALID_VALUE;
+    }
+
+    getControl("PROGRAMCACHE_CacheDir", g_CacheDir);
+
+    _init_dispatch();
+
+    g_pNextDispatch = target_dispatch;
+
+    *layer_dispatch_ret = &dispatch;
+    *num_entries_out = dispatchTableSize;
+
+    return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clInitLayer(
+    cl_uint num_entries,
+    const struct _cl_icd_dispatch* target_dispatch,
+    cl_uint* num_entries_out,
+    const struct _cl_icd_dispatch** layer_dispatch_ret)
+{
+    return clInitLayerWithProperties(
+        num_entries,
+        target_dispatch,
+        num_entries_out,
+        layer_dispatch_ret,
+        nullptr);
+}
@@ -0,0 +1,574 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+
+#include <CL/cl_layer.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_util.hpp"
+#include "sharded_map.hpp"
+
+#include "programcache.h"
+
+// Increment this whenever the format of the cache files changes, so stale
+// cache files are ignored.
+static constexpr cl_uint cacheVersion = 2;
+
+struct SProgramSource
+{
+    cl_context  Context;
+    std::string Source;
+    bool        HasIncludes = false;
+};
+
+struct SLayerContext
+{
+    // Source for each program created from source.
+    CShardedMap<cl_program, std::shared_ptr<const SProgramSource>> Sources;
+
+    // Maps programs created from source to the programs built from cached
+    // binaries.
+    CShardedMap<cl_program, cl_program> BinaryPrograms;
+
+    // Maps kernels created from programs built from cached binaries to the
+    // programs created from source.  Each kernel retains its program created
+    // from source, just like a kernel retains the program it is created
+    // from, so the program remains valid while the kernel exists.
+    CShardedMap<cl_kernel, cl_program>  KernelPrograms;
+};
+
+static SLayerContext& getLayerContext(void)
+{
+    static SLayerContext c;
+    return c;
+}
+
+static std::string getDeviceString(cl_device_id device, cl_device_info param_name)
+{
+    std::string value;
+    size_t size = 0;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        param_name,
+        0,
+        nullptr,
+        &size);
+    if (size) {
+        value.resize(size);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            param_name,
+            size,
+            &value[0],
+            nullptr);
+        value.pop_back();
+    }
+    return value;
+}
+
+static bool getProgramDevices(
+    cl_program program,
+    std::vector<cl_device_id>& devices)
+{
+    size_t size = 0;
+    cl_int errorCode = g_pNextDispatch->clGetProgramInfo(
+        program,
+        CL_PROGRAM_DEVICES,
+        0,
+        nullptr,
+        &size);
+    if (errorCode != CL_SUCCESS || size == 0) {
+        return false;
+    }
+
+    devices.resize(size / sizeof(cl_device_id));
+    errorCode = g_pNextDispatch->clGetProgramInfo(
+        program,
+        CL_PROGRAM_DEVICES,
+        size,
+        devices.data(),
+        nullptr);
+    return errorCode == CL_SUCCESS;
+}
+
+// Returns true if the program source has an #include directive.  Files
+// included by the program are not part of the cache header, so programs
+// that include other files are not cached.
+static bool hasIncludes(const std::string& source)
+{
+    for (size_t pos = source.find('#');
+         pos != std::string::npos;
+         pos = source.find('#', pos + 1)) {
+        size_t next = source.find_first_not_of(" \t", pos + 1);
+        if (next != std::string::npos &&
+            source.compare(next, 7, "include") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the build options add an include path.
+static bool hasIncludePaths(const char* options)
+{
+    const std::string str(options ? options : "");
+    for (size_t pos = str.find("-I");
+         pos != std::string::npos;
+         pos = str.find("-I", pos + 1)) {
+        if (pos == 0 || str[pos - 1] == ' ' || str[pos - 1] == '\t') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The cache header identifies the program source, the build options, and
+// the device and driver.  It is written at the start of each cache file and
+// must match exactly for the cached binary to be used.  The full source is
+// included in the header, so a cached binary is never used for a different
+// program, even if the hashes used for cache file names collide.
+static std::string getCacheHeader(
+    cl_device_id device,
+    const std::string& options,
+    const std::string& source)
+{
+    std::string header;
+    header += "PROGRAMCACHE " + std::to_string(cacheVersion) + "\n";
+    header += "DeviceName " + getDeviceString(device, CL_DEVICE_NAME) + "\n";
+    header += "DeviceVersion " + getDeviceString(device, CL_DEVICE_VERSION) + "\n";
+    header += "DriverVersion " + getDeviceString(device, CL_DRIVER_VERSION) + "\n";
+    header += "Options " + options + "\n";
+    header += "Source " + std::to_string(source.size()) + "\n";
+    header += source + "\n";
+    return header;
+}
+
+static std::string getCacheFileName(const std::string& header)
+{
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx",
+        (unsigned long long)hashString(header));
+    return g_CacheDir + "/programcache_" + hash + ".bin";
+}
+
+static bool loadBinary(
+    const std::string& header,
+    std::vector<unsigned char>& binary)
+{
+    std::ifstream is(getCacheFileName(header), std::ios::binary);
+    if (!is.good()) {
+        return false;
+    }
+
+    std::vector<unsigned char> contents(
+        (std::istreambuf_iterator<char>(is)),
+        std::istreambuf_iterator<char>());
+    if (contents.size() <= header.size() ||
+        !std::equal(header.begin(), header.end(), contents.begin())) {
+        return false;
+    }
+
+    binary.assign(contents.begin() + header.size(), contents.end());
+    return true;
+}
+
+static void saveBinary(
+    const std::string& header,
+    const unsigned char* binary,
+    size_t size)
+{
+    // Failures are ignored, since the program will simply be built from
+    // source again.
+    writeFileAtomically(
+        getCacheFileName(header),
+        [&](std::ofstream& out) {
+            out.write(header.data(), header.size());
+            out.write((const char*)binary, size);
+        });
+}
+
+static void saveProgramBinaries(
+    cl_program program,
+    const SProgramSource& source,
+    const std::string& options)
+{
+    std::vector<cl_device_id> devices;
+    if (getProgramDevices(program, devices) == false) {
+        return;
+    }
+
+    std::vector<size_t> sizes(devices.size());
+    cl_int errorCode = g_pNextDispatch->clGetProgramInfo(
+        program,
+        CL_PROGRAM_BINARY_SIZES,
+        sizes.size() * sizeof(size_t),
+        sizes.data(),
+        nullptr);
+    if (errorCode != CL_SUCCESS) {
+        return;
+    }
+
+    std::vector<std::vector<unsigned char>> binaries(devices.size());
+    std::vector<unsigned char*> pointers(devices.size());
+    for (size_t i = 0; i < devices.size(); i++) {
+        binaries[i].resize(sizes[i]);
+        pointers[i] = sizes[i] ? binaries[i].data() : nullptr;
+    }
+    errorCode = g_pNextDispatch->clGetProgramInfo(
+        program,
+        CL_PROGRAM_BINARIES,
+        pointers.size() * sizeof(unsigned char*),
+        pointers.data(),
+        nullptr);
+    if (errorCode != CL_SUCCESS) {
+        return;
+    }
+
+    for (size_t i = 0; i < devices.size(); i++) {
+        cl_build_status status = CL_BUILD_NONE;
+        g_pNextDispatch->clGetProgramBuildInfo(
+            program,
+            devices[i],
+            CL_PROGRAM_BUILD_STATUS,
+            sizeof(status),
+            &status,
+            nullptr);
+        if (status == CL_BUILD_SUCCESS && sizes[i] != 0) {
+            saveBinary(
+                getCacheHeader(devices[i], options, source.Source),
+                binaries[i].data(),
+                sizes[i]);
+        }
+    }
+}
+
+// Creates and builds a program from cached binaries for every device, or
+// returns nullptr if any binary is not cached or the build fails.
+static cl_program buildFromCache(
+    const SProgramSource& source,
+    const std::vector<cl_device_id>& devices,
+    const char* options)
+{
+    const std::string buildOptions(options ? options : "");
+
+    std::vector<std::vector<unsigned char>> binaries(devices.size());
+    std::vector<size_t> lengths(devices.size());
+    std::vector<const unsigned char*> pointers(devices.size());
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (loadBinary(
+                getCacheHeader(devices[i], buildOptions, source.Source),
+                binaries[i]) == false) {
+            return nullptr;
+        }
+        lengths[i] = binaries[i].size();
+        pointers[i] = binaries[i].data();
+    }
+
+    cl_int errorCode = CL_SUCCESS;
+    cl_program program = g_pNextDispatch->clCreateProgramWithBinary(
+        source.Context,
+        (cl_uint)devices.size(),
+        devices.data(),
+        lengths.data(),
+        pointers.data(),
+        nullptr,
+        &errorCode);
+    if (program == nullptr) {
+        return nullptr;
+    }
+
+    errorCode = g_pNextDispatch->clBuildProgram(
+        program,
+        (cl_uint)devices.size(),
+        devices.data(),
+        options,
+        nullptr,
+        nullptr);
+    if (errorCode != CL_SUCCESS) {
+        g_pNextDispatch->clReleaseProgram(program);
+        return nullptr;
+    }
+
+    return program;
+}
+
+static void releaseBinaryProgram(
+    cl_program program)
+{
+    auto& context = getLayerContext();
+    cl_program binaryProgram = nullptr;
+    if (!context.BinaryPrograms.empty() &&
+        context.BinaryPrograms.erase(program, &binaryProgram)) {
+        g_pNextDispatch->clReleaseProgram(binaryProgram);
+    }
+}
+
+// The driver may free a program created from source without the layer
+// seeing its last release, for example when the application releases the
+// program before the kernels created from it.  A new program may then have
+// the same handle, so any state for the handle is discarded when a program
+// is created.
+static void discardProgramState(
+    cl_program program)
+{
+    auto& context = getLayerContext();
+    if (!context.Sources.empty()) {
+        context.Sources.erase(program);
+    }
+    releaseBinaryProgram(program);
+}
+
+struct SBuildCallbackData
+{
+    std::shared_ptr<const SProgramSource> Source;
+    std::string Options;
+    void (CL_CALLBACK* pfn_notify)(cl_program program, void* user_data);
+    void* user_data;
+};
+
+static void CL_CALLBACK buildCallback(
+    cl_program program,
+    void* user_data)
+{
+    SBuildCallbackData* data = (SBuildCallbackData*)user_data;
+    saveProgramBinaries(program, *data->Source, data->Options);
+    data->pfn_notify(program, data->user_data);
+    delete data;
+}
+
+cl_program clCreateProgramWithSource_override(
+    cl_context context,
+    cl_uint count,
+    const char** strings,
+    const size_t* lengths,
+    cl_int* errcode_ret)
+{
+    cl_int errorCode = CL_SUCCESS;
+    cl_program program = g_pNextDispatch->clCreateProgramWithSource(
+        context,
+        count,
+        strings,
+        lengths,
+        &errorCode);
+
+    if (program != nullptr) {
+        discardProgramState(program);
+
+        auto source = std::make_shared<SProgramSource>();
+        source->Context = context;
+        for (cl_uint i = 0; i < count; i++) {
+            if (lengths && lengths[i]) {
+                source->Source.append(strings[i], lengths[i]);
+            } else {
+                source->Source.append(strings[i]);
+            }
+        }
+        source->HasIncludes = hasIncludes(source->Source);
+        getLayerContext().Sources.insert(program, source);
+    }
+
+    if (errcode_ret) {
+        errcode_ret[0] = errorCode;
+    }
+    return program;
+}
+
+cl_int clBuildProgram_override(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id* device_list,
+    const char* options,
+    void (CL_CALLBACK* pfn_notify)(cl_program program, void* user_data),
+    void* user_data)
+{
+    auto& context = getLayerContext();
+
+    std::shared_ptr<const SProgramSource> source;
+    std::vector<cl_device_id> devices;
+    if (context.Sources.empty() ||
+        context.Sources.find(program, source) == false ||
+        source->HasIncludes ||
+        hasIncludePaths(options) ||
+        getProgramDevices(program, devices) == false) {
+        return g_pNextDispatch->clBuildProgram(
+            program,
+            num_devices,
+            device_list,
+            options,
+            pfn_notify,
+            user_data);
+    }
+
+    // Rebuilding a program discards the program built from cached binaries
+    // for a previous build.
+    releaseBinaryProgram(program);
+
+    // Cached binaries are only used when building for every device in the
+    // program, so queries for the program and its binaries may be redirected
+    // to the program built from cached binaries.
+    const bool allDevices = device_list == nullptr ||
+        (num_devices == devices.size() &&
+         std::is_permutation(device_list, device_list + num_devices, devices.begin()));
+    if (allDevices) {
+        cl_program binaryProgram = buildFromCache(*source, devices, options);
+        if (binaryProgram != nullptr) {
+            context.BinaryPrograms.insert(program, binaryProgram);
+            if (pfn_notify) {
+                pfn_notify(program, user_data);
+            }
+            return CL_SUCCESS;
+        }
+    }
+
+    const std::string buildOptions(options ? options : "");
+    if (pfn_notify) {
+        SBuildCallbackData* data =
+            new SBuildCallbackData{source, buildOptions, pfn_notify, user_data};
+        cl_int errorCode = g_pNextDispatch->clBuildProgram(
+            program,
+            num_devices,
+            device_list,
+            options,
+            buildCallback,
+            data);
+        // The callback is not called if the build could not be started.
+        if (errorCode != CL_SUCCESS && errorCode != CL_BUILD_PROGRAM_FAILURE) {
+            delete data;
+        }
+        return errorCode;
+    }
+
+    cl_int errorCode = g_pNextDispatch->clBuildProgram(
+        program,
+        num_devices,
+        device_list,
+        options,
+        nullptr,
+        nullptr);
+    if (errorCode == CL_SUCCESS) {
+        saveProgramBinaries(program, *source, buildOptions);
+    }
+    return errorCode;
+}
+
+void clReleaseProgram_override(
+    cl_program program)
+{
+    // Only query the reference count if any programs were created from
+    // source, since the program handle may be reused after the program is
+    // released.
+    auto& context = getLayerContext();
+    if (!context.Sources.empty()) {
+        cl_uint refCount = 0;
+        g_pNextDispatch->clGetProgramInfo(
+            program,
+            CL_PROGRAM_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+        if (refCount == 1) {
+            context.Sources.erase(program);
+            releaseBinaryProgram(program);
+        }
+    }
+}
+
+cl_program getBinaryProgram(
+    cl_program program)
+{
+    auto& context = getLayerContext();
+    cl_program binaryProgram = nullptr;
+    if (!context.BinaryPrograms.empty() &&
+        context.BinaryPrograms.find(program, binaryProgram)) {
+        return binaryProgram;
+    }
+    return program;
+}
+
+void trackProgram(
+    cl_program program)
+{
+    if (program != nullptr) {
+        discardProgramState(program);
+    }
+}
+
+void trackKernels(
+    cl_program program,
+    cl_uint num_kernels,
+    const cl_kernel* kernels)
+{
+    if (getBinaryProgram(program) == program) {
+        return;
+    }
+
+    auto& context = getLayerContext();
+    for (cl_uint i = 0; i < num_kernels; i++) {
+        g_pNextDispatch->clRetainProgram(program);
+        context.KernelPrograms.insert(kernels[i], program);
+    }
+}
+
+void trackClonedKernel(
+    cl_kernel source_kernel,
+    cl_kernel kernel)
+{
+    auto& context = getLayerContext();
+    cl_program program = nullptr;
+    if (!context.KernelPrograms.empty() &&
+        context.KernelPrograms.find(source_kernel, program)) {
+        g_pNextDispatch->clRetainProgram(program);
+        context.KernelPrograms.insert(kernel, program);
+    }
+}
+
+cl_int clReleaseKernel_override(
+    cl_kernel kernel)
+{
+    // Only query the reference count if any kernels were created from
+    // programs built from cached binaries.
+    auto& context = getLayerContext();
+    cl_uint refCount = 0;
+    if (!context.KernelPrograms.empty()) {
+        g_pNextDispatch->clGetKernelInfo(
+            kernel,
+            CL_KERNEL_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+    }
+
+    cl_int errorCode = g_pNextDispatch->clReleaseKernel(kernel);
+
+    // The program created from source may be released for the last time
+    // here, so it is released the same way the application releases it.
+    cl_program program = nullptr;
+    if (errorCode == CL_SUCCESS && refCount == 1 &&
+        context.KernelPrograms.erase(kernel, &program)) {
+        clReleaseProgram_override(program);
+        g_pNextDispatch->clReleaseProgram(program);
+    }
+    return errorCode;
+}
+
+cl_program getKernelProgram(
+    cl_kernel kernel,
+    cl_program program)
+{
+    auto& context = getLayerContext();
+    cl_program sourceProgram = nullptr;
+    if (!context.KernelPrograms.empty() &&
+        context.KernelPrograms.find(kernel, sourceProgram)) {
+        return sourceProgram;
+    }
+    return program;
+}
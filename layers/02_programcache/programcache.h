@@ -0,0 +1,69 @@
+/*
+// Copyright (c) 2026 Ben Ashbaugh
+//
+// SPDX-License-Identifier: MIT
+*/
+
+#include <CL/cl.h>
+
+#include <string>
+
+extern const struct _cl_icd_dispatch* g_pNextDispatch;
+
+extern std::string g_CacheDir;
+
+///////////////////////////////////////////////////////////////////////////////
+// Override Functions
+
+cl_program clCreateProgramWithSource_override(
+    cl_context context,
+    cl_uint count,
+    const char** strings,
+    const size_t* lengths,
+    cl_int* errcode_ret);
+
+cl_int clBuildProgram_override(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id* device_list,
+    const char* options,
+    void (CL_CALLBACK* pfn_notify)(cl_program program, void* user_data),
+    void* user_data);
+
+void clReleaseProgram_override(
+    cl_program program);
+
+// Returns the program built from cached binaries for a program created from
+// source, or the program itself if it was not built from cached binaries.
+cl_program getBinaryProgram(
+    cl_program program);
+
+// Records a program created other than from source, discarding any state
+// for a program created from source with the same handle.
+void trackProgram(
+    cl_program program);
+
+// Records kernels created from a program.  Kernels created from a program
+// built from cached binaries retain the program created from source.
+void trackKernels(
+    cl_program program,
+    cl_uint num_kernels,
+    const cl_kernel* kernels);
+
+// Records a kernel cloned from another kernel.
+void trackClonedKernel(
+    cl_kernel source_kernel,
+    cl_kernel kernel);
+
+// Releases a kernel, and releases the program created from source when a
+// kernel created from a program built from cached binaries is released for
+// the last time.
+cl_int clReleaseKernel_override(
+    cl_kernel kernel);
+
+// Returns the program created from source for a kernel created from a
+// program built from cached binaries, or the program returned by the kernel
+// query otherwise.
+cl_program getKernelProgram(
+    cl_kernel kernel,
+    cl_program program);
@@ -11,7 +11,12 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -24,6 +29,10 @@ static constexpr cl_version version_cl_khr_command_buffer =
     CL_MAKE_VERSION(0, 9, 8);
 static constexpr cl_version version_cl_khr_command_buffer_mutable_dispatch =
     CL_MAKE_VERSION(0, 9, 5);
+#if defined(cl_khr_command_buffer_multi_device)
+static constexpr cl_version version_cl_khr_command_buffer_multi_device =
+    CL_MAKE_VERSION(0, 9, 1);
+#endif // defined(cl_khr_command_buffer_multi_device)
 
 SLayerContext& getLayerContext(void)
 {
@@ -31,6 +40,31 @@ SLayerContext& getLayerContext(void)
     return c;
 }
 
+// Returns the properties of a command-queue.  Command-queue properties are
+// cached until the command-queue is released, since they are needed for
+// every replay.
+static cl_command_queue_properties getQueueProperties(
+    cl_command_queue queue )
+{
+    auto& context = getLayerContext();
+
+    cl_command_queue_properties props = 0;
+    if( context.QueuePropertiesMap.find(queue, props) )
+    {
+        return props;
+    }
+
+    g_pNextDispatch->clGetCommandQueueInfo(
+        queue,
+        CL_QUEUE_PROPERTIES,
+        sizeof(props),
+        &props,
+        nullptr);
+    context.QueuePropertiesMap.insert(queue, props);
+
+    return props;
+}
+
 // Supported mutable dispatch capabilities.
 // Right now, all capabilities are supported.
 const cl_mutable_dispatch_fields_khr g_MutableDispatchCaps =
@@ -60,6 +94,664 @@ static cl_int enqueueProfilingKernel(
         event );
 }
 
+// Returns the memory object that ultimately owns the storage for a memory
+// object, for example the parent buffer of a sub-buffer.
+static cl_mem getRootMemObject(
+    cl_mem mem,
+    size_t* offset = nullptr )
+{
+    cl_mem parent = nullptr;
+    while( g_pNextDispatch->clGetMemObjectInfo(
+                mem,
+                CL_MEM_ASSOCIATED_MEMOBJECT,
+                sizeof(parent),
+                &parent,
+                nullptr ) == CL_SUCCESS &&
+           parent != nullptr )
+    {
+        if( offset != nullptr )
+        {
+            size_t memOffset = 0;
+            g_pNextDispatch->clGetMemObjectInfo(
+                mem,
+                CL_MEM_OFFSET,
+                sizeof(memOffset),
+                &memOffset,
+                nullptr );
+            offset[0] += memOffset;
+        }
+        mem = parent;
+        parent = nullptr;
+    }
+    return mem;
+}
+
+// Queries whether a pointer-sized kernel argument is a memory object,
+// another handle, or a value, from its address qualifier and type name.
+static uint8_t queryKernelArgKind(
+    cl_kernel kernel,
+    cl_uint arg_index )
+{
+    cl_kernel_arg_address_qualifier addressQualifier = 0;
+    if( g_pNextDispatch->clGetKernelArgInfo(
+            kernel,
+            arg_index,
+            CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+            sizeof(addressQualifier),
+            &addressQualifier,
+            nullptr ) != CL_SUCCESS )
+    {
+        return cKernelArgUnknown;
+    }
+    if( addressQualifier == CL_KERNEL_ARG_ADDRESS_GLOBAL ||
+        addressQualifier == CL_KERNEL_ARG_ADDRESS_CONSTANT )
+    {
+        return cKernelArgMemObject;
+    }
+
+    size_t  size = 0;
+    g_pNextDispatch->clGetKernelArgInfo(
+        kernel,
+        arg_index,
+        CL_KERNEL_ARG_TYPE_NAME,
+        0,
+        nullptr,
+        &size );
+    std::string typeName(size, '\0');
+    if( size == 0 ||
+        g_pNextDispatch->clGetKernelArgInfo(
+            kernel,
+            arg_index,
+            CL_KERNEL_ARG_TYPE_NAME,
+            size,
+            &typeName[0],
+            nullptr ) != CL_SUCCESS )
+    {
+        return cKernelArgUnknown;
+    }
+    typeName.pop_back();
+    if( typeName == "sampler_t" || typeName == "queue_t" )
+    {
+        return cKernelArgHandle;
+    }
+
+    return cKernelArgValue;
+}
+
+// Determines whether a kernel argument is a memory object, another handle,
+// or a value.  The kernel argument has already been set successfully, so a
+// global or constant kernel argument is a valid memory object.  The kind of
+// kernel argument is only needed for command buffer binaries.
+static uint8_t getKernelArgKind(
+    cl_kernel kernel,
+    cl_uint arg_index,
+    size_t arg_size,
+    const void* arg_value )
+{
+    if( arg_value == nullptr || arg_size != sizeof(cl_mem) )
+    {
+        return cKernelArgValue;
+    }
+    if( !g_CommandBufferBinaries )
+    {
+        return cKernelArgUnknown;
+    }
+    return queryKernelArgKind(kernel, arg_index);
+}
+
+void trackKernelArg(
+    cl_kernel kernel,
+    cl_uint arg_index,
+    size_t arg_size,
+    const void* arg_value,
+    bool is_svm_pointer )
+{
+    const uint8_t kind = is_svm_pointer ?
+        cKernelArgValue :
+        getKernelArgKind(kernel, arg_index, arg_size, arg_value);
+
+    auto& context = getLayerContext();
+    std::lock_guard<std::mutex> lock(context.KernelInfoMutex);
+
+    auto& args = context.KernelInfoMap[kernel].Args;
+    if( args.size() <= arg_index )
+    {
+        args.resize(arg_index + 1);
+    }
+
+    auto& arg = args[arg_index];
+    arg.IsSet = true;
+    arg.IsSVMPointer = is_svm_pointer;
+    arg.Kind = kind;
+    arg.Size = arg_size;
+    if( arg_value != nullptr )
+    {
+        auto p = reinterpret_cast<const uint8_t*>(arg_value);
+        arg.Value.assign(p, p + arg_size);
+    }
+    else
+    {
+        arg.Value.clear();
+    }
+}
+
+void trackKernelExecInfo(
+    cl_kernel kernel )
+{
+    auto& context = getLayerContext();
+    std::lock_guard<std::mutex> lock(context.KernelInfoMutex);
+
+    context.KernelInfoMap[kernel].HasExecInfo = true;
+}
+
+void trackCloneKernel(
+    cl_kernel source_kernel,
+    cl_kernel kernel )
+{
+    auto& context = getLayerContext();
+    std::lock_guard<std::mutex> lock(context.KernelInfoMutex);
+
+    auto it = context.KernelInfoMap.find(source_kernel);
+    if( it != context.KernelInfoMap.end() )
+    {
+        SKernelInfo info = it->second;
+        context.KernelInfoMap[kernel] = std::move(info);
+    }
+}
+
+// Called before a kernel is released.  The kernel arguments are no longer
+// needed when the last reference to the kernel is released, and must be
+// removed in case the kernel handle is reused.
+void untrackKernel(
+    cl_kernel kernel )
+{
+    cl_uint refCount = 0;
+    g_pNextDispatch->clGetKernelInfo(
+        kernel,
+        CL_KERNEL_REFERENCE_COUNT,
+        sizeof(refCount),
+        &refCount,
+        nullptr );
+    if( refCount == 1 )
+    {
+        auto& context = getLayerContext();
+        std::lock_guard<std::mutex> lock(context.KernelInfoMutex);
+
+        context.KernelInfoMap.erase(kernel);
+    }
+}
+
+struct SMemAccess
+{
+    cl_mem  Mem;
+    bool    IsWrite;
+};
+
+// Gets the tracked kernel arguments for a kernel, with one entry for each
+// kernel argument.  Returns false if any kernel argument is not set.  If the
+// kernel arguments cannot be determined, for example because the kernel has
+// execution info set, no entries are returned.
+static bool getTrackedKernelArgs(
+    cl_kernel kernel,
+    std::vector<SKernelArg>& args )
+{
+    args.clear();
+
+    cl_uint numArgs = 0;
+    if( g_pNextDispatch->clGetKernelInfo(
+            kernel,
+            CL_KERNEL_NUM_ARGS,
+            sizeof(numArgs),
+            &numArgs,
+            nullptr ) != CL_SUCCESS )
+    {
+        return false;
+    }
+
+    args.resize(numArgs);
+    {
+        auto& context = getLayerContext();
+        std::lock_guard<std::mutex> lock(context.KernelInfoMutex);
+
+        auto it = context.KernelInfoMap.find(kernel);
+        if( it != context.KernelInfoMap.end() )
+        {
+            if( it->second.HasExecInfo )
+            {
+                args.clear();
+                return false;
+            }
+            const auto& tracked = it->second.Args;
+            std::copy(
+                tracked.begin(),
+                tracked.begin() + std::min<size_t>(tracked.size(), numArgs),
+                args.begin());
+        }
+    }
+
+    for( const auto& arg : args )
+    {
+        if( !arg.IsSet )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Determines the memory objects a kernel reads and writes from its kernel
+// arguments.  Returns false if the memory accessed by the kernel cannot be
+// determined, for example if kernel argument information is not available or
+// if the kernel may access SVM allocations.
+static bool getKernelMemAccesses(
+    cl_kernel kernel,
+    const std::vector<SKernelArg>& args,
+    std::vector<SMemAccess>& accesses )
+{
+    const cl_uint numArgs = static_cast<cl_uint>(args.size());
+    for( cl_uint i = 0; i < numArgs; i++ )
+    {
+        const auto& arg = args[i];
+        if( !arg.IsSet || arg.IsSVMPointer )
+        {
+            return false;
+        }
+
+        cl_kernel_arg_address_qualifier addressQualifier = 0;
+        cl_kernel_arg_access_qualifier accessQualifier = 0;
+        cl_kernel_arg_type_qualifier typeQualifier = 0;
+        if( g_pNextDispatch->clGetKernelArgInfo(
+                kernel,
+                i,
+                CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+                sizeof(addressQualifier),
+                &addressQualifier,
+                nullptr ) != CL_SUCCESS ||
+            g_pNextDispatch->clGetKernelArgInfo(
+                kernel,
+                i,
+                CL_KERNEL_ARG_ACCESS_QUALIFIER,
+                sizeof(accessQualifier),
+                &accessQualifier,
+                nullptr ) != CL_SUCCESS ||
+            g_pNextDispatch->clGetKernelArgInfo(
+                kernel,
+                i,
+                CL_KERNEL_ARG_TYPE_QUALIFIER,
+                sizeof(typeQualifier),
+                &typeQualifier,
+                nullptr ) != CL_SUCCESS )
+        {
+            return false;
+        }
+
+        // Only global and constant arguments may be memory objects.  Images
+        // and pipes are global arguments.
+        if( addressQualifier != CL_KERNEL_ARG_ADDRESS_GLOBAL &&
+            addressQualifier != CL_KERNEL_ARG_ADDRESS_CONSTANT )
+        {
+            continue;
+        }
+        if( arg.Value.size() != sizeof(cl_mem) )
+        {
+            return false;
+        }
+
+        cl_mem mem = nullptr;
+        std::copy(
+            arg.Value.begin(),
+            arg.Value.end(),
+            reinterpret_cast<uint8_t*>(&mem));
+        if( mem == nullptr )
+        {
+            continue;
+        }
+
+        const bool isWrite =
+            addressQualifier != CL_KERNEL_ARG_ADDRESS_CONSTANT &&
+            accessQualifier != CL_KERNEL_ARG_ACCESS_READ_ONLY &&
+            !(typeQualifier & CL_KERNEL_ARG_TYPE_CONST);
+        accesses.push_back({getRootMemObject(mem), isWrite});
+    }
+
+    return true;
+}
+
+// Gets a snapshot of a kernel's arguments, which is equal for two kernels
+// with the same kernel arguments.
+static void getKernelArgSnapshot(
+    const std::vector<SKernelArg>& args,
+    std::vector<uint8_t>& snapshot )
+{
+    snapshot.clear();
+    for( const auto& arg : args )
+    {
+        const uint8_t header[] = {
+            arg.IsSVMPointer,
+            static_cast<uint8_t>(arg.Value.size() ? 1 : 0) };
+        const uint8_t* size = reinterpret_cast<const uint8_t*>(&arg.Size);
+        snapshot.insert(snapshot.end(), header, header + sizeof(header));
+        snapshot.insert(snapshot.end(), size, size + sizeof(arg.Size));
+        snapshot.insert(snapshot.end(), arg.Value.begin(), arg.Value.end());
+    }
+}
+
+// Sets the kernel arguments for a kernel.
+static cl_int setKernelArgs(
+    cl_kernel kernel,
+    const std::vector<SKernelArg>& args )
+{
+    for( cl_uint i = 0; i < args.size(); i++ )
+    {
+        const auto& arg = args[i];
+        cl_int errorCode = CL_SUCCESS;
+        if( arg.IsSVMPointer )
+        {
+            const void* value = nullptr;
+            memcpy(&value, arg.Value.data(), sizeof(value));
+            errorCode = g_pNextDispatch->clSetKernelArgSVMPointer(
+                kernel,
+                i,
+                value );
+        }
+        else
+        {
+            errorCode = g_pNextDispatch->clSetKernelArg(
+                kernel,
+                i,
+                arg.Size,
+                arg.Value.empty() ? nullptr : arg.Value.data() );
+        }
+        if( errorCode != CL_SUCCESS )
+        {
+            return errorCode;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+// Reads or writes a command buffer binary.  The same functions are used to
+// read and write each value, so a command can describe its binary layout
+// once.  Memory objects and kernels are stored as indices into tables
+// provided by the application.  When a binary is read, any error marks the
+// binary as bad and all later reads are ignored.
+class CCommandBufferBinary
+{
+public:
+    static constexpr uint32_t cMagic = 0x4342494e;  // "CBIN"
+    static constexpr uint32_t cVersion = 2;
+
+    CCommandBufferBinary(
+        cl_uint num_mem_objects,
+        const cl_mem* mem_objects,
+        cl_uint num_kernels,
+        const cl_kernel* kernels ) :
+        IsLoading(false),
+        NumMemObjects(num_mem_objects),
+        MemObjects(mem_objects),
+        NumKernels(num_kernels),
+        Kernels(kernels) {}
+
+    CCommandBufferBinary(
+        const void* binary,
+        size_t binary_size,
+        cl_uint num_mem_objects,
+        const cl_mem* mem_objects,
+        cl_uint num_kernels,
+        const cl_kernel* kernels ) :
+        IsLoading(true),
+        NumMemObjects(num_mem_objects),
+        MemObjects(mem_objects),
+        NumKernels(num_kernels),
+        Kernels(kernels)
+    {
+        auto p = reinterpret_cast<const uint8_t*>(binary);
+        Data.assign(p, p + binary_size);
+    }
+
+    bool    isLoading() const
+    {
+        return IsLoading;
+    }
+
+    bool    good() const
+    {
+        return Good;
+    }
+
+    void    fail()
+    {
+        Good = false;
+    }
+
+    // Returns true if all of the binary has been read.
+    bool    done() const
+    {
+        return Offset == Data.size();
+    }
+
+    const std::vector<uint8_t>& data() const
+    {
+        return Data;
+    }
+
+    template<class T>
+    void    value(T& v)
+    {
+        if( IsLoading )
+        {
+            if( !Good || Data.size() - Offset < sizeof(T) )
+            {
+                Good = false;
+                return;
+            }
+            memcpy(&v, Data.data() + Offset, sizeof(T));
+            Offset += sizeof(T);
+        }
+        else
+        {
+            auto p = reinterpret_cast<const uint8_t*>(&v);
+            Data.insert(Data.end(), p, p + sizeof(T));
+        }
+    }
+
+    // Reads or writes an array of count sizes.  The array must already have
+    // count elements when it is read.
+    void    sizes(cl_uint count, size_t* v)
+    {
+        for( cl_uint i = 0; i < count; i++ )
+        {
+            uint64_t size = v[i];
+            value(size);
+            v[i] = static_cast<size_t>(size);
+        }
+    }
+
+    // Returns true if at least count bytes remain to be read.
+    bool    hasBytes(size_t count) const
+    {
+        return Good && Data.size() - Offset >= count;
+    }
+
+    void    bytes(std::vector<uint8_t>& v)
+    {
+        uint64_t size = v.size();
+        value(size);
+        if( IsLoading )
+        {
+            if( !Good || Data.size() - Offset < size )
+            {
+                Good = false;
+                return;
+            }
+            v.assign(
+                Data.begin() + Offset,
+                Data.begin() + Offset + static_cast<size_t>(size));
+            Offset += static_cast<size_t>(size);
+        }
+        else
+        {
+            Data.insert(Data.end(), v.begin(), v.end());
+        }
+    }
+
+    // Memory objects read from a binary are retained.
+    void    mem(cl_mem& m)
+    {
+        handle(m, NumMemObjects, MemObjects);
+        if( IsLoading && Good && m != nullptr )
+        {
+            g_pNextDispatch->clRetainMemObject(m);
+        }
+    }
+
+    // Kernels read from a binary are retained.
+    void    kernel(cl_kernel& k)
+    {
+        handle(k, NumKernels, Kernels);
+        if( IsLoading && Good && k != nullptr )
+        {
+            g_pNextDispatch->clRetainKernel(k);
+        }
+    }
+
+    bool    hasMem(cl_mem m) const
+    {
+        return std::find(MemObjects, MemObjects + NumMemObjects, m) !=
+            MemObjects + NumMemObjects;
+    }
+
+    // Kernel arguments that are memory objects in the memory object table
+    // are stored as indices, so they are rebound when the binary is read.
+    // Other kernel arguments that are handles cannot be stored, and all
+    // other kernel arguments are stored by value.
+    void    kernelArgs(std::vector<SKernelArg>& args)
+    {
+        uint32_t numArgs = static_cast<uint32_t>(args.size());
+        value(numArgs);
+        if( IsLoading )
+        {
+            // Each kernel argument uses at least one byte, so this also
+            // checks for an invalid number of kernel arguments.
+            if( !Good || numArgs > Data.size() - Offset )
+            {
+                Good = false;
+                return;
+            }
+            args.resize(numArgs);
+        }
+        for( auto& arg : args )
+        {
+            uint8_t kind = cArgKindBytes;
+            cl_mem m = nullptr;
+            if( !IsLoading )
+            {
+                if( !arg.IsSet || arg.IsSVMPointer )
+                {
+                    Good = false;
+                    return;
+                }
+                if( arg.Value.empty() )
+                {
+                    kind = cArgKindNoValue;
+                }
+                else if( arg.Kind != cKernelArgValue )
+                {
+                    // A kernel argument of an unknown kind is only stored if
+                    // it is a memory object in the memory object table.
+                    memcpy(&m, arg.Value.data(), sizeof(m));
+                    if( arg.Kind == cKernelArgHandle ||
+                        ( m != nullptr && !hasMem(m) ) )
+                    {
+                        Good = false;
+                        return;
+                    }
+                    kind = cArgKindMem;
+                }
+            }
+
+            value(kind);
+            uint64_t size = arg.Size;
+            value(size);
+            switch( kind )
+            {
+            case cArgKindBytes:
+                bytes(arg.Value);
+                break;
+            case cArgKindMem:
+                handle(m, NumMemObjects, MemObjects);
+                if( IsLoading )
+                {
+                    auto p = reinterpret_cast<const uint8_t*>(&m);
+                    arg.Value.assign(p, p + sizeof(m));
+                }
+                break;
+            case cArgKindNoValue:
+                arg.Value.clear();
+                break;
+            default:
+                Good = false;
+                break;
+            }
+            if( !Good )
+            {
+                return;
+            }
+
+            arg.IsSet = true;
+            arg.IsSVMPointer = false;
+            arg.Kind = kind == cArgKindMem ? cKernelArgMemObject : cKernelArgValue;
+            arg.Size = static_cast<size_t>(size);
+        }
+    }
+
+private:
+    static constexpr uint8_t cArgKindBytes = 0;
+    static constexpr uint8_t cArgKindMem = 1;
+    static constexpr uint8_t cArgKindNoValue = 2;
+    static constexpr uint32_t cNullIndex = ~0u;
+
+    const bool  IsLoading;
+    bool    Good = true;
+    size_t  Offset = 0;
+    std::vector<uint8_t>    Data;
+
+    const cl_uint   NumMemObjects;
+    const cl_mem*   MemObjects;
+    const cl_uint   NumKernels;
+    const cl_kernel*    Kernels;
+
+    template<class T>
+    void    handle(T& h, cl_uint count, const T* table)
+    {
+        uint32_t index = cNullIndex;
+        if( !IsLoading && h != nullptr )
+        {
+            index = static_cast<uint32_t>(
+                std::find(table, table + count, h) - table);
+            if( index == count )
+            {
+                Good = false;
+                return;
+            }
+        }
+
+        value(index);
+        if( IsLoading )
+        {
+            if( !Good || ( index != cNullIndex && index >= count ) )
+            {
+                Good = false;
+                h = nullptr;
+                return;
+            }
+            h = index == cNullIndex ? nullptr : table[index];
+        }
+    }
+};
+
 typedef struct _cl_mutable_command_khr
 {
     static bool isValid( cl_mutable_command_khr command )
@@ -175,35 +867,90 @@ typedef struct _cl_mutable_command_khr
         }
     }
 
-    std::vector<cl_event> getEventWaitList(
-        const std::vector<cl_event>& deps) const
+    cl_command_queue getQueue() const
     {
-        std::vector<cl_event> eventWaitList(WaitList.size());
-        std::transform(
-            WaitList.cbegin(),
-            WaitList.cend(),
-            eventWaitList.begin(),
-            [&](cl_uint s){ return deps[s]; });
-        return eventWaitList;
+        return Queue;
     }
 
-    cl_event* getEventSignalPtr(
-        std::vector<cl_event>& deps) const
+    cl_uint getQueueIndex() const
     {
-        return SyncPoint != 0 ? &deps[SyncPoint] : nullptr;
+        return QueueIndex;
+    }
+
+    const std::vector<cl_sync_point_khr>& getWaitList() const
+    {
+        return WaitList;
+    }
+
+    void setWaitList(std::vector<cl_sync_point_khr>&& waitList)
+    {
+        WaitList = std::move(waitList);
+    }
+
+    cl_sync_point_khr getSyncPoint() const
+    {
+        return SyncPoint;
+    }
+
+    void setSyncPoint(cl_sync_point_khr syncPoint)
+    {
+        SyncPoint = syncPoint;
+    }
+
+    virtual ~_cl_mutable_command_khr() = default;
+
+    // Gets the memory objects this command reads and writes.  Returns false
+    // if the memory accessed by this command is not known, in which case
+    // this command must be ordered with respect to all other commands.
+    virtual bool getMemAccesses(
+        std::vector<SMemAccess>&) const
+    {
+        return false;
+    }
+
+    // Reads or writes the command-specific parts of this command from or to
+    // a command buffer binary.  Returns false if this command cannot be
+    // stored in a command buffer binary.
+    virtual bool serialize(
+        CCommandBufferBinary&)
+    {
+        return false;
     }
 
-    virtual ~_cl_mutable_command_khr() = default;
-
     virtual int playback(
         cl_command_queue,
-        std::vector<cl_event>&) const = 0;
+        cl_uint,
+        const cl_event*,
+        cl_event*) const = 0;
+
+    // Creates a copy of this command for a different command buffer and
+    // queue.  This is used when a command buffer is remapped.
+    virtual std::unique_ptr<_cl_mutable_command_khr> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const = 0;
 
     _cl_mutable_command_khr(
         cl_command_buffer_khr cmdbuf,
         cl_command_queue queue,
         cl_command_type type);
 
+    // Commands are allocated from their command buffer's arena, so the
+    // commands in a command buffer are laid out contiguously in memory.  The
+    // memory for a command is freed when its command buffer is destroyed.
+    static void* operator new(
+        size_t size,
+        cl_command_buffer_khr cmdbuf);
+    static void operator delete(
+        void*,
+        cl_command_buffer_khr) {}
+    static void operator delete(
+        void*) {}
+
+protected:
+    void remap(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue);
+
 private:
     static constexpr cl_uint cMagic = 0x4d434442;   // "MCMD"
 
@@ -211,6 +958,7 @@ private:
     const cl_command_type Type;
     cl_command_buffer_khr CmdBuf;
     cl_command_queue Queue;
+    cl_uint QueueIndex;
 
     std::vector<cl_sync_point_khr> WaitList;
     cl_sync_point_khr SyncPoint = 0;
@@ -223,20 +971,51 @@ struct BarrierWithWaitList : Command
         cl_command_queue queue)
     {
         auto ret = std::unique_ptr<BarrierWithWaitList>(
-            new BarrierWithWaitList(cmdbuf, queue));
+            new (cmdbuf) BarrierWithWaitList(cmdbuf, queue));
+        return ret;
+    }
+
+    static std::unique_ptr<BarrierWithWaitList> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<BarrierWithWaitList>(
+            new (cmdbuf) BarrierWithWaitList(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<BarrierWithWaitList>(
+            new (cmdbuf) BarrierWithWaitList(*this));
+        ret->remap(cmdbuf, queue);
+
         return ret;
     }
 
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueBarrierWithWaitList(
             queue,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -258,7 +1037,7 @@ struct CopyBuffer : Command
         size_t size)
     {
         auto ret = std::unique_ptr<CopyBuffer>(
-            new CopyBuffer(cmdbuf, queue));
+            new (cmdbuf) CopyBuffer(cmdbuf, queue));
 
         ret->src_buffer = src_buffer;
         ret->dst_buffer = dst_buffer;
@@ -272,18 +1051,65 @@ struct CopyBuffer : Command
         return ret;
     }
 
+    static std::unique_ptr<CopyBuffer> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<CopyBuffer>(
+            new (cmdbuf) CopyBuffer(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~CopyBuffer()
     {
         g_pNextDispatch->clReleaseMemObject(src_buffer);
         g_pNextDispatch->clReleaseMemObject(dst_buffer);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(src_buffer), false});
+        accesses.push_back({getRootMemObject(dst_buffer), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<CopyBuffer>(
+            new (cmdbuf) CopyBuffer(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->src_buffer);
+        g_pNextDispatch->clRetainMemObject(ret->dst_buffer);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(src_buffer);
+        binary.mem(dst_buffer);
+        binary.value(src_offset);
+        binary.value(dst_offset);
+        binary.value(size);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueCopyBuffer(
             queue,
             src_buffer,
@@ -291,8 +1117,8 @@ struct CopyBuffer : Command
             src_offset,
             dst_offset,
             size,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -324,7 +1150,7 @@ struct CopyBufferRect : Command
         size_t dst_slice_pitch)
     {
         auto ret = std::unique_ptr<CopyBufferRect>(
-            new CopyBufferRect(cmdbuf, queue));
+            new (cmdbuf) CopyBufferRect(cmdbuf, queue));
 
         ret->src_buffer = src_buffer;
         ret->dst_buffer = dst_buffer;
@@ -342,18 +1168,69 @@ struct CopyBufferRect : Command
         return ret;
     }
 
+    static std::unique_ptr<CopyBufferRect> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<CopyBufferRect>(
+            new (cmdbuf) CopyBufferRect(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~CopyBufferRect()
     {
         g_pNextDispatch->clReleaseMemObject(src_buffer);
         g_pNextDispatch->clReleaseMemObject(dst_buffer);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(src_buffer), false});
+        accesses.push_back({getRootMemObject(dst_buffer), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<CopyBufferRect>(
+            new (cmdbuf) CopyBufferRect(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->src_buffer);
+        g_pNextDispatch->clRetainMemObject(ret->dst_buffer);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(src_buffer);
+        binary.mem(dst_buffer);
+        binary.value(src_origin);
+        binary.value(dst_origin);
+        binary.value(region);
+        binary.value(src_row_pitch);
+        binary.value(src_slice_pitch);
+        binary.value(dst_row_pitch);
+        binary.value(dst_slice_pitch);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueCopyBufferRect(
             queue,
             src_buffer,
@@ -365,8 +1242,8 @@ struct CopyBufferRect : Command
             src_slice_pitch,
             dst_row_pitch,
             dst_slice_pitch,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -398,7 +1275,7 @@ struct CopyBufferToImage : Command
         const size_t* region)
     {
         auto ret = std::unique_ptr<CopyBufferToImage>(
-            new CopyBufferToImage(cmdbuf, queue));
+            new (cmdbuf) CopyBufferToImage(cmdbuf, queue));
 
         ret->src_buffer = src_buffer;
         ret->dst_image = dst_image;
@@ -412,18 +1289,65 @@ struct CopyBufferToImage : Command
         return ret;
     }
 
+    static std::unique_ptr<CopyBufferToImage> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<CopyBufferToImage>(
+            new (cmdbuf) CopyBufferToImage(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~CopyBufferToImage()
     {
         g_pNextDispatch->clReleaseMemObject(src_buffer);
         g_pNextDispatch->clReleaseMemObject(dst_image);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(src_buffer), false});
+        accesses.push_back({getRootMemObject(dst_image), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<CopyBufferToImage>(
+            new (cmdbuf) CopyBufferToImage(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->src_buffer);
+        g_pNextDispatch->clRetainMemObject(ret->dst_image);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(src_buffer);
+        binary.mem(dst_image);
+        binary.value(src_offset);
+        binary.value(dst_origin);
+        binary.value(region);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueCopyBufferToImage(
             queue,
             src_buffer,
@@ -431,8 +1355,8 @@ struct CopyBufferToImage : Command
             src_offset,
             dst_origin.data(),
             region.data(),
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -460,7 +1384,7 @@ struct CopyImage : Command
         const size_t* region)
     {
         auto ret = std::unique_ptr<CopyImage>(
-            new CopyImage(cmdbuf, queue));
+            new (cmdbuf) CopyImage(cmdbuf, queue));
 
         ret->src_image = src_image;
         ret->dst_image = dst_image;
@@ -474,18 +1398,65 @@ struct CopyImage : Command
         return ret;
     }
 
+    static std::unique_ptr<CopyImage> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<CopyImage>(
+            new (cmdbuf) CopyImage(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~CopyImage()
     {
         g_pNextDispatch->clReleaseMemObject(src_image);
         g_pNextDispatch->clReleaseMemObject(dst_image);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(src_image), false});
+        accesses.push_back({getRootMemObject(dst_image), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<CopyImage>(
+            new (cmdbuf) CopyImage(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->src_image);
+        g_pNextDispatch->clRetainMemObject(ret->dst_image);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(src_image);
+        binary.mem(dst_image);
+        binary.value(src_origin);
+        binary.value(dst_origin);
+        binary.value(region);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueCopyImage(
             queue,
             src_image,
@@ -493,8 +1464,8 @@ struct CopyImage : Command
             src_origin.data(),
             dst_origin.data(),
             region.data(),
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -522,7 +1493,7 @@ struct CopyImageToBuffer : Command
         size_t dst_offset)
     {
         auto ret = std::unique_ptr<CopyImageToBuffer>(
-            new CopyImageToBuffer(cmdbuf, queue));
+            new (cmdbuf) CopyImageToBuffer(cmdbuf, queue));
 
         ret->src_image = src_image;
         ret->dst_buffer = dst_buffer;
@@ -536,18 +1507,65 @@ struct CopyImageToBuffer : Command
         return ret;
     }
 
+    static std::unique_ptr<CopyImageToBuffer> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<CopyImageToBuffer>(
+            new (cmdbuf) CopyImageToBuffer(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~CopyImageToBuffer()
     {
         g_pNextDispatch->clReleaseMemObject(src_image);
         g_pNextDispatch->clReleaseMemObject(dst_buffer);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(src_image), false});
+        accesses.push_back({getRootMemObject(dst_buffer), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<CopyImageToBuffer>(
+            new (cmdbuf) CopyImageToBuffer(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->src_image);
+        g_pNextDispatch->clRetainMemObject(ret->dst_buffer);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(src_image);
+        binary.mem(dst_buffer);
+        binary.value(src_origin);
+        binary.value(region);
+        binary.value(dst_offset);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueCopyImageToBuffer(
             queue,
             src_image,
@@ -555,8 +1573,8 @@ struct CopyImageToBuffer : Command
             src_origin.data(),
             region.data(),
             dst_offset,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -584,7 +1602,7 @@ struct FillBuffer : Command
         size_t size)
     {
         auto ret = std::unique_ptr<FillBuffer>(
-            new FillBuffer(cmdbuf, queue));
+            new (cmdbuf) FillBuffer(cmdbuf, queue));
 
         ret->buffer = buffer;
 
@@ -603,17 +1621,61 @@ struct FillBuffer : Command
         return ret;
     }
 
+    static std::unique_ptr<FillBuffer> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<FillBuffer>(
+            new (cmdbuf) FillBuffer(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~FillBuffer()
     {
         g_pNextDispatch->clReleaseMemObject(buffer);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(buffer), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<FillBuffer>(
+            new (cmdbuf) FillBuffer(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->buffer);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(buffer);
+        binary.bytes(pattern);
+        binary.value(offset);
+        binary.value(size);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueFillBuffer(
             queue,
             buffer,
@@ -621,8 +1683,8 @@ struct FillBuffer : Command
             pattern.size(),
             offset,
             size,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -648,7 +1710,7 @@ struct FillImage : Command
         const size_t* region)
     {
         auto ret = std::unique_ptr<FillImage>(
-            new FillImage(cmdbuf, queue));
+            new (cmdbuf) FillImage(cmdbuf, queue));
 
         ret->image = image;
 
@@ -681,25 +1743,69 @@ struct FillImage : Command
         return ret;
     }
 
+    static std::unique_ptr<FillImage> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        auto ret = std::unique_ptr<FillImage>(
+            new (cmdbuf) FillImage(cmdbuf, queue));
+        if( !ret->serialize(binary) )
+        {
+            return nullptr;
+        }
+        return ret;
+    }
+
     ~FillImage()
     {
         g_pNextDispatch->clReleaseMemObject(image);
     }
 
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        accesses.push_back({getRootMemObject(image), true});
+        return true;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<FillImage>(
+            new (cmdbuf) FillImage(*this));
+        ret->remap(cmdbuf, queue);
+
+        g_pNextDispatch->clRetainMemObject(ret->image);
+
+        return ret;
+    }
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        binary.mem(image);
+        binary.bytes(fill_color);
+        binary.value(origin);
+        binary.value(region);
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueFillImage(
             queue,
             image,
             fill_color.data(),
             origin.data(),
             region.data(),
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -724,7 +1830,7 @@ struct SVMMemcpy : Command
         size_t size)
     {
         auto ret = std::unique_ptr<SVMMemcpy>(
-            new SVMMemcpy(cmdbuf, queue));
+            new (cmdbuf) SVMMemcpy(cmdbuf, queue));
 
         ret->dst_ptr = dst_ptr;
         ret->src_ptr = src_ptr;
@@ -733,20 +1839,31 @@ struct SVMMemcpy : Command
         return ret;
     }
 
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<SVMMemcpy>(
+            new (cmdbuf) SVMMemcpy(*this));
+        ret->remap(cmdbuf, queue);
+
+        return ret;
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueSVMMemcpy(
             queue,
             CL_FALSE,
             dst_ptr,
             src_ptr,
             size,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -771,7 +1888,7 @@ struct SVMMemFill : Command
         size_t size)
     {
         auto ret = std::unique_ptr<SVMMemFill>(
-            new SVMMemFill(cmdbuf, queue));
+            new (cmdbuf) SVMMemFill(cmdbuf, queue));
 
         ret->dst_ptr = dst_ptr;
 
@@ -787,20 +1904,31 @@ struct SVMMemFill : Command
         return ret;
     }
 
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override
+    {
+        auto ret = std::unique_ptr<SVMMemFill>(
+            new (cmdbuf) SVMMemFill(*this));
+        ret->remap(cmdbuf, queue);
+
+        return ret;
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueSVMMemFill(
             queue,
             dst_ptr,
             pattern.data(),
             pattern.size(),
             size,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -814,27 +1942,67 @@ private:
         cl_command_queue queue) : Command(cmdbuf, queue, CL_COMMAND_SVM_MEMFILL) {};
 };
 
-struct NDRangeKernel : Command
+// A global work offset, global work size, or local work size.  Up to three
+// work dimensions are stored inline, which covers nearly all kernels, and
+// more work dimensions are stored on the heap.
+class CWorkSizes
 {
-    static std::unique_ptr<NDRangeKernel> create(
-        const bool isMutable,
-        const cl_command_properties_khr* properties,
-        cl_command_buffer_khr cmdbuf,
-        cl_command_queue queue,
-        cl_kernel kernel,
-        cl_uint work_dim,
-        const size_t* global_work_offset,
-        const size_t* global_work_size,
-        const size_t* local_work_size,
-        cl_int& errorCode);
+public:
+    static constexpr cl_uint cInlineWorkDim = 3;
 
-    ~NDRangeKernel()
+    void    resize(cl_uint work_dim)
     {
-        g_pNextDispatch->clReleaseKernel(kernel);
-        g_pNextDispatch->clReleaseKernel(original_kernel);
-    }
-
-    cl_int  getInfo(
+        if( work_dim > cInlineWorkDim )
+        {
+            Heap.assign(work_dim, 0);
+        }
+        else
+        {
+            Heap.clear();
+            Inline.fill(0);
+        }
+    }
+
+    size_t* data()
+    {
+        return Heap.empty() ? Inline.data() : Heap.data();
+    }
+
+    const size_t* data() const
+    {
+        return Heap.empty() ? Inline.data() : Heap.data();
+    }
+
+private:
+    std::array<size_t, cInlineWorkDim>  Inline{};
+    std::vector<size_t> Heap;
+};
+
+struct NDRangeKernel : Command
+{
+    static std::unique_ptr<NDRangeKernel> create(
+        const bool isMutable,
+        const cl_command_properties_khr* properties,
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        cl_kernel kernel,
+        cl_uint work_dim,
+        const size_t* global_work_offset,
+        const size_t* global_work_size,
+        const size_t* local_work_size,
+        cl_int& errorCode);
+
+    ~NDRangeKernel()
+    {
+        if( isTrackingKernelArgs() )
+        {
+            untrackKernel(original_kernel);
+        }
+        g_pNextDispatch->clReleaseKernel(kernel);
+        g_pNextDispatch->clReleaseKernel(original_kernel);
+    }
+
+    cl_int  getInfo(
         cl_mutable_command_info_khr param_name,
         size_t param_value_size,
         void* param_value,
@@ -846,9 +2014,10 @@ struct NDRangeKernel : Command
         case CL_MUTABLE_COMMAND_PROPERTIES_ARRAY_KHR:
             {
                 auto ptr = (cl_command_properties_khr*)param_value;
-                return writeVectorToMemory(
+                return writeArrayToMemory(
                     param_value_size,
-                    properties,
+                    properties.data(),
+                    numProperties,
                     param_value_size_ret,
                     ptr );
             }
@@ -875,59 +2044,38 @@ struct NDRangeKernel : Command
             break;
         case CL_MUTABLE_DISPATCH_GLOBAL_WORK_OFFSET_KHR:
             {
+                // TODO: Should it be valid to return a size of zero if there
+                // is no global work offset?  For now, this returns zeroes.
                 auto ptr = (size_t*)param_value;
-                if( global_work_offset.size() )
-                {
-                    return writeVectorToMemory(
-                        param_value_size,
-                        global_work_offset,
-                        param_value_size_ret,
-                        ptr );
-                }
-                else
-                {
-                    // TODO: Should it be valid to return a size of zero in
-                    // this case instead?
-                    std::vector<size_t> temp_global_work_offset(work_dim, 0);
-                    return writeVectorToMemory(
-                        param_value_size,
-                        temp_global_work_offset,
-                        param_value_size_ret,
-                        ptr );
-                }
+                return writeArrayToMemory(
+                    param_value_size,
+                    global_work_offset.data(),
+                    work_dim,
+                    param_value_size_ret,
+                    ptr );
             }
             break;
         case CL_MUTABLE_DISPATCH_GLOBAL_WORK_SIZE_KHR:
             {
                 auto ptr = (size_t*)param_value;
-                return writeVectorToMemory(
+                return writeArrayToMemory(
                     param_value_size,
-                    global_work_size,
+                    global_work_size.data(),
+                    hasGlobalWorkSize ? work_dim : 0,
                     param_value_size_ret,
                     ptr );
             }
         case CL_MUTABLE_DISPATCH_LOCAL_WORK_SIZE_KHR:
             {
+                // TODO: Should it be valid to return a size of zero if there
+                // is no local work size?  For now, this returns zeroes.
                 auto ptr = (size_t*)param_value;
-                if( local_work_size.size() )
-                {
-                    return writeVectorToMemory(
-                        param_value_size,
-                        local_work_size,
-                        param_value_size_ret,
-                        ptr );
-                }
-                else
-                {
-                    // TODO: Should it be valid to return a size of zero in
-                    // this case instead?
-                    std::vector<size_t> temp_local_work_size(work_dim, 0);
-                    return writeVectorToMemory(
-                        param_value_size,
-                        temp_local_work_size,
-                        param_value_size_ret,
-                        ptr );
-                }
+                return writeArrayToMemory(
+                    param_value_size,
+                    local_work_size.data(),
+                    work_dim,
+                    param_value_size_ret,
+                    ptr );
             }
             break;
         default:
@@ -992,11 +2140,31 @@ struct NDRangeKernel : Command
             return CL_INVALID_VALUE;
         }
 
+        // A shared kernel clone must not be modified, so clone it before
+        // updating its kernel arguments or execution info.
+        if( isSharedKernel &&
+            ( dispatchConfig->num_args != 0 ||
+              dispatchConfig->num_svm_args != 0 ||
+              dispatchConfig->num_exec_infos != 0 ) )
+        {
+            cl_int errorCode = CL_SUCCESS;
+            cl_kernel clone = g_pNextDispatch->clCloneKernel(
+                kernel,
+                &errorCode );
+            if( errorCode != CL_SUCCESS )
+            {
+                return errorCode;
+            }
+            g_pNextDispatch->clReleaseKernel(kernel);
+            kernel = clone;
+            isSharedKernel = false;
+        }
+
         for( cl_uint i = 0; i < dispatchConfig->num_args; i++ )
         {
-            if( cl_int errorCode = g_pNextDispatch->clSetKernelArg(
-                    kernel,
+            if( cl_int errorCode = updateArg(
                     dispatchConfig->arg_list[i].arg_index,
+                    false,
                     dispatchConfig->arg_list[i].arg_size,
                     dispatchConfig->arg_list[i].arg_value ) )
             {
@@ -1006,15 +2174,25 @@ struct NDRangeKernel : Command
 
         for( cl_uint i = 0; i < dispatchConfig->num_svm_args; i++ )
         {
-            if( cl_int errorCode = g_pNextDispatch->clSetKernelArgSVMPointer(
-                    kernel,
+            const void* arg_value = dispatchConfig->arg_svm_list[i].arg_value;
+            if( cl_int errorCode = updateArg(
                     dispatchConfig->arg_svm_list[i].arg_index,
-                    dispatchConfig->arg_svm_list[i].arg_value ) )
+                    true,
+                    sizeof(arg_value),
+                    &arg_value ) )
             {
                 return errorCode;
             }
         }
 
+        // Execution info is not tracked, so a command with execution info
+        // cannot be stored in a command buffer binary.
+        if( dispatchConfig->num_exec_infos != 0 )
+        {
+            hasKernelArgs = false;
+            kernelArgs.clear();
+        }
+
         for( cl_uint i = 0; i < dispatchConfig->num_exec_infos; i++ )
         {
             if( cl_int errorCode = g_pNextDispatch->clSetKernelExecInfo(
@@ -1033,15 +2211,11 @@ struct NDRangeKernel : Command
             const size_t* check_global_work_size =
                 dispatchConfig->global_work_size ?
                 dispatchConfig->global_work_size :
-                global_work_size.size() > 0 ?
-                global_work_size.data() :
-                nullptr;
+                getGlobalWorkSize();
             const size_t* check_local_work_size =
                 dispatchConfig->local_work_size ?
                 dispatchConfig->local_work_size :
-                local_work_size.size() > 0 ?
-                local_work_size.data() :
-                nullptr;
+                getLocalWorkSize();
             if( check_local_work_size == nullptr )
             {
                 return CL_INVALID_WORK_GROUP_SIZE;
@@ -1059,43 +2233,170 @@ struct NDRangeKernel : Command
 
         if( dispatchConfig->global_work_offset )
         {
-            global_work_offset.assign(
+            std::copy(
                 dispatchConfig->global_work_offset,
-                dispatchConfig->global_work_offset + work_dim );
+                dispatchConfig->global_work_offset + work_dim,
+                global_work_offset.data() );
+            hasGlobalWorkOffset = true;
         }
 
         if( dispatchConfig->global_work_size )
         {
-            global_work_size.assign(
+            std::copy(
                 dispatchConfig->global_work_size,
-                dispatchConfig->global_work_size + work_dim );
+                dispatchConfig->global_work_size + work_dim,
+                global_work_size.data() );
+            hasGlobalWorkSize = true;
         }
 
         if( dispatchConfig->local_work_size )
         {
-            local_work_size.assign(
+            std::copy(
                 dispatchConfig->local_work_size,
-                dispatchConfig->local_work_size + work_dim );
+                dispatchConfig->local_work_size + work_dim,
+                local_work_size.data() );
+            hasLocalWorkSize = true;
         }
 
         return CL_SUCCESS;
     }
 
+    bool    hasPendingUpdates() const
+    {
+        return !pendingArgIndices.empty();
+    }
+
+    // Applies staged kernel argument updates to the kernel.  Called before
+    // the command buffer is replayed.  An update that cannot be applied is
+    // kept pending, so the error is returned again by the next replay rather
+    // than replaying with the previous argument value.
+    cl_int  applyUpdates()
+    {
+        cl_int errorCode = CL_SUCCESS;
+        size_t numPending = 0;
+        for( auto index : pendingArgIndices )
+        {
+            auto& arg = args[index];
+            if( !arg.IsPending )
+            {
+                continue;
+            }
+
+            cl_int argErrorCode = CL_SUCCESS;
+            if( arg.IsSVMPointer )
+            {
+                const void* value = nullptr;
+                memcpy(&value, arg.Pending.data(), sizeof(value));
+                argErrorCode = g_pNextDispatch->clSetKernelArgSVMPointer(
+                    kernel,
+                    index,
+                    value );
+            }
+            else
+            {
+                argErrorCode = g_pNextDispatch->clSetKernelArg(
+                    kernel,
+                    index,
+                    arg.Size,
+                    arg.HasValue ? arg.Pending.data() : nullptr );
+            }
+            if( argErrorCode != CL_SUCCESS )
+            {
+                errorCode = argErrorCode;
+                pendingArgIndices[numPending++] = index;
+                continue;
+            }
+
+            arg.Applied.swap(arg.Pending);
+            arg.IsPending = false;
+        }
+
+        pendingArgIndices.resize(numPending);
+        return errorCode;
+    }
+
+    bool getMemAccesses(
+        std::vector<SMemAccess>& accesses) const override
+    {
+        if( hasMemAccesses )
+        {
+            accesses.insert(
+                accesses.end(),
+                memAccesses.begin(),
+                memAccesses.end());
+        }
+        return hasMemAccesses;
+    }
+
+    std::unique_ptr<Command> clone(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue) const override;
+
+    static std::unique_ptr<NDRangeKernel> createFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary);
+
+    bool serialize(
+        CCommandBufferBinary& binary) override
+    {
+        if( !binary.isLoading() && !hasKernelArgs )
+        {
+            return false;
+        }
+
+        binary.kernel(original_kernel);
+        binary.value(work_dim);
+        if( binary.isLoading() )
+        {
+            // Each work dimension uses at least one byte, so this also
+            // checks for an invalid number of work dimensions.
+            if( work_dim < 1 || !binary.hasBytes(work_dim) )
+            {
+                binary.fail();
+                return false;
+            }
+            global_work_offset.resize(work_dim);
+            global_work_size.resize(work_dim);
+            local_work_size.resize(work_dim);
+        }
+        binary.value(mutableFields);
+        binary.value(mutableAsserts);
+        binary.value(numWorkGroups);
+        binary.value(isSuggestedLocalWorkSize);
+        binary.value(numProperties);
+        binary.value(properties);
+        binary.value(hasGlobalWorkOffset);
+        binary.value(hasGlobalWorkSize);
+        binary.value(hasLocalWorkSize);
+        binary.sizes(work_dim, global_work_offset.data());
+        binary.sizes(work_dim, global_work_size.data());
+        binary.sizes(work_dim, local_work_size.data());
+        binary.value(hasMemAccesses);
+        binary.kernelArgs(kernelArgs);
+
+        if( numProperties > properties.size() )
+        {
+            binary.fail();
+        }
+        return binary.good();
+    }
+
     int playback(
         cl_command_queue queue,
-        std::vector<cl_event>& deps) const override
+        cl_uint num_events,
+        const cl_event* wait_list,
+        cl_event* signal) const override
     {
-        auto wait_list = getEventWaitList(deps);
-        auto signal = getEventSignalPtr(deps);
         return g_pNextDispatch->clEnqueueNDRangeKernel(
             queue,
             kernel,
             work_dim,
-            global_work_offset.size() ? global_work_offset.data() : nullptr,
-            global_work_size.data(),
-            local_work_size.size() ? local_work_size.data() : nullptr,
-            static_cast<cl_uint>(wait_list.size()),
-            wait_list.size() ? wait_list.data() : nullptr,
+            getGlobalWorkOffset(),
+            getGlobalWorkSize(),
+            getLocalWorkSize(),
+            num_events,
+            wait_list,
             signal);
     }
 
@@ -1105,10 +2406,69 @@ struct NDRangeKernel : Command
     cl_mutable_dispatch_fields_khr mutableFields = 0;
     cl_mutable_dispatch_asserts_khr mutableAsserts = 0;
     size_t  numWorkGroups = 0;
-    std::vector<cl_command_properties_khr> properties;
-    std::vector<size_t> global_work_offset;
-    std::vector<size_t> global_work_size;
-    std::vector<size_t> local_work_size;
+    bool    isSuggestedLocalWorkSize = false;
+    bool    isSharedKernel = false;
+
+    // The properties are stored inline, since there are at most two
+    // properties.  The NDRange is stored inline for up to three work
+    // dimensions.
+    std::array<cl_command_properties_khr, 5> properties{};
+    size_t  numProperties = 0;
+    bool    hasGlobalWorkOffset = false;
+    bool    hasGlobalWorkSize = false;
+    bool    hasLocalWorkSize = false;
+    CWorkSizes  global_work_offset;
+    CWorkSizes  global_work_size;
+    CWorkSizes  local_work_size;
+
+    const size_t* getGlobalWorkOffset() const
+    {
+        return hasGlobalWorkOffset ? global_work_offset.data() : nullptr;
+    }
+    const size_t* getGlobalWorkSize() const
+    {
+        return hasGlobalWorkSize ? global_work_size.data() : nullptr;
+    }
+    const size_t* getLocalWorkSize() const
+    {
+        return hasLocalWorkSize ? local_work_size.data() : nullptr;
+    }
+
+    // Kernel argument values set by mutable dispatch updates.  The first
+    // update to each kernel argument is applied immediately so it is
+    // validated by the kernel.  Later updates with the same size to values
+    // and memory objects are validated when the update is made, then staged
+    // and applied when the command buffer is next replayed, so repeated
+    // updates to the same argument are coalesced and updates that do not
+    // change the argument value are skipped.  Updates to SVM pointers and
+    // other handles cannot be validated without setting them, so they are
+    // always applied immediately.
+    struct SArgState
+    {
+        bool    IsKnown = false;
+        bool    IsPending = false;
+        bool    IsSVMPointer = false;
+        bool    HasValue = false;
+        bool    HasKind = false;
+        uint8_t Kind = cKernelArgUnknown;
+        size_t  Size = 0;
+        std::vector<uint8_t>    Applied;
+        std::vector<uint8_t>    Pending;
+    };
+    std::vector<SArgState>  args;
+    std::vector<cl_uint>    pendingArgIndices;
+
+    // The kernel arguments for this command, including any updates from
+    // mutable dispatch, stored only when command buffer binaries are enabled.
+    // Some kernel arguments may not be set yet for a mutable command.
+    bool    hasKernelArgs = false;
+    std::vector<SKernelArg> kernelArgs;
+
+    // The memory objects accessed by this kernel, determined from the kernel
+    // arguments when the command is recorded.  Only known for commands that
+    // are not mutable and only when dependencies are inferred.
+    bool    hasMemAccesses = false;
+    std::vector<SMemAccess> memAccesses;
 
 private:
     NDRangeKernel(
@@ -1116,169 +2476,569 @@ private:
         cl_command_queue queue)
         : Command(cmdbuf, queue, CL_COMMAND_NDRANGE_KERNEL) {};
 
-    static size_t getNumWorkGroups(
-        cl_uint work_dim,
-        const size_t* global_work_size,
-        const size_t* local_work_size )
-    {
-        if( work_dim == 0 ||
-            global_work_size == nullptr ||
-            local_work_size == nullptr )
-        {
-            return 1;
-        }
+    void suggestLocalWorkSize(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_queue queue,
+        cl_kernel kernel );
 
-        size_t  count = 1;
-        for( cl_uint i = 0; i < work_dim; i++ )
+    void    updateKernelArg(
+        cl_uint index,
+        bool isSVMPointer,
+        size_t size,
+        const uint8_t* bytes )
+    {
+        if( hasKernelArgs && index < kernelArgs.size() )
         {
-            size_t  gws = global_work_size[i];
-            size_t  lws = local_work_size[i];
-            count *= (gws + lws - 1) / lws;
+            auto& kernelArg = kernelArgs[index];
+            kernelArg.IsSet = true;
+            kernelArg.IsSVMPointer = isSVMPointer;
+            kernelArg.Kind = isSVMPointer ?
+                cKernelArgValue :
+                getKernelArgKind(original_kernel, index, size, bytes);
+            kernelArg.Size = size;
+            if( bytes )
+            {
+                kernelArg.Value.assign(bytes, bytes + size);
+            }
+            else
+            {
+                kernelArg.Value.clear();
+            }
         }
-
-        return count;
     }
-};
 
-typedef struct _cl_command_buffer_khr
-{
-    static _cl_command_buffer_khr* create(
-        cl_uint num_queues,
-        const cl_command_queue* queues,
-        const cl_command_buffer_properties_khr* properties,
-        cl_int* errcode_ret)
+    cl_int  updateArg(
+        cl_uint index,
+        bool isSVMPointer,
+        size_t size,
+        const void* value )
     {
-        cl_command_buffer_khr cmdbuf = nullptr;
-        cl_int errorCode = CL_SUCCESS;
-
-        ptrdiff_t numProperties = 0;
-        cl_command_buffer_flags_khr flags = 0;
-        cl_mutable_dispatch_asserts_khr mutableDispatchAsserts = 0;
-
-        if( num_queues != 1 || queues == nullptr )
+        if( args.size() <= index )
         {
-            errorCode = CL_INVALID_VALUE;
+            args.resize(index + 1);
         }
-        if( properties )
+
+        auto& arg = args[index];
+        const bool hasValue = value != nullptr;
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(value);
+
+        bool canStage =
+            arg.IsKnown &&
+            arg.IsSVMPointer == isSVMPointer &&
+            arg.HasValue == hasValue &&
+            arg.Size == size &&
+            !isSVMPointer;
+        if( canStage && hasValue && size == sizeof(cl_mem) )
         {
-            const cl_command_buffer_properties_khr* check = properties;
-            bool found_CL_COMMAND_BUFFER_FLAGS_KHR = false;
-            bool found_CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR = false;
-            while( errorCode == CL_SUCCESS && check[0] != 0 )
+            if( !arg.HasKind )
             {
-                cl_int  property = (cl_int)check[0];
-                switch( property )
+                arg.Kind = queryKernelArgKind(kernel, index);
+                arg.HasKind = true;
+            }
+            if( arg.Kind == cKernelArgMemObject )
+            {
+                if( cl_int errorCode = validateMemObjectArg(value) )
                 {
-                case CL_COMMAND_BUFFER_FLAGS_KHR:
-                    if( found_CL_COMMAND_BUFFER_FLAGS_KHR )
-                    {
-                        errorCode = CL_INVALID_VALUE;
-                    }
-                    else
-                    {
-                        found_CL_COMMAND_BUFFER_FLAGS_KHR = true;
-                        flags = ((const cl_command_buffer_flags_khr*)(check + 1))[0];
-                        errorCode = validateCreateCommandBufferFlags( flags );
-                        check += 2;
-                    }
-                    break;
-                case CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR:
-                    if( found_CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR )
-                    {
-                        errorCode = CL_INVALID_VALUE;
-                    }
-                    else
-                    {
-                        found_CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR = true;
-                        mutableDispatchAsserts = ((const cl_mutable_dispatch_asserts_khr*)(check + 1))[0];
-                        check += 2;
-                    }
-                    break;
-                default:
-                    errorCode = CL_INVALID_VALUE;
-                    break;
+                    return errorCode;
                 }
             }
-            numProperties = check - properties + 1;
-        }
-        for( cl_uint q = 0; q < num_queues && queues != nullptr; q++ )
-        {
-            cl_uint refCount = 0;
-            if( g_pNextDispatch->clGetCommandQueueInfo(
-                    queues[q],
-                    CL_QUEUE_REFERENCE_COUNT,
-                    sizeof(refCount),
-                    &refCount,
-                    nullptr) != CL_SUCCESS )
+            else if( arg.Kind != cKernelArgValue )
             {
-                errorCode = CL_INVALID_COMMAND_QUEUE;
-                break;
+                canStage = false;
             }
         }
-        if( errcode_ret )
+
+        if( !canStage )
         {
-            errcode_ret[0] = errorCode;
-        }
-        if( errorCode == CL_SUCCESS) {
-            cmdbuf = new _cl_command_buffer_khr(flags, mutableDispatchAsserts);
-            cmdbuf->Queues.reserve(num_queues);
-            cmdbuf->Queues.insert(
-                cmdbuf->Queues.begin(),
-                queues,
-                queues + num_queues );
-            cmdbuf->Properties.reserve(numProperties);
-            cmdbuf->Properties.insert(
-                cmdbuf->Properties.begin(),
-                properties,
-                properties + numProperties );
+            cl_int errorCode = isSVMPointer ?
+                g_pNextDispatch->clSetKernelArgSVMPointer(
+                    kernel,
+                    index,
+                    ((const void* const*)value)[0] ) :
+                g_pNextDispatch->clSetKernelArg(
+                    kernel,
+                    index,
+                    size,
+                    value );
+            if( errorCode != CL_SUCCESS )
+            {
+                return errorCode;
+            }
 
-            cmdbuf->IsInOrder.reserve(num_queues);
-            cmdbuf->TestQueues.reserve(num_queues);
-            cmdbuf->BlockingEvents.reserve(num_queues);
+            updateKernelArg(index, isSVMPointer, size, bytes);
 
-            if( cmdbuf->Queues.size() == 1 )
+            arg.IsKnown = true;
+            arg.IsPending = false;
+            arg.IsSVMPointer = isSVMPointer;
+            arg.HasValue = hasValue;
+            arg.Size = size;
+            if( hasValue )
             {
-                cmdbuf->setupSuggestedLocalWorkSize();
+                arg.Applied.assign(bytes, bytes + size);
             }
-
-            for( auto queue : cmdbuf->Queues )
+            else
             {
-                g_pNextDispatch->clRetainCommandQueue(queue);
+                arg.Applied.clear();
+            }
+            return CL_SUCCESS;
+        }
 
-                cl_command_queue_properties props = 0;
-                g_pNextDispatch->clGetCommandQueueInfo(
-                    queue,
-                    CL_QUEUE_PROPERTIES,
-                    sizeof(props),
-                    &props,
-                    nullptr);
-                cmdbuf->IsInOrder.push_back(
-                    (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0 );
+        updateKernelArg(index, isSVMPointer, size, bytes);
 
-                cmdbuf->setupTestQueue(queue);
-                cmdbuf->setupProfilingKernel(queue);
+        if( hasValue && memcmp(arg.Applied.data(), bytes, size) != 0 )
+        {
+            arg.Pending.assign(bytes, bytes + size);
+            if( !arg.IsPending )
+            {
+                arg.IsPending = true;
+                pendingArgIndices.push_back(index);
             }
         }
+        else
+        {
+            // The argument already has this value.
+            arg.IsPending = false;
+        }
 
-        return cmdbuf;
+        return CL_SUCCESS;
     }
 
-    ~_cl_command_buffer_khr()
+    // Checks that a staged update to a memory object kernel argument is a
+    // valid memory object in the same context as the kernel, or is null.
+    cl_int  validateMemObjectArg(
+        const void* value ) const
     {
-        for( auto queue : Queues )
+        cl_mem mem = nullptr;
+        memcpy(&mem, value, sizeof(mem));
+        if( mem == nullptr )
         {
-            g_pNextDispatch->clReleaseCommandQueue(queue);
+            return CL_SUCCESS;
         }
 
-        for( auto event : BlockingEvents )
-        {
-            g_pNextDispatch->clSetUserEventStatus(
-                event,
-                -1 );
-            g_pNextDispatch->clReleaseEvent(event);
+        cl_context kernelContext = nullptr;
+        cl_context memContext = nullptr;
+        g_pNextDispatch->clGetKernelInfo(
+            kernel,
+            CL_KERNEL_CONTEXT,
+            sizeof(kernelContext),
+            &kernelContext,
+            nullptr );
+        if( g_pNextDispatch->clGetMemObjectInfo(
+                mem,
+                CL_MEM_CONTEXT,
+                sizeof(memContext),
+                &memContext,
+                nullptr ) != CL_SUCCESS ||
+            memContext != kernelContext )
+        {
+            return CL_INVALID_MEM_OBJECT;
+        }
+        return CL_SUCCESS;
+    }
+
+    static size_t getNumWorkGroups(
+        cl_uint work_dim,
+        const size_t* global_work_size,
+        const size_t* local_work_size )
+    {
+        if( work_dim == 0 ||
+            global_work_size == nullptr ||
+            local_work_size == nullptr )
+        {
+            return 1;
+        }
+
+        size_t  count = 1;
+        for( cl_uint i = 0; i < work_dim; i++ )
+        {
+            size_t  gws = global_work_size[i];
+            size_t  lws = local_work_size[i];
+            count *= (gws + lws - 1) / lws;
+        }
+
+        return count;
+    }
+};
+
+// A replay plan describes the events each command waits on and signals when
+// a command buffer is replayed.  The sync point wait list for command N is
+// stored in WaitListSyncPoints starting at WaitListOffsets[N] and ending at
+// WaitListOffsets[N + 1], and the sync point command N signals is stored in
+// SignalSyncPoints[N], or zero if command N does not signal a sync point.
+struct SReplayPlan
+{
+    std::vector<cl_sync_point_khr>  WaitListSyncPoints;
+    std::vector<uint32_t>   WaitListOffsets;
+    std::vector<cl_sync_point_khr>  SignalSyncPoints;
+    uint32_t    NumSyncPoints = 0;
+    uint32_t    MaxWaitListSize = 0;
+
+    bool    empty() const
+    {
+        return WaitListOffsets.empty();
+    }
+
+    void    clear()
+    {
+        WaitListSyncPoints.clear();
+        WaitListOffsets.clear();
+        SignalSyncPoints.clear();
+        NumSyncPoints = 0;
+        MaxWaitListSize = 0;
+    }
+
+    void    addCommand(
+                const std::vector<cl_sync_point_khr>& waitList,
+                cl_sync_point_khr syncPoint )
+    {
+        WaitListOffsets.push_back(
+            static_cast<uint32_t>(WaitListSyncPoints.size()));
+        WaitListSyncPoints.insert(
+            WaitListSyncPoints.end(),
+            waitList.begin(),
+            waitList.end());
+        SignalSyncPoints.push_back(syncPoint);
+        NumSyncPoints = std::max(NumSyncPoints, syncPoint + 1);
+        MaxWaitListSize = std::max(
+            MaxWaitListSize,
+            static_cast<uint32_t>(waitList.size()));
+    }
+
+    void    finish()
+    {
+        WaitListOffsets.push_back(
+            static_cast<uint32_t>(WaitListSyncPoints.size()));
+    }
+};
+
+// Used to indicate the absence of a command when commands are referred to by
+// their index in a command buffer.
+static constexpr uint32_t cNoCommand = ~0u;
+
+static std::shared_ptr<const SDeviceInfo> getDeviceInfo(
+    cl_device_id device );
+
+// Native cl_khr_command_buffer functions, used when native command buffers
+// are preferred and the device supports command buffers natively.
+struct SNativeCommandBufferFunctions
+{
+    clCreateCommandBufferKHR_fn clCreateCommandBufferKHR = nullptr;
+    clFinalizeCommandBufferKHR_fn clFinalizeCommandBufferKHR = nullptr;
+    clReleaseCommandBufferKHR_fn clReleaseCommandBufferKHR = nullptr;
+    clEnqueueCommandBufferKHR_fn clEnqueueCommandBufferKHR = nullptr;
+    clCommandBarrierWithWaitListKHR_fn clCommandBarrierWithWaitListKHR = nullptr;
+    clCommandCopyBufferKHR_fn clCommandCopyBufferKHR = nullptr;
+    clCommandCopyBufferRectKHR_fn clCommandCopyBufferRectKHR = nullptr;
+    clCommandCopyBufferToImageKHR_fn clCommandCopyBufferToImageKHR = nullptr;
+    clCommandCopyImageKHR_fn clCommandCopyImageKHR = nullptr;
+    clCommandCopyImageToBufferKHR_fn clCommandCopyImageToBufferKHR = nullptr;
+    clCommandFillBufferKHR_fn clCommandFillBufferKHR = nullptr;
+    clCommandFillImageKHR_fn clCommandFillImageKHR = nullptr;
+    clCommandSVMMemcpyKHR_fn clCommandSVMMemcpyKHR = nullptr;
+    clCommandSVMMemFillKHR_fn clCommandSVMMemFillKHR = nullptr;
+    clCommandNDRangeKernelKHR_fn clCommandNDRangeKernelKHR = nullptr;
+
+    // Returns false if any native function is not available.
+    bool    init(cl_platform_id platform)
+    {
+        clCreateCommandBufferKHR = (clCreateCommandBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCreateCommandBufferKHR" );
+        clFinalizeCommandBufferKHR = (clFinalizeCommandBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clFinalizeCommandBufferKHR" );
+        clReleaseCommandBufferKHR = (clReleaseCommandBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clReleaseCommandBufferKHR" );
+        clEnqueueCommandBufferKHR = (clEnqueueCommandBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clEnqueueCommandBufferKHR" );
+        clCommandBarrierWithWaitListKHR = (clCommandBarrierWithWaitListKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandBarrierWithWaitListKHR" );
+        clCommandCopyBufferKHR = (clCommandCopyBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandCopyBufferKHR" );
+        clCommandCopyBufferRectKHR = (clCommandCopyBufferRectKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandCopyBufferRectKHR" );
+        clCommandCopyBufferToImageKHR = (clCommandCopyBufferToImageKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandCopyBufferToImageKHR" );
+        clCommandCopyImageKHR = (clCommandCopyImageKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandCopyImageKHR" );
+        clCommandCopyImageToBufferKHR = (clCommandCopyImageToBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandCopyImageToBufferKHR" );
+        clCommandFillBufferKHR = (clCommandFillBufferKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandFillBufferKHR" );
+        clCommandFillImageKHR = (clCommandFillImageKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandFillImageKHR" );
+        clCommandSVMMemcpyKHR = (clCommandSVMMemcpyKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandSVMMemcpyKHR" );
+        clCommandSVMMemFillKHR = (clCommandSVMMemFillKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandSVMMemFillKHR" );
+        clCommandNDRangeKernelKHR = (clCommandNDRangeKernelKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clCommandNDRangeKernelKHR" );
+
+        return
+            clCreateCommandBufferKHR != nullptr &&
+            clFinalizeCommandBufferKHR != nullptr &&
+            clReleaseCommandBufferKHR != nullptr &&
+            clEnqueueCommandBufferKHR != nullptr &&
+            clCommandBarrierWithWaitListKHR != nullptr &&
+            clCommandCopyBufferKHR != nullptr &&
+            clCommandCopyBufferRectKHR != nullptr &&
+            clCommandCopyBufferToImageKHR != nullptr &&
+            clCommandCopyImageKHR != nullptr &&
+            clCommandCopyImageToBufferKHR != nullptr &&
+            clCommandFillBufferKHR != nullptr &&
+            clCommandFillImageKHR != nullptr &&
+            clCommandSVMMemcpyKHR != nullptr &&
+            clCommandSVMMemFillKHR != nullptr &&
+            clCommandNDRangeKernelKHR != nullptr;
+    }
+};
+
+// A simple thread-safe arena that allocates memory from large blocks and
+// frees all of its memory when it is destroyed.
+class CArena
+{
+public:
+    void*   allocate(size_t size)
+    {
+        size = (size + cAlignment - 1) & ~(cAlignment - 1);
+
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( Blocks.empty() || Offset + size > Capacity )
+        {
+            Capacity = size > cBlockSize ? size : cBlockSize;
+            Blocks.emplace_back(new uint8_t[Capacity]);
+            Offset = 0;
+        }
+
+        void* ptr = Blocks.back().get() + Offset;
+        Offset += size;
+        return ptr;
+    }
+
+private:
+    static constexpr size_t cBlockSize = 16 * 1024;
+    static constexpr size_t cAlignment = alignof(std::max_align_t);
+
+    std::mutex  Mutex;
+    std::vector<std::unique_ptr<uint8_t[]>> Blocks;
+    size_t  Offset = 0;
+    size_t  Capacity = 0;
+};
+
+// Profiling information for one command in a command buffer, aggregated over
+// all replays of the command buffer.  Times are in nanoseconds.
+struct SCommandProfile
+{
+    uint64_t    Count = 0;
+    cl_ulong    TotalQueuedToStart = 0;
+    cl_ulong    TotalDuration = 0;
+    cl_ulong    MinDuration = ~(cl_ulong)0;
+    cl_ulong    MaxDuration = 0;
+};
+
+static const char* getCommandTypeName(
+    cl_command_type type )
+{
+    switch( type )
+    {
+    case CL_COMMAND_BARRIER:                return "barrier";
+    case CL_COMMAND_COPY_BUFFER:            return "copy_buffer";
+    case CL_COMMAND_COPY_BUFFER_RECT:       return "copy_buffer_rect";
+    case CL_COMMAND_COPY_BUFFER_TO_IMAGE:   return "copy_buffer_to_image";
+    case CL_COMMAND_COPY_IMAGE:             return "copy_image";
+    case CL_COMMAND_COPY_IMAGE_TO_BUFFER:   return "copy_image_to_buffer";
+    case CL_COMMAND_FILL_BUFFER:            return "fill_buffer";
+    case CL_COMMAND_FILL_IMAGE:             return "fill_image";
+    case CL_COMMAND_SVM_MEMCPY:             return "svm_memcpy";
+    case CL_COMMAND_SVM_MEMFILL:            return "svm_memfill";
+    case CL_COMMAND_NDRANGE_KERNEL:         return "ndrange_kernel";
+    default: break;
+    }
+    return "unknown";
+}
+
+typedef struct _cl_command_buffer_khr
+{
+    static _cl_command_buffer_khr* create(
+        cl_uint num_queues,
+        const cl_command_queue* queues,
+        const cl_command_buffer_properties_khr* properties,
+        cl_int* errcode_ret)
+    {
+        cl_command_buffer_khr cmdbuf = nullptr;
+        cl_int errorCode = CL_SUCCESS;
+
+        ptrdiff_t numProperties = 0;
+        cl_command_buffer_flags_khr flags = 0;
+        cl_mutable_dispatch_asserts_khr mutableDispatchAsserts = 0;
+
+#if defined(cl_khr_command_buffer_multi_device)
+        if( num_queues == 0 || queues == nullptr )
+#else
+        if( num_queues != 1 || queues == nullptr )
+#endif
+        {
+            errorCode = CL_INVALID_VALUE;
+        }
+        if( properties )
+        {
+            const cl_command_buffer_properties_khr* check = properties;
+            bool found_CL_COMMAND_BUFFER_FLAGS_KHR = false;
+            bool found_CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR = false;
+            while( errorCode == CL_SUCCESS && check[0] != 0 )
+            {
+                cl_int  property = (cl_int)check[0];
+                switch( property )
+                {
+                case CL_COMMAND_BUFFER_FLAGS_KHR:
+                    if( found_CL_COMMAND_BUFFER_FLAGS_KHR )
+                    {
+                        errorCode = CL_INVALID_VALUE;
+                    }
+                    else
+                    {
+                        found_CL_COMMAND_BUFFER_FLAGS_KHR = true;
+                        flags = ((const cl_command_buffer_flags_khr*)(check + 1))[0];
+                        errorCode = validateCreateCommandBufferFlags( flags );
+                        check += 2;
+                    }
+                    break;
+                case CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR:
+                    if( found_CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR )
+                    {
+                        errorCode = CL_INVALID_VALUE;
+                    }
+                    else
+                    {
+                        found_CL_COMMAND_BUFFER_MUTABLE_DISPATCH_ASSERTS_KHR = true;
+                        mutableDispatchAsserts = ((const cl_mutable_dispatch_asserts_khr*)(check + 1))[0];
+                        check += 2;
+                    }
+                    break;
+                default:
+                    errorCode = CL_INVALID_VALUE;
+                    break;
+                }
+            }
+            numProperties = check - properties + 1;
+        }
+        cl_context context = nullptr;
+        for( cl_uint q = 0; q < num_queues && queues != nullptr; q++ )
+        {
+            cl_context queueContext = nullptr;
+            if( g_pNextDispatch->clGetCommandQueueInfo(
+                    queues[q],
+                    CL_QUEUE_CONTEXT,
+                    sizeof(queueContext),
+                    &queueContext,
+                    nullptr) != CL_SUCCESS ||
+                std::find(queues, queues + q, queues[q]) != queues + q )
+            {
+                errorCode = CL_INVALID_COMMAND_QUEUE;
+                break;
+            }
+            if( context == nullptr )
+            {
+                context = queueContext;
+            }
+            else if( queueContext != context )
+            {
+                errorCode = CL_INVALID_CONTEXT;
+                break;
+            }
+        }
+        if( errcode_ret )
+        {
+            errcode_ret[0] = errorCode;
+        }
+        if( errorCode == CL_SUCCESS) {
+            cmdbuf = new _cl_command_buffer_khr(flags, mutableDispatchAsserts);
+            cmdbuf->Queues.reserve(num_queues);
+            cmdbuf->Queues.insert(
+                cmdbuf->Queues.begin(),
+                queues,
+                queues + num_queues );
+            cmdbuf->Properties.reserve(numProperties);
+            cmdbuf->Properties.insert(
+                cmdbuf->Properties.begin(),
+                properties,
+                properties + numProperties );
+
+            cmdbuf->IsInOrder.reserve(num_queues);
+            cmdbuf->ReplayBarriers.assign(num_queues, false);
+            cmdbuf->ReplayProfiling.assign(num_queues, false);
+
+            if( cmdbuf->Queues.size() == 1 )
+            {
+                cmdbuf->setupSuggestedLocalWorkSize();
+            }
+
+            for( auto queue : cmdbuf->Queues )
+            {
+                g_pNextDispatch->clRetainCommandQueue(queue);
+
+                cl_command_queue_properties props =
+                    getQueueProperties(queue);
+                cmdbuf->IsInOrder.push_back(
+                    (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0 );
+
+                cmdbuf->setupProfilingKernel(queue);
+            }
+
+            // Per-command profiling is only captured for emulated command
+            // buffers, so native command buffers are not used when a command
+            // profiling file is set.
+            if( g_PreferNative && g_CommandProfilingFile.empty() &&
+                mutableDispatchAsserts == 0 )
+            {
+                cmdbuf->setupNativeCommandBuffer(
+                    flags,
+                    properties);
+            }
+        }
+
+        return cmdbuf;
+    }
+
+    ~_cl_command_buffer_khr()
+    {
+        releaseNativeCommandBuffer();
+
+        if( !g_CommandProfilingFile.empty() )
+        {
+            harvestCommandProfiling(true);
+            writeCommandProfiling();
         }
 
-        for( auto queue : TestQueues )
+        for( auto queue : Queues )
         {
             g_pNextDispatch->clReleaseCommandQueue(queue);
         }
@@ -1287,6 +3047,11 @@ typedef struct _cl_command_buffer_khr
         {
             g_pNextDispatch->clReleaseKernel(kernel);
         }
+
+        for( const auto& kc : KernelClones )
+        {
+            g_pNextDispatch->clReleaseKernel(kc.second);
+        }
     }
 
     static bool isValid( cl_command_buffer_khr cmdbuf )
@@ -1300,7 +3065,7 @@ typedef struct _cl_command_buffer_khr
         const cl_command_buffer_flags_khr allFlags =
             CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR |
             CL_COMMAND_BUFFER_MUTABLE_KHR |
-#if defined(cl_khr_command_buffer_multi_device) && 0
+#if defined(cl_khr_command_buffer_multi_device)
             CL_COMMAND_BUFFER_DEVICE_SIDE_SYNC_KHR |
 #endif // defined(cl_khr_command_buffer_multi_device)
             0;
@@ -1333,9 +3098,26 @@ typedef struct _cl_command_buffer_khr
         return Queues.empty() ? nullptr : Queues[0];
     }
 
-    cl_command_queue    getTestQueue() const
+    const cl_command_queue* getQueues() const
+    {
+        return Queues.data();
+    }
+
+    cl_uint getNumQueues() const
     {
-        return TestQueues.empty() ? nullptr : TestQueues[0];
+        return static_cast<cl_uint>(Queues.size());
+    }
+
+    cl_uint getQueueIndex(cl_command_queue queue) const
+    {
+        for( cl_uint q = 0; q < Queues.size(); q++ )
+        {
+            if( Queues[q] == queue )
+            {
+                return q;
+            }
+        }
+        return 0;
     }
 
     cl_kernel   getProfilingKernel() const
@@ -1446,10 +3228,24 @@ typedef struct _cl_command_buffer_khr
         {
             return CL_INVALID_OPERATION;
         }
+#if defined(cl_khr_command_buffer_multi_device)
+        // With multiple queues, each command must specify the queue it is
+        // recorded to.
+        if( queue == nullptr && Queues.size() > 1 )
+        {
+            return CL_INVALID_COMMAND_QUEUE;
+        }
+        if( queue != nullptr &&
+            std::find(Queues.begin(), Queues.end(), queue) == Queues.end() )
+        {
+            return CL_INVALID_COMMAND_QUEUE;
+        }
+#else
         if( queue != nullptr )
         {
             return CL_INVALID_COMMAND_QUEUE;
         }
+#endif
         if( ( sync_point_wait_list == nullptr && num_sync_points_in_wait_list > 0 ) ||
             ( sync_point_wait_list != nullptr && num_sync_points_in_wait_list == 0 ) )
         {
@@ -1485,7 +3281,7 @@ typedef struct _cl_command_buffer_khr
         {
             return CL_INVALID_VALUE;
         }
-        if( num_queues > 1 )
+        if( num_queues > 0 && num_queues != Queues.size() )
         {
             return CL_INVALID_VALUE;
         }
@@ -1528,13 +3324,27 @@ typedef struct _cl_command_buffer_khr
         return CL_SUCCESS;
     }
 
+    // Adds a command to this command buffer.  If this command buffer has a
+    // native command buffer, the command is also recorded into the native
+    // command buffer by calling recordNative, which is passed the native
+    // functions, the native command buffer, the native sync point wait list,
+    // and a pointer to return the native sync point.
+    template<class TRecordNative>
     void    addCommand(
                 std::unique_ptr<Command> command,
                 cl_uint num_sync_points,
                 const cl_sync_point_khr* wait_list,
                 cl_sync_point_khr* sync_point,
-                cl_mutable_command_khr* mutable_handle )
+                cl_mutable_command_khr* mutable_handle,
+                TRecordNative recordNative )
     {
+        // Commands may be recorded from multiple threads.  The command is
+        // created before the lock is taken, so the expensive parts of
+        // recording a command run concurrently, but sync points are assigned
+        // and commands are added in the same order, so a command is always
+        // added after the commands it may depend on.
+        std::lock_guard<std::mutex> lock(RecordMutex);
+
         cl_sync_point_khr syncPoint =
             sync_point != nullptr ?
             NextSyncPoint.fetch_add(1, std::memory_order_relaxed) :
@@ -1548,73 +3358,197 @@ typedef struct _cl_command_buffer_khr
             command->addDependencies(num_sync_points, wait_list, syncPoint);
         }
 
-        if( sync_point != nullptr )
+        // Mutable commands are always emulated, so a command buffer with
+        // a mutable command cannot use a native command buffer.
+        if( NativeCmdBuf != nullptr && mutable_handle != nullptr )
         {
-            sync_point[0] = syncPoint;
+            releaseNativeCommandBuffer();
         }
-        if( mutable_handle != nullptr )
+        if( NativeCmdBuf != nullptr )
         {
-            mutable_handle[0] = command.get();
-        }
-
-        Commands.push_back(std::move(command));
-    }
+            NativeWaitList.clear();
+            for( cl_uint i = 0; i < num_sync_points; i++ )
+            {
+                NativeWaitList.push_back(NativeSyncPoints[wait_list[i]]);
+            }
+
+            cl_sync_point_khr nativeSyncPoint = 0;
+            cl_int errorCode = recordNative(
+                Native,
+                NativeCmdBuf,
+                num_sync_points,
+                num_sync_points ? NativeWaitList.data() : nullptr,
+                sync_point ? &nativeSyncPoint : nullptr );
+            if( errorCode != CL_SUCCESS )
+            {
+                releaseNativeCommandBuffer();
+            }
+            else if( sync_point != nullptr )
+            {
+                NativeSyncPoints.resize(syncPoint + 1);
+                NativeSyncPoints[syncPoint] = nativeSyncPoint;
+            }
+        }
+
+        if( sync_point != nullptr )
+        {
+            sync_point[0] = syncPoint;
+        }
+        if( mutable_handle != nullptr )
+        {
+            mutable_handle[0] = command.get();
+        }
+
+        Commands.push_back(std::move(command));
+    }
 
     cl_int  finalize()
     {
+        std::lock_guard<std::mutex> lock(RecordMutex);
+
         if( State != CL_COMMAND_BUFFER_STATE_RECORDING_KHR )
         {
             return CL_INVALID_OPERATION;
         }
 
-        for( auto event : BlockingEvents )
+        // The emulated command buffer is finalized even if the native
+        // command buffer is finalized successfully, so the command buffer
+        // may still be remapped or written to a binary.
+        if( NativeCmdBuf != nullptr &&
+            Native.clFinalizeCommandBufferKHR(NativeCmdBuf) != CL_SUCCESS )
         {
-            g_pNextDispatch->clSetUserEventStatus(
-                event,
-                -1 );
-            g_pNextDispatch->clReleaseEvent(event);
+            releaseNativeCommandBuffer();
         }
 
-        BlockingEvents.clear();
+        optimize();
+        setupReplayTables();
+
+        State = CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR;
+        return CL_SUCCESS;
+    }
+
+    void*   allocateCommand(size_t size)
+    {
+        return CommandArena.allocate(size);
+    }
+
+    // Returns a retained clone of a kernel with the given kernel arguments
+    // that may be shared with other commands recording the same kernel with
+    // the same kernel arguments, or nullptr if the kernel cannot be cloned.
+    cl_kernel getSharedKernelClone(
+                cl_kernel kernel,
+                const std::vector<SKernelArg>& args)
+    {
+        std::vector<uint8_t> snapshot;
+        getKernelArgSnapshot(args, snapshot);
+
+        std::lock_guard<std::mutex> lock(KernelCloneMutex);
 
-        for( auto queue : TestQueues )
+        auto key = std::make_pair(kernel, std::move(snapshot));
+        auto it = KernelClones.find(key);
+        if( it == KernelClones.end() )
         {
-            g_pNextDispatch->clReleaseCommandQueue(queue);
+            // The kernel arguments are set on the clone since the kernel's
+            // current arguments may be different, for example when the
+            // clone is created for a command buffer binary.
+            cl_kernel clone = g_pNextDispatch->clCloneKernel(kernel, nullptr);
+            if( clone == nullptr )
+            {
+                return nullptr;
+            }
+            if( setKernelArgs(clone, args) != CL_SUCCESS )
+            {
+                g_pNextDispatch->clReleaseKernel(clone);
+                return nullptr;
+            }
+            it = KernelClones.insert(std::make_pair(std::move(key), clone)).first;
         }
 
-        TestQueues.clear();
-
-        State = CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR;
-        return CL_SUCCESS;
+        g_pNextDispatch->clRetainKernel(it->second);
+        return it->second;
     }
 
+    // Replays the commands in this command buffer.  The queues array has one
+    // queue for each queue this command buffer was created with.
     cl_int  replay(
-                cl_command_queue queue) const
+                const cl_command_queue* queues)
     {
+        // The replay plans and the event scratch space are shared by all
+        // replays of this command buffer, so only one replay may use them at
+        // a time.
+        std::lock_guard<std::mutex> lock(ReplayMutex);
+
         cl_int errorCode = CL_SUCCESS;
 
-        cl_command_queue_properties props = 0;
-        g_pNextDispatch->clGetCommandQueueInfo(
-            queue,
-            CL_QUEUE_PROPERTIES,
-            sizeof(props),
-            &props,
-            nullptr);
-        bool isRecordQueueInOrder = IsInOrder[0];
-        bool isReplayQueueInOrder =
-            (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0;
+        // When an in-order recording is replayed on an out-of-order queue,
+        // the commands must still execute in order.  If there is a plan with
+        // explicit dependencies for this case then use it, otherwise add a
+        // barrier after each command recorded for the in-order queue.
+        for( size_t q = 0; q < Queues.size(); q++ )
+        {
+            cl_command_queue_properties props = getQueueProperties(queues[q]);
+            bool isReplayQueueInOrder =
+                (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0;
+            ReplayBarriers[q] = IsInOrder[q] && !isReplayQueueInOrder;
+            ReplayProfiling[q] = !g_CommandProfilingFile.empty() &&
+                (props & CL_QUEUE_PROFILING_ENABLE) != 0;
+        }
 
-        const uint32_t numSyncPoints = NextSyncPoint.load(std::memory_order_relaxed);
-        std::vector<cl_event> deps(numSyncPoints, nullptr);
+        if( !ProfilingEvents.empty() )
+        {
+            harvestCommandProfiling(false);
+        }
 
-        for( const auto& command : Commands )
+        errorCode = applyPendingUpdates();
+        if( errorCode != CL_SUCCESS )
+        {
+            return errorCode;
+        }
+
+        bool useOOQPlan =
+            Queues.size() == 1 && ReplayBarriers[0] && !OOQPlan.empty();
+        if( useOOQPlan )
         {
-            errorCode = command->playback(queue, deps);
-            if( (errorCode == CL_SUCCESS) &&
-                isRecordQueueInOrder && !isReplayQueueInOrder )
+            ReplayBarriers[0] = false;
+        }
+        const SReplayPlan& plan = useOOQPlan ? OOQPlan : Plan;
+
+        for( size_t c = 0; c < Commands.size(); c++ )
+        {
+            const uint32_t begin = plan.WaitListOffsets[c];
+            const uint32_t end = plan.WaitListOffsets[c + 1];
+            for( uint32_t w = begin; w < end; w++ )
+            {
+                WaitEvents[w - begin] = Deps[plan.WaitListSyncPoints[w]];
+            }
+
+            const cl_uint queueIndex = Commands[c]->getQueueIndex();
+            const cl_sync_point_khr syncPoint = plan.SignalSyncPoints[c];
+            cl_event profilingEvent = nullptr;
+            cl_event* signalEvent = syncPoint != 0 ? &Deps[syncPoint] : nullptr;
+            if( signalEvent == nullptr && ReplayProfiling[queueIndex] )
+            {
+                signalEvent = &profilingEvent;
+            }
+            errorCode = Commands[c]->playback(
+                queues[queueIndex],
+                end - begin,
+                end > begin ? WaitEvents.data() : nullptr,
+                signalEvent);
+            if( errorCode == CL_SUCCESS && ReplayProfiling[queueIndex] &&
+                signalEvent[0] != nullptr )
+            {
+                if( signalEvent != &profilingEvent )
+                {
+                    g_pNextDispatch->clRetainEvent(signalEvent[0]);
+                }
+                ProfilingEvents.push_back(
+                    std::make_pair(static_cast<uint32_t>(c), signalEvent[0]));
+            }
+            if( errorCode == CL_SUCCESS && ReplayBarriers[queueIndex] )
             {
                 errorCode = g_pNextDispatch->clEnqueueBarrierWithWaitList(
-                    queue,
+                    queues[queueIndex],
                     0,
                     nullptr,
                     nullptr);
@@ -1625,11 +3559,12 @@ typedef struct _cl_command_buffer_khr
             }
         }
 
-        for( auto event : deps )
+        for( auto& event : Deps )
         {
             if (event != nullptr)
             {
                 g_pNextDispatch->clReleaseEvent(event);
+                event = nullptr;
             }
         }
 
@@ -1661,6 +3596,10 @@ typedef struct _cl_command_buffer_khr
             return CL_INVALID_VALUE;
         }
 
+        // Updates are staged in the commands and applied by the next replay,
+        // so they must not be modified during a replay.
+        std::lock_guard<std::mutex> lock(ReplayMutex);
+
         for( cl_uint i = 0; i < numUpdates; i++ )
         {
             if( updateTypes[i] == CL_STRUCTURE_TYPE_MUTABLE_DISPATCH_CONFIG_KHR &&
@@ -1673,9 +3612,16 @@ typedef struct _cl_command_buffer_khr
                 {
                     return CL_INVALID_MUTABLE_COMMAND_KHR;
                 }
-                if( cl_int errorCode = ((NDRangeKernel*)config->command)->mutate(
-                        MutableDispatchAsserts,
-                        config ) )
+                auto command = (NDRangeKernel*)config->command;
+                const bool hadPendingUpdates = command->hasPendingUpdates();
+                cl_int errorCode = command->mutate(
+                    MutableDispatchAsserts,
+                    config );
+                if( !hadPendingUpdates && command->hasPendingUpdates() )
+                {
+                    PendingUpdates.push_back(command);
+                }
+                if( errorCode != CL_SUCCESS )
                 {
                     return errorCode;
                 }
@@ -1689,359 +3635,2654 @@ typedef struct _cl_command_buffer_khr
         return CL_SUCCESS;
     }
 
-    cl_int  clGetKernelSuggestedLocalWorkSize(
-                cl_command_queue queue,
-                cl_kernel kernel,
-                cl_uint work_dim,
-                const size_t* global_work_offset,
-                const size_t* global_work_size,
-                size_t* suggested_local_work_size )
+#if defined(cl_khr_command_buffer_multi_device)
+    // Creates a copy of this command buffer with its commands remapped to a
+    // different set of queues.  When the remapping is automatic, commands
+    // recorded to queue N are remapped to queue N modulo num_queues.
+    cl_command_buffer_khr   remap(
+                cl_bool automatic,
+                cl_uint num_queues,
+                const cl_command_queue* queues,
+                cl_uint num_handles,
+                const cl_mutable_command_khr* handles,
+                cl_mutable_command_khr* handles_ret,
+                cl_int* errcode_ret )
     {
-        if( ptrGetKernelSuggestedLocalWorkSizeKHR == nullptr )
+        cl_int errorCode = CL_SUCCESS;
+
+        if( num_queues == 0 || queues == nullptr )
         {
-            return CL_INVALID_OPERATION;
+            errorCode = CL_INVALID_VALUE;
         }
-        if( queue != nullptr && queue != Queues[0] )
+        else if( automatic == CL_FALSE && num_queues != Queues.size() )
         {
-            return CL_INVALID_COMMAND_QUEUE;
+            errorCode = CL_INVALID_VALUE;
+        }
+        else if( ( num_handles > 0 && ( handles == nullptr || handles_ret == nullptr ) ) ||
+                 ( num_handles == 0 && ( handles != nullptr || handles_ret != nullptr ) ) )
+        {
+            errorCode = CL_INVALID_VALUE;
+        }
+        for( cl_uint h = 0; errorCode == CL_SUCCESS && h < num_handles; h++ )
+        {
+            if( !Command::isValid(handles[h]) || handles[h]->getCmdBuf() != this )
+            {
+                errorCode = CL_INVALID_MUTABLE_COMMAND_KHR;
+            }
         }
 
-        return ptrGetKernelSuggestedLocalWorkSizeKHR(
-            Queues[0],
-            kernel,
-            work_dim,
-            global_work_offset,
-            global_work_size,
-            suggested_local_work_size );
-    }
+        cl_context context = nullptr;
+        g_pNextDispatch->clGetCommandQueueInfo(
+            getQueue(),
+            CL_QUEUE_CONTEXT,
+            sizeof(context),
+            &context,
+            nullptr);
+        for( cl_uint q = 0; errorCode == CL_SUCCESS && q < num_queues; q++ )
+        {
+            cl_context queueContext = nullptr;
+            if( g_pNextDispatch->clGetCommandQueueInfo(
+                    queues[q],
+                    CL_QUEUE_CONTEXT,
+                    sizeof(queueContext),
+                    &queueContext,
+                    nullptr) != CL_SUCCESS )
+            {
+                errorCode = CL_INVALID_COMMAND_QUEUE;
+            }
+            else if( queueContext != context )
+            {
+                errorCode = CL_INVALID_CONTEXT;
+            }
+        }
 
-private:
-    static constexpr cl_uint cMagic = 0x434d4442;   // "CMDB"
+        // Apply any staged mutable dispatch updates so the cloned commands
+        // include them.
+        if( errorCode == CL_SUCCESS )
+        {
+            std::lock_guard<std::mutex> lock(ReplayMutex);
+            errorCode = applyPendingUpdates();
+        }
 
-    const cl_uint Magic;
-    std::vector<cl_command_queue>   Queues;
-    std::vector<cl_command_buffer_properties_khr>   Properties;
-    cl_command_buffer_state_khr State;
-    cl_command_buffer_flags_khr Flags;
-    cl_mutable_dispatch_asserts_khr MutableDispatchAsserts;
+        cl_command_buffer_khr cmdbuf = nullptr;
+        if( errorCode == CL_SUCCESS )
+        {
+            cmdbuf = create(
+                num_queues,
+                queues,
+                Properties.empty() ? nullptr : Properties.data(),
+                &errorCode);
+        }
+        if( errorCode != CL_SUCCESS )
+        {
+            if( errcode_ret )
+            {
+                errcode_ret[0] = errorCode;
+            }
+            return nullptr;
+        }
 
-    std::atomic<uint32_t> RefCount;
+        // The commands are cloned into the new command buffer rather than
+        // recorded, so it is always emulated.
+        cmdbuf->releaseNativeCommandBuffer();
 
-    std::vector<bool>   IsInOrder;
-    std::vector<cl_command_queue>   TestQueues;
-    std::vector<cl_event>   BlockingEvents;
-    std::vector<cl_kernel>  ProfilingKernels;
+        // The commands were recorded with the ordering guarantees of the
+        // original queues, so a remapped queue is treated as in-order if
+        // any queue remapped to it was in-order.
+        cmdbuf->IsInOrder.assign(num_queues, false);
+        for( size_t q = 0; q < Queues.size(); q++ )
+        {
+            if( IsInOrder[q] )
+            {
+                cmdbuf->IsInOrder[q % num_queues] = true;
+            }
+        }
 
-    std::vector<std::unique_ptr<Command>> Commands;
-    std::atomic<uint32_t> NextSyncPoint;
+        cmdbuf->Commands.reserve(Commands.size());
+        for( const auto& command : Commands )
+        {
+            cmdbuf->Commands.push_back(command->clone(
+                cmdbuf,
+                queues[command->getQueueIndex() % num_queues]));
+        }
+        cmdbuf->NextSyncPoint.store(
+            NextSyncPoint.load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
 
-    clGetKernelSuggestedLocalWorkSizeKHR_fn ptrGetKernelSuggestedLocalWorkSizeKHR = nullptr;
+        for( cl_uint h = 0; h < num_handles; h++ )
+        {
+            handles_ret[h] = nullptr;
+            for( size_t c = 0; c < Commands.size(); c++ )
+            {
+                if( Commands[c].get() == handles[h] )
+                {
+                    handles_ret[h] = cmdbuf->Commands[c].get();
+                    break;
+                }
+            }
+        }
 
-    void setupSuggestedLocalWorkSize()
-    {
-        cl_device_id device = nullptr;
-        g_pNextDispatch->clGetCommandQueueInfo(
-            Queues[0],
-            CL_QUEUE_DEVICE,
-            sizeof(device),
-            &device,
-            nullptr );
+        if( State == CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR )
+        {
+            errorCode = cmdbuf->finalize();
+        }
 
-        cl_platform_id platform = nullptr;
-        g_pNextDispatch->clGetDeviceInfo(
-            device,
-            CL_DEVICE_PLATFORM,
-            sizeof(platform),
-            &platform,
-            nullptr );
+        if( errcode_ret )
+        {
+            errcode_ret[0] = errorCode;
+        }
+        return cmdbuf;
+    }
+#endif // defined(cl_khr_command_buffer_multi_device)
 
-        ptrGetKernelSuggestedLocalWorkSizeKHR = (clGetKernelSuggestedLocalWorkSizeKHR_fn)
-            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
-                platform,
-                "clGetKernelSuggestedLocalWorkSizeKHR" );
+    bool    hasNativeCommandBuffer() const
+    {
+        return NativeCmdBuf != nullptr;
     }
 
-    void setupTestQueue(cl_command_queue src)
+    cl_int  enqueueNativeCommandBuffer(
+                cl_uint num_queues,
+                cl_command_queue* queues,
+                cl_uint num_events_in_wait_list,
+                const cl_event* event_wait_list,
+                cl_event* event )
     {
-        if( g_EnhancedErrorChecking )
+        return Native.clEnqueueCommandBufferKHR(
+            num_queues,
+            queues,
+            NativeCmdBuf,
+            num_events_in_wait_list,
+            event_wait_list,
+            event );
+    }
+
+    // Writes this command buffer to a command buffer binary.  The binary
+    // stores the properties of this command buffer, the ordering of each
+    // queue, and each command with its sync points, followed by the command
+    // index for each mutable command handle.
+    cl_int  getBinary(
+                cl_uint num_mem_objects,
+                const cl_mem* mem_objects,
+                cl_uint num_kernels,
+                const cl_kernel* kernels,
+                cl_uint num_handles,
+                const cl_mutable_command_khr* handles,
+                size_t binary_size,
+                void* binary,
+                size_t* binary_size_ret )
+    {
+        if( State != CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR )
+        {
+            return CL_INVALID_OPERATION;
+        }
+        if( ( num_mem_objects > 0 && mem_objects == nullptr ) ||
+            ( num_mem_objects == 0 && mem_objects != nullptr ) ||
+            ( num_kernels > 0 && kernels == nullptr ) ||
+            ( num_kernels == 0 && kernels != nullptr ) ||
+            ( num_handles > 0 && handles == nullptr ) ||
+            ( num_handles == 0 && handles != nullptr ) )
         {
-            cl_command_queue testQueue = nullptr;
+            return CL_INVALID_VALUE;
+        }
 
-            cl_context context = nullptr;
-            g_pNextDispatch->clGetCommandQueueInfo(
-                src,
-                CL_QUEUE_CONTEXT,
-                sizeof(context),
-                &context,
-                nullptr );
+        CCommandBufferBinary out(
+            num_mem_objects,
+            mem_objects,
+            num_kernels,
+            kernels );
+
+        uint32_t magic = CCommandBufferBinary::cMagic;
+        uint32_t version = CCommandBufferBinary::cVersion;
+        uint32_t sizeOfSizeT = sizeof(size_t);
+        out.value(magic);
+        out.value(version);
+        out.value(sizeOfSizeT);
+
+        uint32_t numProperties = static_cast<uint32_t>(Properties.size());
+        out.value(numProperties);
+        for( auto property : Properties )
+        {
+            out.value(property);
+        }
 
-            cl_device_id device = nullptr;
-            g_pNextDispatch->clGetCommandQueueInfo(
-                src,
-                CL_QUEUE_DEVICE,
-                sizeof(device),
-                &device,
-                nullptr );
+        uint32_t numQueues = static_cast<uint32_t>(Queues.size());
+        out.value(numQueues);
+        for( size_t q = 0; q < Queues.size(); q++ )
+        {
+            uint8_t isInOrder = IsInOrder[q];
+            out.value(isInOrder);
+        }
 
-            size_t propsSize = 0;
-            g_pNextDispatch->clGetCommandQueueInfo(
-                src,
-                CL_QUEUE_PROPERTIES_ARRAY,
-                0,
-                nullptr,
-                &propsSize );
-            if (propsSize != 0) {
-                size_t numProps = propsSize / sizeof(cl_queue_properties);
-                std::vector<cl_queue_properties> props(numProps);
-                g_pNextDispatch->clGetCommandQueueInfo(
-                    src,
-                    CL_QUEUE_PROPERTIES_ARRAY,
-                    propsSize,
-                    props.data(),
-                    nullptr );
-                testQueue =  g_pNextDispatch->clCreateCommandQueueWithProperties(
-                    context,
-                    device,
-                    props.data(),
-                    nullptr );
-            } else {
-                cl_command_queue_properties props = 0;
-                g_pNextDispatch->clGetCommandQueueInfo(
-                    src,
-                    CL_QUEUE_PROPERTIES,
-                    sizeof(props),
-                    &props,
-                    nullptr );
-                testQueue = g_pNextDispatch->clCreateCommandQueue(
-                    context,
-                    device,
-                    props,
-                    nullptr );
+        uint32_t nextSyncPoint = NextSyncPoint.load(std::memory_order_relaxed);
+        out.value(nextSyncPoint);
+
+        // Staged mutable dispatch updates are applied so the binary includes
+        // them.
+        std::lock_guard<std::mutex> lock(ReplayMutex);
+        if( cl_int errorCode = applyPendingUpdates() )
+        {
+            return errorCode;
+        }
+
+        uint32_t numCommands = static_cast<uint32_t>(Commands.size());
+        out.value(numCommands);
+        for( const auto& command : Commands )
+        {
+            cl_command_type type = command->getType();
+            cl_uint queueIndex = command->getQueueIndex();
+            cl_sync_point_khr syncPoint = command->getSyncPoint();
+            out.value(type);
+            out.value(queueIndex);
+            out.value(syncPoint);
+
+            const auto& waitList = command->getWaitList();
+            uint32_t numWaits = static_cast<uint32_t>(waitList.size());
+            out.value(numWaits);
+            for( auto waitSyncPoint : waitList )
+            {
+                out.value(waitSyncPoint);
             }
 
-            cl_event blockingEvent = g_pNextDispatch->clCreateUserEvent(
-                context,
-                nullptr );
-            g_pNextDispatch->clEnqueueBarrierWithWaitList(
-                testQueue,
-                1,
-                &blockingEvent,
-                nullptr );
+            if( !command->serialize(out) )
+            {
+                return CL_INVALID_OPERATION;
+            }
+        }
 
-            TestQueues.push_back(testQueue);
-            BlockingEvents.push_back(blockingEvent);
+        out.value(num_handles);
+        for( cl_uint h = 0; h < num_handles; h++ )
+        {
+            uint32_t index = 0;
+            while( index < Commands.size() && Commands[index].get() != handles[h] )
+            {
+                index++;
+            }
+            if( index == Commands.size() )
+            {
+                return CL_INVALID_MUTABLE_COMMAND_KHR;
+            }
+            out.value(index);
         }
+
+        return writeVectorToMemory(
+            binary_size,
+            out.data(),
+            binary_size_ret,
+            (uint8_t*)binary );
     }
 
-    void setupProfilingKernel(cl_command_queue queue)
+    // Creates a finalized command buffer from a command buffer binary.  The
+    // commands are created directly from the binary, so they are not
+    // recorded or validated again.
+    static _cl_command_buffer_khr* createWithBinary(
+        cl_uint num_queues,
+        const cl_command_queue* queues,
+        size_t binary_size,
+        const void* binary,
+        cl_uint num_mem_objects,
+        const cl_mem* mem_objects,
+        cl_uint num_kernels,
+        const cl_kernel* kernels,
+        cl_uint num_handles,
+        cl_mutable_command_khr* handles_ret,
+        cl_int* errcode_ret)
     {
-        if( g_KernelForProfiling )
+        cl_int errorCode = CL_SUCCESS;
+
+        if( binary == nullptr || binary_size == 0 ||
+            ( num_mem_objects > 0 && mem_objects == nullptr ) ||
+            ( num_mem_objects == 0 && mem_objects != nullptr ) ||
+            ( num_kernels > 0 && kernels == nullptr ) ||
+            ( num_kernels == 0 && kernels != nullptr ) ||
+            ( num_handles > 0 && handles_ret == nullptr ) ||
+            ( num_handles == 0 && handles_ret != nullptr ) )
         {
-            cl_context context = nullptr;
-            g_pNextDispatch->clGetCommandQueueInfo(
-                queue,
-                CL_QUEUE_CONTEXT,
-                sizeof(context),
-                &context,
-                nullptr );
+            errorCode = CL_INVALID_VALUE;
+        }
 
-            cl_device_id device = nullptr;
-            g_pNextDispatch->clGetCommandQueueInfo(
-                queue,
-                CL_QUEUE_DEVICE,
-                sizeof(device),
-                &device,
+        CCommandBufferBinary in(
+            binary,
+            errorCode == CL_SUCCESS ? binary_size : 0,
+            num_mem_objects,
+            mem_objects,
+            num_kernels,
+            kernels );
+
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t sizeOfSizeT = 0;
+        in.value(magic);
+        in.value(version);
+        in.value(sizeOfSizeT);
+        if( magic != CCommandBufferBinary::cMagic ||
+            version != CCommandBufferBinary::cVersion ||
+            sizeOfSizeT != sizeof(size_t) )
+        {
+            in.fail();
+        }
+
+        // Counts are checked against the size of the binary before any
+        // storage is allocated for them.
+        uint32_t numProperties = 0;
+        in.value(numProperties);
+        if( numProperties > binary_size )
+        {
+            in.fail();
+        }
+        std::vector<cl_command_buffer_properties_khr> properties(
+            in.good() ? numProperties : 0);
+        for( auto& property : properties )
+        {
+            in.value(property);
+        }
+        if( !properties.empty() && properties.back() != 0 )
+        {
+            in.fail();
+        }
+
+        uint32_t numQueues = 0;
+        in.value(numQueues);
+        if( numQueues > binary_size )
+        {
+            in.fail();
+        }
+        std::vector<uint8_t> isInOrder(in.good() ? numQueues : 0);
+        for( auto& inOrder : isInOrder )
+        {
+            in.value(inOrder);
+        }
+
+        if( errorCode == CL_SUCCESS && !in.good() )
+        {
+            errorCode = CL_INVALID_BINARY;
+        }
+        if( errorCode == CL_SUCCESS && numQueues != num_queues )
+        {
+            errorCode = CL_INVALID_VALUE;
+        }
+
+        cl_command_buffer_khr cmdbuf = nullptr;
+        if( errorCode == CL_SUCCESS )
+        {
+            cmdbuf = create(
+                num_queues,
+                queues,
+                properties.empty() ? nullptr : properties.data(),
+                &errorCode);
+        }
+        if( errorCode != CL_SUCCESS )
+        {
+            if( errcode_ret )
+            {
+                errcode_ret[0] = errorCode;
+            }
+            return nullptr;
+        }
+
+        // The commands are created from the binary rather than recorded, so
+        // the new command buffer is always emulated.
+        cmdbuf->releaseNativeCommandBuffer();
+
+        // The commands were recorded with the ordering guarantees of the
+        // original queues.
+        for( cl_uint q = 0; q < num_queues; q++ )
+        {
+            cmdbuf->IsInOrder[q] = isInOrder[q] != 0;
+        }
+
+        uint32_t nextSyncPoint = 0;
+        in.value(nextSyncPoint);
+        if( nextSyncPoint == 0 )
+        {
+            in.fail();
+        }
+
+        uint32_t numCommands = 0;
+        in.value(numCommands);
+        if( numCommands > binary_size )
+        {
+            in.fail();
+        }
+
+        // A command may only wait on sync points produced by earlier
+        // commands, otherwise the command would wait on an event that has
+        // not been created when the command buffer is executed.
+        std::vector<bool> isProduced(in.good() ? nextSyncPoint : 0, false);
+        for( uint32_t c = 0; c < numCommands && in.good(); c++ )
+        {
+            cl_command_type type = 0;
+            cl_uint queueIndex = 0;
+            cl_sync_point_khr syncPoint = 0;
+            uint32_t numWaits = 0;
+            in.value(type);
+            in.value(queueIndex);
+            in.value(syncPoint);
+            in.value(numWaits);
+            if( queueIndex >= num_queues ||
+                syncPoint >= nextSyncPoint ||
+                ( syncPoint != 0 && isProduced[syncPoint] ) ||
+                numWaits > binary_size )
+            {
+                in.fail();
+                break;
+            }
+
+            std::vector<cl_sync_point_khr> waitList(numWaits);
+            for( auto& waitSyncPoint : waitList )
+            {
+                in.value(waitSyncPoint);
+                if( waitSyncPoint == 0 || waitSyncPoint >= nextSyncPoint ||
+                    !isProduced[waitSyncPoint] )
+                {
+                    in.fail();
+                    break;
+                }
+            }
+
+            std::unique_ptr<Command> command;
+            if( in.good() )
+            {
+                command = createCommandFromBinary(
+                    cmdbuf,
+                    type,
+                    queues[queueIndex],
+                    in);
+            }
+            if( command == nullptr )
+            {
+                in.fail();
+                break;
+            }
+
+            command->setWaitList(std::move(waitList));
+            command->setSyncPoint(syncPoint);
+            cmdbuf->Commands.push_back(std::move(command));
+            isProduced[syncPoint] = true;
+        }
+
+        uint32_t numHandles = 0;
+        in.value(numHandles);
+        if( in.good() && numHandles != num_handles )
+        {
+            errorCode = CL_INVALID_VALUE;
+        }
+        for( cl_uint h = 0; errorCode == CL_SUCCESS && h < num_handles; h++ )
+        {
+            uint32_t index = 0;
+            in.value(index);
+            if( index >= cmdbuf->Commands.size() )
+            {
+                in.fail();
+                break;
+            }
+            handles_ret[h] = cmdbuf->Commands[index].get();
+        }
+
+        if( errorCode == CL_SUCCESS && ( !in.good() || !in.done() ) )
+        {
+            errorCode = CL_INVALID_BINARY;
+        }
+        if( errorCode == CL_SUCCESS )
+        {
+            cmdbuf->NextSyncPoint.store(
+                nextSyncPoint,
+                std::memory_order_relaxed);
+            errorCode = cmdbuf->finalize();
+        }
+        if( errorCode != CL_SUCCESS )
+        {
+            cmdbuf->release();
+            cmdbuf = nullptr;
+        }
+
+        if( errcode_ret )
+        {
+            errcode_ret[0] = errorCode;
+        }
+        return cmdbuf;
+    }
+
+    cl_int  clGetKernelSuggestedLocalWorkSize(
+                cl_command_queue queue,
+                cl_kernel kernel,
+                cl_uint work_dim,
+                const size_t* global_work_offset,
+                const size_t* global_work_size,
+                size_t* suggested_local_work_size )
+    {
+        if( ptrGetKernelSuggestedLocalWorkSizeKHR == nullptr )
+        {
+            return CL_INVALID_OPERATION;
+        }
+        if( queue != nullptr && queue != Queues[0] )
+        {
+            return CL_INVALID_COMMAND_QUEUE;
+        }
+
+        return ptrGetKernelSuggestedLocalWorkSizeKHR(
+            Queues[0],
+            kernel,
+            work_dim,
+            global_work_offset,
+            global_work_size,
+            suggested_local_work_size );
+    }
+
+private:
+    static constexpr cl_uint cMagic = 0x434d4442;   // "CMDB"
+
+    static std::unique_ptr<Command> createCommandFromBinary(
+        cl_command_buffer_khr cmdbuf,
+        cl_command_type type,
+        cl_command_queue queue,
+        CCommandBufferBinary& binary)
+    {
+        switch( type )
+        {
+        case CL_COMMAND_BARRIER:
+            return BarrierWithWaitList::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_COPY_BUFFER:
+            return CopyBuffer::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_COPY_BUFFER_RECT:
+            return CopyBufferRect::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_COPY_BUFFER_TO_IMAGE:
+            return CopyBufferToImage::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_COPY_IMAGE:
+            return CopyImage::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_COPY_IMAGE_TO_BUFFER:
+            return CopyImageToBuffer::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_FILL_BUFFER:
+            return FillBuffer::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_FILL_IMAGE:
+            return FillImage::createFromBinary(cmdbuf, queue, binary);
+        case CL_COMMAND_NDRANGE_KERNEL:
+            return NDRangeKernel::createFromBinary(cmdbuf, queue, binary);
+        default:
+            break;
+        }
+        return nullptr;
+    }
+
+    const cl_uint Magic;
+    std::vector<cl_command_queue>   Queues;
+    std::vector<cl_command_buffer_properties_khr>   Properties;
+    cl_command_buffer_state_khr State;
+    cl_command_buffer_flags_khr Flags;
+    cl_mutable_dispatch_asserts_khr MutableDispatchAsserts;
+
+    std::atomic<uint32_t> RefCount;
+
+    std::vector<bool>   IsInOrder;
+    std::vector<bool>   ReplayBarriers;
+    std::vector<bool>   ReplayProfiling;
+    std::vector<cl_kernel>  ProfilingKernels;
+
+    // Kernel clones shared by kernel commands, indexed by the cloned kernel
+    // and a snapshot of its kernel arguments.  Each shared clone is retained
+    // by this map and by each command using it.
+    typedef std::map<std::pair<cl_kernel, std::vector<uint8_t>>, cl_kernel>
+        CKernelCloneMap;
+    std::mutex  KernelCloneMutex;
+    CKernelCloneMap KernelClones;
+
+    // The native command buffer, used when native command buffers are
+    // preferred, the device supports command buffers natively, and every
+    // command recorded so far is supported natively.  Emulated sync points
+    // are mapped to native sync points.  Commands are also recorded into the
+    // emulated command buffer, so the emulated command buffer is used if a
+    // later command is not supported natively.
+    SNativeCommandBufferFunctions   Native;
+    cl_command_buffer_khr   NativeCmdBuf = nullptr;
+    std::vector<cl_sync_point_khr>  NativeSyncPoints;
+    std::vector<cl_sync_point_khr>  NativeWaitList;
+
+    // Guards the command list while commands are recorded.  The arena must
+    // be declared before the commands, since it owns their memory.
+    std::mutex  RecordMutex;
+    CArena  CommandArena;
+    std::vector<std::unique_ptr<Command>> Commands;
+    std::atomic<uint32_t> NextSyncPoint;
+
+    // Replay plans, computed when the command buffer is finalized.  The
+    // OOQ plan is used when an in-order recording is replayed on an
+    // out-of-order queue, and may be empty.
+    SReplayPlan Plan;
+    SReplayPlan OOQPlan;
+
+    // Scratch space used during replay, sized when the command buffer is
+    // finalized so replaying the command buffer does not allocate.
+    std::mutex  ReplayMutex;
+    std::vector<cl_event>   Deps;
+    std::vector<cl_event>   WaitEvents;
+
+    // Mutable commands with staged updates, guarded by the replay mutex.
+    std::vector<NDRangeKernel*> PendingUpdates;
+
+    // Per-command profiling, captured when a command profiling file is set.
+    // Captured events are harvested once they complete, and are guarded by
+    // the replay mutex.
+    std::vector<std::pair<uint32_t, cl_event>>  ProfilingEvents;
+    std::vector<SCommandProfile>    CommandProfiles;
+
+    clGetKernelSuggestedLocalWorkSizeKHR_fn ptrGetKernelSuggestedLocalWorkSizeKHR = nullptr;
+
+    // Applies any staged mutable dispatch updates.  The replay mutex must be
+    // held.
+    // Commands with updates that could not be applied stay in the list.
+    cl_int  applyPendingUpdates()
+    {
+        cl_int errorCode = CL_SUCCESS;
+        size_t numPending = 0;
+        for( auto command : PendingUpdates )
+        {
+            if( cl_int commandErrorCode = command->applyUpdates() )
+            {
+                errorCode = commandErrorCode;
+            }
+            if( command->hasPendingUpdates() )
+            {
+                PendingUpdates[numPending++] = command;
+            }
+        }
+        PendingUpdates.resize(numPending);
+        return errorCode;
+    }
+
+    // Accumulates profiling information for captured command events that
+    // have completed and releases them.  If wait is true, waits for all
+    // captured command events to complete first.
+    void harvestCommandProfiling(bool wait)
+    {
+        size_t numPending = 0;
+        for( const auto& pe : ProfilingEvents )
+        {
+            const uint32_t c = pe.first;
+            cl_event event = pe.second;
+
+            if( wait )
+            {
+                g_pNextDispatch->clWaitForEvents(1, &event);
+            }
+
+            cl_int status = CL_COMPLETE;
+            g_pNextDispatch->clGetEventInfo(
+                event,
+                CL_EVENT_COMMAND_EXECUTION_STATUS,
+                sizeof(status),
+                &status,
                 nullptr );
+            if( status > CL_COMPLETE )
+            {
+                ProfilingEvents[numPending++] = pe;
+                continue;
+            }
 
-            const char* kernelString = "kernel void Empty() {}";
-            cl_program program = g_pNextDispatch->clCreateProgramWithSource(
-                context,
-                1,
-                &kernelString,
-                nullptr,
+            cl_ulong queued = 0, start = 0, end = 0;
+            cl_int errorCode = g_pNextDispatch->clGetEventProfilingInfo(
+                event,
+                CL_PROFILING_COMMAND_QUEUED,
+                sizeof(queued),
+                &queued,
                 nullptr );
-            g_pNextDispatch->clBuildProgram(
-                program,
-                1,
-                &device,
-                nullptr,
-                nullptr,
+            errorCode |= g_pNextDispatch->clGetEventProfilingInfo(
+                event,
+                CL_PROFILING_COMMAND_START,
+                sizeof(start),
+                &start,
                 nullptr );
-
-            cl_kernel kernel = g_pNextDispatch->clCreateKernel(
-                program,
-                "Empty",
+            errorCode |= g_pNextDispatch->clGetEventProfilingInfo(
+                event,
+                CL_PROFILING_COMMAND_END,
+                sizeof(end),
+                &end,
                 nullptr );
-            g_pNextDispatch->clReleaseProgram(
-                program );
+            if( status == CL_COMPLETE && errorCode == CL_SUCCESS &&
+                start >= queued && end >= start )
+            {
+                if( CommandProfiles.size() < Commands.size() )
+                {
+                    CommandProfiles.resize(Commands.size());
+                }
 
-            ProfilingKernels.push_back(kernel);
+                SCommandProfile& profile = CommandProfiles[c];
+                const cl_ulong duration = end - start;
+                profile.Count++;
+                profile.TotalQueuedToStart += start - queued;
+                profile.TotalDuration += duration;
+                profile.MinDuration = std::min(profile.MinDuration, duration);
+                profile.MaxDuration = std::max(profile.MaxDuration, duration);
+            }
+
+            g_pNextDispatch->clReleaseEvent(event);
+        }
+
+        ProfilingEvents.resize(numPending);
+    }
+
+    // Appends the per-command profiling information for this command buffer
+    // to the command profiling file.  Commands are identified by their index
+    // after any finalize-time optimizations.
+    void writeCommandProfiling()
+    {
+        if( CommandProfiles.empty() )
+        {
+            return;
+        }
+
+        static std::mutex fileMutex;
+        std::lock_guard<std::mutex> lock(fileMutex);
+
+        FILE* fp = fopen(g_CommandProfilingFile.c_str(), "a");
+        if( fp == nullptr )
+        {
+            return;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        if( ftell(fp) == 0 )
+        {
+            fprintf(fp,
+                "command_buffer,command,type,queue,count,"
+                "total_ns,average_ns,min_ns,max_ns,"
+                "average_queued_to_start_ns\n");
+        }
+
+        for( size_t c = 0; c < CommandProfiles.size(); c++ )
+        {
+            const SCommandProfile& profile = CommandProfiles[c];
+            if( profile.Count == 0 )
+            {
+                continue;
+            }
+
+            fprintf(fp,
+                "%p,%zu,%s,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                (void*)this,
+                c,
+                getCommandTypeName(Commands[c]->getType()),
+                Commands[c]->getQueueIndex(),
+                profile.Count,
+                (uint64_t)profile.TotalDuration,
+                (uint64_t)(profile.TotalDuration / profile.Count),
+                (uint64_t)profile.MinDuration,
+                (uint64_t)profile.MaxDuration,
+                (uint64_t)(profile.TotalQueuedToStart / profile.Count));
+        }
+
+        fclose(fp);
+    }
+
+    void setupReplayTables()
+    {
+        const uint32_t numSyncPoints =
+            NextSyncPoint.load(std::memory_order_relaxed);
+
+        // A command does not need to wait for a command recorded earlier
+        // to the same in-order queue, since it executes in order anyway.
+        std::vector<uint32_t> producerQueues(numSyncPoints, 0);
+        for( const auto& command : Commands )
+        {
+            if( command->getSyncPoint() != 0 )
+            {
+                producerQueues[command->getSyncPoint()] =
+                    command->getQueueIndex();
+            }
+        }
+
+        std::vector<std::vector<cl_sync_point_khr>> waitLists(Commands.size());
+        std::vector<bool> isWaitedOn(numSyncPoints, false);
+        for( size_t c = 0; c < Commands.size(); c++ )
+        {
+            const cl_uint queueIndex = Commands[c]->getQueueIndex();
+            for( auto s : Commands[c]->getWaitList() )
+            {
+                if( !IsInOrder[queueIndex] || producerQueues[s] != queueIndex )
+                {
+                    waitLists[c].push_back(s);
+                    isWaitedOn[s] = true;
+                }
+            }
+        }
+
+        // Only sync points that are waited on need to signal an event.
+        Plan.clear();
+        for( size_t c = 0; c < Commands.size(); c++ )
+        {
+            const cl_sync_point_khr syncPoint = Commands[c]->getSyncPoint();
+            Plan.addCommand(
+                waitLists[c],
+                isWaitedOn[syncPoint] ? syncPoint : 0);
+        }
+        Plan.finish();
+
+        // For an in-order recording replayed on an out-of-order queue, each
+        // command either waits for the commands it was inferred to depend
+        // on or for the command immediately before it.  These sync points
+        // are only used by this plan, so they are simply the index of each
+        // command plus one.
+        OOQPlan.clear();
+        if( g_InferDependencies && Queues.size() == 1 && IsInOrder[0] )
+        {
+            std::vector<std::vector<uint32_t>> preds(Commands.size());
+            inferDependencies(preds);
+            pruneTransitiveEdges(preds);
+
+            // Only commands that another command waits on need to signal
+            // an event.
+            std::vector<bool> isWaitedOn(Commands.size(), false);
+            for( const auto& commandPreds : preds )
+            {
+                for( auto p : commandPreds )
+                {
+                    isWaitedOn[p] = true;
+                }
+            }
+
+            std::vector<cl_sync_point_khr> waitList;
+            for( size_t c = 0; c < Commands.size(); c++ )
+            {
+                waitList.clear();
+                for( auto p : preds[c] )
+                {
+                    waitList.push_back(p + 1);
+                }
+                OOQPlan.addCommand(
+                    waitList,
+                    isWaitedOn[c] ? static_cast<cl_sync_point_khr>(c + 1) : 0);
+            }
+            OOQPlan.finish();
         }
+        else if( g_InOrderEventChain && Queues.size() == 1 && IsInOrder[0] )
+        {
+            const std::vector<cl_sync_point_khr> none;
+            std::vector<cl_sync_point_khr> prev(1);
+            for( size_t c = 0; c < Commands.size(); c++ )
+            {
+                const bool isLast = c + 1 == Commands.size();
+                prev[0] = static_cast<cl_sync_point_khr>(c);
+                OOQPlan.addCommand(
+                    c == 0 ? none : prev,
+                    isLast ? 0 : static_cast<cl_sync_point_khr>(c + 1));
+            }
+            OOQPlan.finish();
+        }
+
+        Deps.assign(
+            std::max(Plan.NumSyncPoints, OOQPlan.NumSyncPoints),
+            nullptr);
+        WaitEvents.assign(
+            std::max(Plan.MaxWaitListSize, OOQPlan.MaxWaitListSize),
+            nullptr);
+    }
+
+    // Finalize-time optimizations.  Each of these passes may be disabled
+    // by an environment variable control.
+    void optimize()
+    {
+        const uint32_t numSyncPoints =
+            NextSyncPoint.load(std::memory_order_relaxed);
+
+        std::vector<cl_sync_point_khr> remap(numSyncPoints);
+        for( uint32_t s = 0; s < numSyncPoints; s++ )
+        {
+            remap[s] = s;
+        }
+
+        if( g_RemoveRedundantBarriers )
+        {
+            removeRedundantBarriers(remap);
+            remapSyncPoints(remap);
+        }
+        if( g_MergeCommands )
+        {
+            mergeCommands(remap);
+            remapSyncPoints(remap);
+        }
+
+        Commands.erase(
+            std::remove(Commands.begin(), Commands.end(), nullptr),
+            Commands.end());
+
+        if( g_PruneSyncPoints )
+        {
+            pruneSyncPoints();
+        }
+    }
+
+    // When one command is removed from the command buffer, any commands that
+    // wait on its sync point should instead wait on the sync point of the
+    // command that replaces it.
+    static void redirectSyncPoint(
+                    Command* from,
+                    Command* to,
+                    std::vector<cl_sync_point_khr>& remap )
+    {
+        const cl_sync_point_khr syncPoint = from->getSyncPoint();
+        if( syncPoint != 0 )
+        {
+            if( to->getSyncPoint() == 0 )
+            {
+                to->setSyncPoint(syncPoint);
+            }
+            else
+            {
+                remap[syncPoint] = to->getSyncPoint();
+            }
+        }
+    }
+
+    void    remapSyncPoints(
+                std::vector<cl_sync_point_khr>& remap )
+    {
+        for( auto& command : Commands )
+        {
+            if( command == nullptr || command->getWaitList().empty() )
+            {
+                continue;
+            }
+
+            std::vector<cl_sync_point_khr> waitList(command->getWaitList());
+            for( auto& s : waitList )
+            {
+                while( remap[s] != s )
+                {
+                    s = remap[s];
+                }
+            }
+            std::sort(waitList.begin(), waitList.end());
+            waitList.erase(
+                std::unique(waitList.begin(), waitList.end()),
+                waitList.end());
+            command->setWaitList(std::move(waitList));
+        }
+    }
+
+    // Barriers in an in-order recording do nothing, since each command
+    // already waits for all previous commands.  In an out-of-order recording
+    // a barrier waiting for all previous commands immediately after another
+    // barrier waiting for all previous commands does nothing, and barriers
+    // at the end of the command buffer do nothing.
+    void    removeRedundantBarriers(
+                std::vector<cl_sync_point_khr>& remap )
+    {
+        const bool isInOrder = Queues.size() == 1 && IsInOrder[0];
+
+        Command* prevBarrier = nullptr;
+        for( auto& command : Commands )
+        {
+            if( command->getType() != CL_COMMAND_BARRIER )
+            {
+                prevBarrier = nullptr;
+            }
+            else if( isInOrder )
+            {
+                command.reset();
+            }
+            else if( !command->getWaitList().empty() )
+            {
+                prevBarrier = nullptr;
+            }
+            else if( prevBarrier != nullptr &&
+                     prevBarrier->getQueue() == command->getQueue() )
+            {
+                redirectSyncPoint(command.get(), prevBarrier, remap);
+                command.reset();
+            }
+            else
+            {
+                prevBarrier = command.get();
+            }
+        }
+
+        for( auto it = Commands.rbegin(); it != Commands.rend(); ++it )
+        {
+            if( *it != nullptr )
+            {
+                if( (*it)->getType() != CL_COMMAND_BARRIER )
+                {
+                    break;
+                }
+                it->reset();
+            }
+        }
+    }
+
+    // Adjacent fills or copies of contiguous buffer ranges with the same
+    // dependencies may be combined into a single fill or copy.
+    void    mergeCommands(
+                std::vector<cl_sync_point_khr>& remap )
+    {
+        Command* prev = nullptr;
+        for( auto& command : Commands )
+        {
+            if( command == nullptr )
+            {
+                continue;
+            }
+            if( prev != nullptr && tryMergeCommands(prev, command.get()) )
+            {
+                redirectSyncPoint(command.get(), prev, remap);
+                command.reset();
+                continue;
+            }
+            prev = command.get();
+        }
+    }
+
+    static bool tryMergeCommands(
+                    Command* a,
+                    const Command* b )
+    {
+        if( a->getType() != b->getType() ||
+            a->getQueue() != b->getQueue() ||
+            a->getWaitList() != b->getWaitList() )
+        {
+            return false;
+        }
+
+        switch( a->getType() )
+        {
+        case CL_COMMAND_FILL_BUFFER:
+            {
+                auto fa = static_cast<FillBuffer*>(a);
+                auto fb = static_cast<const FillBuffer*>(b);
+                if( fa->buffer != fb->buffer || fa->pattern != fb->pattern )
+                {
+                    return false;
+                }
+                if( fa->offset + fa->size == fb->offset )
+                {
+                    fa->size += fb->size;
+                    return true;
+                }
+                if( fb->offset + fb->size == fa->offset )
+                {
+                    fa->offset = fb->offset;
+                    fa->size += fb->size;
+                    return true;
+                }
+            }
+            break;
+        case CL_COMMAND_COPY_BUFFER:
+            {
+                auto ca = static_cast<CopyBuffer*>(a);
+                auto cb = static_cast<const CopyBuffer*>(b);
+                if( ca->src_buffer != cb->src_buffer ||
+                    ca->dst_buffer != cb->dst_buffer ||
+                    ca->src_offset + ca->size != cb->src_offset ||
+                    ca->dst_offset + ca->size != cb->dst_offset )
+                {
+                    return false;
+                }
+                // Copies within the same buffer are not merged, since the
+                // merged source and destination ranges could overlap.
+                if( getRootMemObject(ca->src_buffer) ==
+                    getRootMemObject(ca->dst_buffer) )
+                {
+                    return false;
+                }
+                ca->size += cb->size;
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+
+        return false;
+    }
+
+    // A sync point in a wait list may be removed if it is also waited on
+    // transitively through another sync point in the same wait list.
+    void    pruneSyncPoints()
+    {
+        const uint32_t numSyncPoints =
+            NextSyncPoint.load(std::memory_order_relaxed);
+
+        std::vector<uint32_t> producers(numSyncPoints, cNoCommand);
+        for( size_t c = 0; c < Commands.size(); c++ )
+        {
+            if( Commands[c]->getSyncPoint() != 0 )
+            {
+                producers[Commands[c]->getSyncPoint()] =
+                    static_cast<uint32_t>(c);
+            }
+        }
+
+        std::vector<std::vector<uint32_t>> preds(Commands.size());
+        for( size_t c = 0; c < Commands.size(); c++ )
+        {
+            for( auto s : Commands[c]->getWaitList() )
+            {
+                if( producers[s] != cNoCommand )
+                {
+                    preds[c].push_back(producers[s]);
+                }
+            }
+        }
+
+        pruneTransitiveEdges(preds);
+
+        for( size_t c = 0; c < Commands.size(); c++ )
+        {
+            const auto& command = Commands[c];
+            if( command->getWaitList().size() < 2 )
+            {
+                continue;
+            }
+
+            std::vector<cl_sync_point_khr> waitList;
+            for( auto s : command->getWaitList() )
+            {
+                if( producers[s] == cNoCommand ||
+                    std::find(preds[c].begin(), preds[c].end(), producers[s]) !=
+                        preds[c].end() )
+                {
+                    waitList.push_back(s);
+                }
+            }
+            command->setWaitList(std::move(waitList));
+        }
+    }
+
+    // Removes each edge from a command to one of its predecessors if the
+    // predecessor is also reached transitively through another predecessor.
+    // Commands may only depend on commands with smaller indices.
+    static void pruneTransitiveEdges(
+                    std::vector<std::vector<uint32_t>>& preds )
+    {
+        std::vector<uint32_t> visited(preds.size(), 0);
+        std::vector<uint32_t> stack;
+        uint32_t stamp = 0;
+
+        for( auto& commandPreds : preds )
+        {
+            if( commandPreds.size() < 2 )
+            {
+                continue;
+            }
+
+            ++stamp;
+            for( auto p : commandPreds )
+            {
+                stack.push_back(p);
+                while( !stack.empty() )
+                {
+                    const uint32_t n = stack.back();
+                    stack.pop_back();
+                    for( auto pp : preds[n] )
+                    {
+                        if( visited[pp] != stamp )
+                        {
+                            visited[pp] = stamp;
+                            stack.push_back(pp);
+                        }
+                    }
+                }
+            }
+
+            commandPreds.erase(
+                std::remove_if(
+                    commandPreds.begin(),
+                    commandPreds.end(),
+                    [&](uint32_t p) { return visited[p] == stamp; }),
+                commandPreds.end());
+        }
+    }
+
+    // Infers the commands each command in an in-order recording depends on
+    // from the memory objects each command reads and writes.  A command
+    // depends on the last command that wrote a memory object it accesses,
+    // and a command that writes a memory object also depends on the
+    // commands that read it since it was last written.  Commands that may
+    // access any memory depend on all previous commands, and all later
+    // commands depend on them.
+    void    inferDependencies(
+                std::vector<std::vector<uint32_t>>& preds ) const
+    {
+        struct SMemState
+        {
+            uint32_t    Writer = cNoCommand;
+            std::vector<uint32_t>   Readers;
+        };
+        std::map<cl_mem, SMemState> memStates;
+
+        // All commands since (and including) the last command that may
+        // access any memory.
+        std::vector<uint32_t> sinceFull;
+        uint32_t lastFull = cNoCommand;
+
+        std::vector<SMemAccess> accesses;
+        for( size_t i = 0; i < Commands.size(); i++ )
+        {
+            const uint32_t c = static_cast<uint32_t>(i);
+            auto& commandPreds = preds[c];
+
+            accesses.clear();
+            if( !Commands[c]->getMemAccesses(accesses) )
+            {
+                commandPreds = sinceFull;
+                memStates.clear();
+                sinceFull.assign(1, c);
+                lastFull = c;
+                continue;
+            }
+
+            if( lastFull != cNoCommand )
+            {
+                commandPreds.push_back(lastFull);
+            }
+            for( const auto& access : accesses )
+            {
+                const auto& state = memStates[access.Mem];
+                if( state.Writer != cNoCommand )
+                {
+                    commandPreds.push_back(state.Writer);
+                }
+                if( access.IsWrite )
+                {
+                    commandPreds.insert(
+                        commandPreds.end(),
+                        state.Readers.begin(),
+                        state.Readers.end());
+                }
+            }
+            for( const auto& access : accesses )
+            {
+                if( access.IsWrite )
+                {
+                    auto& state = memStates[access.Mem];
+                    state.Writer = c;
+                    state.Readers.clear();
+                }
+            }
+            for( const auto& access : accesses )
+            {
+                auto& state = memStates[access.Mem];
+                if( !access.IsWrite && state.Writer != c &&
+                    ( state.Readers.empty() || state.Readers.back() != c ) )
+                {
+                    state.Readers.push_back(c);
+                }
+            }
+
+            std::sort(commandPreds.begin(), commandPreds.end());
+            commandPreds.erase(
+                std::unique(commandPreds.begin(), commandPreds.end()),
+                commandPreds.end());
+            sinceFull.push_back(c);
+        }
+    }
+
+    void setupNativeCommandBuffer(
+        cl_command_buffer_flags_khr flags,
+        const cl_command_buffer_properties_khr* properties)
+    {
+        if( Queues.size() != 1 || ( flags & CL_COMMAND_BUFFER_MUTABLE_KHR ) )
+        {
+            return;
+        }
+
+        cl_device_id device = nullptr;
+        g_pNextDispatch->clGetCommandQueueInfo(
+            Queues[0],
+            CL_QUEUE_DEVICE,
+            sizeof(device),
+            &device,
+            nullptr );
+
+        auto info = getDeviceInfo(device);
+        if( !info->HasNativeCommandBuffer )
+        {
+            return;
+        }
+        if( ( flags & CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR ) &&
+            !( info->NativeCommandBufferCapabilities &
+               CL_COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR ) )
+        {
+            return;
+        }
+
+        cl_platform_id platform = nullptr;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_PLATFORM,
+            sizeof(platform),
+            &platform,
+            nullptr );
+        if( !Native.init(platform) )
+        {
+            return;
+        }
+
+        cl_int errorCode = CL_SUCCESS;
+        NativeCmdBuf = Native.clCreateCommandBufferKHR(
+            1,
+            Queues.data(),
+            properties,
+            &errorCode );
+        if( errorCode != CL_SUCCESS )
+        {
+            NativeCmdBuf = nullptr;
+        }
+    }
+
+    void releaseNativeCommandBuffer()
+    {
+        if( NativeCmdBuf != nullptr )
+        {
+            Native.clReleaseCommandBufferKHR(NativeCmdBuf);
+            NativeCmdBuf = nullptr;
+        }
+        NativeSyncPoints.clear();
+    }
+
+    void setupSuggestedLocalWorkSize()
+    {
+        cl_device_id device = nullptr;
+        g_pNextDispatch->clGetCommandQueueInfo(
+            Queues[0],
+            CL_QUEUE_DEVICE,
+            sizeof(device),
+            &device,
+            nullptr );
+
+        cl_platform_id platform = nullptr;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_PLATFORM,
+            sizeof(platform),
+            &platform,
+            nullptr );
+
+        ptrGetKernelSuggestedLocalWorkSizeKHR = (clGetKernelSuggestedLocalWorkSizeKHR_fn)
+            g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
+                platform,
+                "clGetKernelSuggestedLocalWorkSizeKHR" );
+    }
+
+    void setupProfilingKernel(cl_command_queue queue)
+    {
+        if( g_KernelForProfiling )
+        {
+            cl_context context = nullptr;
+            g_pNextDispatch->clGetCommandQueueInfo(
+                queue,
+                CL_QUEUE_CONTEXT,
+                sizeof(context),
+                &context,
+                nullptr );
+
+            cl_device_id device = nullptr;
+            g_pNextDispatch->clGetCommandQueueInfo(
+                queue,
+                CL_QUEUE_DEVICE,
+                sizeof(device),
+                &device,
+                nullptr );
+
+            const char* kernelString = "kernel void Empty() {}";
+            cl_program program = g_pNextDispatch->clCreateProgramWithSource(
+                context,
+                1,
+                &kernelString,
+                nullptr,
+                nullptr );
+            g_pNextDispatch->clBuildProgram(
+                program,
+                1,
+                &device,
+                nullptr,
+                nullptr,
+                nullptr );
+
+            cl_kernel kernel = g_pNextDispatch->clCreateKernel(
+                program,
+                "Empty",
+                nullptr );
+            g_pNextDispatch->clReleaseProgram(
+                program );
+
+            ProfilingKernels.push_back(kernel);
+        }
+    }
+
+    _cl_command_buffer_khr(
+            cl_command_buffer_flags_khr flags,
+            cl_mutable_dispatch_asserts_khr mutableDispatchAsserts) :
+        Magic(cMagic),
+        State(CL_COMMAND_BUFFER_STATE_RECORDING_KHR),
+        Flags(flags),
+        MutableDispatchAsserts(mutableDispatchAsserts),
+        RefCount(1),
+        NextSyncPoint(1) {}
+} CommandBuffer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// These functions need to be defined separately and after the definition of a
+// command buffer because they call into the command buffer.
+
+_cl_mutable_command_khr::_cl_mutable_command_khr(
+    cl_command_buffer_khr cmdbuf,
+    cl_command_queue queue,
+    cl_command_type type) :
+    Magic(cMagic),
+    Type(type),
+    CmdBuf(cmdbuf),
+    Queue(queue ? queue : cmdbuf->getQueue()),
+    QueueIndex(cmdbuf->getQueueIndex(Queue)) {}
+
+void* _cl_mutable_command_khr::operator new(
+    size_t size,
+    cl_command_buffer_khr cmdbuf)
+{
+    return cmdbuf->allocateCommand(size);
+}
+
+void _cl_mutable_command_khr::remap(
+    cl_command_buffer_khr cmdbuf,
+    cl_command_queue queue)
+{
+    CmdBuf = cmdbuf;
+    Queue = queue;
+    QueueIndex = cmdbuf->getQueueIndex(queue);
+}
+
+std::unique_ptr<NDRangeKernel> NDRangeKernel::create(
+    const bool isMutable,
+    const cl_command_properties_khr* properties,
+    cl_command_buffer_khr cmdbuf,
+    cl_command_queue queue,
+    cl_kernel kernel,
+    cl_uint work_dim,
+    const size_t* global_work_offset,
+    const size_t* global_work_size,
+    const size_t* local_work_size,
+    cl_int& errorCode)
+{
+    errorCode = CL_SUCCESS;
+
+    ptrdiff_t numProperties = 0;
+    cl_mutable_dispatch_fields_khr mutableFields = g_MutableDispatchCaps;
+    cl_mutable_dispatch_asserts_khr mutableAsserts = 0;
+
+    if( properties )
+    {
+        const cl_command_properties_khr* check = properties;
+        bool found_CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR = false;
+        bool found_CL_MUTABLE_DISPATCH_ASSERTS_KHR = false;
+        while( errorCode == CL_SUCCESS && check[0] != 0 )
+        {
+            cl_int  property = (cl_int)check[0];
+            switch( property )
+            {
+            case CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR:
+                if( found_CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR )
+                {
+                    errorCode = CL_INVALID_VALUE;
+                    return nullptr;
+                }
+                else
+                {
+                    found_CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR = true;
+                    mutableFields = ((const cl_mutable_dispatch_fields_khr*)(check + 1))[0];
+                    check += 2;
+                }
+                break;
+            case CL_MUTABLE_DISPATCH_ASSERTS_KHR:
+                if( found_CL_MUTABLE_DISPATCH_ASSERTS_KHR )
+                {
+                    errorCode = CL_INVALID_VALUE;
+                    return nullptr;
+                }
+                else
+                {
+                    found_CL_MUTABLE_DISPATCH_ASSERTS_KHR = true;
+                    mutableAsserts = ((const cl_mutable_dispatch_asserts_khr*)(check + 1))[0];
+                    check += 2;
+                }
+                break;
+            default:
+                errorCode = CL_INVALID_VALUE;
+                return nullptr;
+            }
+        }
+        numProperties = check - properties + 1;
+    }
+
+    if( work_dim == 0 )
+    {
+        errorCode = CL_INVALID_WORK_DIMENSION;
+        return nullptr;
+    }
+
+    if( local_work_size == nullptr )
+    {
+        const auto mutableAssertsCmdBuf = cmdbuf->getMutableDispatchAsserts();
+        if( mutableAssertsCmdBuf & CL_MUTABLE_DISPATCH_ASSERT_NO_ADDITIONAL_WORK_GROUPS_KHR ||
+            mutableAsserts & CL_MUTABLE_DISPATCH_ASSERT_NO_ADDITIONAL_WORK_GROUPS_KHR )
+        {
+            errorCode = CL_INVALID_WORK_GROUP_SIZE;
+            return nullptr;
+        }
+    }
+
+    auto command = std::unique_ptr<NDRangeKernel>(
+        new (cmdbuf) NDRangeKernel(cmdbuf, queue));
+
+    std::vector<SKernelArg> trackedArgs;
+    const bool isArgsKnown =
+        isTrackingKernelArgs() && getTrackedKernelArgs(kernel, trackedArgs);
+
+    command->original_kernel = kernel;
+    if( g_ShareKernelClones && isArgsKnown )
+    {
+        command->kernel = cmdbuf->getSharedKernelClone(kernel, trackedArgs);
+        command->isSharedKernel = command->kernel != nullptr;
+    }
+    if( command->kernel == nullptr )
+    {
+        command->kernel = g_pNextDispatch->clCloneKernel(kernel, nullptr);
+    }
+    command->work_dim = work_dim;
+    command->global_work_offset.resize(work_dim);
+    command->global_work_size.resize(work_dim);
+    command->local_work_size.resize(work_dim);
+
+    command->mutableFields = mutableFields;
+    command->mutableAsserts = mutableAsserts;
+    command->numWorkGroups = getNumWorkGroups(
+        work_dim,
+        global_work_size,
+        local_work_size );
+
+    command->numProperties = numProperties;
+    std::copy(
+        properties,
+        properties + numProperties,
+        command->properties.begin() );
+
+    if( global_work_offset )
+    {
+        std::copy(
+            global_work_offset,
+            global_work_offset + work_dim,
+            command->global_work_offset.data() );
+        command->hasGlobalWorkOffset = true;
+    }
+
+    if( global_work_size )
+    {
+        std::copy(
+            global_work_size,
+            global_work_size + work_dim,
+            command->global_work_size.data() );
+        command->hasGlobalWorkSize = true;
+    }
+
+    if( local_work_size )
+    {
+        std::copy(
+            local_work_size,
+            local_work_size + work_dim,
+            command->local_work_size.data() );
+        command->hasLocalWorkSize = true;
+    }
+    else if( g_SuggestedLocalWorkSize && isMutable == false )
+    {
+        command->suggestLocalWorkSize(cmdbuf, queue, kernel);
+    }
+
+    if( g_InferDependencies && isMutable == false && isArgsKnown )
+    {
+        command->hasMemAccesses = getKernelMemAccesses(
+            kernel,
+            trackedArgs,
+            command->memAccesses );
+    }
+
+    // Kernel arguments that are not set yet may be set by mutable dispatch
+    // updates, so the kernel arguments are stored even if they are not all
+    // known.
+    if( g_CommandBufferBinaries )
+    {
+        command->hasKernelArgs = isArgsKnown || !trackedArgs.empty();
+        command->kernelArgs = std::move(trackedArgs);
+    }
+
+    g_pNextDispatch->clRetainKernel(command->original_kernel);
+
+    return command;
+}
+
+std::unique_ptr<NDRangeKernel> NDRangeKernel::createFromBinary(
+    cl_command_buffer_khr cmdbuf,
+    cl_command_queue queue,
+    CCommandBufferBinary& binary)
+{
+    auto command = std::unique_ptr<NDRangeKernel>(
+        new (cmdbuf) NDRangeKernel(cmdbuf, queue));
+    if( !command->serialize(binary) )
+    {
+        return nullptr;
+    }
+
+    command->hasKernelArgs = true;
+    if( g_ShareKernelClones )
+    {
+        command->kernel = cmdbuf->getSharedKernelClone(
+            command->original_kernel,
+            command->kernelArgs);
+        command->isSharedKernel = command->kernel != nullptr;
+    }
+    if( command->kernel == nullptr )
+    {
+        command->kernel = g_pNextDispatch->clCloneKernel(
+            command->original_kernel,
+            nullptr);
+        if( command->kernel == nullptr ||
+            setKernelArgs(command->kernel, command->kernelArgs) != CL_SUCCESS )
+        {
+            return nullptr;
+        }
+    }
+
+    // The suggested local work-group size and the memory objects accessed by
+    // the kernel are computed again, since they depend on the device and on
+    // the memory objects the binary was loaded with.
+    if( command->isSuggestedLocalWorkSize )
+    {
+        command->suggestLocalWorkSize(
+            cmdbuf,
+            command->getQueue(),
+            command->kernel);
+    }
+    if( command->hasMemAccesses )
+    {
+        command->hasMemAccesses = g_InferDependencies && getKernelMemAccesses(
+            command->original_kernel,
+            command->kernelArgs,
+            command->memAccesses );
+    }
+
+    return command;
+}
+
+void NDRangeKernel::suggestLocalWorkSize(
+    cl_command_buffer_khr cmdbuf,
+    cl_command_queue queue,
+    cl_kernel kernel )
+{
+    cl_int checkError = cmdbuf->clGetKernelSuggestedLocalWorkSize(
+        queue,
+        kernel,
+        work_dim,
+        getGlobalWorkOffset(),
+        getGlobalWorkSize(),
+        local_work_size.data() );
+    if( checkError != CL_SUCCESS )
+    {
+        local_work_size.resize(work_dim);
+    }
+    hasLocalWorkSize = checkError == CL_SUCCESS;
+    isSuggestedLocalWorkSize = hasLocalWorkSize;
+}
+
+std::unique_ptr<Command> NDRangeKernel::clone(
+    cl_command_buffer_khr cmdbuf,
+    cl_command_queue queue) const
+{
+    auto ret = std::unique_ptr<NDRangeKernel>(
+        new (cmdbuf) NDRangeKernel(*this));
+    ret->remap(cmdbuf, queue);
+
+    // The cloned kernel has the same kernel arguments as this command's
+    // kernel, including any updates from mutable dispatch.
+    ret->kernel = g_pNextDispatch->clCloneKernel(kernel, nullptr);
+    ret->isSharedKernel = false;
+    g_pNextDispatch->clRetainKernel(ret->original_kernel);
+
+    // A suggested local work-group size may not be valid for the device
+    // associated with the new queue, so compute it again.
+    if( isSuggestedLocalWorkSize )
+    {
+        ret->suggestLocalWorkSize(cmdbuf, ret->getQueue(), original_kernel);
+    }
+
+    return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Record-time validation for enhanced error checking.  These functions check
+// the arguments for each command when it is recorded into a command buffer,
+// so errors are reported by the clCommand functions rather than when the
+// command buffer is executed.
+
+struct SMemInfo
+{
+    cl_mem_object_type  Type = 0;
+    size_t  Size = 0;
+
+    // The memory object this memory object was created from, if any, and
+    // the offset into it, so copies between sub-buffers of the same buffer
+    // may be checked for overlap.
+    cl_mem  Root = nullptr;
+    size_t  RootOffset = 0;
+
+    // Only set for images.
+    cl_image_format Format = {};
+    size_t  ElementSize = 0;
+    size_t  Width = 0;
+    size_t  Height = 0;
+    size_t  Depth = 0;
+    size_t  ArraySize = 0;
+};
+
+static cl_context getQueueContext(
+    cl_command_queue queue )
+{
+    cl_context context = nullptr;
+    g_pNextDispatch->clGetCommandQueueInfo(
+        queue,
+        CL_QUEUE_CONTEXT,
+        sizeof(context),
+        &context,
+        nullptr );
+    return context;
+}
+
+static cl_int validateMemObject(
+    cl_context context,
+    cl_mem mem,
+    SMemInfo& info )
+{
+    cl_context memContext = nullptr;
+    if( mem == nullptr ||
+        g_pNextDispatch->clGetMemObjectInfo(
+            mem,
+            CL_MEM_CONTEXT,
+            sizeof(memContext),
+            &memContext,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetMemObjectInfo(
+            mem,
+            CL_MEM_TYPE,
+            sizeof(info.Type),
+            &info.Type,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetMemObjectInfo(
+            mem,
+            CL_MEM_SIZE,
+            sizeof(info.Size),
+            &info.Size,
+            nullptr ) != CL_SUCCESS )
+    {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    if( memContext != context )
+    {
+        return CL_INVALID_CONTEXT;
+    }
+
+    info.Root = getRootMemObject(mem, &info.RootOffset);
+    return CL_SUCCESS;
+}
+
+static cl_int validateBuffer(
+    cl_context context,
+    cl_mem buffer,
+    SMemInfo& info )
+{
+    if( cl_int errorCode = validateMemObject(context, buffer, info) )
+    {
+        return errorCode;
+    }
+    if( info.Type != CL_MEM_OBJECT_BUFFER )
+    {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    return CL_SUCCESS;
+}
+
+static cl_int validateImage(
+    cl_context context,
+    cl_mem image,
+    SMemInfo& info )
+{
+    if( cl_int errorCode = validateMemObject(context, image, info) )
+    {
+        return errorCode;
+    }
+    switch( info.Type )
+    {
+    case CL_MEM_OBJECT_IMAGE1D:
+    case CL_MEM_OBJECT_IMAGE1D_BUFFER:
+    case CL_MEM_OBJECT_IMAGE1D_ARRAY:
+    case CL_MEM_OBJECT_IMAGE2D:
+    case CL_MEM_OBJECT_IMAGE2D_ARRAY:
+    case CL_MEM_OBJECT_IMAGE3D:
+        break;
+    default:
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    if( g_pNextDispatch->clGetImageInfo(
+            image,
+            CL_IMAGE_FORMAT,
+            sizeof(info.Format),
+            &info.Format,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetImageInfo(
+            image,
+            CL_IMAGE_ELEMENT_SIZE,
+            sizeof(info.ElementSize),
+            &info.ElementSize,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetImageInfo(
+            image,
+            CL_IMAGE_WIDTH,
+            sizeof(info.Width),
+            &info.Width,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetImageInfo(
+            image,
+            CL_IMAGE_HEIGHT,
+            sizeof(info.Height),
+            &info.Height,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetImageInfo(
+            image,
+            CL_IMAGE_DEPTH,
+            sizeof(info.Depth),
+            &info.Depth,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetImageInfo(
+            image,
+            CL_IMAGE_ARRAY_SIZE,
+            sizeof(info.ArraySize),
+            &info.ArraySize,
+            nullptr ) != CL_SUCCESS )
+    {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    return CL_SUCCESS;
+}
+
+// Checks that a region of an image is within the image.  Unused dimensions
+// of the origin must be zero and unused dimensions of the region must be one.
+static cl_int validateImageRegion(
+    const SMemInfo& info,
+    const size_t* origin,
+    const size_t* region )
+{
+    if( origin == nullptr || region == nullptr )
+    {
+        return CL_INVALID_VALUE;
+    }
+    if( region[0] == 0 || region[1] == 0 || region[2] == 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    size_t limits[3] = { info.Width, 1, 1 };
+    switch( info.Type )
+    {
+    case CL_MEM_OBJECT_IMAGE1D_ARRAY:
+        limits[1] = info.ArraySize;
+        break;
+    case CL_MEM_OBJECT_IMAGE2D:
+        limits[1] = info.Height;
+        break;
+    case CL_MEM_OBJECT_IMAGE2D_ARRAY:
+        limits[1] = info.Height;
+        limits[2] = info.ArraySize;
+        break;
+    case CL_MEM_OBJECT_IMAGE3D:
+        limits[1] = info.Height;
+        limits[2] = info.Depth;
+        break;
+    default:
+        break;
+    }
+
+    for( int d = 0; d < 3; d++ )
+    {
+        if( origin[d] >= limits[d] || region[d] > limits[d] - origin[d] )
+        {
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+// Checks that a range of bytes is within a buffer.
+static cl_int validateBufferRange(
+    const SMemInfo& info,
+    size_t offset,
+    size_t size )
+{
+    if( size == 0 || offset >= info.Size || size > info.Size - offset )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+// Checks the pitches and the region for a rectangular buffer copy and
+// computes the pitches to use if the pitches are zero.  Returns the range of
+// bytes accessed in the buffer.
+static cl_int validateBufferRect(
+    const SMemInfo& info,
+    const size_t* origin,
+    const size_t* region,
+    size_t& row_pitch,
+    size_t& slice_pitch,
+    size_t& offset,
+    size_t& size )
+{
+    if( origin == nullptr || region == nullptr )
+    {
+        return CL_INVALID_VALUE;
+    }
+    if( region[0] == 0 || region[1] == 0 || region[2] == 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    if( row_pitch == 0 )
+    {
+        row_pitch = region[0];
+    }
+    else if( row_pitch < region[0] )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    if( slice_pitch == 0 )
+    {
+        slice_pitch = region[1] * row_pitch;
+    }
+    else if( slice_pitch < region[1] * row_pitch ||
+             slice_pitch % row_pitch != 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    offset =
+        origin[2] * slice_pitch +
+        origin[1] * row_pitch +
+        origin[0];
+    size =
+        ( region[2] - 1 ) * slice_pitch +
+        ( region[1] - 1 ) * row_pitch +
+        region[0];
+    return validateBufferRange(info, offset, size);
+}
+
+static bool isValidPatternSize(
+    size_t pattern_size )
+{
+    switch( pattern_size )
+    {
+    case 1: case 2: case 4: case 8: case 16: case 32: case 64: case 128:
+        return true;
+    default:
+        break;
+    }
+    return false;
+}
+
+// Returns true if two ranges of bytes overlap.
+static bool isOverlapping(
+    size_t offsetA,
+    size_t sizeA,
+    size_t offsetB,
+    size_t sizeB )
+{
+    return offsetA < offsetB + sizeB && offsetB < offsetA + sizeA;
+}
+
+static bool isOverlapping(
+    size_t offsetA,
+    size_t offsetB,
+    size_t size )
+{
+    return isOverlapping(offsetA, size, offsetB, size);
+}
+
+// Returns true if two regions of the same image overlap.
+static bool isOverlapping(
+    const size_t* originA,
+    const size_t* originB,
+    const size_t* region )
+{
+    return isOverlapping(originA[0], originB[0], region[0]) &&
+        isOverlapping(originA[1], originB[1], region[1]) &&
+        isOverlapping(originA[2], originB[2], region[2]);
+}
+
+// Computes the range of bytes in the memory object an image was created from
+// that are accessed by a region of the image.
+static void getImageRange(
+    cl_mem image,
+    const SMemInfo& info,
+    const size_t* origin,
+    const size_t* region,
+    size_t& offset,
+    size_t& size )
+{
+    size_t rowPitch = 0;
+    size_t slicePitch = 0;
+    g_pNextDispatch->clGetImageInfo(
+        image,
+        CL_IMAGE_ROW_PITCH,
+        sizeof(rowPitch),
+        &rowPitch,
+        nullptr );
+    g_pNextDispatch->clGetImageInfo(
+        image,
+        CL_IMAGE_SLICE_PITCH,
+        sizeof(slicePitch),
+        &slicePitch,
+        nullptr );
+
+    // The second dimension of a 1D image array is the array index.
+    if( info.Type == CL_MEM_OBJECT_IMAGE1D_ARRAY )
+    {
+        rowPitch = slicePitch;
+    }
+
+    offset =
+        info.RootOffset +
+        origin[2] * slicePitch +
+        origin[1] * rowPitch +
+        origin[0] * info.ElementSize;
+    size =
+        ( region[2] - 1 ) * slicePitch +
+        ( region[1] - 1 ) * rowPitch +
+        region[0] * info.ElementSize;
+}
+
+static cl_int validateCopyBuffer(
+    cl_command_queue queue,
+    cl_mem src_buffer,
+    cl_mem dst_buffer,
+    size_t src_offset,
+    size_t dst_offset,
+    size_t size )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo srcInfo, dstInfo;
+    if( cl_int errorCode = validateBuffer(context, src_buffer, srcInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateBuffer(context, dst_buffer, dstInfo) )
+    {
+        return errorCode;
+    }
+    if( validateBufferRange(srcInfo, src_offset, size) ||
+        validateBufferRange(dstInfo, dst_offset, size) )
+    {
+        return CL_INVALID_VALUE;
+    }
+    if( srcInfo.Root == dstInfo.Root &&
+        isOverlapping(
+            srcInfo.RootOffset + src_offset,
+            dstInfo.RootOffset + dst_offset,
+            size ) )
+    {
+        return CL_MEM_COPY_OVERLAP;
+    }
+
+    return CL_SUCCESS;
+}
+
+static cl_int validateCopyBufferRect(
+    cl_command_queue queue,
+    cl_mem src_buffer,
+    cl_mem dst_buffer,
+    const size_t* src_origin,
+    const size_t* dst_origin,
+    const size_t* region,
+    size_t src_row_pitch,
+    size_t src_slice_pitch,
+    size_t dst_row_pitch,
+    size_t dst_slice_pitch )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo srcInfo, dstInfo;
+    if( cl_int errorCode = validateBuffer(context, src_buffer, srcInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateBuffer(context, dst_buffer, dstInfo) )
+    {
+        return errorCode;
+    }
+    size_t srcOffset = 0, srcSize = 0;
+    size_t dstOffset = 0, dstSize = 0;
+    if( validateBufferRect(
+            srcInfo,
+            src_origin,
+            region,
+            src_row_pitch,
+            src_slice_pitch,
+            srcOffset,
+            srcSize ) ||
+        validateBufferRect(
+            dstInfo,
+            dst_origin,
+            region,
+            dst_row_pitch,
+            dst_slice_pitch,
+            dstOffset,
+            dstSize ) )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    // Copies within the same buffer must use the same pitches, so the copy
+    // overlaps if the source and destination boxes overlap.  Copies between
+    // different sub-buffers of the same buffer overlap if the ranges of bytes
+    // they access overlap.
+    if( src_buffer == dst_buffer )
+    {
+        if( src_row_pitch != dst_row_pitch ||
+            src_slice_pitch != dst_slice_pitch )
+        {
+            return CL_INVALID_VALUE;
+        }
+        if( isOverlapping(src_origin, dst_origin, region) )
+        {
+            return CL_MEM_COPY_OVERLAP;
+        }
+    }
+    else if( srcInfo.Root == dstInfo.Root &&
+             isOverlapping(
+                srcInfo.RootOffset + srcOffset,
+                srcSize,
+                dstInfo.RootOffset + dstOffset,
+                dstSize ) )
+    {
+        return CL_MEM_COPY_OVERLAP;
+    }
+
+    return CL_SUCCESS;
+}
+
+static cl_int validateCopyBufferToImage(
+    cl_command_queue queue,
+    cl_mem src_buffer,
+    cl_mem dst_image,
+    size_t src_offset,
+    const size_t* dst_origin,
+    const size_t* region )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo srcInfo, dstInfo;
+    if( cl_int errorCode = validateBuffer(context, src_buffer, srcInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateImage(context, dst_image, dstInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateImageRegion(dstInfo, dst_origin, region) )
+    {
+        return errorCode;
+    }
+
+    const size_t size =
+        region[0] * region[1] * region[2] * dstInfo.ElementSize;
+    return validateBufferRange(srcInfo, src_offset, size);
+}
+
+static cl_int validateCopyImage(
+    cl_command_queue queue,
+    cl_mem src_image,
+    cl_mem dst_image,
+    const size_t* src_origin,
+    const size_t* dst_origin,
+    const size_t* region )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo srcInfo, dstInfo;
+    if( cl_int errorCode = validateImage(context, src_image, srcInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateImage(context, dst_image, dstInfo) )
+    {
+        return errorCode;
+    }
+    if( srcInfo.Format.image_channel_order != dstInfo.Format.image_channel_order ||
+        srcInfo.Format.image_channel_data_type != dstInfo.Format.image_channel_data_type )
+    {
+        return CL_IMAGE_FORMAT_MISMATCH;
+    }
+    if( cl_int errorCode = validateImageRegion(srcInfo, src_origin, region) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateImageRegion(dstInfo, dst_origin, region) )
+    {
+        return errorCode;
+    }
+
+    // Copies between different images created from the same memory object
+    // overlap if the ranges of bytes they access overlap.
+    if( src_image == dst_image )
+    {
+        if( isOverlapping(src_origin, dst_origin, region) )
+        {
+            return CL_MEM_COPY_OVERLAP;
+        }
+    }
+    else if( srcInfo.Root == dstInfo.Root )
+    {
+        size_t srcOffset = 0, srcSize = 0;
+        size_t dstOffset = 0, dstSize = 0;
+        getImageRange(src_image, srcInfo, src_origin, region, srcOffset, srcSize);
+        getImageRange(dst_image, dstInfo, dst_origin, region, dstOffset, dstSize);
+        if( isOverlapping(srcOffset, srcSize, dstOffset, dstSize) )
+        {
+            return CL_MEM_COPY_OVERLAP;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+static cl_int validateCopyImageToBuffer(
+    cl_command_queue queue,
+    cl_mem src_image,
+    cl_mem dst_buffer,
+    const size_t* src_origin,
+    const size_t* region,
+    size_t dst_offset )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo srcInfo, dstInfo;
+    if( cl_int errorCode = validateImage(context, src_image, srcInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateBuffer(context, dst_buffer, dstInfo) )
+    {
+        return errorCode;
+    }
+    if( cl_int errorCode = validateImageRegion(srcInfo, src_origin, region) )
+    {
+        return errorCode;
+    }
+
+    const size_t size =
+        region[0] * region[1] * region[2] * srcInfo.ElementSize;
+    return validateBufferRange(dstInfo, dst_offset, size);
+}
+
+static cl_int validateFillBuffer(
+    cl_command_queue queue,
+    cl_mem buffer,
+    const void* pattern,
+    size_t pattern_size,
+    size_t offset,
+    size_t size )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo info;
+    if( cl_int errorCode = validateBuffer(context, buffer, info) )
+    {
+        return errorCode;
+    }
+    if( pattern == nullptr || !isValidPatternSize(pattern_size) )
+    {
+        return CL_INVALID_VALUE;
+    }
+    if( offset % pattern_size != 0 || size % pattern_size != 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    return validateBufferRange(info, offset, size);
+}
+
+static cl_int validateFillImage(
+    cl_command_queue queue,
+    cl_mem image,
+    const void* fill_color,
+    const size_t* origin,
+    const size_t* region )
+{
+    const cl_context context = getQueueContext(queue);
+    SMemInfo info;
+    if( cl_int errorCode = validateImage(context, image, info) )
+    {
+        return errorCode;
+    }
+    if( fill_color == nullptr )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    return validateImageRegion(info, origin, region);
+}
+
+static cl_int validateSVMMemcpy(
+    void* dst_ptr,
+    const void* src_ptr,
+    size_t size )
+{
+    if( dst_ptr == nullptr || src_ptr == nullptr )
+    {
+        return CL_INVALID_VALUE;
+    }
+    if( isOverlapping(
+            reinterpret_cast<uintptr_t>(dst_ptr),
+            reinterpret_cast<uintptr_t>(src_ptr),
+            size ) )
+    {
+        return CL_MEM_COPY_OVERLAP;
+    }
+
+    return CL_SUCCESS;
+}
+
+static cl_int validateSVMMemFill(
+    void* svm_ptr,
+    const void* pattern,
+    size_t pattern_size,
+    size_t size )
+{
+    if( svm_ptr == nullptr || pattern == nullptr ||
+        !isValidPatternSize(pattern_size) )
+    {
+        return CL_INVALID_VALUE;
+    }
+    if( reinterpret_cast<uintptr_t>(svm_ptr) % pattern_size != 0 ||
+        size % pattern_size != 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    return CL_SUCCESS;
+}
+
+// Determines whether a kernel may be enqueued with a global work size that
+// is not a multiple of the local work size.  This requires device support,
+// and the program must not be compiled with -cl-uniform-work-group-size.
+// OpenCL C programs must also be compiled for OpenCL C 2.0 or newer.  If the
+// program build options cannot be queried then non-uniform work-groups are
+// assumed to be supported, so valid commands are never rejected.
+static bool supportsNonUniformWorkGroups(
+    cl_kernel kernel,
+    cl_device_id device,
+    cl_version deviceVersion )
+{
+    if( deviceVersion < CL_MAKE_VERSION(2, 0, 0) )
+    {
+        return false;
+    }
+    if( deviceVersion >= CL_MAKE_VERSION(3, 0, 0) )
+    {
+        cl_bool supported = CL_FALSE;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_NON_UNIFORM_WORK_GROUP_SUPPORT,
+            sizeof(supported),
+            &supported,
+            nullptr );
+        if( supported == CL_FALSE )
+        {
+            return false;
+        }
+    }
+
+    cl_program program = nullptr;
+    size_t  optionsSize = 0;
+    if( g_pNextDispatch->clGetKernelInfo(
+            kernel,
+            CL_KERNEL_PROGRAM,
+            sizeof(program),
+            &program,
+            nullptr ) != CL_SUCCESS ||
+        g_pNextDispatch->clGetProgramBuildInfo(
+            program,
+            device,
+            CL_PROGRAM_BUILD_OPTIONS,
+            0,
+            nullptr,
+            &optionsSize ) != CL_SUCCESS ||
+        optionsSize == 0 )
+    {
+        return true;
     }
 
-    _cl_command_buffer_khr(
-            cl_command_buffer_flags_khr flags,
-            cl_mutable_dispatch_asserts_khr mutableDispatchAsserts) :
-        Magic(cMagic),
-        State(CL_COMMAND_BUFFER_STATE_RECORDING_KHR),
-        Flags(flags),
-        MutableDispatchAsserts(mutableDispatchAsserts),
-        RefCount(1),
-        NextSyncPoint(1) {}
-} CommandBuffer;
+    std::string options(optionsSize, '\0');
+    g_pNextDispatch->clGetProgramBuildInfo(
+        program,
+        device,
+        CL_PROGRAM_BUILD_OPTIONS,
+        optionsSize,
+        &options[0],
+        nullptr );
+    if( options.find("-cl-uniform-work-group-size") != std::string::npos )
+    {
+        return false;
+    }
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// These functions need to be defined separately and after the definition of a
-// command buffer because they call into the command buffer.
+    // Programs created from source are compiled for OpenCL C 1.2 unless
+    // another version is requested.
+    size_t  sourceSize = 0;
+    g_pNextDispatch->clGetProgramInfo(
+        program,
+        CL_PROGRAM_SOURCE,
+        0,
+        nullptr,
+        &sourceSize );
+    if( sourceSize > 1 )
+    {
+        const size_t pos = options.find("-cl-std=CL");
+        if( pos == std::string::npos ||
+            options.compare(pos, 12, "-cl-std=CL1.") == 0 )
+        {
+            return false;
+        }
+    }
 
-_cl_mutable_command_khr::_cl_mutable_command_khr(
-    cl_command_buffer_khr cmdbuf,
-    cl_command_queue queue,
-    cl_command_type type) :
-    Magic(cMagic),
-    Type(type),
-    CmdBuf(cmdbuf),
-    Queue(queue ? queue : cmdbuf->getQueue()) {}
+    return true;
+}
 
-std::unique_ptr<NDRangeKernel> NDRangeKernel::create(
-    const bool isMutable,
-    const cl_command_properties_khr* properties,
-    cl_command_buffer_khr cmdbuf,
+// Kernel arguments are always tracked when enhanced error checking is
+// enabled.  The kernel arguments for a mutable command may be set later by
+// mutable dispatch updates.
+static cl_int validateNDRangeKernel(
     cl_command_queue queue,
     cl_kernel kernel,
     cl_uint work_dim,
     const size_t* global_work_offset,
     const size_t* global_work_size,
     const size_t* local_work_size,
-    cl_int& errorCode)
+    bool isMutable )
 {
-    errorCode = CL_SUCCESS;
-
-    ptrdiff_t numProperties = 0;
-    cl_mutable_dispatch_fields_khr mutableFields = g_MutableDispatchCaps;
-    cl_mutable_dispatch_asserts_khr mutableAsserts = 0;
-
-    if( properties )
+    cl_context kernelContext = nullptr;
+    if( kernel == nullptr ||
+        g_pNextDispatch->clGetKernelInfo(
+            kernel,
+            CL_KERNEL_CONTEXT,
+            sizeof(kernelContext),
+            &kernelContext,
+            nullptr ) != CL_SUCCESS )
     {
-        const cl_command_properties_khr* check = properties;
-        bool found_CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR = false;
-        bool found_CL_MUTABLE_DISPATCH_ASSERTS_KHR = false;
-        while( errorCode == CL_SUCCESS && check[0] != 0 )
-        {
-            cl_int  property = (cl_int)check[0];
-            switch( property )
-            {
-            case CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR:
-                if( found_CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR )
-                {
-                    errorCode = CL_INVALID_VALUE;
-                    return nullptr;
-                }
-                else
-                {
-                    found_CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR = true;
-                    mutableFields = ((const cl_mutable_dispatch_fields_khr*)(check + 1))[0];
-                    check += 2;
-                }
-                break;
-            case CL_MUTABLE_DISPATCH_ASSERTS_KHR:
-                if( found_CL_MUTABLE_DISPATCH_ASSERTS_KHR )
-                {
-                    errorCode = CL_INVALID_VALUE;
-                    return nullptr;
-                }
-                else
-                {
-                    found_CL_MUTABLE_DISPATCH_ASSERTS_KHR = true;
-                    mutableAsserts = ((const cl_mutable_dispatch_asserts_khr*)(check + 1))[0];
-                    check += 2;
-                }
-                break;
-            default:
-                errorCode = CL_INVALID_VALUE;
-                return nullptr;
-            }
-        }
-        numProperties = check - properties + 1;
+        return CL_INVALID_KERNEL;
     }
 
-    if( local_work_size == nullptr )
+    cl_context queueContext = nullptr;
+    cl_device_id device = nullptr;
+    g_pNextDispatch->clGetCommandQueueInfo(
+        queue,
+        CL_QUEUE_CONTEXT,
+        sizeof(queueContext),
+        &queueContext,
+        nullptr );
+    g_pNextDispatch->clGetCommandQueueInfo(
+        queue,
+        CL_QUEUE_DEVICE,
+        sizeof(device),
+        &device,
+        nullptr );
+    if( kernelContext != queueContext )
     {
-        const auto mutableAssertsCmdBuf = cmdbuf->getMutableDispatchAsserts();
-        if( mutableAssertsCmdBuf & CL_MUTABLE_DISPATCH_ASSERT_NO_ADDITIONAL_WORK_GROUPS_KHR ||
-            mutableAsserts & CL_MUTABLE_DISPATCH_ASSERT_NO_ADDITIONAL_WORK_GROUPS_KHR )
-        {
-            errorCode = CL_INVALID_WORK_GROUP_SIZE;
-            return nullptr;
-        }
+        return CL_INVALID_CONTEXT;
     }
 
-    auto command = std::unique_ptr<NDRangeKernel>(
-        new NDRangeKernel(cmdbuf, queue));
-
-    command->original_kernel = kernel;
-    command->kernel = g_pNextDispatch->clCloneKernel(kernel, nullptr);
-    command->work_dim = work_dim;
-
-    command->mutableFields = mutableFields;
-    command->mutableAsserts = mutableAsserts;
-    command->numWorkGroups = getNumWorkGroups(
-        work_dim,
-        global_work_size,
-        local_work_size );
-
-    command->properties.reserve(numProperties);
-    command->properties.insert(
-        command->properties.begin(),
-        properties,
-        properties + numProperties );
-
-    if( global_work_offset )
+    cl_uint maxWorkDim = 0;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+        sizeof(maxWorkDim),
+        &maxWorkDim,
+        nullptr );
+    if( work_dim < 1 || ( maxWorkDim != 0 && work_dim > maxWorkDim ) )
     {
-        command->global_work_offset.reserve(work_dim);
-        command->global_work_offset.insert(
-            command->global_work_offset.begin(),
-            global_work_offset,
-            global_work_offset + work_dim);
+        return CL_INVALID_WORK_DIMENSION;
     }
-
-    if( global_work_size )
+    if( global_work_size == nullptr )
     {
-        command->global_work_size.reserve(work_dim);
-        command->global_work_size.insert(
-            command->global_work_size.begin(),
-            global_work_size,
-            global_work_size + work_dim);
+        return CL_INVALID_GLOBAL_WORK_SIZE;
     }
 
-    if( local_work_size )
-    {
-        command->local_work_size.reserve(work_dim);
-        command->local_work_size.insert(
-            command->local_work_size.begin(),
-            local_work_size,
-            local_work_size + work_dim);
+    size_t  versionSize = 0;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_VERSION,
+        0,
+        nullptr,
+        &versionSize );
+    std::vector<char> versionString(versionSize + 1);
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_VERSION,
+        versionSize,
+        versionString.data(),
+        nullptr );
+    const cl_version deviceVersion =
+        getOpenCLVersionFromString(versionString.data());
+
+    // Global work sizes and offsets must fit in the device size_t.  Global
+    // work sizes of zero are only an error before OpenCL 2.1.
+    cl_uint addressBits = 0;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_ADDRESS_BITS,
+        sizeof(addressBits),
+        &addressBits,
+        nullptr );
+    const size_t maxSize =
+        addressBits != 0 && addressBits < sizeof(size_t) * 8 ?
+        ( (size_t)1 << addressBits ) - 1 :
+        ~(size_t)0;
+    for( cl_uint d = 0; d < work_dim; d++ )
+    {
+        if( ( global_work_size[d] == 0 &&
+              deviceVersion < CL_MAKE_VERSION(2, 1, 0) ) ||
+            global_work_size[d] > maxSize )
+        {
+            return CL_INVALID_GLOBAL_WORK_SIZE;
+        }
+        if( global_work_offset &&
+            global_work_offset[d] > maxSize - global_work_size[d] )
+        {
+            return CL_INVALID_GLOBAL_OFFSET;
+        }
     }
-    else if( g_SuggestedLocalWorkSize && isMutable == false )
+
+    if( local_work_size )
     {
-        command->local_work_size.resize(work_dim);
-        cl_int checkError = cmdbuf->clGetKernelSuggestedLocalWorkSize(
-            queue,
+        size_t maxWorkGroupSize = 0;
+        size_t compileWorkGroupSize[3] = { 0, 0, 0 };
+        std::vector<size_t> maxWorkItemSizes(std::max(work_dim, maxWorkDim));
+        g_pNextDispatch->clGetKernelWorkGroupInfo(
             kernel,
-            work_dim,
-            global_work_offset,
-            global_work_size,
-            command->local_work_size.data() );
-        if( checkError != CL_SUCCESS )
+            device,
+            CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(maxWorkGroupSize),
+            &maxWorkGroupSize,
+            nullptr );
+        g_pNextDispatch->clGetKernelWorkGroupInfo(
+            kernel,
+            device,
+            CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+            sizeof(compileWorkGroupSize),
+            compileWorkGroupSize,
+            nullptr );
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_MAX_WORK_ITEM_SIZES,
+            maxWorkDim * sizeof(size_t),
+            maxWorkItemSizes.data(),
+            nullptr );
+
+        const bool hasCompileWorkGroupSize = compileWorkGroupSize[0] != 0;
+        size_t workGroupSize = 1;
+        for( cl_uint d = 0; d < work_dim; d++ )
+        {
+            if( local_work_size[d] == 0 )
+            {
+                return CL_INVALID_WORK_GROUP_SIZE;
+            }
+            // The required work-group size only has three dimensions.
+            if( hasCompileWorkGroupSize &&
+                local_work_size[d] != ( d < 3 ? compileWorkGroupSize[d] : 1 ) )
+            {
+                return CL_INVALID_WORK_GROUP_SIZE;
+            }
+            if( maxWorkItemSizes[d] != 0 &&
+                local_work_size[d] > maxWorkItemSizes[d] )
+            {
+                return CL_INVALID_WORK_ITEM_SIZE;
+            }
+            workGroupSize *= local_work_size[d];
+        }
+        if( maxWorkGroupSize != 0 && workGroupSize > maxWorkGroupSize )
+        {
+            return CL_INVALID_WORK_GROUP_SIZE;
+        }
+
+        bool isUniform = true;
+        for( cl_uint d = 0; d < work_dim; d++ )
+        {
+            if( global_work_size[d] % local_work_size[d] != 0 )
+            {
+                isUniform = false;
+            }
+        }
+        if( !isUniform &&
+            !supportsNonUniformWorkGroups(kernel, device, deviceVersion) )
         {
-            command->local_work_size.clear();
+            return CL_INVALID_WORK_GROUP_SIZE;
         }
     }
 
-    g_pNextDispatch->clRetainKernel(command->original_kernel);
+    if( isTrackingKernelArgs() && !isMutable )
+    {
+        std::vector<SKernelArg> args;
+        if( !getTrackedKernelArgs(kernel, args) && !args.empty() )
+        {
+            return CL_INVALID_KERNEL_ARGS;
+        }
+    }
 
-    return command;
+    return CL_SUCCESS;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -2126,12 +6367,21 @@ cl_int CL_API_CALL clEnqueueCommandBufferKHR_EMU(
         return errorCode;
     }
 
-    cl_command_queue queue = cmdbuf->getQueue();
-    if( num_queues > 0 )
+    if( cmdbuf->hasNativeCommandBuffer() )
     {
-        queue = queues[0];
+        return cmdbuf->enqueueNativeCommandBuffer(
+            num_queues,
+            queues,
+            num_events_in_wait_list,
+            event_wait_list,
+            event);
     }
 
+    const cl_uint numQueues = cmdbuf->getNumQueues();
+    const cl_command_queue* replayQueues =
+        num_queues > 0 ? queues : cmdbuf->getQueues();
+    cl_command_queue queue = replayQueues[0];
+
     cl_int errorCode = CL_SUCCESS;
     cl_event startEvent = nullptr;
 
@@ -2153,18 +6403,68 @@ cl_int CL_API_CALL clEnqueueCommandBufferKHR_EMU(
         }
     }
 
+    // Commands on the other queues must also wait for the event wait list.
+    // If there is a start event, it already waits for the event wait list.
+    for( cl_uint q = 1; q < numQueues && errorCode == CL_SUCCESS; q++ )
+    {
+        if( startEvent != nullptr )
+        {
+            errorCode = g_pNextDispatch->clEnqueueBarrierWithWaitList(
+                replayQueues[q],
+                1,
+                &startEvent,
+                nullptr );
+        }
+        else if( num_events_in_wait_list )
+        {
+            errorCode = g_pNextDispatch->clEnqueueBarrierWithWaitList(
+                replayQueues[q],
+                num_events_in_wait_list,
+                event_wait_list,
+                nullptr );
+        }
+    }
+
     if( errorCode == CL_SUCCESS )
     {
-        errorCode = cmdbuf->replay(queue);
+        errorCode = cmdbuf->replay(replayQueues);
     }
 
     if( errorCode == CL_SUCCESS && event )
     {
-        errorCode = g_pNextDispatch->clEnqueueBarrierWithWaitList(
-            queue,
-            0,
-            nullptr,
-            g_KernelForProfiling ? nullptr : event );
+        // The command buffer is complete when the commands on all of the
+        // queues are complete, so join the other queues into the first
+        // queue before signaling the event.
+        std::vector<cl_event> joinEvents;
+        if( numQueues > 1 )
+        {
+            joinEvents.reserve(numQueues - 1);
+        }
+        for( cl_uint q = 1; q < numQueues && errorCode == CL_SUCCESS; q++ )
+        {
+            cl_event joinEvent = nullptr;
+            errorCode = g_pNextDispatch->clEnqueueMarkerWithWaitList(
+                replayQueues[q],
+                0,
+                nullptr,
+                &joinEvent );
+            if( errorCode == CL_SUCCESS )
+            {
+                joinEvents.push_back(joinEvent);
+            }
+        }
+        if( errorCode == CL_SUCCESS )
+        {
+            errorCode = g_pNextDispatch->clEnqueueBarrierWithWaitList(
+                queue,
+                static_cast<cl_uint>(joinEvents.size()),
+                joinEvents.empty() ? nullptr : joinEvents.data(),
+                g_KernelForProfiling ? nullptr : event );
+        }
+        for( auto joinEvent : joinEvents )
+        {
+            g_pNextDispatch->clReleaseEvent(joinEvent);
+        }
         if( errorCode == CL_SUCCESS && g_KernelForProfiling )
         {
             errorCode = enqueueProfilingKernel(
@@ -2180,7 +6480,7 @@ cl_int CL_API_CALL clEnqueueCommandBufferKHR_EMU(
     {
         if( errorCode == CL_SUCCESS )
         {
-            getLayerContext().EventMap[event[0]] = startEvent;
+            getLayerContext().EventMap.insert(event[0], startEvent);
         }
         else
         {
@@ -2235,7 +6535,22 @@ cl_int CL_API_CALL clCommandBarrierWithWaitListKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandBarrierWithWaitListKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2275,18 +6590,17 @@ cl_int CL_API_CALL clCommandCopyBufferKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueCopyBuffer(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateCopyBuffer(
+                queue,
                 src_buffer,
                 dst_buffer,
                 src_offset,
                 dst_offset,
-                size,
-                0,
-                nullptr,
-                nullptr ) )
+                size ) )
         {
             return errorCode;
         }
@@ -2305,7 +6619,27 @@ cl_int CL_API_CALL clCommandCopyBufferKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandCopyBufferKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                src_buffer,
+                dst_buffer,
+                src_offset,
+                dst_offset,
+                size,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2349,10 +6683,12 @@ cl_int CL_API_CALL clCommandCopyBufferRectKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueCopyBufferRect(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateCopyBufferRect(
+                queue,
                 src_buffer,
                 dst_buffer,
                 src_origin,
@@ -2361,10 +6697,7 @@ cl_int CL_API_CALL clCommandCopyBufferRectKHR_EMU(
                 src_row_pitch,
                 src_slice_pitch,
                 dst_row_pitch,
-                dst_slice_pitch,
-                0,
-                nullptr,
-                nullptr ) )
+                dst_slice_pitch ) )
         {
             return errorCode;
         }
@@ -2386,7 +6719,31 @@ cl_int CL_API_CALL clCommandCopyBufferRectKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandCopyBufferRectKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                src_buffer,
+                dst_buffer,
+                src_origin,
+                dst_origin,
+                region,
+                src_row_pitch,
+                src_slice_pitch,
+                dst_row_pitch,
+                dst_slice_pitch,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2426,18 +6783,17 @@ cl_int CL_API_CALL clCommandCopyBufferToImageKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueCopyBufferToImage(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateCopyBufferToImage(
+                queue,
                 src_buffer,
                 dst_image,
                 src_offset,
                 dst_origin,
-                region,
-                0,
-                nullptr,
-                nullptr ) )
+                region ) )
         {
             return errorCode;
         }
@@ -2455,7 +6811,27 @@ cl_int CL_API_CALL clCommandCopyBufferToImageKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandCopyBufferToImageKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                src_buffer,
+                dst_image,
+                src_offset,
+                dst_origin,
+                region,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2495,18 +6871,17 @@ cl_int CL_API_CALL clCommandCopyImageKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueCopyImage(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateCopyImage(
+                queue,
                 src_image,
                 dst_image,
                 src_origin,
                 dst_origin,
-                region,
-                0,
-                nullptr,
-                nullptr ) )
+                region ) )
         {
             return errorCode;
         }
@@ -2524,7 +6899,27 @@ cl_int CL_API_CALL clCommandCopyImageKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandCopyImageKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                src_image,
+                dst_image,
+                src_origin,
+                dst_origin,
+                region,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2564,18 +6959,17 @@ cl_int CL_API_CALL clCommandCopyImageToBufferKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueCopyImageToBuffer(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateCopyImageToBuffer(
+                queue,
                 src_image,
                 dst_buffer,
                 src_origin,
                 region,
-                dst_offset,
-                0,
-                nullptr,
-                nullptr ) )
+                dst_offset ) )
         {
             return errorCode;
         }
@@ -2593,7 +6987,27 @@ cl_int CL_API_CALL clCommandCopyImageToBufferKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandCopyImageToBufferKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                src_image,
+                dst_buffer,
+                src_origin,
+                region,
+                dst_offset,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2633,18 +7047,17 @@ cl_int CL_API_CALL clCommandFillBufferKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueFillBuffer(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateFillBuffer(
+                queue,
                 buffer,
                 pattern,
                 pattern_size,
                 offset,
-                size,
-                0,
-                nullptr,
-                nullptr ) )
+                size ) )
         {
             return errorCode;
         }
@@ -2662,7 +7075,27 @@ cl_int CL_API_CALL clCommandFillBufferKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandFillBufferKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                buffer,
+                pattern,
+                pattern_size,
+                offset,
+                size,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2701,17 +7134,16 @@ cl_int CL_API_CALL clCommandFillImageKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueFillImage(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateFillImage(
+                queue,
                 image,
                 fill_color,
                 origin,
-                region,
-                0,
-                nullptr,
-                nullptr ) )
+                region ) )
         {
             return errorCode;
         }
@@ -2728,7 +7160,26 @@ cl_int CL_API_CALL clCommandFillImageKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandFillImageKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                image,
+                fill_color,
+                origin,
+                region,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2766,17 +7217,12 @@ cl_int CL_API_CALL clCommandSVMMemcpyKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueSVMMemcpy(
-                testQueue,
-                CL_FALSE,
+        if( cl_int errorCode = validateSVMMemcpy(
                 dst_ptr,
                 src_ptr,
-                size,
-                0,
-                nullptr,
-                nullptr ) )
+                size ) )
         {
             return errorCode;
         }
@@ -2792,7 +7238,25 @@ cl_int CL_API_CALL clCommandSVMMemcpyKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandSVMMemcpyKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                dst_ptr,
+                src_ptr,
+                size,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2831,17 +7295,13 @@ cl_int CL_API_CALL clCommandSVMMemFillKHR_EMU(
     {
         return CL_INVALID_VALUE;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueSVMMemFill(
-                testQueue,
+        if( cl_int errorCode = validateSVMMemFill(
                 dst_ptr,
                 pattern,
                 pattern_size,
-                size,
-                0,
-                nullptr,
-                nullptr ) )
+                size ) )
         {
             return errorCode;
         }
@@ -2858,7 +7318,26 @@ cl_int CL_API_CALL clCommandSVMMemFillKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandSVMMemFillKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                dst_ptr,
+                pattern,
+                pattern_size,
+                size,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2890,25 +7369,20 @@ cl_int CL_API_CALL clCommandNDRangeKernelKHR_EMU(
     {
         return errorCode;
     }
-    if( cl_command_queue testQueue = cmdbuf->getTestQueue() )
+    if( g_EnhancedErrorChecking )
     {
-        if( cl_int errorCode = g_pNextDispatch->clEnqueueNDRangeKernel(
-                testQueue,
+        cl_command_queue queue =
+            command_queue ? command_queue : cmdbuf->getQueue();
+        if( cl_int errorCode = validateNDRangeKernel(
+                queue,
                 kernel,
                 work_dim,
                 global_work_offset,
                 global_work_size,
                 local_work_size,
-                0,
-                nullptr,
-                nullptr ) )
+                mutable_handle != nullptr ) )
         {
-            // Ignore CL_INVALID_KERNEL_ARGS errors if this is a mutable
-            // command in order to handle deferred kernel arguments.
-            if( !( errorCode == CL_INVALID_KERNEL_ARGS && mutable_handle ) )
-            {
-                return errorCode;
-            }
+            return errorCode;
         }
     }
 
@@ -2936,7 +7410,27 @@ cl_int CL_API_CALL clCommandNDRangeKernelKHR_EMU(
         num_sync_points_in_wait_list,
         sync_point_wait_list,
         sync_point,
-        mutable_handle);
+        mutable_handle,
+        [&]( const SNativeCommandBufferFunctions& native,
+             cl_command_buffer_khr nativeCmdBuf,
+             cl_uint numSyncPoints,
+             const cl_sync_point_khr* syncPointWaitList,
+             cl_sync_point_khr* syncPoint )
+        {
+            return native.clCommandNDRangeKernelKHR(
+                nativeCmdBuf,
+                command_queue,
+                properties,
+                kernel,
+                work_dim,
+                global_work_offset,
+                global_work_size,
+                local_work_size,
+                numSyncPoints,
+                syncPointWaitList,
+                syncPoint,
+                nullptr );
+        });
     return CL_SUCCESS;
 }
 
@@ -2955,80 +7449,429 @@ cl_int CL_API_CALL clGetCommandBufferInfoKHR_EMU(
         return CL_INVALID_COMMAND_BUFFER_KHR;
     }
 
-    return cmdbuf->getInfo(
-        param_name,
-        param_value_size,
-        param_value,
-        param_value_size_ret);
-}
+    return cmdbuf->getInfo(
+        param_name,
+        param_value_size,
+        param_value,
+        param_value_size_ret);
+}
+
+#if defined(cl_khr_command_buffer_multi_device)
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// cl_khr_command_buffer_multi_device
+cl_command_buffer_khr CL_API_CALL clRemapCommandBufferKHR_EMU(
+    cl_command_buffer_khr cmdbuf,
+    cl_bool automatic,
+    cl_uint num_queues,
+    const cl_command_queue* queues,
+    cl_uint num_handles,
+    const cl_mutable_command_khr* handles,
+    cl_mutable_command_khr* handles_ret,
+    cl_int* errcode_ret)
+{
+    if( !CommandBuffer::isValid(cmdbuf) )
+    {
+        if( errcode_ret )
+        {
+            errcode_ret[0] = CL_INVALID_COMMAND_BUFFER_KHR;
+        }
+        return nullptr;
+    }
+
+    return cmdbuf->remap(
+        automatic,
+        num_queues,
+        queues,
+        num_handles,
+        handles,
+        handles_ret,
+        errcode_ret);
+}
+
+#endif // defined(cl_khr_command_buffer_multi_device)
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Command buffer binaries (layer-specific)
+cl_int CL_API_CALL clGetCommandBufferBinaryEXP_EMU(
+    cl_command_buffer_khr cmdbuf,
+    cl_uint num_mem_objects,
+    const cl_mem* mem_objects,
+    cl_uint num_kernels,
+    const cl_kernel* kernels,
+    cl_uint num_handles,
+    const cl_mutable_command_khr* handles,
+    size_t binary_size,
+    void* binary,
+    size_t* binary_size_ret)
+{
+    if( !CommandBuffer::isValid(cmdbuf) )
+    {
+        return CL_INVALID_COMMAND_BUFFER_KHR;
+    }
+    for( cl_uint h = 0; handles && h < num_handles; h++ )
+    {
+        if( !Command::isValid(handles[h]) || handles[h]->getCmdBuf() != cmdbuf )
+        {
+            return CL_INVALID_MUTABLE_COMMAND_KHR;
+        }
+    }
+
+    return cmdbuf->getBinary(
+        num_mem_objects,
+        mem_objects,
+        num_kernels,
+        kernels,
+        num_handles,
+        handles,
+        binary_size,
+        binary,
+        binary_size_ret);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Command buffer binaries (layer-specific)
+cl_command_buffer_khr CL_API_CALL clCreateCommandBufferWithBinaryEXP_EMU(
+    cl_uint num_queues,
+    const cl_command_queue* queues,
+    size_t binary_size,
+    const void* binary,
+    cl_uint num_mem_objects,
+    const cl_mem* mem_objects,
+    cl_uint num_kernels,
+    const cl_kernel* kernels,
+    cl_uint num_handles,
+    cl_mutable_command_khr* handles_ret,
+    cl_int* errcode_ret)
+{
+    return CommandBuffer::createWithBinary(
+        num_queues,
+        queues,
+        binary_size,
+        binary,
+        num_mem_objects,
+        mem_objects,
+        num_kernels,
+        kernels,
+        num_handles,
+        handles_ret,
+        errcode_ret);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// cl_khr_command_buffer_mutable_dispatch
+cl_int CL_API_CALL clUpdateMutableCommandsKHR_EMU(
+    cl_command_buffer_khr cmdbuf,
+    cl_uint num_configs,
+    const cl_command_buffer_update_type_khr* config_types,
+    const void** configs )
+{
+    if( !CommandBuffer::isValid(cmdbuf) )
+    {
+        return CL_INVALID_COMMAND_BUFFER_KHR;
+    }
+    if( cl_int errorCode = cmdbuf->mutate(
+            num_configs,
+            config_types,
+            configs ) )
+    {
+        return errorCode;
+    }
+
+    return CL_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// cl_khr_command_buffer_mutable_dispatch
+cl_int CL_API_CALL clGetMutableCommandInfoKHR_EMU(
+    cl_mutable_command_khr command,
+    cl_mutable_command_info_khr param_name,
+    size_t param_value_size,
+    void* param_value,
+    size_t* param_value_size_ret)
+{
+    if( !Command::isValid(command) )
+    {
+        return CL_INVALID_MUTABLE_COMMAND_KHR;
+    }
+
+    return command->getInfo(
+        param_name,
+        param_value_size,
+        param_value,
+        param_value_size_ret);
+}
+
+static void initDeviceInfo(
+    cl_device_id device,
+    SDeviceInfo& info )
+{
+    size_t  size = 0;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_VERSION,
+        0,
+        nullptr,
+        &size );
+
+    std::vector<char> deviceVersion(size);
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_VERSION,
+        size,
+        deviceVersion.data(),
+        nullptr );
+
+    bool supportsEmulation =
+        getOpenCLVersionFromString(
+            deviceVersion.data() ) >= CL_MAKE_VERSION(2, 1, 0);
+
+    {
+        size = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS,
+            0,
+            nullptr,
+            &size );
+
+        std::vector<char> deviceExtensions(size);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS,
+            size,
+            deviceExtensions.data(),
+            nullptr );
+
+        info.HasNativeCommandBuffer =
+            checkStringForExtension(
+                deviceExtensions.data(),
+                CL_KHR_COMMAND_BUFFER_EXTENSION_NAME );
+        if( info.HasNativeCommandBuffer )
+        {
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR,
+                sizeof(info.NativeCommandBufferCapabilities),
+                &info.NativeCommandBufferCapabilities,
+                nullptr );
+        }
+
+        if( supportsEmulation && info.HasNativeCommandBuffer == false )
+        {
+            std::string newExtensions;
+            newExtensions += CL_KHR_COMMAND_BUFFER_EXTENSION_NAME;
+            newExtensions += ' ';
+            newExtensions += CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_NAME;
+#if defined(cl_khr_command_buffer_multi_device)
+            newExtensions += ' ';
+            newExtensions += CL_KHR_COMMAND_BUFFER_MULTI_DEVICE_EXTENSION_NAME;
+#endif // defined(cl_khr_command_buffer_multi_device)
+
+            std::string oldExtensions(deviceExtensions.data());
+
+            // If the old extension string ends with a space ensure the
+            // new extension string does too.
+            if( oldExtensions.back() == ' ' )
+            {
+                newExtensions += ' ';
+            }
+            else
+            {
+                oldExtensions += ' ';
+            }
+
+            oldExtensions += newExtensions;
+
+            info.OverrideExtensions = true;
+            info.Extensions = oldExtensions;
+        }
+    }
+
+    {
+        size = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS_WITH_VERSION,
+            0,
+            nullptr,
+            &size );
+
+        size_t  numExtensions = size / sizeof(cl_name_version);
+        std::vector<cl_name_version>    extensions(numExtensions);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS_WITH_VERSION,
+            size,
+            extensions.data(),
+            nullptr );
+
+        bool found = false;
+        for( const auto& extension : extensions )
+        {
+            if( strcmp(extension.name, CL_KHR_COMMAND_BUFFER_EXTENSION_NAME) == 0 )
+            {
+                found = true;
+                break;
+            }
+        }
+
+        if( supportsEmulation && found == false )
+        {
+            {
+                extensions.emplace_back();
+                cl_name_version& extension = extensions.back();
+
+                memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+                strcpy(extension.name, CL_KHR_COMMAND_BUFFER_EXTENSION_NAME);
+
+                extension.version = version_cl_khr_command_buffer;
+            }
+            {
+                extensions.emplace_back();
+                cl_name_version& extension = extensions.back();
+
+                memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+                strcpy(extension.name, CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_NAME);
+
+                extension.version = version_cl_khr_command_buffer_mutable_dispatch;
+            }
+#if defined(cl_khr_command_buffer_multi_device)
+            {
+                extensions.emplace_back();
+                cl_name_version& extension = extensions.back();
+
+                memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+                strcpy(extension.name, CL_KHR_COMMAND_BUFFER_MULTI_DEVICE_EXTENSION_NAME);
+
+                extension.version = version_cl_khr_command_buffer_multi_device;
+            }
+#endif // defined(cl_khr_command_buffer_multi_device)
+
+            info.OverrideExtensionsWithVersion = true;
+            info.ExtensionsWithVersion = std::move(extensions);
+        }
+    }
+
+    {
+        cl_device_command_buffer_capabilities_khr caps =
+            CL_COMMAND_BUFFER_CAPABILITY_KERNEL_PRINTF_KHR |
+            CL_COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR;
+
+        cl_device_device_enqueue_capabilities dseCaps = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES,
+            sizeof(dseCaps),
+            &dseCaps,
+            nullptr );
+        if( dseCaps != 0 )
+        {
+            caps |= CL_COMMAND_BUFFER_CAPABILITY_DEVICE_SIDE_ENQUEUE_KHR;
+        }
+
+#if defined(cl_khr_command_buffer_multi_device)
+        caps |= CL_COMMAND_BUFFER_CAPABILITY_MULTIPLE_QUEUE_KHR;
+#endif // defined(cl_khr_command_buffer_multi_device)
+
+        info.CommandBufferCapabilities = caps;
+    }
+
+    {
+        cl_command_queue_properties cqProps = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_QUEUE_PROPERTIES,
+            sizeof(cqProps),
+            &cqProps,
+            nullptr );
+
+        cl_command_queue_properties cbProps = 0;
+        if(cqProps & CL_QUEUE_PROFILING_ENABLE)
+        {
+            cbProps |= CL_QUEUE_PROFILING_ENABLE;
+        }
 
-#if defined(cl_khr_command_buffer_multi_device) && 0
+        if(cqProps & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+        {
+            cbProps |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+        }
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// cl_khr_command_buffer_multi_device
-cl_command_buffer_khr CL_API_CALL clRemapCommandBufferKHR_EMU(
-    cl_command_buffer_khr command_buffer,
-    cl_bool automatic,
-    cl_uint num_queues,
-    const cl_command_queue* queues,
-    cl_uint num_handles,
-    const cl_mutable_command_khr* handles,
-    cl_mutable_command_khr* handles_ret,
-    cl_int* errcode_ret)
-{
-    if (errcode_ret) {
-        errcode_ret[0] = CL_OUT_OF_HOST_MEMORY;
+        info.SupportedQueueProperties = cbProps;
     }
-    return nullptr;
-}
 
+#if defined(cl_khr_command_buffer_multi_device)
+    {
+        // Emulated command buffers synchronize using events, so any
+        // device in the platform may synchronize with this device.
+        cl_platform_id platform = nullptr;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_PLATFORM,
+            sizeof(platform),
+            &platform,
+            nullptr );
+
+        cl_uint numDevices = 0;
+        g_pNextDispatch->clGetDeviceIDs(
+            platform,
+            CL_DEVICE_TYPE_ALL,
+            0,
+            nullptr,
+            &numDevices );
+
+        info.SyncDevices.resize(numDevices);
+        g_pNextDispatch->clGetDeviceIDs(
+            platform,
+            CL_DEVICE_TYPE_ALL,
+            numDevices,
+            info.SyncDevices.data(),
+            nullptr );
+    }
 #endif // defined(cl_khr_command_buffer_multi_device)
+}
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// cl_khr_command_buffer_mutable_dispatch
-cl_int CL_API_CALL clUpdateMutableCommandsKHR_EMU(
-    cl_command_buffer_khr cmdbuf,
-    cl_uint num_configs,
-    const cl_command_buffer_update_type_khr* config_types,
-    const void** configs )
+// Returns the overridden device info for a device.  The device info for a
+// root device is computed the first time it is needed and cached.
+static std::shared_ptr<const SDeviceInfo> getDeviceInfo(
+    cl_device_id device )
 {
-    if( !CommandBuffer::isValid(cmdbuf) )
-    {
-        return CL_INVALID_COMMAND_BUFFER_KHR;
-    }
-    if( cl_int errorCode = cmdbuf->mutate(
-            num_configs,
-            config_types,
-            configs ) )
+    auto& context = getLayerContext();
     {
-        return errorCode;
+        std::lock_guard<std::mutex> lock(context.DeviceInfoMutex);
+        auto it = context.DeviceInfoMap.find(device);
+        if( it != context.DeviceInfoMap.end() )
+        {
+            return it->second;
+        }
     }
 
-    return CL_SUCCESS;
-}
+    cl_device_id parentDevice = nullptr;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_PARENT_DEVICE,
+        sizeof(parentDevice),
+        &parentDevice,
+        nullptr );
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// cl_khr_command_buffer_mutable_dispatch
-cl_int CL_API_CALL clGetMutableCommandInfoKHR_EMU(
-    cl_mutable_command_khr command,
-    cl_mutable_command_info_khr param_name,
-    size_t param_value_size,
-    void* param_value,
-    size_t* param_value_size_ret)
-{
-    if( !Command::isValid(command) )
+    auto info = std::make_shared<SDeviceInfo>();
+    initDeviceInfo(device, *info);
+
+    if( parentDevice == nullptr )
     {
-        return CL_INVALID_MUTABLE_COMMAND_KHR;
+        // If another thread computed the device info first, use it instead.
+        std::lock_guard<std::mutex> lock(context.DeviceInfoMutex);
+        auto result = context.DeviceInfoMap.insert(
+            std::make_pair(device, info));
+        return result.first->second;
     }
 
-    return command->getInfo(
-        param_name,
-        param_value_size,
-        param_value,
-        param_value_size_ret);
+    return info;
 }
 
 bool clGetDeviceInfo_override(
@@ -3042,68 +7885,13 @@ bool clGetDeviceInfo_override(
     switch(param_name) {
     case CL_DEVICE_EXTENSIONS:
         {
-            size_t  size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS,
-                0,
-                nullptr,
-                &size );
-
-            std::vector<char> deviceExtensions(size);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS,
-                size,
-                deviceExtensions.data(),
-                nullptr );
-
-            size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_VERSION,
-                0,
-                nullptr,
-                &size );
-
-            std::vector<char> deviceVersion(size);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_VERSION,
-                size,
-                deviceVersion.data(),
-                nullptr );
-
-            if( checkStringForExtension(
-                    deviceExtensions.data(),
-                    CL_KHR_COMMAND_BUFFER_EXTENSION_NAME ) == false &&
-                getOpenCLVersionFromString(
-                    deviceVersion.data() ) >= CL_MAKE_VERSION(2, 1, 0))
+            auto info = getDeviceInfo(device);
+            if( info->OverrideExtensions )
             {
-                std::string newExtensions;
-                newExtensions += CL_KHR_COMMAND_BUFFER_EXTENSION_NAME;
-                newExtensions += ' ';
-                newExtensions += CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_NAME;
-
-                std::string oldExtensions(deviceExtensions.data());
-
-                // If the old extension string ends with a space ensure the
-                // new extension string does too.
-                if( oldExtensions.back() == ' ' )
-                {
-                    newExtensions += ' ';
-                }
-                else
-                {
-                    oldExtensions += ' ';
-                }
-
-                oldExtensions += newExtensions;
-
                 auto ptr = (char*)param_value;
                 cl_int errorCode = writeStringToMemory(
                     param_value_size,
-                    oldExtensions.c_str(),
+                    info->Extensions.c_str(),
                     param_value_size_ret,
                     ptr );
 
@@ -3117,76 +7905,13 @@ bool clGetDeviceInfo_override(
         break;
     case CL_DEVICE_EXTENSIONS_WITH_VERSION:
         {
-            size_t  size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS_WITH_VERSION,
-                0,
-                nullptr,
-                &size );
-
-            size_t  numExtensions = size / sizeof(cl_name_version);
-            std::vector<cl_name_version>    extensions(numExtensions);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS_WITH_VERSION,
-                size,
-                extensions.data(),
-                nullptr );
-
-            size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_VERSION,
-                0,
-                nullptr,
-                &size );
-
-            std::vector<char> deviceVersion(size);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_VERSION,
-                size,
-                deviceVersion.data(),
-                nullptr );
-
-            bool found = false;
-            for( const auto& extension : extensions )
-            {
-                if( strcmp(extension.name, CL_KHR_COMMAND_BUFFER_EXTENSION_NAME) == 0 )
-                {
-                    found = true;
-                    break;
-                }
-            }
-
-            if( found == false &&
-                getOpenCLVersionFromString(
-                    deviceVersion.data() ) >= CL_MAKE_VERSION(2, 1, 0))
+            auto info = getDeviceInfo(device);
+            if( info->OverrideExtensionsWithVersion )
             {
-                {
-                    extensions.emplace_back();
-                    cl_name_version& extension = extensions.back();
-
-                    memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
-                    strcpy(extension.name, CL_KHR_COMMAND_BUFFER_EXTENSION_NAME);
-
-                    extension.version = version_cl_khr_command_buffer;
-                }
-                {
-                    extensions.emplace_back();
-                    cl_name_version& extension = extensions.back();
-
-                    memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
-                    strcpy(extension.name, CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_NAME);
-
-                    extension.version = version_cl_khr_command_buffer_mutable_dispatch;
-                }
-
                 auto ptr = (cl_name_version*)param_value;
                 cl_int errorCode = writeVectorToMemory(
                     param_value_size,
-                    extensions,
+                    info->ExtensionsWithVersion,
                     param_value_size_ret,
                     ptr );
 
@@ -3200,21 +7925,9 @@ bool clGetDeviceInfo_override(
         break;
     case CL_DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR:
         {
+            auto info = getDeviceInfo(device);
             cl_device_command_buffer_capabilities_khr caps =
-                CL_COMMAND_BUFFER_CAPABILITY_KERNEL_PRINTF_KHR |
-                CL_COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR;
-
-            cl_device_device_enqueue_capabilities dseCaps = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES,
-                sizeof(dseCaps),
-                &dseCaps,
-                nullptr );
-            if( dseCaps != 0 )
-            {
-                caps |= CL_COMMAND_BUFFER_CAPABILITY_DEVICE_SIDE_ENQUEUE_KHR;
-            }
+                info->CommandBufferCapabilities;
 
             auto ptr = (cl_device_command_buffer_capabilities_khr*)param_value;
             cl_int errorCode = writeParamToMemory(
@@ -3232,24 +7945,9 @@ bool clGetDeviceInfo_override(
         break;
     case CL_DEVICE_COMMAND_BUFFER_SUPPORTED_QUEUE_PROPERTIES_KHR:
         {
-            cl_command_queue_properties cqProps = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_QUEUE_PROPERTIES,
-                sizeof(cqProps),
-                &cqProps,
-                nullptr );
-
-            cl_command_queue_properties cbProps = 0;
-            if(cqProps & CL_QUEUE_PROFILING_ENABLE)
-            {
-                cbProps |= CL_QUEUE_PROFILING_ENABLE;
-            }
-
-            if(cqProps & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
-            {
-                cbProps |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
-            }
+            auto info = getDeviceInfo(device);
+            cl_command_queue_properties cbProps =
+                info->SupportedQueueProperties;
 
             auto ptr = (cl_command_queue_properties*)param_value;
             cl_int errorCode = writeParamToMemory(
@@ -3284,6 +7982,42 @@ bool clGetDeviceInfo_override(
             return true;
         }
         break;
+#if defined(cl_khr_command_buffer_multi_device)
+    case CL_DEVICE_COMMAND_BUFFER_NUM_SYNC_DEVICES_KHR:
+    case CL_DEVICE_COMMAND_BUFFER_SYNC_DEVICES_KHR:
+        {
+            auto info = getDeviceInfo(device);
+            const auto& devices = info->SyncDevices;
+            cl_uint numDevices = static_cast<cl_uint>(devices.size());
+
+            cl_int errorCode = CL_SUCCESS;
+            if( param_name == CL_DEVICE_COMMAND_BUFFER_NUM_SYNC_DEVICES_KHR )
+            {
+                auto ptr = (cl_uint*)param_value;
+                errorCode = writeParamToMemory(
+                    param_value_size,
+                    numDevices,
+                    param_value_size_ret,
+                    ptr );
+            }
+            else
+            {
+                auto ptr = (cl_device_id*)param_value;
+                errorCode = writeVectorToMemory(
+                    param_value_size,
+                    devices,
+                    param_value_size_ret,
+                    ptr );
+            }
+
+            if( errcode_ret )
+            {
+                errcode_ret[0] = errorCode;
+            }
+            return true;
+        }
+        break;
+#endif // defined(cl_khr_command_buffer_multi_device)
     case CL_DEVICE_MUTABLE_DISPATCH_CAPABILITIES_KHR:
         {
             cl_mutable_dispatch_fields_khr caps =
@@ -3321,8 +8055,8 @@ bool clGetEventInfo_override(
     case CL_EVENT_COMMAND_TYPE:
         {
             auto& context = getLayerContext();
-            auto it = context.EventMap.find(event);
-            if (it != context.EventMap.end()) {
+            cl_event startEvent = nullptr;
+            if (context.EventMap.find(event, startEvent)) {
                 cl_command_type type = CL_COMMAND_COMMAND_BUFFER_KHR;
                 auto ptr = (cl_command_type*)param_value;
                 cl_int errorCode = writeParamToMemory(
@@ -3358,10 +8092,10 @@ bool clGetEventProfilingInfo_override(
     case CL_PROFILING_COMMAND_START:
         {
             auto& context = getLayerContext();
-            auto it = context.EventMap.find(event);
-            if (it != context.EventMap.end()) {
+            cl_event startEvent = nullptr;
+            if (context.EventMap.find(event, startEvent)) {
                 cl_int errorCode = g_pNextDispatch->clGetEventProfilingInfo(
-                    it->second,
+                    startEvent,
                     param_name,
                     param_value_size,
                     param_value,
@@ -3433,6 +8167,10 @@ bool clGetPlatformInfo_override(
                 newExtensions += CL_KHR_COMMAND_BUFFER_EXTENSION_NAME;
                 newExtensions += ' ';
                 newExtensions += CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_NAME;
+#if defined(cl_khr_command_buffer_multi_device)
+                newExtensions += ' ';
+                newExtensions += CL_KHR_COMMAND_BUFFER_MULTI_DEVICE_EXTENSION_NAME;
+#endif // defined(cl_khr_command_buffer_multi_device)
 
                 std::string oldExtensions(platformExtensions.data());
 
@@ -3531,6 +8269,17 @@ bool clGetPlatformInfo_override(
 
                     extension.version = version_cl_khr_command_buffer_mutable_dispatch;
                 }
+#if defined(cl_khr_command_buffer_multi_device)
+                {
+                    extensions.emplace_back();
+                    cl_name_version& extension = extensions.back();
+
+                    memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+                    strcpy(extension.name, CL_KHR_COMMAND_BUFFER_MULTI_DEVICE_EXTENSION_NAME);
+
+                    extension.version = version_cl_khr_command_buffer_multi_device;
+                }
+#endif // defined(cl_khr_command_buffer_multi_device)
 
                 auto ptr = (cl_name_version*)param_value;
                 cl_int errorCode = writeVectorToMemory(
@@ -3547,6 +8296,29 @@ bool clGetPlatformInfo_override(
             }
         }
         break;
+#if defined(cl_khr_command_buffer_multi_device)
+    case CL_PLATFORM_COMMAND_BUFFER_CAPABILITIES_KHR:
+        {
+            cl_platform_command_buffer_capabilities_khr caps =
+                CL_COMMAND_BUFFER_PLATFORM_UNIVERSAL_SYNC_KHR |
+                CL_COMMAND_BUFFER_PLATFORM_REMAP_QUEUES_KHR |
+                CL_COMMAND_BUFFER_PLATFORM_AUTOMATIC_REMAP_KHR;
+
+            auto ptr = (cl_platform_command_buffer_capabilities_khr*)param_value;
+            cl_int errorCode = writeParamToMemory(
+                param_value_size,
+                caps,
+                param_value_size_ret,
+                ptr );
+
+            if( errcode_ret )
+            {
+                errcode_ret[0] = errorCode;
+            }
+            return true;
+        }
+        break;
+#endif // defined(cl_khr_command_buffer_multi_device)
     default: break;
     }
     return false;
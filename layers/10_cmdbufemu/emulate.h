@@ -8,21 +8,124 @@
 #include <CL/cl_ext.h>
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sharded_map.hpp"
 
 extern bool g_EnhancedErrorChecking;
 extern bool g_KernelForProfiling;
 extern bool g_SuggestedLocalWorkSize;
+extern bool g_RemoveRedundantBarriers;
+extern bool g_PruneSyncPoints;
+extern bool g_MergeCommands;
+extern bool g_InOrderEventChain;
+extern bool g_InferDependencies;
+extern bool g_ShareKernelClones;
+extern bool g_CommandBufferBinaries;
+extern bool g_PreferNative;
+extern std::string g_CommandProfilingFile;
 
 extern const struct _cl_icd_dispatch* g_pNextDispatch;
 
+// Kinds of kernel arguments, determined when a kernel argument is set.
+// Kernel arguments that are handles to other objects, such as samplers,
+// cannot be stored in a command buffer binary.
+static constexpr uint8_t cKernelArgValue = 0;
+static constexpr uint8_t cKernelArgMemObject = 1;
+static constexpr uint8_t cKernelArgHandle = 2;
+static constexpr uint8_t cKernelArgUnknown = 3;
+
+struct SKernelArg
+{
+    bool    IsSet = false;
+    bool    IsSVMPointer = false;
+    uint8_t Kind = cKernelArgUnknown;
+    size_t  Size = 0;
+    std::vector<uint8_t>    Value;
+};
+
+struct SKernelInfo
+{
+    std::vector<SKernelArg> Args;
+    bool    HasExecInfo = false;
+};
+
+// Overridden device info, computed once per device.
+struct SDeviceInfo
+{
+    bool    OverrideExtensions = false;
+    std::string Extensions;
+
+    bool    OverrideExtensionsWithVersion = false;
+    std::vector<cl_name_version>    ExtensionsWithVersion;
+
+    cl_device_command_buffer_capabilities_khr   CommandBufferCapabilities = 0;
+    cl_command_queue_properties SupportedQueueProperties = 0;
+
+    std::vector<cl_device_id>   SyncDevices;
+
+    // Native command buffer support, used when native command buffers are
+    // preferred.
+    bool    HasNativeCommandBuffer = false;
+    cl_device_command_buffer_capabilities_khr   NativeCommandBufferCapabilities = 0;
+};
+
 struct SLayerContext
 {
-    typedef std::map<cl_event, cl_event> CEventMap;
+    typedef CShardedMap<cl_event, cl_event> CEventMap;
     CEventMap EventMap;
+
+    // Command-queue properties, erased when the command-queue is released.
+    typedef CShardedMap<cl_command_queue, cl_command_queue_properties>
+        CQueuePropertiesMap;
+    CQueuePropertiesMap QueuePropertiesMap;
+
+    // Device info for root devices.  Sub-device handles may be reused after
+    // the sub-device is released, so sub-device info is not cached.
+    typedef std::map<cl_device_id, std::shared_ptr<const SDeviceInfo>>
+        CDeviceInfoMap;
+    std::mutex  DeviceInfoMutex;
+    CDeviceInfoMap  DeviceInfoMap;
+
+    // Kernel arguments, tracked only when dependencies are inferred, kernel
+    // clones are shared, command buffer binaries are enabled, or enhanced
+    // error checking is enabled.
+    typedef std::map<cl_kernel, SKernelInfo> CKernelInfoMap;
+    std::mutex  KernelInfoMutex;
+    CKernelInfoMap  KernelInfoMap;
 };
 
 SLayerContext& getLayerContext(void);
 
+///////////////////////////////////////////////////////////////////////////////
+// Kernel Argument Tracking
+
+inline bool isTrackingKernelArgs()
+{
+    return g_InferDependencies || g_ShareKernelClones ||
+        g_CommandBufferBinaries || g_EnhancedErrorChecking;
+}
+
+void trackKernelArg(
+    cl_kernel kernel,
+    cl_uint arg_index,
+    size_t arg_size,
+    const void* arg_value,
+    bool is_svm_pointer);
+
+void trackKernelExecInfo(
+    cl_kernel kernel);
+
+void trackCloneKernel(
+    cl_kernel source_kernel,
+    cl_kernel kernel);
+
+void untrackKernel(
+    cl_kernel kernel);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Emulated Functions
 
@@ -205,7 +308,7 @@ cl_int CL_API_CALL clGetCommandBufferInfoKHR_EMU(
     void* param_value,
     size_t* param_value_size_ret);
 
-#if defined(cl_khr_command_buffer_multi_device) && 0
+#if defined(cl_khr_command_buffer_multi_device)
 
 cl_command_buffer_khr CL_API_CALL clRemapCommandBufferKHR_EMU(
     cl_command_buffer_khr command_buffer,
@@ -219,6 +322,36 @@ cl_command_buffer_khr CL_API_CALL clRemapCommandBufferKHR_EMU(
 
 #endif // defined(cl_khr_command_buffer_multi_device)
 
+// These functions are specific to this layer and are not part of any
+// extension.  A command buffer binary stores memory objects and kernels as
+// indices into tables provided by the application, so a command buffer may be
+// created from a binary with different memory objects and kernels.
+
+cl_int CL_API_CALL clGetCommandBufferBinaryEXP_EMU(
+    cl_command_buffer_khr command_buffer,
+    cl_uint num_mem_objects,
+    const cl_mem* mem_objects,
+    cl_uint num_kernels,
+    const cl_kernel* kernels,
+    cl_uint num_handles,
+    const cl_mutable_command_khr* handles,
+    size_t binary_size,
+    void* binary,
+    size_t* binary_size_ret);
+
+cl_command_buffer_khr CL_API_CALL clCreateCommandBufferWithBinaryEXP_EMU(
+    cl_uint num_queues,
+    const cl_command_queue* queues,
+    size_t binary_size,
+    const void* binary,
+    cl_uint num_mem_objects,
+    const cl_mem* mem_objects,
+    cl_uint num_kernels,
+    const cl_kernel* kernels,
+    cl_uint num_handles,
+    cl_mutable_command_khr* handles_ret,
+    cl_int* errcode_ret);
+
 cl_int CL_API_CALL clUpdateMutableCommandsKHR_EMU(
     cl_command_buffer_khr command_buffer,
     cl_uint num_configs,
@@ -29,8 +29,8 @@
 #include "emulate.h"
 
 // Enhanced error checking can be used to catch additional errors when
-// commands are recorded into a command buffer, but relies on tricky
-// use of user events that may not work properly with some implementations.
+// commands are recorded into a command buffer, such as out of bounds
+// buffer and image regions, at the cost of additional queries.
 
 bool g_EnhancedErrorChecking = false;
 
@@ -45,6 +45,66 @@ bool g_KernelForProfiling = false;
 
 bool g_SuggestedLocalWorkSize = true;
 
+// Removing redundant barriers when a command buffer is finalized can reduce
+// the number of commands enqueued each time the command buffer is executed.
+
+bool g_RemoveRedundantBarriers = true;
+
+// Pruning sync points that are already implied by other sync points when a
+// command buffer is finalized can reduce the number of events each command
+// waits on when the command buffer is executed.
+
+bool g_PruneSyncPoints = true;
+
+// Merging adjacent fills or copies of contiguous buffer ranges when a command
+// buffer is finalized can reduce the number of commands enqueued each time
+// the command buffer is executed.
+
+bool g_MergeCommands = true;
+
+// Chaining commands with events rather than adding a barrier after every
+// command can reduce the number of commands enqueued when a command buffer
+// recorded for an in-order queue is executed on an out-of-order queue.
+
+bool g_InOrderEventChain = true;
+
+// Inferring dependencies from the memory objects each command reads and
+// writes allows independent commands in a command buffer recorded for an
+// in-order queue to execute concurrently when the command buffer is executed
+// on an out-of-order queue.  This requires tracking kernel arguments and
+// assumes kernels only access memory objects passed as kernel arguments.
+
+bool g_InferDependencies = false;
+
+// Sharing kernel clones between kernel commands in a command buffer that
+// record the same kernel with the same kernel arguments can reduce the
+// number of kernel objects created when a command buffer is recorded.  This
+// requires tracking kernel arguments.  Mutable commands clone the shared
+// kernel when their kernel arguments are first updated.
+
+bool g_ShareKernelClones = false;
+
+// Command buffer binaries require the kernel arguments for each kernel
+// command, so enabling command buffer binaries tracks kernel arguments and
+// stores a copy of the kernel arguments in each kernel command.
+
+bool g_CommandBufferBinaries = false;
+
+// Preferring native command buffers records commands into a native command
+// buffer as well as the emulated command buffer when the device supports
+// command buffers natively, and executes the native command buffer when every
+// command was supported natively.  Command buffers with multiple queues or
+// mutable commands are always emulated.
+
+bool g_PreferNative = false;
+
+// Setting a command profiling file captures the start and end time of each
+// command in a command buffer every time the command buffer is executed on a
+// queue with profiling enabled.  The aggregated times for each command are
+// appended to this file as CSV when the command buffer is released.
+
+std::string g_CommandProfilingFile;
+
 const struct _cl_icd_dispatch* g_pNextDispatch = NULL;
 
 static cl_int CL_API_CALL
@@ -142,8 +202,9 @@ clGetExtensionFunctionAddressForPlatform_layer(
     cl_platform_id platform,
     const char *   func_name)
 {
-    // For now, prefer the emulated functions, even if the extension is
-    // supported natively.  Eventually this should become smarter.
+    // Always return the emulated functions, even if the extension is
+    // supported natively.  When native command buffers are preferred the
+    // emulated functions forward to the native functions where possible.
     CHECK_RETURN_EXTENSION_FUNCTION( clCreateCommandBufferKHR );
     CHECK_RETURN_EXTENSION_FUNCTION( clFinalizeCommandBufferKHR );
     CHECK_RETURN_EXTENSION_FUNCTION( clRetainCommandBufferKHR );
@@ -162,13 +223,17 @@ clGetExtensionFunctionAddressForPlatform_layer(
     CHECK_RETURN_EXTENSION_FUNCTION( clCommandNDRangeKernelKHR );
     CHECK_RETURN_EXTENSION_FUNCTION( clGetCommandBufferInfoKHR );
 
-#if defined(cl_khr_command_buffer_multi_device) && 0
+#if defined(cl_khr_command_buffer_multi_device)
     CHECK_RETURN_EXTENSION_FUNCTION( clRemapCommandBufferKHR );
 #endif
 
     CHECK_RETURN_EXTENSION_FUNCTION( clUpdateMutableCommandsKHR );
     CHECK_RETURN_EXTENSION_FUNCTION( clGetMutableCommandInfoKHR );
 
+    // These functions are specific to this layer.
+    CHECK_RETURN_EXTENSION_FUNCTION( clGetCommandBufferBinaryEXP );
+    CHECK_RETURN_EXTENSION_FUNCTION( clCreateCommandBufferWithBinaryEXP );
+
     return g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
         platform,
         func_name);
@@ -206,25 +271,139 @@ static cl_int CL_API_CALL
 clReleaseEvent_layer(
     cl_event         event)
 {
-    cl_uint refCount = 0;
-    g_pNextDispatch->clGetEventInfo(
-        event,
-        CL_EVENT_REFERENCE_COUNT,
-        sizeof(refCount),
-        &refCount,
-        nullptr);
-    if (refCount == 1) {
-        auto& context = getLayerContext();
-        auto it = context.EventMap.find(event);
-        if (it != context.EventMap.end()) {
-            g_pNextDispatch->clReleaseEvent(it->second);
-            context.EventMap.erase(it);
+    // Most events are not command buffer events, so only query the
+    // reference count if there are command buffer events.
+    auto& context = getLayerContext();
+    if (!context.EventMap.empty()) {
+        cl_uint refCount = 0;
+        g_pNextDispatch->clGetEventInfo(
+            event,
+            CL_EVENT_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+        cl_event startEvent = nullptr;
+        if (refCount == 1 && context.EventMap.erase(event, &startEvent)) {
+            g_pNextDispatch->clReleaseEvent(startEvent);
         }
     }
 
     return g_pNextDispatch->clReleaseEvent(event);
 }
 
+static cl_int CL_API_CALL
+clReleaseCommandQueue_layer(
+    cl_command_queue command_queue)
+{
+    // Only query the reference count if properties have been cached for any
+    // command-queue, since the command-queue handle may be reused after the
+    // command-queue is released.
+    auto& context = getLayerContext();
+    if (!context.QueuePropertiesMap.empty()) {
+        cl_uint refCount = 0;
+        g_pNextDispatch->clGetCommandQueueInfo(
+            command_queue,
+            CL_QUEUE_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+        if (refCount == 1) {
+            context.QueuePropertiesMap.erase(command_queue);
+        }
+    }
+
+    return g_pNextDispatch->clReleaseCommandQueue(command_queue);
+}
+
+static cl_int CL_API_CALL
+clSetKernelArg_layer(
+    cl_kernel       kernel,
+    cl_uint         arg_index,
+    size_t          arg_size,
+    const void *    arg_value)
+{
+    cl_int  errorCode = g_pNextDispatch->clSetKernelArg(
+        kernel,
+        arg_index,
+        arg_size,
+        arg_value);
+    if (errorCode == CL_SUCCESS) {
+        trackKernelArg(
+            kernel,
+            arg_index,
+            arg_size,
+            arg_value,
+            false);
+    }
+
+    return errorCode;
+}
+
+static cl_int CL_API_CALL
+clSetKernelArgSVMPointer_layer(
+    cl_kernel       kernel,
+    cl_uint         arg_index,
+    const void *    arg_value)
+{
+    cl_int  errorCode = g_pNextDispatch->clSetKernelArgSVMPointer(
+        kernel,
+        arg_index,
+        arg_value);
+    if (errorCode == CL_SUCCESS) {
+        trackKernelArg(
+            kernel,
+            arg_index,
+            sizeof(arg_value),
+            &arg_value,
+            true);
+    }
+
+    return errorCode;
+}
+
+static cl_int CL_API_CALL
+clSetKernelExecInfo_layer(
+    cl_kernel            kernel,
+    cl_kernel_exec_info  param_name,
+    size_t               param_value_size,
+    const void *         param_value)
+{
+    cl_int  errorCode = g_pNextDispatch->clSetKernelExecInfo(
+        kernel,
+        param_name,
+        param_value_size,
+        param_value);
+    if (errorCode == CL_SUCCESS) {
+        trackKernelExecInfo(kernel);
+    }
+
+    return errorCode;
+}
+
+static cl_kernel CL_API_CALL
+clCloneKernel_layer(
+    cl_kernel   source_kernel,
+    cl_int *    errcode_ret)
+{
+    cl_kernel   kernel = g_pNextDispatch->clCloneKernel(
+        source_kernel,
+        errcode_ret);
+    if (kernel != nullptr) {
+        trackCloneKernel(source_kernel, kernel);
+    }
+
+    return kernel;
+}
+
+static cl_int CL_API_CALL
+clReleaseKernel_layer(
+    cl_kernel   kernel)
+{
+    untrackKernel(kernel);
+
+    return g_pNextDispatch->clReleaseKernel(kernel);
+}
+
 static struct _cl_icd_dispatch dispatch;
 static void _init_dispatch()
 {
@@ -233,7 +412,19 @@ static void _init_dispatch()
     dispatch.clGetEventProfilingInfo = clGetEventProfilingInfo_layer;
     dispatch.clGetExtensionFunctionAddressForPlatform = clGetExtensionFunctionAddressForPlatform_layer;
     dispatch.clGetPlatformInfo = clGetPlatformInfo_layer;
+    dispatch.clReleaseCommandQueue = clReleaseCommandQueue_layer;
     dispatch.clReleaseEvent = clReleaseEvent_layer;
+
+    // Kernel arguments only need to be tracked to infer dependencies, to
+    // share kernel clones, for command buffer binaries, or to check for
+    // unset kernel arguments.
+    if (isTrackingKernelArgs()) {
+        dispatch.clCloneKernel = clCloneKernel_layer;
+        dispatch.clReleaseKernel = clReleaseKernel_layer;
+        dispatch.clSetKernelArg = clSetKernelArg_layer;
+        dispatch.clSetKernelArgSVMPointer = clSetKernelArgSVMPointer_layer;
+        dispatch.clSetKernelExecInfo = clSetKernelExecInfo_layer;
+    }
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clGetLayerInfo(
@@ -299,11 +490,20 @@ CL_API_ENTRY cl_int CL_API_CALL clInitLayerWithProperties(
         return CL_INVALID_VALUE;
     }
 
-    _init_dispatch();
-
     getControl("CMDBUFEMU_EnhancedErrorChecking", g_EnhancedErrorChecking);
     getControl("CMDBUFEMU_KernelForProfiling", g_KernelForProfiling);
     getControl("CMDBUFEMU_SuggestedLocalWorkSize", g_SuggestedLocalWorkSize);
+    getControl("CMDBUFEMU_RemoveRedundantBarriers", g_RemoveRedundantBarriers);
+    getControl("CMDBUFEMU_PruneSyncPoints", g_PruneSyncPoints);
+    getControl("CMDBUFEMU_MergeCommands", g_MergeCommands);
+    getControl("CMDBUFEMU_InOrderEventChain", g_InOrderEventChain);
+    getControl("CMDBUFEMU_InferDependencies", g_InferDependencies);
+    getControl("CMDBUFEMU_ShareKernelClones", g_ShareKernelClones);
+    getControl("CMDBUFEMU_CommandBufferBinaries", g_CommandBufferBinaries);
+    getControl("CMDBUFEMU_PreferNative", g_PreferNative);
+    getControl("CMDBUFEMU_CommandProfilingFile", g_CommandProfilingFile);
+
+    _init_dispatch();
 
     g_pNextDispatch = target_dispatch;
 
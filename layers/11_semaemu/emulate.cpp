@@ -11,6 +11,11 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -26,6 +31,7 @@
 #define CL_SEMAPHORE_DEVICE_HANDLE_LIST_END_KHR 0
 #endif
 
+
 static constexpr cl_version version_cl_khr_semaphore =
     CL_MAKE_VERSION(1, 0, 0);
 
@@ -119,6 +125,12 @@ typedef struct _cl_semaphore_khr
                         {
                         case CL_SEMAPHORE_TYPE_BINARY_KHR:
                             break;
+                        case CL_SEMAPHORE_TYPE_TIMELINE_EXP:
+                            if( !g_TimelineSemaphores )
+                            {
+                                errorCode = CL_INVALID_PROPERTY;
+                            }
+                            break;
                         default:
                             errorCode = CL_INVALID_PROPERTY;
                             break;
@@ -229,299 +241,1203 @@ typedef struct _cl_semaphore_khr
         return semaphore && semaphore->Magic == cMagic;
     }
 
-    const cl_uint Magic;
-    const cl_context Context;
-    const cl_semaphore_type_khr Type;
-    std::vector<cl_semaphore_properties_khr> Properties;
-    std::vector<cl_device_id>   Devices;
-
-    std::atomic<cl_uint> RefCount;
-    cl_event Event;
-
-private:
-    static constexpr cl_uint cMagic = 0x53454d41;   // "SEMA"
-
-    _cl_semaphore_khr(cl_context context, cl_semaphore_type_khr type) :
-        Magic(cMagic),
-        Context(context),
-        Type(type),
-        RefCount(1),
-        Event(nullptr) {}
-} cli_semaphore;
-
-cl_semaphore_khr CL_API_CALL clCreateSemaphoreWithPropertiesKHR_EMU(
-    cl_context context,
-    const cl_semaphore_properties_khr *sema_props,
-    cl_int *errcode_ret)
-{
-    return cli_semaphore::create(
-        context,
-        sema_props,
-        errcode_ret);
-}
-
-cl_int CL_API_CALL clEnqueueWaitSemaphoresKHR_EMU(
-    cl_command_queue command_queue,
-    cl_uint num_semaphores,
-    const cl_semaphore_khr *semaphores,
-    const cl_semaphore_payload_khr *semaphore_payloads,
-    cl_uint num_events_in_wait_list,
-    const cl_event *event_wait_list,
-    cl_event *event)
-{
-    cl_int retVal = CL_SUCCESS;
-    if( num_semaphores == 0 )
+    ~_cl_semaphore_khr()
     {
-        return CL_INVALID_VALUE;
-    }
+        if( Event != nullptr )
+        {
+            g_pNextDispatch->clReleaseEvent(Event);
+        }
+        for( const auto& signal : Timeline )
+        {
+            g_pNextDispatch->clReleaseEvent(signal.second);
+        }
 
-    cl_context q_context = nullptr;
-    retVal = g_pNextDispatch->clGetCommandQueueInfo(
-        command_queue,
-        CL_QUEUE_CONTEXT,
-        sizeof(q_context),
-        &q_context,
-        nullptr);
-    if( retVal != CL_SUCCESS )
-    {
-        return retVal;
+        // Fail any waits that were never satisfied by a signal.
+        for( auto waitEvent : DeferredWaits )
+        {
+            completeDeferredWait(waitEvent, -1);
+        }
+        for( const auto& wait : DeferredTimelineWaits )
+        {
+            completeDeferredWait(wait.second, -1);
+        }
     }
 
-    if( (num_events_in_wait_list > 0 && event_wait_list == nullptr) ||
-        (num_events_in_wait_list == 0 && event_wait_list != nullptr) )
+    bool isTimeline() const
     {
-        return CL_INVALID_EVENT_WAIT_LIST;
+        return Type == CL_SEMAPHORE_TYPE_TIMELINE_EXP;
     }
 
-    for( cl_uint i = 0; i < num_events_in_wait_list; i++ )
+    // Gets the event to wait on for a timeline semaphore to reach a payload
+    // value.  The event is the event for the first signal with a payload
+    // value greater than or equal to the requested value, and the caller
+    // must release it.  If the semaphore already reached the payload value
+    // then the event is nullptr.  If no signal with a payload value greater
+    // than or equal to the requested value has been enqueued then the wait
+    // is deferred, and the event is a user event that is completed by a
+    // later signal.
+    cl_int getTimelineWaitEvent(
+        cl_semaphore_payload_khr payload,
+        cl_event& event,
+        bool& isDeferred )
     {
-        if( event_wait_list[i] == nullptr )
-        {
-            return CL_INVALID_EVENT_WAIT_LIST;
-        }
+        std::lock_guard<std::mutex> lock(Mutex);
+        pruneTimeline();
 
-        cl_context e_context = nullptr;
-        retVal = g_pNextDispatch->clGetEventInfo(
-            event_wait_list[i],
-            CL_EVENT_CONTEXT,
-            sizeof(e_context),
-            &e_context,
-            nullptr);
-        if( retVal != CL_SUCCESS )
+        event = nullptr;
+        isDeferred = false;
+        if( payload <= CompletedPayload )
         {
-            return retVal; // or CL_INVALID_EVENT_WAIT_LIST?
+            return CL_SUCCESS;
         }
-        if( q_context != e_context )
+
+        auto it = findTimelineSignal(payload);
+        if( it == Timeline.end() )
         {
-            return CL_INVALID_CONTEXT;
+            cl_int errorCode = createDeferredWait(event);
+            if( errorCode == CL_SUCCESS )
+            {
+                DeferredTimelineWaits.insert(std::make_pair(payload, event));
+                g_pNextDispatch->clRetainEvent(event);
+                isDeferred = true;
+            }
+            return errorCode;
         }
 
-        cl_int status = 0;
-        retVal = g_pNextDispatch->clGetEventInfo(
-            event_wait_list[i],
-            CL_EVENT_COMMAND_EXECUTION_STATUS,
-            sizeof(status),
-            &status,
-            nullptr);
-        if( retVal != CL_SUCCESS )
+        event = it->second;
+        g_pNextDispatch->clRetainEvent(event);
+        return CL_SUCCESS;
+    }
+
+    // Gets the event to wait on for a binary semaphore and resets the
+    // semaphore to the unsignaled state.  The caller must release the event.
+    // If the semaphore is not signaled then the wait is deferred, and the
+    // event is a user event that is completed by the next signal.
+    cl_int getBinaryWaitEvent(
+        cl_event& event,
+        bool& isDeferred )
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        isDeferred = false;
+        if( Event != nullptr )
         {
-            return retVal; // or CL_INVALID_EVENT_WAIT_LIST?
+            event = Event;
+            Event = nullptr;
+            return CL_SUCCESS;
         }
-        if( status < 0 )
+
+        cl_int errorCode = createDeferredWait(event);
+        if( errorCode == CL_SUCCESS )
         {
-            return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+            DeferredWaits.push_back(event);
+            g_pNextDispatch->clRetainEvent(event);
+            isDeferred = true;
         }
+        return errorCode;
     }
 
-    std::vector<cl_event> combinedWaitList;
-    combinedWaitList.insert(
-        combinedWaitList.end(),
-        event_wait_list,
-        event_wait_list + num_events_in_wait_list);
-
-    for( cl_uint i = 0; i < num_semaphores; i++ )
+    // Undoes getBinaryWaitEvent if the wait could not be enqueued, or
+    // waitFromHost if a later wait in the same call failed, and releases the
+    // caller's reference to the event.  If the wait took the
+    // pending signal, or if a signal already satisfied the deferred wait,
+    // then the signal is returned to the semaphore.  For a satisfied
+    // deferred wait, the user event completes when the signal completes, so
+    // it is used as the signal.
+    void cancelBinaryWait(
+        cl_event event,
+        bool isDeferred )
     {
-        if( !cli_semaphore::isValid(semaphores[i]) )
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( isDeferred )
         {
-            return CL_INVALID_SEMAPHORE_KHR;
+            auto it = std::find(DeferredWaits.begin(), DeferredWaits.end(), event);
+            if( it != DeferredWaits.end() )
+            {
+                DeferredWaits.erase(it);
+                completeDeferredWait(event, -1);
+                g_pNextDispatch->clReleaseEvent(event);
+                return;
+            }
         }
-        if( semaphores[i]->Context != q_context )
+
+        if( !DeferredWaits.empty() )
         {
-            return CL_INVALID_CONTEXT;
+            chainDeferredWait(event, DeferredWaits.front());
+            DeferredWaits.pop_front();
+            g_pNextDispatch->clReleaseEvent(event);
         }
-        if( semaphores[i]->Event == nullptr )
+        else if( Event == nullptr )
         {
-            // This is a semaphore that is not in a pending signal
-            // or signaled state.  What should happen here?
-            return CL_INVALID_OPERATION;
+            Event = event;
+            Cond.notify_all();
+        }
+        else
+        {
+            // The semaphore was signaled again since the wait took the
+            // signal, so it is already in the signaled state.
+            g_pNextDispatch->clReleaseEvent(event);
         }
-        combinedWaitList.push_back(
-            semaphores[i]->Event);
     }
 
-    retVal = g_pNextDispatch->clEnqueueMarkerWithWaitList(
-        command_queue,
-        (cl_uint)combinedWaitList.size(),
-        combinedWaitList.data(),
-        event );
-
-    for( cl_uint i = 0; i < num_semaphores; i++ )
+    // Undoes getTimelineWaitEvent if the wait could not be enqueued, and
+    // releases the caller's reference to the event.  Waits on a timeline
+    // semaphore do not change its payload value, so only a deferred wait
+    // that has not been satisfied yet needs to be removed.
+    void cancelTimelineWait(
+        cl_event event,
+        bool isDeferred )
     {
-        g_pNextDispatch->clReleaseEvent(
-            semaphores[i]->Event);
-        semaphores[i]->Event = nullptr;
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( isDeferred )
+        {
+            for( auto it = DeferredTimelineWaits.begin();
+                 it != DeferredTimelineWaits.end();
+                 ++it )
+            {
+                if( it->second == event )
+                {
+                    DeferredTimelineWaits.erase(it);
+                    completeDeferredWait(event, -1);
+                    break;
+                }
+            }
+        }
+        g_pNextDispatch->clReleaseEvent(event);
     }
 
-    if( event )
+    // Returns true if a binary semaphore is in the signaled state or has a
+    // pending signal.
+    bool isBinarySignaled()
     {
-        getLayerContext().EventMap[event[0]] = CL_COMMAND_SEMAPHORE_WAIT_KHR;
+        std::lock_guard<std::mutex> lock(Mutex);
+        return Event != nullptr;
     }
 
-    return retVal;
-}
-
-cl_int CL_API_CALL clEnqueueSignalSemaphoresKHR_EMU(
-    cl_command_queue command_queue,
-    cl_uint num_semaphores,
-    const cl_semaphore_khr *semaphores,
-    const cl_semaphore_payload_khr *sema_payload_list,
-    cl_uint num_events_in_wait_list,
-    const cl_event *event_wait_list,
-    cl_event *event)
-{
-    cl_int retVal = CL_SUCCESS;
-    if( num_semaphores == 0 )
+    // Returns true if a payload value may be signaled for a timeline
+    // semaphore.  Payload values must be signaled in increasing order.  This
+    // is only an early check, since another signal may be added before this
+    // signal is added, so signalTimeline checks the payload value again.
+    bool canSignalTimeline(
+        cl_semaphore_payload_khr payload )
     {
-        return CL_INVALID_VALUE;
+        std::lock_guard<std::mutex> lock(Mutex);
+        return payload > SignaledPayload;
     }
 
-    cl_context q_context = nullptr;
-    retVal = g_pNextDispatch->clGetCommandQueueInfo(
-        command_queue,
-        CL_QUEUE_CONTEXT,
-        sizeof(q_context),
-        &q_context,
-        nullptr);
-    if (retVal != CL_SUCCESS)
+    // Adds a signal with a payload value to a timeline semaphore.  The
+    // timeline holds a reference to the event until the signal is pruned.
+    // If the caller owns a reference to the event it may transfer it to the
+    // semaphore.  Payload values must be signaled in increasing order, so
+    // the timeline stays sorted, and this is checked with the mutex held.
+    cl_int signalTimeline(
+        cl_semaphore_payload_khr payload,
+        cl_event event,
+        bool transferOwnership )
     {
-        return retVal;
-    }
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( payload <= SignaledPayload )
+        {
+            if( transferOwnership )
+            {
+                g_pNextDispatch->clReleaseEvent(event);
+            }
+            return CL_INVALID_VALUE;
+        }
 
-    if( (num_events_in_wait_list > 0 && event_wait_list == nullptr) ||
-        (num_events_in_wait_list == 0 && event_wait_list != nullptr) )
-    {
-        return CL_INVALID_EVENT_WAIT_LIST;
-    }
+        pruneTimeline();
 
-    for( cl_uint i = 0; i < num_events_in_wait_list; i++ )
-    {
-        if (event_wait_list[i] == nullptr)
+        if( !transferOwnership )
         {
-            return CL_INVALID_EVENT_WAIT_LIST;
+            g_pNextDispatch->clRetainEvent(event);
         }
+        Timeline.emplace_back(payload, event);
+        SignaledPayload = payload;
 
-        cl_context e_context = nullptr;
-        retVal = g_pNextDispatch->clGetEventInfo(
-            event_wait_list[i],
-            CL_EVENT_CONTEXT,
-            sizeof(e_context),
-            &e_context,
-            nullptr);
-        if( retVal != CL_SUCCESS )
+        // Deferred waits for this payload value or a smaller payload value
+        // complete when this signal completes.
+        auto end = DeferredTimelineWaits.upper_bound(payload);
+        for( auto it = DeferredTimelineWaits.begin(); it != end; ++it )
         {
-            return retVal;
+            chainDeferredWait(event, it->second);
         }
-        if( q_context != e_context )
+        DeferredTimelineWaits.erase(DeferredTimelineWaits.begin(), end);
+
+        Cond.notify_all();
+        return CL_SUCCESS;
+    }
+
+    // Sets the payload value of a timeline semaphore from the host.  Every
+    // enqueued signal has a smaller payload value, so waits for any enqueued
+    // signal are satisfied and the timeline may be cleared.
+    cl_int signalTimelineFromHost(
+        cl_semaphore_payload_khr payload )
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( payload <= SignaledPayload )
         {
-            return CL_INVALID_CONTEXT;
+            return CL_INVALID_VALUE;
         }
 
-        cl_int status = 0;
-        retVal = g_pNextDispatch->clGetEventInfo(
-            event_wait_list[i],
-            CL_EVENT_COMMAND_EXECUTION_STATUS,
-            sizeof(status),
-            &status,
-            nullptr);
-        if( retVal != CL_SUCCESS )
+        for( const auto& signal : Timeline )
         {
-            return retVal;
+            g_pNextDispatch->clReleaseEvent(signal.second);
         }
-        if( status < 0 )
+        Timeline.clear();
+        CompletedPayload = payload;
+        SignaledPayload = payload;
+
+        auto end = DeferredTimelineWaits.upper_bound(payload);
+        for( auto it = DeferredTimelineWaits.begin(); it != end; ++it )
         {
-            return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+            completeDeferredWait(it->second, CL_COMPLETE);
         }
+        DeferredTimelineWaits.erase(DeferredTimelineWaits.begin(), end);
+
+        Cond.notify_all();
+        return CL_SUCCESS;
     }
 
-    for( cl_uint i = 0; i < num_semaphores; i++ )
+    // Signals a binary semaphore.  If a wait is deferred then the signal
+    // satisfies the oldest deferred wait, and the semaphore stays in the
+    // unsignaled state.  Otherwise, the semaphore holds a reference to the
+    // event until the semaphore is waited on.  If the caller owns a
+    // reference to the event it may transfer it to the semaphore.
+    void signalBinary(
+        cl_event event,
+        bool transferOwnership )
     {
-        if( !cli_semaphore::isValid(semaphores[i]) )
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( !DeferredWaits.empty() )
         {
-            return CL_INVALID_SEMAPHORE_KHR;
+            chainDeferredWait(event, DeferredWaits.front());
+            DeferredWaits.pop_front();
+            if( transferOwnership )
+            {
+                g_pNextDispatch->clReleaseEvent(event);
+            }
+            return;
         }
-        if( semaphores[i]->Context != q_context )
+
+        Event = event;
+        if( !transferOwnership )
         {
-            return CL_INVALID_CONTEXT;
+            g_pNextDispatch->clRetainEvent(Event);
         }
-        if( semaphores[i]->Event != nullptr )
+
+        Cond.notify_all();
+    }
+
+    // Signals a binary semaphore from the host, using a user event that is
+    // already complete as the event for the signal.
+    cl_int signalBinaryFromHost()
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( Event != nullptr )
         {
-            // This is a semaphore that is in a pending signal or signaled
-            // state.  What should happen here?
             return CL_INVALID_OPERATION;
         }
-    }
 
-    cl_event    local_event = nullptr;
-    if( event == nullptr )
-    {
-        event = &local_event;
-    }
+        if( !DeferredWaits.empty() )
+        {
+            completeDeferredWait(DeferredWaits.front(), CL_COMPLETE);
+            DeferredWaits.pop_front();
+            return CL_SUCCESS;
+        }
 
-    retVal = g_pNextDispatch->clEnqueueMarkerWithWaitList(
-        command_queue,
-        num_events_in_wait_list,
-        event_wait_list,
-        event );
+        cl_int errorCode = CL_SUCCESS;
+        cl_event event = g_pNextDispatch->clCreateUserEvent(
+            Context,
+            &errorCode );
+        if( errorCode != CL_SUCCESS )
+        {
+            return errorCode;
+        }
+        g_pNextDispatch->clSetUserEventStatus(
+            event,
+            CL_COMPLETE );
+        Event = event;
 
-    for( cl_uint i = 0; i < num_semaphores; i++ )
-    {
-        semaphores[i]->Event = *event;
-        g_pNextDispatch->clRetainEvent(
-            semaphores[i]->Event );
+        Cond.notify_all();
+        return CL_SUCCESS;
     }
 
-    if( local_event != nullptr )
-    {
-        g_pNextDispatch->clReleaseEvent(
-            local_event );
-        local_event = nullptr;
-    }
-    else
+    // Blocks the calling thread until the semaphore is signaled, or until
+    // the deadline.  For binary semaphores, the semaphore is reset to the
+    // unsignaled state once it is signaled, and the caller takes the event
+    // for the signal, so the wait may be undone with cancelBinaryWait.  For
+    // timeline semaphores, waits for the payload value.
+    cl_int waitFromHost(
+        cl_semaphore_payload_khr payload,
+        bool hasDeadline,
+        std::chrono::steady_clock::time_point deadline,
+        cl_event& binaryEvent )
     {
-        getLayerContext().EventMap[event[0]] = CL_COMMAND_SEMAPHORE_SIGNAL_KHR;
-    }
+        binaryEvent = nullptr;
+        while( true )
+        {
+            cl_event event = nullptr;
+            bool needsCallback = false;
+            {
+                std::unique_lock<std::mutex> lock(Mutex);
+                if( isTimeline() )
+                {
+                    pruneTimeline();
+                    if( payload <= CompletedPayload )
+                    {
+                        return CL_SUCCESS;
+                    }
+                    auto it = findTimelineSignal(payload);
+                    if( it != Timeline.end() )
+                    {
+                        event = it->second;
+                    }
+                }
+                else
+                {
+                    event = Event;
+                }
 
-    return retVal;
-}
+                // No signal has been enqueued yet, so wait for one.
+                if( event == nullptr )
+                {
+                    if( !waitForCond(lock, hasDeadline, deadline) )
+                    {
+                        return CL_SEMAPHORE_WAIT_TIMEOUT_EXP;
+                    }
+                    continue;
+                }
 
-cl_int CL_API_CALL clGetSemaphoreInfoKHR_EMU(
-    cl_semaphore_khr semaphore,
-    cl_semaphore_info_khr param_name,
-    size_t param_value_size,
-    void *param_value,
-    size_t *param_value_size_ret)
-{
-    if( !cli_semaphore::isValid(semaphore) )
-    {
-        return CL_INVALID_SEMAPHORE_KHR;
-    }
+                g_pNextDispatch->clRetainEvent(event);
+                needsCallback = CallbackEvents.insert(event).second;
+            }
 
-    switch( param_name )
-    {
-    case CL_SEMAPHORE_CONTEXT_KHR:
-        {
-            auto ptr = (cl_context*)param_value;
-            return writeParamToMemory(
+            // The event callback is set without holding the mutex, since the
+            // callback may be called immediately if the event is complete.
+            // The callback holds a reference to the event and the semaphore.
+            if( needsCallback )
+            {
+                g_pNextDispatch->clRetainEvent(event);
+                RefCount.fetch_add(1, std::memory_order_relaxed);
+                cl_int errorCode = g_pNextDispatch->clSetEventCallback(
+                    event,
+                    CL_COMPLETE,
+                    hostWaitCallback,
+                    this );
+                if( errorCode != CL_SUCCESS )
+                {
+                    onEventComplete(event);
+                    g_pNextDispatch->clReleaseEvent(event);
+                    RefCount.fetch_sub(1, std::memory_order_relaxed);
+                    g_pNextDispatch->clReleaseEvent(event);
+                    return errorCode;
+                }
+            }
+
+            cl_int errorCode = CL_SUCCESS;
+            bool retry = false;
+            {
+                // A timeline semaphore may also reach the payload value by
+                // a signal from the host.
+                std::unique_lock<std::mutex> lock(Mutex);
+                while( CallbackEvents.count(event) != 0 &&
+                       !( isTimeline() && payload <= CompletedPayload ) )
+                {
+                    if( !waitForCond(lock, hasDeadline, deadline) )
+                    {
+                        errorCode = CL_SEMAPHORE_WAIT_TIMEOUT_EXP;
+                        break;
+                    }
+                }
+
+                if( errorCode == CL_SUCCESS )
+                {
+                    cl_int  eventStatus = 0;
+                    g_pNextDispatch->clGetEventInfo(
+                        event,
+                        CL_EVENT_COMMAND_EXECUTION_STATUS,
+                        sizeof( eventStatus ),
+                        &eventStatus,
+                        nullptr );
+                    if( eventStatus < 0 )
+                    {
+                        errorCode = CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+                    }
+                    else if( !isTimeline() )
+                    {
+                        // If another wait already reset the binary semaphore
+                        // then wait for the next signal.
+                        if( Event != event )
+                        {
+                            retry = true;
+                        }
+                        else
+                        {
+                            binaryEvent = Event;
+                            Event = nullptr;
+                        }
+                    }
+                }
+            }
+
+            g_pNextDispatch->clReleaseEvent(event);
+
+            // For timeline semaphores, the completed signal had a payload
+            // value greater than or equal to the requested value, so the
+            // semaphore reached the requested value.
+            if( !retry )
+            {
+                return errorCode;
+            }
+        }
+    }
+
+    // Gets the payload value of a binary semaphore, which is one if the
+    // semaphore is in the signaled state and zero otherwise.
+    cl_semaphore_payload_khr getBinaryPayload()
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if( Event == nullptr )
+        {
+            return 0;
+        }
+
+        cl_int  eventStatus = 0;
+        g_pNextDispatch->clGetEventInfo(
+            Event,
+            CL_EVENT_COMMAND_EXECUTION_STATUS,
+            sizeof( eventStatus ),
+            &eventStatus,
+            nullptr );
+        return eventStatus == CL_COMPLETE ? 1 : 0;
+    }
+
+    cl_semaphore_payload_khr getTimelinePayload()
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        pruneTimeline();
+        return CompletedPayload;
+    }
+
+    const cl_uint Magic;
+    const cl_context Context;
+    const cl_semaphore_type_khr Type;
+    std::vector<cl_semaphore_properties_khr> Properties;
+    std::vector<cl_device_id>   Devices;
+
+    std::atomic<cl_uint> RefCount;
+
+    // For binary semaphores, the event for the pending signal, if any.
+    cl_event Event;
+
+private:
+    static constexpr cl_uint cMagic = 0x53454d41;   // "SEMA"
+
+    _cl_semaphore_khr(cl_context context, cl_semaphore_type_khr type) :
+        Magic(cMagic),
+        Context(context),
+        Type(type),
+        RefCount(1),
+        Event(nullptr),
+        CompletedPayload(0),
+        SignaledPayload(0) {}
+
+    // For timeline semaphores, the signals that may not have completed yet,
+    // in increasing payload value order, and the payload value of the last
+    // completed and last enqueued signals.
+    std::mutex  Mutex;
+    typedef std::deque<std::pair<cl_semaphore_payload_khr, cl_event>>
+        CTimeline;
+    CTimeline   Timeline;
+    cl_semaphore_payload_khr    CompletedPayload;
+    cl_semaphore_payload_khr    SignaledPayload;
+
+    // For host waits, signaled when a signal is enqueued and when an event
+    // with an event callback completes.  Events are in the set of callback
+    // events from when their event callback is set until it is called.
+    std::condition_variable Cond;
+    std::set<cl_event>  CallbackEvents;
+
+    // Waits that were enqueued before a signal that satisfies them.  Each
+    // deferred wait waits on a user event, which is completed when the
+    // signal that satisfies the wait completes.  Deferred waits on binary
+    // semaphores are satisfied in order, and deferred waits on timeline
+    // semaphores are ordered by payload value.
+    std::deque<cl_event>    DeferredWaits;
+    std::multimap<cl_semaphore_payload_khr, cl_event>   DeferredTimelineWaits;
+
+    cl_int createDeferredWait(
+        cl_event& event )
+    {
+        cl_int errorCode = CL_SUCCESS;
+        event = g_pNextDispatch->clCreateUserEvent(
+            Context,
+            &errorCode );
+        return errorCode;
+    }
+
+    // Completes a deferred wait and releases the semaphore's reference to
+    // its user event.
+    static void completeDeferredWait(
+        cl_event waitEvent,
+        cl_int status )
+    {
+        g_pNextDispatch->clSetUserEventStatus(
+            waitEvent,
+            status );
+        g_pNextDispatch->clReleaseEvent(waitEvent);
+    }
+
+    // Completes a deferred wait when a signal completes.  The semaphore's
+    // reference to the user event for the deferred wait is transferred to
+    // the event callback.
+    static void chainDeferredWait(
+        cl_event signalEvent,
+        cl_event waitEvent )
+    {
+        cl_int errorCode = g_pNextDispatch->clSetEventCallback(
+            signalEvent,
+            CL_COMPLETE,
+            deferredWaitCallback,
+            waitEvent );
+        if( errorCode != CL_SUCCESS )
+        {
+            completeDeferredWait(waitEvent, errorCode);
+        }
+    }
+
+    static void CL_CALLBACK deferredWaitCallback(
+        cl_event event,
+        cl_int status,
+        void* user_data )
+    {
+        completeDeferredWait(
+            (cl_event)user_data,
+            status < 0 ? status : CL_COMPLETE );
+    }
+
+    static void CL_CALLBACK hostWaitCallback(
+        cl_event event,
+        cl_int status,
+        void* user_data )
+    {
+        cl_semaphore_khr semaphore = (cl_semaphore_khr)user_data;
+        semaphore->onEventComplete(event);
+        g_pNextDispatch->clReleaseEvent(event);
+        clReleaseSemaphoreKHR_EMU(semaphore);
+    }
+
+    void onEventComplete(
+        cl_event event )
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        CallbackEvents.erase(event);
+        Cond.notify_all();
+    }
+
+    // Waits for the condition variable, returning false on timeout.
+    bool waitForCond(
+        std::unique_lock<std::mutex>& lock,
+        bool hasDeadline,
+        std::chrono::steady_clock::time_point deadline )
+    {
+        if( !hasDeadline )
+        {
+            Cond.wait(lock);
+            return true;
+        }
+        return Cond.wait_until(lock, deadline) != std::cv_status::timeout;
+    }
+
+    // Finds the first signal with a payload value greater than or equal to
+    // a payload value.  The timeline is ordered by payload value, so this
+    // is a binary search.  The mutex must be held.
+    CTimeline::iterator findTimelineSignal(
+        cl_semaphore_payload_khr payload )
+    {
+        return std::lower_bound(
+            Timeline.begin(),
+            Timeline.end(),
+            payload,
+            [](const std::pair<cl_semaphore_payload_khr, cl_event>& signal,
+               cl_semaphore_payload_khr value) {
+                return signal.first < value;
+            });
+    }
+
+    // Removes completed signals from the front of the timeline.  Signals
+    // are only removed in order, so the completed payload value never
+    // decreases.  The mutex must be held.
+    void pruneTimeline()
+    {
+        while( !Timeline.empty() )
+        {
+            cl_int  eventStatus = 0;
+            g_pNextDispatch->clGetEventInfo(
+                Timeline.front().second,
+                CL_EVENT_COMMAND_EXECUTION_STATUS,
+                sizeof( eventStatus ),
+                &eventStatus,
+                nullptr );
+            if( eventStatus != CL_COMPLETE )
+            {
+                break;
+            }
+
+            CompletedPayload = Timeline.front().first;
+            g_pNextDispatch->clReleaseEvent(Timeline.front().second);
+            Timeline.pop_front();
+        }
+    }
+} cli_semaphore;
+
+// A list of events to wait on, or of semaphore waits.  Most semaphore
+// operations only wait on a few events, so a small number of elements are
+// stored inline and the list only allocates memory when there are more
+// elements.
+template<class T>
+class CInlineList
+{
+public:
+    void push_back(const T& value)
+    {
+        if( Overflow.empty() && Size < cInlineSize )
+        {
+            Inline[Size] = value;
+        }
+        else
+        {
+            if( Overflow.empty() )
+            {
+                Overflow.assign(Inline.begin(), Inline.begin() + Size);
+            }
+            Overflow.push_back(value);
+        }
+        Size++;
+    }
+
+    void insert(const T* values, cl_uint count)
+    {
+        for( cl_uint i = 0; i < count; i++ )
+        {
+            push_back(values[i]);
+        }
+    }
+
+    cl_uint size() const
+    {
+        return (cl_uint)Size;
+    }
+
+    const T* begin() const
+    {
+        return Overflow.empty() ? Inline.data() : Overflow.data();
+    }
+
+    const T* end() const
+    {
+        return begin() + Size;
+    }
+
+    const T* data() const
+    {
+        return Size == 0 ? nullptr : begin();
+    }
+
+private:
+    static constexpr size_t cInlineSize = 8;
+
+    std::array<T, cInlineSize>  Inline;
+    std::vector<T>  Overflow;
+    size_t  Size = 0;
+};
+
+typedef CInlineList<cl_event> CWaitList;
+
+// The event taken from a semaphore for a semaphore wait, so the wait may be
+// undone if it cannot be enqueued.
+struct SSemaphoreWait
+{
+    cl_semaphore_khr    Semaphore;
+    cl_event            Event;
+    bool                IsDeferred;
+};
+
+// Gets the context for a command-queue.  The context is cached the first
+// time it is queried, and the cached context is removed when the
+// command-queue is released.
+static cl_int getQueueContext(
+    cl_command_queue queue,
+    cl_context& context )
+{
+    auto& layerContext = getLayerContext();
+    if( layerContext.QueueContextMap.find(queue, context) )
+    {
+        return CL_SUCCESS;
+    }
+
+    cl_int retVal = g_pNextDispatch->clGetCommandQueueInfo(
+        queue,
+        CL_QUEUE_CONTEXT,
+        sizeof(context),
+        &context,
+        nullptr);
+    if( retVal == CL_SUCCESS )
+    {
+        layerContext.QueueContextMap.insert(queue, context);
+    }
+    return retVal;
+}
+
+// Checks an event wait list for a semaphore operation.  Checking that each
+// event is in the context of the command-queue and has not failed requires
+// querying every event, so these checks are only done when event wait list
+// validation is enabled.
+static cl_int validateEventWaitList(
+    cl_context q_context,
+    cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list)
+{
+    if( (num_events_in_wait_list > 0 && event_wait_list == nullptr) ||
+        (num_events_in_wait_list == 0 && event_wait_list != nullptr) )
+    {
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+
+    for( cl_uint i = 0; i < num_events_in_wait_list; i++ )
+    {
+        if( event_wait_list[i] == nullptr )
+        {
+            return CL_INVALID_EVENT_WAIT_LIST;
+        }
+
+        if( !g_ValidateEventWaitList )
+        {
+            continue;
+        }
+
+        cl_context e_context = nullptr;
+        cl_int retVal = g_pNextDispatch->clGetEventInfo(
+            event_wait_list[i],
+            CL_EVENT_CONTEXT,
+            sizeof(e_context),
+            &e_context,
+            nullptr);
+        if( retVal != CL_SUCCESS )
+        {
+            return retVal; // or CL_INVALID_EVENT_WAIT_LIST?
+        }
+        if( q_context != e_context )
+        {
+            return CL_INVALID_CONTEXT;
+        }
+
+        cl_int status = 0;
+        retVal = g_pNextDispatch->clGetEventInfo(
+            event_wait_list[i],
+            CL_EVENT_COMMAND_EXECUTION_STATUS,
+            sizeof(status),
+            &status,
+            nullptr);
+        if( retVal != CL_SUCCESS )
+        {
+            return retVal; // or CL_INVALID_EVENT_WAIT_LIST?
+        }
+        if( status < 0 )
+        {
+            return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+cl_semaphore_khr CL_API_CALL clCreateSemaphoreWithPropertiesKHR_EMU(
+    cl_context context,
+    const cl_semaphore_properties_khr *sema_props,
+    cl_int *errcode_ret)
+{
+    return cli_semaphore::create(
+        context,
+        sema_props,
+        errcode_ret);
+}
+
+cl_int CL_API_CALL clEnqueueWaitSemaphoresKHR_EMU(
+    cl_command_queue command_queue,
+    cl_uint num_semaphores,
+    const cl_semaphore_khr *semaphores,
+    const cl_semaphore_payload_khr *semaphore_payloads,
+    cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list,
+    cl_event *event)
+{
+    cl_int retVal = CL_SUCCESS;
+    if( num_semaphores == 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_context q_context = nullptr;
+    retVal = getQueueContext(
+        command_queue,
+        q_context);
+    if( retVal != CL_SUCCESS )
+    {
+        return retVal;
+    }
+
+    retVal = validateEventWaitList(
+        q_context,
+        num_events_in_wait_list,
+        event_wait_list);
+    if( retVal != CL_SUCCESS )
+    {
+        return retVal;
+    }
+
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        if( !cli_semaphore::isValid(semaphores[i]) )
+        {
+            return CL_INVALID_SEMAPHORE_KHR;
+        }
+        if( semaphores[i]->Context != q_context )
+        {
+            return CL_INVALID_CONTEXT;
+        }
+        if( semaphores[i]->isTimeline() && semaphore_payloads == nullptr )
+        {
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    CWaitList combinedWaitList;
+    combinedWaitList.insert(
+        event_wait_list,
+        num_events_in_wait_list);
+
+    // The events for each semaphore are taken from the semaphores and
+    // retained until the wait is enqueued.  Waits on binary semaphores reset
+    // the semaphore to the unsignaled state, and waits on timeline
+    // semaphores do not change the state of the semaphore.  Every semaphore
+    // was validated above, so taking an event only fails if a deferred wait
+    // cannot be created.
+    CInlineList<SSemaphoreWait> waits;
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        cl_event waitEvent = nullptr;
+        bool isDeferred = false;
+        retVal = semaphores[i]->isTimeline() ?
+            semaphores[i]->getTimelineWaitEvent(
+                semaphore_payloads[i],
+                waitEvent,
+                isDeferred ) :
+            semaphores[i]->getBinaryWaitEvent(
+                waitEvent,
+                isDeferred );
+        if( retVal != CL_SUCCESS )
+        {
+            break;
+        }
+        if( waitEvent != nullptr )
+        {
+            combinedWaitList.push_back(waitEvent);
+            waits.push_back({semaphores[i], waitEvent, isDeferred});
+        }
+    }
+
+    if( retVal == CL_SUCCESS )
+    {
+        retVal = g_pNextDispatch->clEnqueueMarkerWithWaitList(
+            command_queue,
+            combinedWaitList.size(),
+            combinedWaitList.data(),
+            event );
+    }
+
+    // If the wait was not enqueued then the semaphores are returned to the
+    // state they were in before the wait, in reverse order, so a binary
+    // semaphore is not left unsignaled and a deferred wait does not consume
+    // a later signal.
+    if( retVal != CL_SUCCESS )
+    {
+        for( cl_uint w = waits.size(); w-- > 0; )
+        {
+            const SSemaphoreWait& wait = waits.begin()[w];
+            if( wait.Semaphore->isTimeline() )
+            {
+                wait.Semaphore->cancelTimelineWait(wait.Event, wait.IsDeferred);
+            }
+            else
+            {
+                wait.Semaphore->cancelBinaryWait(wait.Event, wait.IsDeferred);
+            }
+        }
+        return retVal;
+    }
+
+    for( const auto& wait : waits )
+    {
+        g_pNextDispatch->clReleaseEvent(wait.Event);
+    }
+
+    if( event )
+    {
+        getLayerContext().EventMap.insert(event[0], CL_COMMAND_SEMAPHORE_WAIT_KHR);
+    }
+
+    return retVal;
+}
+
+cl_int CL_API_CALL clEnqueueSignalSemaphoresKHR_EMU(
+    cl_command_queue command_queue,
+    cl_uint num_semaphores,
+    const cl_semaphore_khr *semaphores,
+    const cl_semaphore_payload_khr *sema_payload_list,
+    cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list,
+    cl_event *event)
+{
+    cl_int retVal = CL_SUCCESS;
+    if( num_semaphores == 0 )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_context q_context = nullptr;
+    retVal = getQueueContext(
+        command_queue,
+        q_context);
+    if( retVal != CL_SUCCESS )
+    {
+        return retVal;
+    }
+
+    retVal = validateEventWaitList(
+        q_context,
+        num_events_in_wait_list,
+        event_wait_list);
+    if( retVal != CL_SUCCESS )
+    {
+        return retVal;
+    }
+
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        if( !cli_semaphore::isValid(semaphores[i]) )
+        {
+            return CL_INVALID_SEMAPHORE_KHR;
+        }
+        if( semaphores[i]->Context != q_context )
+        {
+            return CL_INVALID_CONTEXT;
+        }
+        if( semaphores[i]->isTimeline() )
+        {
+            if( sema_payload_list == nullptr ||
+                !semaphores[i]->canSignalTimeline(sema_payload_list[i]) )
+            {
+                return CL_INVALID_VALUE;
+            }
+        }
+        else if( semaphores[i]->isBinarySignaled() )
+        {
+            // This is a semaphore that is in a pending signal or signaled
+            // state.  What should happen here?
+            return CL_INVALID_OPERATION;
+        }
+    }
+
+    cl_event    local_event = nullptr;
+    if( event == nullptr )
+    {
+        event = &local_event;
+    }
+
+    retVal = g_pNextDispatch->clEnqueueMarkerWithWaitList(
+        command_queue,
+        num_events_in_wait_list,
+        event_wait_list,
+        event );
+
+    if( retVal != CL_SUCCESS )
+    {
+        return retVal;
+    }
+
+    // If the application did not request an event then the reference to
+    // the marker event is transferred to the last semaphore rather than
+    // retaining the event for the semaphore and releasing it here.  A
+    // timeline signal may still fail if a concurrent signal added a larger
+    // payload value since the payload values were checked.
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        const bool transferOwnership =
+            local_event != nullptr && i == num_semaphores - 1;
+        if( semaphores[i]->isTimeline() )
+        {
+            cl_int signalRetVal = semaphores[i]->signalTimeline(
+                sema_payload_list[i],
+                *event,
+                transferOwnership );
+            if( retVal == CL_SUCCESS )
+            {
+                retVal = signalRetVal;
+            }
+        }
+        else
+        {
+            semaphores[i]->signalBinary(
+                *event,
+                transferOwnership );
+        }
+    }
+
+    if( retVal != CL_SUCCESS )
+    {
+        // The event is not returned to the application if the signal fails.
+        if( local_event == nullptr )
+        {
+            g_pNextDispatch->clReleaseEvent(event[0]);
+            event[0] = nullptr;
+        }
+        return retVal;
+    }
+
+    if( local_event == nullptr )
+    {
+        getLayerContext().EventMap.insert(event[0], CL_COMMAND_SEMAPHORE_SIGNAL_KHR);
+    }
+
+    return retVal;
+}
+
+cl_int CL_API_CALL clSignalSemaphoresFromHostEXP_EMU(
+    cl_uint num_semaphores,
+    const cl_semaphore_khr *semaphores,
+    const cl_semaphore_payload_khr *sema_payload_list)
+{
+    if( num_semaphores == 0 || semaphores == nullptr )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        if( !cli_semaphore::isValid(semaphores[i]) )
+        {
+            return CL_INVALID_SEMAPHORE_KHR;
+        }
+        if( semaphores[i]->isTimeline() && sema_payload_list == nullptr )
+        {
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        cl_int retVal = semaphores[i]->isTimeline() ?
+            semaphores[i]->signalTimelineFromHost(sema_payload_list[i]) :
+            semaphores[i]->signalBinaryFromHost();
+        if( retVal != CL_SUCCESS )
+        {
+            return retVal;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clWaitSemaphoresFromHostEXP_EMU(
+    cl_uint num_semaphores,
+    const cl_semaphore_khr *semaphores,
+    const cl_semaphore_payload_khr *sema_payload_list,
+    cl_ulong timeout_ns)
+{
+    if( num_semaphores == 0 || semaphores == nullptr )
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        if( !cli_semaphore::isValid(semaphores[i]) )
+        {
+            return CL_INVALID_SEMAPHORE_KHR;
+        }
+        if( semaphores[i]->isTimeline() && sema_payload_list == nullptr )
+        {
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    // A timeout of CL_SEMAPHORE_WAIT_FOREVER_EXP waits without a deadline.
+    // Very long timeouts are also treated as waiting forever, to avoid
+    // overflowing the deadline.
+    const auto start = std::chrono::steady_clock::now();
+    const bool hasDeadline =
+        timeout_ns < (cl_ulong)std::chrono::nanoseconds::max().count() / 2;
+    const auto deadline = hasDeadline ?
+        start + std::chrono::nanoseconds(timeout_ns) :
+        start;
+
+    // The semaphores are waited on in order.  If a wait fails, the binary
+    // semaphores that were already reset get their signals back, so a
+    // failed call does not consume any signals.
+    CInlineList<SSemaphoreWait> waits;
+    cl_int retVal = CL_SUCCESS;
+    for( cl_uint i = 0; i < num_semaphores; i++ )
+    {
+        cl_event binaryEvent = nullptr;
+        retVal = semaphores[i]->waitFromHost(
+            sema_payload_list ? sema_payload_list[i] : 0,
+            hasDeadline,
+            deadline,
+            binaryEvent );
+        if( retVal != CL_SUCCESS )
+        {
+            break;
+        }
+        if( binaryEvent != nullptr )
+        {
+            waits.push_back({semaphores[i], binaryEvent, false});
+        }
+    }
+
+    for( cl_uint w = waits.size(); w-- > 0; )
+    {
+        const SSemaphoreWait& wait = waits.begin()[w];
+        if( retVal != CL_SUCCESS )
+        {
+            wait.Semaphore->cancelBinaryWait(wait.Event, false);
+        }
+        else
+        {
+            g_pNextDispatch->clReleaseEvent(wait.Event);
+        }
+    }
+
+    return retVal;
+}
+
+cl_int CL_API_CALL clGetSemaphoreInfoKHR_EMU(
+    cl_semaphore_khr semaphore,
+    cl_semaphore_info_khr param_name,
+    size_t param_value_size,
+    void *param_value,
+    size_t *param_value_size_ret)
+{
+    if( !cli_semaphore::isValid(semaphore) )
+    {
+        return CL_INVALID_SEMAPHORE_KHR;
+    }
+
+    switch( param_name )
+    {
+    case CL_SEMAPHORE_CONTEXT_KHR:
+        {
+            auto ptr = (cl_context*)param_value;
+            return writeParamToMemory(
                 param_value_size,
                 semaphore->Context,
                 param_value_size_ret,
@@ -560,21 +1476,16 @@ cl_int CL_API_CALL clGetSemaphoreInfoKHR_EMU(
         {
             // For binary semaphores, the payload should be zero if the
             // semaphore is in the unsignaled state and one if it is in
-            // the signaled state.
+            // the signaled state.  For timeline semaphores, the payload is
+            // the payload value of the last completed signal.
             cl_semaphore_payload_khr payload = 0;
-            if( semaphore->Event != nullptr )
+            if( semaphore->isTimeline() )
             {
-                cl_int  eventStatus = 0;
-                g_pNextDispatch->clGetEventInfo(
-                    semaphore->Event,
-                    CL_EVENT_COMMAND_EXECUTION_STATUS,
-                    sizeof( eventStatus ),
-                    &eventStatus,
-                    nullptr );
-                if( eventStatus == CL_COMPLETE )
-                {
-                    payload = 1;
-                }
+                payload = semaphore->getTimelinePayload();
+            }
+            else
+            {
+                payload = semaphore->getBinaryPayload();
             }
 
             auto ptr = (cl_semaphore_payload_khr*)param_value;
@@ -622,14 +1533,145 @@ cl_int CL_API_CALL clReleaseSemaphoreKHR_EMU(
         return CL_INVALID_SEMAPHORE_KHR;
     }
 
-    semaphore->RefCount.fetch_sub(1, std::memory_order_relaxed);
-    if( semaphore->RefCount.load(std::memory_order_relaxed) == 0 )
+    // Only the release that drops the last reference deletes the semaphore,
+    // since host wait callbacks may release the semaphore concurrently.
+    if( semaphore->RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1 )
     {
         delete semaphore;
     }
     return CL_SUCCESS;
 }
 
+static void initDeviceInfo(
+    cl_device_id device,
+    SDeviceInfo& info )
+{
+    {
+        size_t  size = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS,
+            0,
+            nullptr,
+            &size );
+
+        std::vector<char> deviceExtensions(size);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS,
+            size,
+            deviceExtensions.data(),
+            nullptr );
+
+        if( checkStringForExtension(
+                deviceExtensions.data(),
+                CL_KHR_SEMAPHORE_EXTENSION_NAME ) == false )
+        {
+            std::string newExtensions;
+            newExtensions += CL_KHR_SEMAPHORE_EXTENSION_NAME;
+
+            std::string oldExtensions(deviceExtensions.data());
+
+            // If the old extension string ends with a space ensure the
+            // new extension string does too.
+            if( oldExtensions.back() == ' ' )
+            {
+                newExtensions += ' ';
+            }
+            else
+            {
+                oldExtensions += ' ';
+            }
+
+            oldExtensions += newExtensions;
+
+            info.OverrideExtensions = true;
+            info.Extensions = oldExtensions;
+        }
+    }
+
+    {
+        size_t  size = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS_WITH_VERSION,
+            0,
+            nullptr,
+            &size );
+
+        size_t  numExtensions = size / sizeof(cl_name_version);
+        std::vector<cl_name_version>    extensions(numExtensions);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS_WITH_VERSION,
+            size,
+            extensions.data(),
+            nullptr );
+
+        bool found = false;
+        for( const auto& extension : extensions )
+        {
+            if( strcmp(extension.name, CL_KHR_SEMAPHORE_EXTENSION_NAME) == 0 )
+            {
+                found = true;
+                break;
+            }
+        }
+
+        if( found == false )
+        {
+            extensions.emplace_back();
+            cl_name_version& extension = extensions.back();
+
+            memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+            strcpy(extension.name, CL_KHR_SEMAPHORE_EXTENSION_NAME);
+
+            extension.version = version_cl_khr_semaphore;
+
+            info.OverrideExtensionsWithVersion = true;
+            info.ExtensionsWithVersion = std::move(extensions);
+        }
+    }
+}
+
+// Returns the overridden device info for a device.  The device info for a
+// root device is computed the first time it is needed and cached.
+static std::shared_ptr<const SDeviceInfo> getDeviceInfo(
+    cl_device_id device )
+{
+    auto& context = getLayerContext();
+    {
+        std::lock_guard<std::mutex> lock(context.DeviceInfoMutex);
+        auto it = context.DeviceInfoMap.find(device);
+        if( it != context.DeviceInfoMap.end() )
+        {
+            return it->second;
+        }
+    }
+
+    cl_device_id parentDevice = nullptr;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_PARENT_DEVICE,
+        sizeof(parentDevice),
+        &parentDevice,
+        nullptr );
+
+    auto info = std::make_shared<SDeviceInfo>();
+    initDeviceInfo(device, *info);
+
+    if( parentDevice == nullptr )
+    {
+        // If another thread computed the device info first, use it instead.
+        std::lock_guard<std::mutex> lock(context.DeviceInfoMutex);
+        auto result = context.DeviceInfoMap.insert(
+            std::make_pair(device, info));
+        return result.first->second;
+    }
+
+    return info;
+}
+
 bool clGetDeviceInfo_override(
     cl_device_id device,
     cl_device_info param_name,
@@ -641,48 +1683,13 @@ bool clGetDeviceInfo_override(
     switch(param_name) {
     case CL_DEVICE_EXTENSIONS:
         {
-            size_t  size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS,
-                0,
-                nullptr,
-                &size );
-
-            std::vector<char> deviceExtensions(size);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS,
-                size,
-                deviceExtensions.data(),
-                nullptr );
-
-            if( checkStringForExtension(
-                    deviceExtensions.data(),
-                    CL_KHR_SEMAPHORE_EXTENSION_NAME ) == false )
+            auto info = getDeviceInfo(device);
+            if( info->OverrideExtensions )
             {
-                std::string newExtensions;
-                newExtensions += CL_KHR_SEMAPHORE_EXTENSION_NAME;
-
-                std::string oldExtensions(deviceExtensions.data());
-
-                // If the old extension string ends with a space ensure the
-                // new extension string does too.
-                if( oldExtensions.back() == ' ' )
-                {
-                    newExtensions += ' ';
-                }
-                else
-                {
-                    oldExtensions += ' ';
-                }
-
-                oldExtensions += newExtensions;
-
                 auto ptr = (char*)param_value;
                 cl_int errorCode = writeStringToMemory(
                     param_value_size,
-                    oldExtensions.c_str(),
+                    info->Extensions.c_str(),
                     param_value_size_ret,
                     ptr );
 
@@ -696,47 +1703,13 @@ bool clGetDeviceInfo_override(
         break;
     case CL_DEVICE_EXTENSIONS_WITH_VERSION:
         {
-            size_t  size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS_WITH_VERSION,
-                0,
-                nullptr,
-                &size );
-
-            size_t  numExtensions = size / sizeof(cl_name_version);
-            std::vector<cl_name_version>    extensions(numExtensions);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS_WITH_VERSION,
-                size,
-                extensions.data(),
-                nullptr );
-
-            bool found = false;
-            for( const auto& extension : extensions )
-            {
-                if( strcmp(extension.name, CL_KHR_SEMAPHORE_EXTENSION_NAME) == 0 )
-                {
-                    found = true;
-                    break;
-                }
-            }
-
-            if( found == false )
+            auto info = getDeviceInfo(device);
+            if( info->OverrideExtensionsWithVersion )
             {
-                extensions.emplace_back();
-                cl_name_version& extension = extensions.back();
-
-                memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
-                strcpy(extension.name, CL_KHR_SEMAPHORE_EXTENSION_NAME);
-
-                extension.version = version_cl_khr_semaphore;
-
                 auto ptr = (cl_name_version*)param_value;
                 cl_int errorCode = writeVectorToMemory(
                     param_value_size,
-                    extensions,
+                    info->ExtensionsWithVersion,
                     param_value_size_ret,
                     ptr );
 
@@ -750,14 +1723,13 @@ bool clGetDeviceInfo_override(
         break;
     case CL_DEVICE_SEMAPHORE_TYPES_KHR:
         {
-            // If we decide to emulate multiple semaphore types we will need
-            // to return an array, but for now we can return just the binary
-            // semaphore type.
             auto ptr = (cl_semaphore_type_khr*)param_value;
-            cl_semaphore_type_khr type = CL_SEMAPHORE_TYPE_BINARY_KHR;
-            cl_int errorCode = writeParamToMemory(
+            std::vector<cl_semaphore_type_khr> types{
+                CL_SEMAPHORE_TYPE_BINARY_KHR,
+            };
+            cl_int errorCode = writeVectorToMemory(
                 param_value_size,
-                type,
+                types,
                 param_value_size_ret,
                 ptr );
 
@@ -786,9 +1758,8 @@ bool clGetEventInfo_override(
     case CL_EVENT_COMMAND_TYPE:
         {
             auto& context = getLayerContext();
-            auto it = context.EventMap.find(event);
-            if (it != context.EventMap.end()) {
-                cl_command_type type = it->second;
+            cl_command_type type = 0;
+            if (context.EventMap.find(event, type)) {
                 auto ptr = (cl_command_type*)param_value;
                 cl_int errorCode = writeParamToMemory(
                     param_value_size,
@@ -929,14 +1900,13 @@ bool clGetPlatformInfo_override(
         break;
     case CL_PLATFORM_SEMAPHORE_TYPES_KHR:
         {
-            // If we decide to emulate multiple semaphore types we will need
-            // to return an array, but for now we can return just the binary
-            // semaphore type.
             auto ptr = (cl_semaphore_type_khr*)param_value;
-            cl_semaphore_type_khr type = CL_SEMAPHORE_TYPE_BINARY_KHR;
-            cl_int errorCode = writeParamToMemory(
+            std::vector<cl_semaphore_type_khr> types{
+                CL_SEMAPHORE_TYPE_BINARY_KHR,
+            };
+            cl_int errorCode = writeVectorToMemory(
                 param_value_size,
-                type,
+                types,
                 param_value_size_ret,
                 ptr );
 
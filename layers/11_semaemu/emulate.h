@@ -8,15 +8,66 @@
 #include <CL/cl_ext.h>
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sharded_map.hpp"
+
+// Timeline semaphores are not part of cl_khr_semaphore, so this layer uses
+// its own semaphore type for timeline semaphores.  The value is chosen so it
+// will not collide with any semaphore type defined by an extension.
+#ifndef CL_SEMAPHORE_TYPE_TIMELINE_EXP
+#define CL_SEMAPHORE_TYPE_TIMELINE_EXP 0x54494d45     // "TIME"
+#endif
+
+// Returned by clWaitSemaphoresFromHostEXP if the timeout expired before the
+// semaphores were signaled.  This is a status rather than an error.
+#ifndef CL_SEMAPHORE_WAIT_TIMEOUT_EXP
+#define CL_SEMAPHORE_WAIT_TIMEOUT_EXP 1
+#endif
+
+// Pass as the timeout to clWaitSemaphoresFromHostEXP to wait without a
+// timeout.
+#ifndef CL_SEMAPHORE_WAIT_FOREVER_EXP
+#define CL_SEMAPHORE_WAIT_FOREVER_EXP (~(cl_ulong)0)
+#endif
+
+// Overridden device info, computed once per device.
+struct SDeviceInfo
+{
+    bool    OverrideExtensions = false;
+    std::string Extensions;
+
+    bool    OverrideExtensionsWithVersion = false;
+    std::vector<cl_name_version>    ExtensionsWithVersion;
+};
 
 struct SLayerContext
 {
-    typedef std::map<cl_event, cl_command_type> CEventMap;
+    typedef CShardedMap<cl_event, cl_command_type> CEventMap;
     CEventMap EventMap;
+
+    // The context for each command-queue used with a semaphore, so the
+    // context does not need to be queried for every semaphore operation.
+    // Entries are removed when the command-queue is released.
+    typedef CShardedMap<cl_command_queue, cl_context> CQueueContextMap;
+    CQueueContextMap QueueContextMap;
+
+    // Device info for root devices.  Sub-device handles may be reused after
+    // the sub-device is released, so sub-device info is not cached.
+    typedef std::map<cl_device_id, std::shared_ptr<const SDeviceInfo>>
+        CDeviceInfoMap;
+    std::mutex  DeviceInfoMutex;
+    CDeviceInfoMap  DeviceInfoMap;
 };
 
 SLayerContext& getLayerContext(void);
 
+extern bool g_ValidateEventWaitList;
+extern bool g_TimelineSemaphores;
+
 extern const struct _cl_icd_dispatch* g_pNextDispatch;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -58,6 +109,21 @@ cl_int CL_API_CALL clRetainSemaphoreKHR_EMU(
 cl_int CL_API_CALL clReleaseSemaphoreKHR_EMU(
     cl_semaphore_khr semaphore);
 
+// Layer-specific functions to signal and wait on semaphores from the host.
+// Host waits block the calling thread using event callbacks rather than
+// waiting for a command-queue to finish.
+
+cl_int CL_API_CALL clSignalSemaphoresFromHostEXP_EMU(
+    cl_uint num_sema_objects,
+    const cl_semaphore_khr *sema_objects,
+    const cl_semaphore_payload_khr *sema_payload_list);
+
+cl_int CL_API_CALL clWaitSemaphoresFromHostEXP_EMU(
+    cl_uint num_sema_objects,
+    const cl_semaphore_khr *sema_objects,
+    const cl_semaphore_payload_khr *sema_payload_list,
+    cl_ulong timeout_ns);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Override Functions
 
@@ -23,6 +23,7 @@
 #include <cstring>
 #include <cstdio>
 
+#include "getenv_util.hpp"
 #include "layer_util.hpp"
 
 #include "emulate.h"
@@ -31,6 +32,20 @@
 #define CL_KHR_SEMAPHORE_EXTENSION_NAME "cl_khr_semaphore"
 #endif
 
+// Validating event wait lists checks that each event in the event wait list
+// for a semaphore wait or signal is in the same context as the command-queue
+// and has not failed.  This requires querying every event, so it is
+// disabled by default.
+
+bool g_ValidateEventWaitList = false;
+
+// Timeline semaphores are not part of cl_khr_semaphore, so semaphores may
+// only be created with the layer-specific timeline semaphore type when this
+// is enabled.  The timeline semaphore type is never included in the
+// semaphore types for a device or platform.
+
+bool g_TimelineSemaphores = false;
+
 const struct _cl_icd_dispatch* g_pNextDispatch = NULL;
 
 static cl_int CL_API_CALL
@@ -124,6 +139,10 @@ clGetExtensionFunctionAddressForPlatform_layer(
     // cl_khr_semaphore.
     CHECK_RETURN_EXTENSION_FUNCTION( clGetSemaphoreHandleForTypeKHR );
 
+    // These functions are specific to this layer.
+    CHECK_RETURN_EXTENSION_FUNCTION( clSignalSemaphoresFromHostEXP );
+    CHECK_RETURN_EXTENSION_FUNCTION( clWaitSemaphoresFromHostEXP );
+
     return g_pNextDispatch->clGetExtensionFunctionAddressForPlatform(
         platform,
         func_name);
@@ -161,24 +180,49 @@ static cl_int CL_API_CALL
 clReleaseEvent_layer(
     cl_event         event)
 {
-    cl_uint refCount = 0;
-    g_pNextDispatch->clGetEventInfo(
-        event,
-        CL_EVENT_REFERENCE_COUNT,
-        sizeof(refCount),
-        &refCount,
-        nullptr);
-    if (refCount == 1) {
-        auto& context = getLayerContext();
-        auto it = context.EventMap.find(event);
-        if (it != context.EventMap.end()) {
-            context.EventMap.erase(it);
+    // Most events are not semaphore events, so only query the reference
+    // count if there are semaphore events.
+    auto& context = getLayerContext();
+    if (!context.EventMap.empty()) {
+        cl_uint refCount = 0;
+        g_pNextDispatch->clGetEventInfo(
+            event,
+            CL_EVENT_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+        if (refCount == 1) {
+            context.EventMap.erase(event);
         }
     }
 
     return g_pNextDispatch->clReleaseEvent(event);
 }
 
+static cl_int CL_API_CALL
+clReleaseCommandQueue_layer(
+    cl_command_queue command_queue)
+{
+    // Only query the reference count if a context has been cached for any
+    // command-queue, since the command-queue handle may be reused after the
+    // command-queue is released.
+    auto& context = getLayerContext();
+    if (!context.QueueContextMap.empty()) {
+        cl_uint refCount = 0;
+        g_pNextDispatch->clGetCommandQueueInfo(
+            command_queue,
+            CL_QUEUE_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+        if (refCount == 1) {
+            context.QueueContextMap.erase(command_queue);
+        }
+    }
+
+    return g_pNextDispatch->clReleaseCommandQueue(command_queue);
+}
+
 static struct _cl_icd_dispatch dispatch;
 static void _init_dispatch()
 {
@@ -186,6 +230,7 @@ static void _init_dispatch()
     dispatch.clGetEventInfo = clGetEventInfo_layer;
     dispatch.clGetExtensionFunctionAddressForPlatform = clGetExtensionFunctionAddressForPlatform_layer;
     dispatch.clGetPlatformInfo = clGetPlatformInfo_layer;
+    dispatch.clReleaseCommandQueue = clReleaseCommandQueue_layer;
     dispatch.clReleaseEvent = clReleaseEvent_layer;
 }
 
@@ -245,6 +290,9 @@ CL_API_ENTRY cl_int CL_API_CALL clInitLayerWithProperties(
         return CL_INVALID_VALUE;
     }
 
+    getControl("SEMAEMU_ValidateEventWaitList", g_ValidateEventWaitList);
+    getControl("SEMAEMU_TimelineSemaphores", g_TimelineSemaphores);
+
     _init_dispatch();
 
     g_pNextDispatch = target_dispatch;
@@ -13,10 +13,18 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include "file_util.hpp"
 #include "layer_util.hpp"
 
 #include "emulate.h"
@@ -24,6 +32,29 @@
 static constexpr cl_version version_cl_khr_subgroup_queries =
     CL_MAKE_VERSION(0, 1, 0);
 
+static std::string getDeviceString(cl_device_id device, cl_device_info param_name)
+{
+    std::string value;
+    size_t size = 0;
+    g_pNextDispatch->clGetDeviceInfo(
+        device,
+        param_name,
+        0,
+        nullptr,
+        &size);
+    if (size) {
+        value.resize(size);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            param_name,
+            size,
+            &value[0],
+            nullptr);
+        value.pop_back();
+    }
+    return value;
+}
+
 struct SDeviceInfo
 {
     bool supports_cl_khr_subgroup_queries = true;
@@ -31,539 +62,803 @@ struct SDeviceInfo
     std::vector<const char*>    ExtendedInstructionSets;
     std::vector<const char*>    Extensions;
     std::vector<cl_uint>        Capabilities;
+
+    // Overridden device extension queries, used when the device does not
+    // support cl_khr_spirv_queries.
+    std::string                 DeviceExtensions;
+    bool                        OverrideExtensionsWithVersion = false;
+    std::vector<cl_name_version>    DeviceExtensionsWithVersion;
 };
 
 struct SLayerContext
 {
-    SLayerContext()
+    const SDeviceInfo& getDeviceInfo(cl_device_id device)
     {
-        cl_uint numPlatforms = 0;
-        g_pNextDispatch->clGetPlatformIDs(
-            0,
-            nullptr,
-            &numPlatforms);
+        // Lookups for devices that have been queried before read an
+        // immutable snapshot of the device map and do not take a lock.
+        auto snapshot = std::atomic_load(&m_Snapshot);
+        if (snapshot) {
+            auto it = snapshot->find(device);
+            if (it != snapshot->end()) {
+                return *it->second;
+            }
+        }
 
-        std::vector<cl_platform_id> platforms;
-        platforms.resize(numPlatforms);
-        g_pNextDispatch->clGetPlatformIDs(
-            numPlatforms,
-            platforms.data(),
-            nullptr);
+        // Device info is built lazily, the first time a root device or one
+        // of its sub-devices is queried, rather than for every device when
+        // the layer is loaded.  Entries are never removed from the device
+        // info map, so references to them remain valid after the lock is
+        // released.
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        // Sub-devices use the device info for their root device.  Invalid
+        // devices use the default device info, which does not override any
+        // queries, and are not memoized.
+        static const SDeviceInfo defaultDeviceInfo;
+        cl_device_id rootDevice = device;
+        while (true) {
+            cl_device_id parentDevice = nullptr;
+            cl_int errorCode = g_pNextDispatch->clGetDeviceInfo(
+                rootDevice,
+                CL_DEVICE_PARENT_DEVICE,
+                sizeof(parentDevice),
+                &parentDevice,
+                nullptr);
+            if (errorCode == CL_INVALID_DEVICE) {
+                return defaultDeviceInfo;
+            }
+            if (errorCode != CL_SUCCESS || parentDevice == nullptr) {
+                break;
+            }
+            rootDevice = parentDevice;
+        }
 
-        for (auto platform : platforms) {
-            getSPIRVQueriesForPlatform(platform);
+        auto it = m_DeviceInfo.find(rootDevice);
+        if (it == m_DeviceInfo.end()) {
+            it = m_DeviceInfo.emplace(rootDevice, SDeviceInfo()).first;
+            SDeviceInfo& deviceInfo = it->second;
+            if (g_CacheDir.empty()) {
+                initDeviceInfo(rootDevice, deviceInfo);
+            } else {
+                std::string cacheKey = getCacheKey(rootDevice);
+                if (loadDeviceInfo(cacheKey, deviceInfo) == false) {
+                    initDeviceInfo(rootDevice, deviceInfo);
+                    saveDeviceInfo(cacheKey, deviceInfo);
+                }
+            }
         }
-    }
+        const SDeviceInfo& deviceInfo = it->second;
+
+        // Publish a new snapshot including this device.  Concurrent readers
+        // continue to use the previous snapshot.
+        auto current = std::atomic_load(&m_Snapshot);
+        auto newSnapshot = current ?
+            std::make_shared<CDeviceMap>(*current) :
+            std::make_shared<CDeviceMap>();
+        (*newSnapshot)[rootDevice] = &deviceInfo;
+        if (device != rootDevice) {
+            (*newSnapshot)[device] = &deviceInfo;
+            m_HasSubDevices = true;
+        }
+        std::atomic_store(&m_Snapshot,
+            std::shared_ptr<const CDeviceMap>(std::move(newSnapshot)));
 
-    const SDeviceInfo& getDeviceInfo(cl_device_id device) const
-    {
-        // TODO: query the parent device if this is a sub-device?
-        return m_DeviceInfo.at(device);
+        return deviceInfo;
     }
 
-    const SDeviceInfo& getDeviceInfo(cl_device_id device)
+    // Removes a sub-device from the device map when it is released, since
+    // the sub-device handle may be reused for a different device.
+    void releaseDevice(cl_device_id device)
     {
-        return m_DeviceInfo[device];
+        // Only query the reference count if any sub-devices are in the map.
+        if (m_HasSubDevices == false) {
+            return;
+        }
+
+        auto snapshot = std::atomic_load(&m_Snapshot);
+        if (!snapshot || snapshot->find(device) == snapshot->end()) {
+            return;
+        }
+
+        cl_uint refCount = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_REFERENCE_COUNT,
+            sizeof(refCount),
+            &refCount,
+            nullptr);
+        if (refCount != 1) {
+            return;
+        }
+
+        // Root devices are never released, so they are not removed.
+        cl_device_id parentDevice = nullptr;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_PARENT_DEVICE,
+            sizeof(parentDevice),
+            &parentDevice,
+            nullptr);
+        if (parentDevice == nullptr) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto newSnapshot =
+            std::make_shared<CDeviceMap>(*std::atomic_load(&m_Snapshot));
+        newSnapshot->erase(device);
+        std::atomic_store(&m_Snapshot,
+            std::shared_ptr<const CDeviceMap>(std::move(newSnapshot)));
     }
 
 private:
+    // Increment this whenever the device info tables computed by the layer
+    // change, so stale cache files are ignored.
+    static constexpr cl_uint cacheVersion = 1;
+
+    std::mutex  m_Mutex;
     std::map<cl_device_id, SDeviceInfo>     m_DeviceInfo;
 
-    void getSPIRVQueriesForPlatform(cl_platform_id platform)
+    // Maps root devices and sub-devices to the device info for their root
+    // device.  The map is copied and replaced when a device is added or
+    // removed, so it may be read without a lock.
+    typedef std::map<cl_device_id, const SDeviceInfo*>  CDeviceMap;
+    std::shared_ptr<const CDeviceMap>   m_Snapshot;
+    std::atomic<bool>   m_HasSubDevices{false};
+
+    // Storage for strings loaded from cache files, since the SPIR-V
+    // extension and extended instruction set queries return pointers.
+    std::set<std::string>   m_Strings;
+
+    void initDeviceInfo(cl_device_id device, SDeviceInfo& deviceInfo)
     {
-        cl_uint numDevices = 0;
-        g_pNextDispatch->clGetDeviceIDs(
-            platform,
-            CL_DEVICE_TYPE_ALL,
+        size_t size = 0;
+
+        std::string deviceExtensions;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS,
             0,
             nullptr,
-            &numDevices);
-
-        std::vector<cl_device_id> devices;
-        devices.resize(numDevices);
-        g_pNextDispatch->clGetDeviceIDs(
-            platform,
-            CL_DEVICE_TYPE_ALL,
-            numDevices,
-            devices.data(),
-            nullptr);
+            &size);
+        if (size) {
+            deviceExtensions.resize(size);
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_EXTENSIONS,
+                size,
+                &deviceExtensions[0],
+                nullptr);
+            deviceExtensions.pop_back();
+            deviceInfo.supports_cl_khr_subgroup_queries =
+                checkStringForExtension(
+                    deviceExtensions.c_str(),
+                    CL_KHR_SPIRV_QUERIES_EXTENSION_NAME);
+        }
 
-        for (auto device : devices) {
-            SDeviceInfo& deviceInfo = m_DeviceInfo[device];
+        std::string deviceILVersion;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_IL_VERSION,
+            0,
+            nullptr,
+            &size);
+        if (size) {
+            deviceILVersion.resize(size);
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_IL_VERSION,
+                size,
+                &deviceILVersion[0],
+                nullptr);
+            deviceILVersion.pop_back();
+        }
 
-            size_t size = 0;
+        if (deviceInfo.supports_cl_khr_subgroup_queries == false &&
+            deviceILVersion.find("SPIR-V") != std::string::npos) {
 
-            std::string deviceExtensions;
+            cl_version  deviceVersion = CL_MAKE_VERSION(0, 0, 0);
+            std::string deviceVersionString;
             g_pNextDispatch->clGetDeviceInfo(
                 device,
-                CL_DEVICE_EXTENSIONS,
+                CL_DEVICE_VERSION,
                 0,
                 nullptr,
                 &size);
             if (size) {
-                deviceExtensions.resize(size);
+                deviceVersionString.resize(size);
                 g_pNextDispatch->clGetDeviceInfo(
                     device,
-                    CL_DEVICE_EXTENSIONS,
+                    CL_DEVICE_VERSION,
                     size,
-                    &deviceExtensions[0],
+                    &deviceVersionString[0],
                     nullptr);
-                deviceExtensions.pop_back();
-                deviceInfo.supports_cl_khr_subgroup_queries =
-                    checkStringForExtension(
-                        deviceExtensions.c_str(),
-                        CL_KHR_SPIRV_QUERIES_EXTENSION_NAME);
+                deviceVersionString.pop_back();
+                deviceVersion = getOpenCLVersionFromString(
+                    deviceVersionString.c_str());
             }
 
-            std::string deviceILVersion;
+            std::string deviceProfile;
             g_pNextDispatch->clGetDeviceInfo(
                 device,
-                CL_DEVICE_IL_VERSION,
+                CL_DEVICE_PROFILE,
                 0,
                 nullptr,
                 &size);
             if (size) {
-                deviceILVersion.resize(size);
+                deviceProfile.resize(size);
                 g_pNextDispatch->clGetDeviceInfo(
                     device,
-                    CL_DEVICE_IL_VERSION,
+                    CL_DEVICE_PROFILE,
                     size,
-                    &deviceILVersion[0],
+                    &deviceProfile[0],
                     nullptr);
-                deviceILVersion.pop_back();
+                deviceProfile.pop_back();
             }
 
-            if (deviceInfo.supports_cl_khr_subgroup_queries == false &&
-                deviceILVersion.find("SPIR-V") != std::string::npos) {
+            cl_bool deviceImageSupport = CL_FALSE;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_IMAGE_SUPPORT,
+                sizeof(deviceImageSupport),
+                &deviceImageSupport,
+                nullptr);
 
-                cl_version  deviceVersion = CL_MAKE_VERSION(0, 0, 0);
-                std::string deviceVersionString;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_VERSION,
-                    0,
-                    nullptr,
-                    &size);
-                if (size) {
-                    deviceVersionString.resize(size);
-                    g_pNextDispatch->clGetDeviceInfo(
-                        device,
-                        CL_DEVICE_VERSION,
-                        size,
-                        &deviceVersionString[0],
-                        nullptr);
-                    deviceVersionString.pop_back();
-                    deviceVersion = getOpenCLVersionFromString(
-                        deviceVersionString.c_str());
-                }
+            cl_uint deviceMaxReadWriteImageArgs = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_MAX_READ_WRITE_IMAGE_ARGS,
+                sizeof(deviceMaxReadWriteImageArgs),
+                &deviceMaxReadWriteImageArgs,
+                nullptr);
 
-                std::string deviceProfile;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_PROFILE,
-                    0,
-                    nullptr,
-                    &size);
-                if (size) {
-                    deviceProfile.resize(size);
-                    g_pNextDispatch->clGetDeviceInfo(
-                        device,
-                        CL_DEVICE_PROFILE,
-                        size,
-                        &deviceProfile[0],
-                        nullptr);
-                    deviceProfile.pop_back();
-                }
+            cl_uint deviceMaxNumSubGroups = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_MAX_NUM_SUB_GROUPS,
+                sizeof(deviceMaxNumSubGroups),
+                &deviceMaxNumSubGroups,
+                nullptr);
 
-                cl_bool deviceImageSupport = CL_FALSE;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_IMAGE_SUPPORT,
-                    sizeof(deviceImageSupport),
-                    &deviceImageSupport,
-                    nullptr);
+            cl_bool deviceGenericAddressSpaceSupport = CL_FALSE;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_GENERIC_ADDRESS_SPACE_SUPPORT,
+                sizeof(deviceGenericAddressSpaceSupport),
+                &deviceGenericAddressSpaceSupport,
+                nullptr);
 
-                cl_uint deviceMaxReadWriteImageArgs = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_MAX_READ_WRITE_IMAGE_ARGS,
-                    sizeof(deviceMaxReadWriteImageArgs),
-                    &deviceMaxReadWriteImageArgs,
-                    nullptr);
+            cl_bool deviceWorkGroupCollectiveFunctionsSupport = CL_FALSE;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_WORK_GROUP_COLLECTIVE_FUNCTIONS_SUPPORT,
+                sizeof(deviceWorkGroupCollectiveFunctionsSupport),
+                &deviceWorkGroupCollectiveFunctionsSupport,
+                nullptr);
 
-                cl_uint deviceMaxNumSubGroups = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_MAX_NUM_SUB_GROUPS,
-                    sizeof(deviceMaxNumSubGroups),
-                    &deviceMaxNumSubGroups,
-                    nullptr);
+            cl_bool devicePipeSupport = CL_FALSE;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_PIPE_SUPPORT,
+                sizeof(devicePipeSupport),
+                &devicePipeSupport,
+                nullptr);
 
-                cl_bool deviceGenericAddressSpaceSupport = CL_FALSE;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_GENERIC_ADDRESS_SPACE_SUPPORT,
-                    sizeof(deviceGenericAddressSpaceSupport),
-                    &deviceGenericAddressSpaceSupport,
-                    nullptr);
+            cl_device_device_enqueue_capabilities deviceDeviceEnqueueCapabilities = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES,
+                sizeof(deviceDeviceEnqueueCapabilities),
+                &deviceDeviceEnqueueCapabilities,
+                nullptr);
 
-                cl_bool deviceWorkGroupCollectiveFunctionsSupport = CL_FALSE;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_WORK_GROUP_COLLECTIVE_FUNCTIONS_SUPPORT,
-                    sizeof(deviceWorkGroupCollectiveFunctionsSupport),
-                    &deviceWorkGroupCollectiveFunctionsSupport,
-                    nullptr);
+            cl_device_integer_dot_product_capabilities_khr deviceIntegerDotProductCapabilities = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR,
+                sizeof(deviceIntegerDotProductCapabilities),
+                &deviceIntegerDotProductCapabilities,
+                nullptr);
 
-                cl_bool devicePipeSupport = CL_FALSE;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_PIPE_SUPPORT,
-                    sizeof(devicePipeSupport),
-                    &devicePipeSupport,
-                    nullptr);
+            cl_device_fp_atomic_capabilities_ext deviceFp32AtomicCapabilities = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_SINGLE_FP_ATOMIC_CAPABILITIES_EXT,
+                sizeof(deviceFp32AtomicCapabilities),
+                &deviceFp32AtomicCapabilities,
+                nullptr);
 
-                cl_device_device_enqueue_capabilities deviceDeviceEnqueueCapabilities = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES,
-                    sizeof(deviceDeviceEnqueueCapabilities),
-                    &deviceDeviceEnqueueCapabilities,
-                    nullptr);
+            cl_device_fp_atomic_capabilities_ext deviceFp16AtomicCapabilities = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_HALF_FP_ATOMIC_CAPABILITIES_EXT,
+                sizeof(deviceFp16AtomicCapabilities),
+                &deviceFp16AtomicCapabilities,
+                nullptr);
 
-                cl_device_integer_dot_product_capabilities_khr deviceIntegerDotProductCapabilities = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR,
-                    sizeof(deviceIntegerDotProductCapabilities),
-                    &deviceIntegerDotProductCapabilities,
-                    nullptr);
+            cl_device_fp_atomic_capabilities_ext deviceFp64AtomicCapabilities = 0;
+            g_pNextDispatch->clGetDeviceInfo(
+                device,
+                CL_DEVICE_DOUBLE_FP_ATOMIC_CAPABILITIES_EXT,
+                sizeof(deviceFp64AtomicCapabilities),
+                &deviceFp64AtomicCapabilities,
+                nullptr);
+
+
+            // Required.
+            deviceInfo.ExtendedInstructionSets.push_back("OpenCL.std");
+
+            deviceInfo.Capabilities.push_back(spv::CapabilityAddresses);
+            deviceInfo.Capabilities.push_back(spv::CapabilityFloat16Buffer);
+            deviceInfo.Capabilities.push_back(spv::CapabilityInt16);
+            deviceInfo.Capabilities.push_back(spv::CapabilityInt8);
+            deviceInfo.Capabilities.push_back(spv::CapabilityKernel);
+            deviceInfo.Capabilities.push_back(spv::CapabilityLinkage);
+            deviceInfo.Capabilities.push_back(spv::CapabilityVector16);
+
+            // Required for FULL_PROFILE devices, or devices supporting cles_khr_int64.
+            if (deviceProfile == "FULL_PROFILE" ||
+                checkStringForExtension(deviceExtensions.c_str(), "cles_khr_int64")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityInt64);
+            }
 
-                cl_device_fp_atomic_capabilities_ext deviceFp32AtomicCapabilities = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_SINGLE_FP_ATOMIC_CAPABILITIES_EXT,
-                    sizeof(deviceFp32AtomicCapabilities),
-                    &deviceFp32AtomicCapabilities,
-                    nullptr);
+            // Required for devices supporting images.
+            if (deviceImageSupport == CL_TRUE) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityImage1D);
+                deviceInfo.Capabilities.push_back(spv::CapabilityImageBasic);
+                deviceInfo.Capabilities.push_back(spv::CapabilityImageBuffer);
+                deviceInfo.Capabilities.push_back(spv::CapabilityLiteralSampler);
+                deviceInfo.Capabilities.push_back(spv::CapabilitySampled1D);
+                deviceInfo.Capabilities.push_back(spv::CapabilitySampledBuffer);
+            }
 
-                cl_device_fp_atomic_capabilities_ext deviceFp16AtomicCapabilities = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_HALF_FP_ATOMIC_CAPABILITIES_EXT,
-                    sizeof(deviceFp16AtomicCapabilities),
-                    &deviceFp16AtomicCapabilities,
-                    nullptr);
+            // Required for devices supporting SPIR-V 1.6.
+            if (deviceILVersion.find("SPIR-V_1.6") != std::string::npos) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityUniformDecoration);
+            }
 
-                cl_device_fp_atomic_capabilities_ext deviceFp64AtomicCapabilities = 0;
-                g_pNextDispatch->clGetDeviceInfo(
-                    device,
-                    CL_DEVICE_DOUBLE_FP_ATOMIC_CAPABILITIES_EXT,
-                    sizeof(deviceFp64AtomicCapabilities),
-                    &deviceFp64AtomicCapabilities,
-                    nullptr);
+            // Required for devices supporting images, for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting read-write images.
+            if (deviceImageSupport == CL_TRUE &&
+                (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
+                 deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
+                 deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
+                 (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
+                     deviceMaxReadWriteImageArgs != 0))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityImageReadWrite);
+            }
 
+            // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting the generic address space.
+            if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
+                (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
+                    deviceGenericAddressSpaceSupport == CL_TRUE)) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGenericPointer);
+            }
 
-                // Required.
-                deviceInfo.ExtendedInstructionSets.push_back("OpenCL.std");
+            // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting sub-groups or work-group collective functions.
+            if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
+                (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
+                    (deviceMaxNumSubGroups != 0 || deviceWorkGroupCollectiveFunctionsSupport == CL_TRUE))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroups);
+            }
 
-                deviceInfo.Capabilities.push_back(spv::CapabilityAddresses);
-                deviceInfo.Capabilities.push_back(spv::CapabilityFloat16Buffer);
-                deviceInfo.Capabilities.push_back(spv::CapabilityInt16);
-                deviceInfo.Capabilities.push_back(spv::CapabilityInt8);
-                deviceInfo.Capabilities.push_back(spv::CapabilityKernel);
-                deviceInfo.Capabilities.push_back(spv::CapabilityLinkage);
-                deviceInfo.Capabilities.push_back(spv::CapabilityVector16);
+            // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting the generic address space.
+            if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
+                (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
+                    devicePipeSupport == CL_TRUE)) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityPipes);
+            }
 
-                // Required for FULL_PROFILE devices, or devices supporting cles_khr_int64.
-                if (deviceProfile == "FULL_PROFILE" ||
-                    checkStringForExtension(deviceExtensions.c_str(), "cles_khr_int64")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityInt64);
-                }
+            // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting device-side enqueue.
+            if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
+                deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
+                (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
+                    deviceDeviceEnqueueCapabilities != 0)) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityDeviceEnqueue);
+            }
 
-                // Required for devices supporting images.
-                if (deviceImageSupport == CL_TRUE) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityImage1D);
-                    deviceInfo.Capabilities.push_back(spv::CapabilityImageBasic);
-                    deviceInfo.Capabilities.push_back(spv::CapabilityImageBuffer);
-                    deviceInfo.Capabilities.push_back(spv::CapabilityLiteralSampler);
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySampled1D);
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySampledBuffer);
-                }
+            // Required for OpenCL 2.2 devices.
+            if (deviceILVersion.find("SPIR-V_1.1") != std::string::npos &&
+                deviceVersion == CL_MAKE_VERSION(2, 2, 0)) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityPipeStorage);
+            }
 
-                // Required for devices supporting SPIR-V 1.6.
-                if (deviceILVersion.find("SPIR-V_1.6") != std::string::npos) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityUniformDecoration);
-                }
+            // Required for OpenCL 2.2, or OpenCL 3.0 devices supporting sub-groups.
+            if (deviceILVersion.find("SPIR-V_1.1") != std::string::npos &&
+                (deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
+                 (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) && deviceMaxNumSubGroups != 0))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupDispatch);
+            }
 
-                // Required for devices supporting images, for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting read-write images.
-                if (deviceImageSupport == CL_TRUE &&
-                    (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
-                     deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
-                     deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
-                     (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
-                         deviceMaxReadWriteImageArgs != 0))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityImageReadWrite);
-                }
+            // Required for devices supporting cl_khr_expect_assume.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_expect_assume")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_expect_assume");
+                deviceInfo.Capabilities.push_back(spv::CapabilityExpectAssumeKHR);
+            }
 
-                // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting the generic address space.
-                if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
-                    (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
-                        deviceGenericAddressSpaceSupport == CL_TRUE)) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGenericPointer);
-                }
+            // Required for devices supporting cl_khr_extended_bit_ops.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_extended_bit_ops")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_bit_instructions");
+                deviceInfo.Capabilities.push_back(spv::CapabilityBitInstructions);
+            }
 
-                // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting sub-groups or work-group collective functions.
-                if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
-                    (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
-                        (deviceMaxNumSubGroups != 0 || deviceWorkGroupCollectiveFunctionsSupport == CL_TRUE))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroups);
-                }
+            // Required for devices supporting half-precision floating-point (cl_khr_fp16).
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_fp16")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityFloat16);
+            }
 
-                // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting the generic address space.
-                if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
-                    (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
-                        devicePipeSupport == CL_TRUE)) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityPipes);
-                }
+            // Required for devices supporting double-precision floating-point (cl_khr_fp64).
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_fp64")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityFloat64);
+            }
 
-                // Required for OpenCL 2.0, OpenCL 2.1, OpenCL 2.2, or OpenCL 3.0 devices supporting device-side enqueue.
-                if (deviceVersion == CL_MAKE_VERSION(2, 0, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 1, 0) ||
-                    deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
-                    (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) &&
-                        deviceDeviceEnqueueCapabilities != 0)) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityDeviceEnqueue);
-                }
+            // Required for devices supporting 64-bit atomics (cl_khr_int64_base_atomics or cl_khr_int64_extended_atomics).
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_int64_base_atomics") ||
+                checkStringForExtension(deviceExtensions.c_str(), "cl_khr_int64_extended_atomics")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityInt64Atomics);
+            }
 
-                // Required for OpenCL 2.2 devices.
-                if (deviceILVersion.find("SPIR-V_1.1") != std::string::npos &&
-                    deviceVersion == CL_MAKE_VERSION(2, 2, 0)) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityPipeStorage);
-                }
+            // Required for devices supporting cl_khr_integer_dot_product.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_integer_dot_product")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_integer_dot_product");
+                deviceInfo.Capabilities.push_back(spv::CapabilityDotProduct);
+                deviceInfo.Capabilities.push_back(spv::CapabilityDotProductInput4x8BitPacked);
+            }
 
-                // Required for OpenCL 2.2, or OpenCL 3.0 devices supporting sub-groups.
-                if (deviceILVersion.find("SPIR-V_1.1") != std::string::npos &&
-                    (deviceVersion == CL_MAKE_VERSION(2, 2, 0) ||
-                     (deviceVersion >= CL_MAKE_VERSION(3, 0, 0) && deviceMaxNumSubGroups != 0))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupDispatch);
-                }
+            // Required for devices supporting cl_khr_integer_dot_product and CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_integer_dot_product") &&
+                (deviceIntegerDotProductCapabilities & CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR)) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityDotProductInput4x8Bit);
+            }
 
-                // Required for devices supporting cl_khr_expect_assume.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_expect_assume")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_expect_assume");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityExpectAssumeKHR);
-                }
+            // Required for devices supporting cl_khr_kernel_clock.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_kernel_clock")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_shader_clock");
+                deviceInfo.Capabilities.push_back(spv::CapabilityShaderClockKHR);
+            }
 
-                // Required for devices supporting cl_khr_extended_bit_ops.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_extended_bit_ops")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_bit_instructions");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityBitInstructions);
-                }
+            // Required for devices supporting both cl_khr_mipmap_image and cl_khr_mipmap_image_writes.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_mipmap_image") &&
+                checkStringForExtension(deviceExtensions.c_str(), "cl_khr_mipmap_image_writes")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityImageMipmap);
+            }
 
-                // Required for devices supporting half-precision floating-point (cl_khr_fp16).
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_fp16")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityFloat16);
-                }
+            // Required for devices supporting cl_khr_spirv_extended_debug_info.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_spirv_extended_debug_info")) {
+                deviceInfo.ExtendedInstructionSets.push_back("OpenCL.DebugInfo.100");
+            }
 
-                // Required for devices supporting double-precision floating-point (cl_khr_fp64).
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_fp64")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityFloat64);
-                }
+            // Required for devices supporting cl_khr_spirv_linkonce_odr.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_spirv_linkonce_odr")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_linkonce_odr");
+            }
 
-                // Required for devices supporting 64-bit atomics (cl_khr_int64_base_atomics or cl_khr_int64_extended_atomics).
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_int64_base_atomics") ||
-                    checkStringForExtension(deviceExtensions.c_str(), "cl_khr_int64_extended_atomics")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityInt64Atomics);
-                }
+            // Required for devices supporting cl_khr_spirv_no_integer_wrap_decoration.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_spirv_no_integer_wrap_decoration")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_no_integer_wrap_decoration");
+            }
 
-                // Required for devices supporting cl_khr_integer_dot_product.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_integer_dot_product")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_integer_dot_product");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityDotProduct);
-                    deviceInfo.Capabilities.push_back(spv::CapabilityDotProductInput4x8BitPacked);
-                }
+            // Required for devices supporting cl_khr_subgroup_ballot.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_ballot")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformBallot);
+            }
 
-                // Required for devices supporting cl_khr_integer_dot_product and CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_integer_dot_product") &&
-                    (deviceIntegerDotProductCapabilities & CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR)) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityDotProductInput4x8Bit);
-                }
+            // Required for devices supporting cl_khr_subgroup_clustered_reduce.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_clustered_reduce")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformClustered);
+            }
 
-                // Required for devices supporting cl_khr_kernel_clock.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_kernel_clock")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_shader_clock");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityShaderClockKHR);
-                }
+            // Required for devices supporting cl_khr_subgroup_named_barrier.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_named_barrier")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityNamedBarrier);
+            }
 
-                // Required for devices supporting both cl_khr_mipmap_image and cl_khr_mipmap_image_writes.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_mipmap_image") &&
-                    checkStringForExtension(deviceExtensions.c_str(), "cl_khr_mipmap_image_writes")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityImageMipmap);
-                }
+            // Required for devices supporting cl_khr_subgroup_non_uniform_arithmetic.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_non_uniform_arithmetic")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformArithmetic);
+            }
 
-                // Required for devices supporting cl_khr_spirv_extended_debug_info.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_spirv_extended_debug_info")) {
-                    deviceInfo.ExtendedInstructionSets.push_back("OpenCL.DebugInfo.100");
-                }
+            // Required for devices supporting cl_khr_subgroup_non_uniform_vote.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_non_uniform_vote")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniform);
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformVote);
+            }
 
-                // Required for devices supporting cl_khr_spirv_linkonce_odr.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_spirv_linkonce_odr")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_linkonce_odr");
-                }
+            // Required for devices supporting cl_khr_subgroup_rotate.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_rotate")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_subgroup_rotate");
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformRotateKHR);
+            }
 
-                // Required for devices supporting cl_khr_spirv_no_integer_wrap_decoration.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_spirv_no_integer_wrap_decoration")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_no_integer_wrap_decoration");
-                }
+            // Required for devices supporting cl_khr_subgroup_shuffle.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_shuffle")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformShuffle);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_ballot.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_ballot")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformBallot);
-                }
+            // Required for devices supporting cl_khr_subgroup_shuffle_relative.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_shuffle_relative")) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformShuffleRelative);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_clustered_reduce.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_clustered_reduce")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformClustered);
-                }
+            // Required for devices supporting cl_khr_work_group_uniform_arithmetic.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_work_group_uniform_arithmetic")) {
+                deviceInfo.Extensions.push_back("SPV_KHR_uniform_group_instructions");
+                deviceInfo.Capabilities.push_back(spv::CapabilityGroupUniformArithmeticKHR);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_named_barrier.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_named_barrier")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityNamedBarrier);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp32 atomic adds.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                (deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat32AddEXT);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_non_uniform_arithmetic.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_non_uniform_arithmetic")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformArithmetic);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp32 atomic min and max.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                (deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat32MinMaxEXT);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_non_uniform_vote.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_non_uniform_vote")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniform);
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformVote);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp16 atomic adds.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                (deviceFp16AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT))) {
+                deviceInfo.Extensions.push_back("SPV_EXT_shader_atomic_float16_add");
+                deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat16AddEXT);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_rotate.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_rotate")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_subgroup_rotate");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformRotateKHR);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp16 atomic min and max.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                (deviceFp16AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat16MinMaxEXT);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_shuffle.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_shuffle")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformShuffle);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp64 atomic adds.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat64AddEXT);
+            }
 
-                // Required for devices supporting cl_khr_subgroup_shuffle_relative.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_subgroup_shuffle_relative")) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupNonUniformShuffleRelative);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp64 atomic min and max.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT))) {
+                deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat64MinMaxEXT);
+            }
 
-                // Required for devices supporting cl_khr_work_group_uniform_arithmetic.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_khr_work_group_uniform_arithmetic")) {
-                    deviceInfo.Extensions.push_back("SPV_KHR_uniform_group_instructions");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityGroupUniformArithmeticKHR);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp16, fp32, or fp64 atomic min or max.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                ((deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT)) ||
+                 (deviceFp16AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT)) ||
+                 (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT)))) {
+                deviceInfo.Extensions.push_back("SPV_EXT_shader_atomic_float_min_max");
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp32 atomic adds.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    (deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat32AddEXT);
-                }
+            // Required for devices supporting cl_ext_float_atomics and fp32 or fp64 atomic adds.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
+                ((deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT)) ||
+                 (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT)))) {
+                deviceInfo.Extensions.push_back("SPV_EXT_shader_atomic_float_add");
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp32 atomic min and max.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    (deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat32MinMaxEXT);
-                }
+            // Required for devices supporting cl_intel_bfloat16_conversions.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_bfloat16_conversions")) {
+                deviceInfo.Extensions.push_back("SPV_INTEL_bfloat16_conversion");
+                deviceInfo.Capabilities.push_back(spv::CapabilityBFloat16ConversionINTEL);
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp16 atomic adds.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    (deviceFp16AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT))) {
-                    deviceInfo.Extensions.push_back("SPV_EXT_shader_atomic_float16_add");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat16AddEXT);
-                }
+            // Required for devices supporting cl_intel_spirv_device_side_avc_motion_estimation.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_spirv_device_side_avc_motion_estimation")) {
+                deviceInfo.Extensions.push_back("SPV_INTEL_device_side_avc_motion_estimation");
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupAvcMotionEstimationChromaINTEL);
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupAvcMotionEstimationINTEL);
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupAvcMotionEstimationIntraINTEL);
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp16 atomic min and max.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    (deviceFp16AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat16MinMaxEXT);
-                }
+            // Required for devices supporting cl_intel_spirv_media_block_io.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_spirv_media_block_io")) {
+                deviceInfo.Extensions.push_back("SPV_INTEL_media_block_io");
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupImageMediaBlockIOINTEL);
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp64 atomic adds.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat64AddEXT);
-                }
+            // Required for devices supporting cl_intel_spirv_subgroups.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_spirv_subgroups")) {
+                deviceInfo.Extensions.push_back("SPV_INTEL_subgroups");
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupBufferBlockIOINTEL);
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupImageBlockIOINTEL);
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupShuffleINTEL);
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp64 atomic min and max.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT))) {
-                    deviceInfo.Capabilities.push_back(spv::CapabilityAtomicFloat64MinMaxEXT);
-                }
+            // Required for devices supporting cl_intel_split_work_group_barrier.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_split_work_group_barrier")) {
+                deviceInfo.Extensions.push_back("SPV_INTEL_split_barrier");
+                deviceInfo.Capabilities.push_back(spv::CapabilitySplitBarrierINTEL);
+            }
 
-                // Required for devices supporting cl_ext_float_atomics and fp16, fp32, or fp64 atomic min or max.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    ((deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT)) ||
-                     (deviceFp16AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT)) ||
-                     (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_MIN_MAX_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_MIN_MAX_EXT)))) {
-                    deviceInfo.Extensions.push_back("SPV_EXT_shader_atomic_float_min_max");
-                }
+            // Required for devices supporting cl_intel_subgroup_buffer_prefetch.
+            if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_subgroup_buffer_prefetch")) {
+                deviceInfo.Extensions.push_back("SPV_INTEL_subgroup_buffer_prefetch");
+                deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupBufferPrefetchINTEL);
+            }
+        }
 
-                // Required for devices supporting cl_ext_float_atomics and fp32 or fp64 atomic adds.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_ext_float_atomics") &&
-                    ((deviceFp32AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT)) ||
-                     (deviceFp64AtomicCapabilities & (CL_DEVICE_GLOBAL_FP_ATOMIC_ADD_EXT | CL_DEVICE_LOCAL_FP_ATOMIC_ADD_EXT)))) {
-                    deviceInfo.Extensions.push_back("SPV_EXT_shader_atomic_float_add");
-                }
+        if (deviceInfo.supports_cl_khr_subgroup_queries == false) {
+            getExtensionOverrides(device, deviceExtensions, deviceInfo);
+        }
+    }
 
-                // Required for devices supporting cl_intel_bfloat16_conversions.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_bfloat16_conversions")) {
-                    deviceInfo.Extensions.push_back("SPV_INTEL_bfloat16_conversion");
-                    deviceInfo.Capabilities.push_back(spv::CapabilityBFloat16ConversionINTEL);
-                }
+    void getExtensionOverrides(
+        cl_device_id device,
+        const std::string& deviceExtensions,
+        SDeviceInfo& deviceInfo)
+    {
+        std::string newExtensions;
+        newExtensions += CL_KHR_SPIRV_QUERIES_EXTENSION_NAME;
 
-                // Required for devices supporting cl_intel_spirv_device_side_avc_motion_estimation.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_spirv_device_side_avc_motion_estimation")) {
-                    deviceInfo.Extensions.push_back("SPV_INTEL_device_side_avc_motion_estimation");
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupAvcMotionEstimationChromaINTEL);
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupAvcMotionEstimationINTEL);
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupAvcMotionEstimationIntraINTEL);
-                }
+        deviceInfo.DeviceExtensions = deviceExtensions;
 
-                // Required for devices supporting cl_intel_spirv_media_block_io.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_spirv_media_block_io")) {
-                    deviceInfo.Extensions.push_back("SPV_INTEL_media_block_io");
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupImageMediaBlockIOINTEL);
-                }
+        // If the old extension string ends with a space ensure the
+        // new extension string does too.
+        if (!deviceExtensions.empty() && deviceExtensions.back() == ' ') {
+            newExtensions += ' ';
+        } else {
+            deviceInfo.DeviceExtensions += ' ';
+        }
 
-                // Required for devices supporting cl_intel_spirv_subgroups.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_spirv_subgroups")) {
-                    deviceInfo.Extensions.push_back("SPV_INTEL_subgroups");
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupBufferBlockIOINTEL);
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupImageBlockIOINTEL);
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupShuffleINTEL);
-                }
+        deviceInfo.DeviceExtensions += newExtensions;
 
-                // Required for devices supporting cl_intel_split_work_group_barrier.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_split_work_group_barrier")) {
-                    deviceInfo.Extensions.push_back("SPV_INTEL_split_barrier");
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySplitBarrierINTEL);
-                }
+        size_t size = 0;
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS_WITH_VERSION,
+            0,
+            nullptr,
+            &size);
+
+        size_t numExtensions = size / sizeof(cl_name_version);
+        std::vector<cl_name_version> extensions(numExtensions);
+        g_pNextDispatch->clGetDeviceInfo(
+            device,
+            CL_DEVICE_EXTENSIONS_WITH_VERSION,
+            size,
+            extensions.data(),
+            nullptr);
 
-                // Required for devices supporting cl_intel_subgroup_buffer_prefetch.
-                if (checkStringForExtension(deviceExtensions.c_str(), "cl_intel_subgroup_buffer_prefetch")) {
-                    deviceInfo.Extensions.push_back("SPV_INTEL_subgroup_buffer_prefetch");
-                    deviceInfo.Capabilities.push_back(spv::CapabilitySubgroupBufferPrefetchINTEL);
+        bool found = false;
+        for (const auto& extension : extensions) {
+            if (strcmp(extension.name, CL_KHR_SPIRV_QUERIES_EXTENSION_NAME) == 0) {
+                found = true;
+                break;
+            }
+        }
+
+        if (found == false) {
+            extensions.emplace_back();
+            cl_name_version& extension = extensions.back();
+
+            memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+            strcpy(extension.name, CL_KHR_SPIRV_QUERIES_EXTENSION_NAME);
+
+            extension.version = version_cl_khr_subgroup_queries;
+
+            deviceInfo.OverrideExtensionsWithVersion = true;
+            deviceInfo.DeviceExtensionsWithVersion = std::move(extensions);
+        }
+    }
+
+    // The cache key identifies the device and the version of the layer that
+    // computed the device info.  It is written at the start of each cache
+    // file and must match exactly for the cache file to be used.
+    std::string getCacheKey(cl_device_id device)
+    {
+        std::string key;
+        key += "SPIRVQUERIESEMU " + std::to_string(cacheVersion) + "\n";
+        key += "DeviceName " + getDeviceString(device, CL_DEVICE_NAME) + "\n";
+        key += "DriverVersion " + getDeviceString(device, CL_DRIVER_VERSION) + "\n";
+        return key;
+    }
+
+    std::string getCacheFileName(const std::string& key)
+    {
+        char hash[32];
+        snprintf(hash, sizeof(hash), "%016llx",
+            (unsigned long long)hashString(key));
+        return g_CacheDir + "/spirvqueriesemu_" + hash + ".txt";
+    }
+
+    bool loadDeviceInfo(const std::string& key, SDeviceInfo& deviceInfo)
+    {
+        std::ifstream is(getCacheFileName(key), std::ios::binary);
+        if (!is.good()) {
+            return false;
+        }
+
+        std::string contents(
+            (std::istreambuf_iterator<char>(is)),
+            std::istreambuf_iterator<char>());
+        if (contents.compare(0, key.size(), key) != 0) {
+            return false;
+        }
+
+        SDeviceInfo loaded;
+        std::istringstream lines(contents.substr(key.size()));
+        std::string line;
+        while (std::getline(lines, line)) {
+            size_t pos = line.find(' ');
+            if (pos == std::string::npos) {
+                return false;
+            }
+
+            const std::string tag = line.substr(0, pos);
+            const std::string value = line.substr(pos + 1);
+            if (tag == "Supported") {
+                loaded.supports_cl_khr_subgroup_queries = value == "1";
+            } else if (tag == "ExtendedInstructionSet") {
+                loaded.ExtendedInstructionSets.push_back(
+                    m_Strings.insert(value).first->c_str());
+            } else if (tag == "Extension") {
+                loaded.Extensions.push_back(
+                    m_Strings.insert(value).first->c_str());
+            } else if (tag == "Capability") {
+                loaded.Capabilities.push_back(
+                    (cl_uint)strtoul(value.c_str(), nullptr, 10));
+            } else if (tag == "DeviceExtensions") {
+                loaded.DeviceExtensions = value;
+            } else if (tag == "ExtensionWithVersion") {
+                size_t namePos = value.find(' ');
+                if (namePos == std::string::npos ||
+                    value.size() - namePos - 1 >= CL_NAME_VERSION_MAX_NAME_SIZE) {
+                    return false;
                 }
+                loaded.DeviceExtensionsWithVersion.emplace_back();
+                cl_name_version& extension =
+                    loaded.DeviceExtensionsWithVersion.back();
+                memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
+                strcpy(extension.name, value.c_str() + namePos + 1);
+                extension.version =
+                    (cl_version)strtoul(value.c_str(), nullptr, 16);
+                loaded.OverrideExtensionsWithVersion = true;
+            } else {
+                return false;
             }
         }
+
+        deviceInfo = std::move(loaded);
+        return true;
+    }
+
+    void saveDeviceInfo(const std::string& key, const SDeviceInfo& deviceInfo)
+    {
+        std::ostringstream os;
+        os << key;
+        os << "Supported " << deviceInfo.supports_cl_khr_subgroup_queries << "\n";
+        for (auto name : deviceInfo.ExtendedInstructionSets) {
+            os << "ExtendedInstructionSet " << name << "\n";
+        }
+        for (auto name : deviceInfo.Extensions) {
+            os << "Extension " << name << "\n";
+        }
+        for (auto capability : deviceInfo.Capabilities) {
+            os << "Capability " << capability << "\n";
+        }
+        if (deviceInfo.supports_cl_khr_subgroup_queries == false) {
+            os << "DeviceExtensions " << deviceInfo.DeviceExtensions << "\n";
+        }
+        for (const auto& extension : deviceInfo.DeviceExtensionsWithVersion) {
+            os << "ExtensionWithVersion " << std::hex << extension.version
+               << std::dec << " " << extension.name << "\n";
+        }
+
+        // Failures are ignored, since the device info will simply be
+        // computed again.
+        writeFileAtomically(
+            getCacheFileName(key),
+            [&](std::ofstream& out) {
+                out << os.str();
+            });
     }
 };
 
@@ -573,6 +868,12 @@ SLayerContext& getLayerContext(void)
     return c;
 }
 
+void clReleaseDevice_override(
+    cl_device_id device)
+{
+    getLayerContext().releaseDevice(device);
+}
+
 bool clGetDeviceInfo_override(
     cl_device_id device,
     cl_device_info param_name,
@@ -589,111 +890,35 @@ bool clGetDeviceInfo_override(
     switch(param_name) {
     case CL_DEVICE_EXTENSIONS:
         {
-            size_t  size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS,
-                0,
-                nullptr,
-                &size );
-
-            std::vector<char> deviceExtensions(size);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS,
-                size,
-                deviceExtensions.data(),
-                nullptr );
+            auto ptr = (char*)param_value;
+            cl_int errorCode = writeStringToMemory(
+                param_value_size,
+                deviceInfo.DeviceExtensions.c_str(),
+                param_value_size_ret,
+                ptr );
 
-            if( checkStringForExtension(
-                    deviceExtensions.data(),
-                    CL_KHR_SPIRV_QUERIES_EXTENSION_NAME ) == false )
+            if( errcode_ret )
             {
-                std::string newExtensions;
-                newExtensions += CL_KHR_SPIRV_QUERIES_EXTENSION_NAME;
-
-                std::string oldExtensions(deviceExtensions.data());
-
-                // If the old extension string ends with a space ensure the
-                // new extension string does too.
-                if( oldExtensions.back() == ' ' )
-                {
-                    newExtensions += ' ';
-                }
-                else
-                {
-                    oldExtensions += ' ';
-                }
-
-                oldExtensions += newExtensions;
-
-                auto ptr = (char*)param_value;
-                cl_int errorCode = writeStringToMemory(
-                    param_value_size,
-                    oldExtensions.c_str(),
-                    param_value_size_ret,
-                    ptr );
-
-                if( errcode_ret )
-                {
-                    errcode_ret[0] = errorCode;
-                }
-                return true;
+                errcode_ret[0] = errorCode;
             }
+            return true;
         }
         break;
     case CL_DEVICE_EXTENSIONS_WITH_VERSION:
+        if( deviceInfo.OverrideExtensionsWithVersion )
         {
-            size_t  size = 0;
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS_WITH_VERSION,
-                0,
-                nullptr,
-                &size );
-
-            size_t  numExtensions = size / sizeof(cl_name_version);
-            std::vector<cl_name_version>    extensions(numExtensions);
-            g_pNextDispatch->clGetDeviceInfo(
-                device,
-                CL_DEVICE_EXTENSIONS_WITH_VERSION,
-                size,
-                extensions.data(),
-                nullptr );
-
-            bool found = false;
-            for( const auto& extension : extensions )
-            {
-                if( strcmp(extension.name, CL_KHR_SPIRV_QUERIES_EXTENSION_NAME) == 0 )
-                {
-                    found = true;
-                    break;
-                }
-            }
+            auto ptr = (cl_name_version*)param_value;
+            cl_int errorCode = writeVectorToMemory(
+                param_value_size,
+                deviceInfo.DeviceExtensionsWithVersion,
+                param_value_size_ret,
+                ptr );
 
-            if( found == false )
+            if( errcode_ret )
             {
-                extensions.emplace_back();
-                cl_name_version& extension = extensions.back();
-
-                memset(extension.name, 0, CL_NAME_VERSION_MAX_NAME_SIZE);
-                strcpy(extension.name, CL_KHR_SPIRV_QUERIES_EXTENSION_NAME);
-
-                extension.version = version_cl_khr_subgroup_queries;
-
-                auto ptr = (cl_name_version*)param_value;
-                cl_int errorCode = writeVectorToMemory(
-                    param_value_size,
-                    extensions,
-                    param_value_size_ret,
-                    ptr );
-
-                if( errcode_ret )
-                {
-                    errcode_ret[0] = errorCode;
-                }
-                return true;
+                errcode_ret[0] = errorCode;
             }
+            return true;
         }
         break;
     case CL_DEVICE_SPIRV_EXTENDED_INSTRUCTION_SETS_KHR:
@@ -863,3 +1088,386 @@ bool clGetPlatformInfo_override(
     }
     return false;
 }
+
+struct SModuleInfo
+{
+    std::vector<std::string>    ExtendedInstructionSets;
+    std::vector<std::string>    Extensions;
+    std::vector<cl_uint>        Capabilities;
+};
+
+// Scans the SPIR-V module header and the capabilities, extensions, and
+// extended instruction sets declared by the module.  These instructions
+// precede all functions, so scanning stops at the first function.  Returns
+// false if the intermediate language is not a SPIR-V module.
+static bool scanModule(
+    const void* il,
+    size_t length,
+    SModuleInfo& moduleInfo)
+{
+    const size_t numWords = length / sizeof(cl_uint);
+    if (il == nullptr || numWords < 5) {
+        return false;
+    }
+
+    auto readWord = [il](size_t index) {
+        cl_uint word = 0;
+        memcpy(&word, (const char*)il + index * sizeof(word), sizeof(word));
+        return word;
+    };
+    auto swapWord = [](cl_uint word) {
+        return ((word & 0x000000FF) << 24) |
+               ((word & 0x0000FF00) << 8) |
+               ((word & 0x00FF0000) >> 8) |
+               ((word & 0xFF000000) >> 24);
+    };
+
+    bool swap = false;
+    if (readWord(0) == spv::MagicNumber) {
+        swap = false;
+    } else if (swapWord(readWord(0)) == spv::MagicNumber) {
+        swap = true;
+    } else {
+        return false;
+    }
+
+    auto getWord = [&](size_t index) {
+        cl_uint word = readWord(index);
+        return swap ? swapWord(word) : word;
+    };
+    auto getString = [&](size_t start, size_t end) {
+        std::string str;
+        for (size_t index = start; index < end; index++) {
+            cl_uint word = getWord(index);
+            for (int b = 0; b < 4; b++) {
+                char c = (char)((word >> (b * 8)) & 0xFF);
+                if (c == '\0') {
+                    return str;
+                }
+                str += c;
+            }
+        }
+        return str;
+    };
+
+    size_t index = 5;
+    while (index < numWords) {
+        const cl_uint word = getWord(index);
+        const cl_uint opCode = word & spv::OpCodeMask;
+        const cl_uint wordCount = word >> spv::WordCountShift;
+        if (wordCount == 0 || wordCount > numWords - index) {
+            break;
+        }
+        if (opCode == spv::OpFunction) {
+            break;
+        }
+
+        switch (opCode) {
+        case spv::OpCapability:
+            if (wordCount >= 2) {
+                moduleInfo.Capabilities.push_back(getWord(index + 1));
+            }
+            break;
+        case spv::OpExtension:
+            moduleInfo.Extensions.push_back(
+                getString(index + 1, index + wordCount));
+            break;
+        case spv::OpExtInstImport:
+            moduleInfo.ExtendedInstructionSets.push_back(
+                getString(index + 2, index + wordCount));
+            break;
+        default: break;
+        }
+
+        index += wordCount;
+    }
+
+    return true;
+}
+
+// Gets the SPIR-V queries for a device that supports cl_khr_spirv_queries
+// natively.  Returns false if the queries are not supported.
+static bool getNativeSPIRVQueries(
+    cl_device_id device,
+    SDeviceInfo& deviceInfo)
+{
+    size_t size = 0;
+    cl_int errorCode = g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_SPIRV_EXTENDED_INSTRUCTION_SETS_KHR,
+        0,
+        nullptr,
+        &size);
+    if (errorCode != CL_SUCCESS) {
+        return false;
+    }
+    deviceInfo.ExtendedInstructionSets.resize(size / sizeof(const char*));
+    errorCode = g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_SPIRV_EXTENDED_INSTRUCTION_SETS_KHR,
+        size,
+        deviceInfo.ExtendedInstructionSets.data(),
+        nullptr);
+    if (errorCode != CL_SUCCESS) {
+        return false;
+    }
+
+    errorCode = g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_SPIRV_EXTENSIONS_KHR,
+        0,
+        nullptr,
+        &size);
+    if (errorCode != CL_SUCCESS) {
+        return false;
+    }
+    deviceInfo.Extensions.resize(size / sizeof(const char*));
+    errorCode = g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_SPIRV_EXTENSIONS_KHR,
+        size,
+        deviceInfo.Extensions.data(),
+        nullptr);
+    if (errorCode != CL_SUCCESS) {
+        return false;
+    }
+
+    errorCode = g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_SPIRV_CAPABILITIES_KHR,
+        0,
+        nullptr,
+        &size);
+    if (errorCode != CL_SUCCESS) {
+        return false;
+    }
+    deviceInfo.Capabilities.resize(size / sizeof(cl_uint));
+    errorCode = g_pNextDispatch->clGetDeviceInfo(
+        device,
+        CL_DEVICE_SPIRV_CAPABILITIES_KHR,
+        size,
+        deviceInfo.Capabilities.data(),
+        nullptr);
+
+    return errorCode == CL_SUCCESS;
+}
+
+// The SPIR-V capabilities, extensions, and extended instruction sets that
+// the emulated SPIR-V queries may report.  The emulated queries are a fixed
+// list, so a module that uses an item not in this list is passed to the
+// device, which may support it even though the emulated queries do not.
+// This list must be updated when items are added to the emulated queries.
+static const cl_uint cKnownCapabilities[] = {
+    spv::CapabilityAddresses,
+    spv::CapabilityAtomicFloat16AddEXT,
+    spv::CapabilityAtomicFloat16MinMaxEXT,
+    spv::CapabilityAtomicFloat32AddEXT,
+    spv::CapabilityAtomicFloat32MinMaxEXT,
+    spv::CapabilityAtomicFloat64AddEXT,
+    spv::CapabilityAtomicFloat64MinMaxEXT,
+    spv::CapabilityBFloat16ConversionINTEL,
+    spv::CapabilityBitInstructions,
+    spv::CapabilityDeviceEnqueue,
+    spv::CapabilityDotProduct,
+    spv::CapabilityDotProductInput4x8Bit,
+    spv::CapabilityDotProductInput4x8BitPacked,
+    spv::CapabilityExpectAssumeKHR,
+    spv::CapabilityFloat16,
+    spv::CapabilityFloat16Buffer,
+    spv::CapabilityFloat64,
+    spv::CapabilityGenericPointer,
+    spv::CapabilityGroupNonUniform,
+    spv::CapabilityGroupNonUniformArithmetic,
+    spv::CapabilityGroupNonUniformBallot,
+    spv::CapabilityGroupNonUniformClustered,
+    spv::CapabilityGroupNonUniformRotateKHR,
+    spv::CapabilityGroupNonUniformShuffle,
+    spv::CapabilityGroupNonUniformShuffleRelative,
+    spv::CapabilityGroupNonUniformVote,
+    spv::CapabilityGroupUniformArithmeticKHR,
+    spv::CapabilityGroups,
+    spv::CapabilityImage1D,
+    spv::CapabilityImageBasic,
+    spv::CapabilityImageBuffer,
+    spv::CapabilityImageMipmap,
+    spv::CapabilityImageReadWrite,
+    spv::CapabilityInt16,
+    spv::CapabilityInt64,
+    spv::CapabilityInt64Atomics,
+    spv::CapabilityInt8,
+    spv::CapabilityKernel,
+    spv::CapabilityLinkage,
+    spv::CapabilityLiteralSampler,
+    spv::CapabilityNamedBarrier,
+    spv::CapabilityPipeStorage,
+    spv::CapabilityPipes,
+    spv::CapabilitySampled1D,
+    spv::CapabilitySampledBuffer,
+    spv::CapabilityShaderClockKHR,
+    spv::CapabilitySplitBarrierINTEL,
+    spv::CapabilitySubgroupAvcMotionEstimationChromaINTEL,
+    spv::CapabilitySubgroupAvcMotionEstimationINTEL,
+    spv::CapabilitySubgroupAvcMotionEstimationIntraINTEL,
+    spv::CapabilitySubgroupBufferBlockIOINTEL,
+    spv::CapabilitySubgroupBufferPrefetchINTEL,
+    spv::CapabilitySubgroupDispatch,
+    spv::CapabilitySubgroupImageBlockIOINTEL,
+    spv::CapabilitySubgroupImageMediaBlockIOINTEL,
+    spv::CapabilitySubgroupShuffleINTEL,
+    spv::CapabilityUniformDecoration,
+    spv::CapabilityVector16,
+};
+
+static const char* const cKnownExtensions[] = {
+    "SPV_EXT_shader_atomic_float16_add",
+    "SPV_EXT_shader_atomic_float_add",
+    "SPV_EXT_shader_atomic_float_min_max",
+    "SPV_INTEL_bfloat16_conversion",
+    "SPV_INTEL_device_side_avc_motion_estimation",
+    "SPV_INTEL_media_block_io",
+    "SPV_INTEL_split_barrier",
+    "SPV_INTEL_subgroup_buffer_prefetch",
+    "SPV_INTEL_subgroups",
+    "SPV_KHR_bit_instructions",
+    "SPV_KHR_expect_assume",
+    "SPV_KHR_integer_dot_product",
+    "SPV_KHR_linkonce_odr",
+    "SPV_KHR_no_integer_wrap_decoration",
+    "SPV_KHR_shader_clock",
+    "SPV_KHR_subgroup_rotate",
+    "SPV_KHR_uniform_group_instructions",
+};
+
+static const char* const cKnownExtendedInstructionSets[] = {
+    "OpenCL.DebugInfo.100",
+    "OpenCL.std",
+};
+
+// Checks whether a device may support everything the module declares.  An
+// item is only unsupported if the device is known not to support it: the
+// native SPIR-V queries are complete, but the emulated SPIR-V queries only
+// describe the items in the known lists above.
+static bool checkModuleForDevice(
+    cl_device_id device,
+    const SModuleInfo& moduleInfo)
+{
+    SDeviceInfo nativeDeviceInfo;
+    const SDeviceInfo* pDeviceInfo = &getLayerContext().getDeviceInfo(device);
+    const bool isEmulated = !pDeviceInfo->supports_cl_khr_subgroup_queries;
+    if (!isEmulated) {
+        // If the device does not support cl_khr_spirv_queries natively
+        // either, such as for invalid devices, assume the module is
+        // supported.
+        if (getNativeSPIRVQueries(device, nativeDeviceInfo) == false) {
+            return true;
+        }
+        pDeviceInfo = &nativeDeviceInfo;
+    }
+    const SDeviceInfo& deviceInfo = *pDeviceInfo;
+
+    auto isKnownName = [&](
+            const std::string& str,
+            const char* const* begin,
+            const char* const* end) {
+        return !isEmulated ||
+            std::find_if(begin, end, [&](const char* name) {
+                return str == name;
+            }) != end;
+    };
+
+    for (auto capability : moduleInfo.Capabilities) {
+        if ((!isEmulated ||
+             std::find(
+                std::begin(cKnownCapabilities),
+                std::end(cKnownCapabilities),
+                capability) != std::end(cKnownCapabilities)) &&
+            std::find(
+                deviceInfo.Capabilities.begin(),
+                deviceInfo.Capabilities.end(),
+                capability) == deviceInfo.Capabilities.end()) {
+            return false;
+        }
+    }
+
+    for (const auto& extension : moduleInfo.Extensions) {
+        if (isKnownName(
+                extension,
+                std::begin(cKnownExtensions),
+                std::end(cKnownExtensions)) &&
+            std::find_if(
+                deviceInfo.Extensions.begin(),
+                deviceInfo.Extensions.end(),
+                [&](const char* name) { return extension == name; }) ==
+                deviceInfo.Extensions.end()) {
+            return false;
+        }
+    }
+
+    for (const auto& set : moduleInfo.ExtendedInstructionSets) {
+        // Non-semantic extended instruction sets may be ignored by the
+        // device, so they are never considered unsupported.
+        if (set.compare(0, 12, "NonSemantic.") == 0) {
+            continue;
+        }
+        if (isKnownName(
+                set,
+                std::begin(cKnownExtendedInstructionSets),
+                std::end(cKnownExtendedInstructionSets)) &&
+            std::find_if(
+                deviceInfo.ExtendedInstructionSets.begin(),
+                deviceInfo.ExtendedInstructionSets.end(),
+                [&](const char* name) { return set == name; }) ==
+                deviceInfo.ExtendedInstructionSets.end()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool clCreateProgramWithIL_override(
+    cl_context context,
+    const void* il,
+    size_t length,
+    cl_int* errcode_ret)
+{
+    SModuleInfo moduleInfo;
+    if (scanModule(il, length, moduleInfo) == false) {
+        return false;
+    }
+
+    size_t size = 0;
+    cl_int errorCode = g_pNextDispatch->clGetContextInfo(
+        context,
+        CL_CONTEXT_DEVICES,
+        0,
+        nullptr,
+        &size);
+    if (errorCode != CL_SUCCESS || size == 0) {
+        return false;
+    }
+
+    std::vector<cl_device_id> devices(size / sizeof(cl_device_id));
+    errorCode = g_pNextDispatch->clGetContextInfo(
+        context,
+        CL_CONTEXT_DEVICES,
+        size,
+        devices.data(),
+        nullptr);
+    if (errorCode != CL_SUCCESS) {
+        return false;
+    }
+
+    // The program may still be built for a subset of the devices in the
+    // context, so the module is only rejected if no device supports it.
+    for (auto device : devices) {
+        if (checkModuleForDevice(device, moduleInfo)) {
+            return false;
+        }
+    }
+
+    if (errcode_ret) {
+        errcode_ret[0] = CL_INVALID_VALUE;
+    }
+    return true;
+}
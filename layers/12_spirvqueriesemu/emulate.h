@@ -7,8 +7,13 @@
 #include <CL/cl.h>
 #include <CL/cl_ext.h>
 
+#include <string>
+
 extern const struct _cl_icd_dispatch* g_pNextDispatch;
 
+extern std::string g_CacheDir;
+extern bool g_CheckModules;
+
 #ifndef cl_khr_spirv_queries
 #define cl_khr_spirv_queries 1
 #define CL_KHR_SPIRV_QUERIES_EXTENSION_NAME "cl_khr_spirv_queries"
@@ -20,6 +25,9 @@ extern const struct _cl_icd_dispatch* g_pNextDispatch;
 ///////////////////////////////////////////////////////////////////////////////
 // Override Functions
 
+void clReleaseDevice_override(
+    cl_device_id device);
+
 bool clGetDeviceInfo_override(
     cl_device_id device,
     cl_device_info param_name,
@@ -35,3 +43,9 @@ bool clGetPlatformInfo_override(
     void* param_value,
     size_t* param_value_size_ret,
     cl_int* errcode_ret);
+
+bool clCreateProgramWithIL_override(
+    cl_context context,
+    const void* il,
+    size_t length,
+    cl_int* errcode_ret);
@@ -24,9 +24,26 @@
 #include <cstdio>
 
 #include "layer_util.hpp"
+#include "getenv_util.hpp"
 
 #include "emulate.h"
 
+// Enables an on-disk cache for the emulated SPIR-V query results.  When set,
+// the results for each device are saved to a file in this directory the
+// first time the device is queried, and are loaded from the file instead of
+// being computed again by later processes.  The cache files are keyed by the
+// device name, driver version, and layer version.
+
+std::string g_CacheDir;
+
+// Enables checking SPIR-V modules passed to clCreateProgramWithIL against the
+// SPIR-V capabilities, extensions, and extended instruction sets supported by
+// the devices in the context.  A module that no device supports is rejected
+// immediately, rather than failing later when the program is built.  Items
+// the emulated queries do not describe are left for the device to check.
+
+bool g_CheckModules = false;
+
 const struct _cl_icd_dispatch* g_pNextDispatch = NULL;
 
 static cl_int CL_API_CALL
@@ -85,11 +102,45 @@ clGetPlatformInfo_layer(
     return errorCode;
 }
 
+static cl_program CL_API_CALL
+clCreateProgramWithIL_layer(
+    cl_context      context,
+    const void*     il,
+    size_t          length,
+    cl_int*         errcode_ret)
+{
+    if (g_CheckModules &&
+        clCreateProgramWithIL_override(
+            context,
+            il,
+            length,
+            errcode_ret)) {
+        return nullptr;
+    }
+
+    return g_pNextDispatch->clCreateProgramWithIL(
+        context,
+        il,
+        length,
+        errcode_ret);
+}
+
+static cl_int CL_API_CALL
+clReleaseDevice_layer(
+    cl_device_id    device)
+{
+    clReleaseDevice_override(device);
+
+    return g_pNextDispatch->clReleaseDevice(device);
+}
+
 static struct _cl_icd_dispatch dispatch;
 static void _init_dispatch()
 {
     dispatch.clGetDeviceInfo = clGetDeviceInfo_layer;
     dispatch.clGetPlatformInfo = clGetPlatformInfo_layer;
+    dispatch.clCreateProgramWithIL = clCreateProgramWithIL_layer;
+    dispatch.clReleaseDevice = clReleaseDevice_layer;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clGetLayerInfo(
@@ -148,6 +199,9 @@ CL_API_ENTRY cl_int CL_API_CALL clInitLayerWithProperties(
         return CL_INVALID_VALUE;
     }
 
+    getControl("SPIRVQUERIESEMU_CacheDir", g_CacheDir);
+    getControl("SPIRVQUERIESEMU_CheckModules", g_CheckModules);
+
     _init_dispatch();
 
     g_pNextDispatch = target_dispatch;
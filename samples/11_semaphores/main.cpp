@@ -10,6 +10,13 @@
 
 #include "util.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+using test_clock = std::chrono::high_resolution_clock;
+
 #ifndef CL_KHR_SEMAPHORE_EXTENSION_NAME
 #define CL_KHR_SEMAPHORE_EXTENSION_NAME "cl_khr_semaphore"
 #endif
@@ -36,6 +43,206 @@ static void PrintSemaphoreTypes(const std::vector<cl_semaphore_type_khr>& types)
     }
 }
 
+// Each benchmark chain has its own command-queues, kernel, buffers, and
+// semaphores, so chains may run concurrently from different threads.  A hop
+// signals a semaphore on one queue and waits on it on the next queue,
+// optionally after executing a kernel on the first queue.
+struct BenchmarkChain
+{
+    std::vector<cl::CommandQueue> queues;
+    std::vector<cl_semaphore_khr> semaphores;
+    cl::Kernel kernel;
+    cl::Buffer b0;
+    cl::Buffer b1;
+
+    std::vector<double> latencies;
+};
+
+static void initChain(
+    BenchmarkChain& chain,
+    cl::Context& context,
+    cl::Device& device,
+    cl::Program& program,
+    int numQueues,
+    size_t gwx)
+{
+    for (int q = 0; q < numQueues; q++) {
+        chain.queues.emplace_back(context, device);
+    }
+
+    cl_semaphore_properties_khr semaphoreProperties[] = {
+        CL_SEMAPHORE_TYPE_KHR,
+        CL_SEMAPHORE_TYPE_BINARY_KHR,
+        0,
+    };
+    for (int q = 0; q < numQueues; q++) {
+        chain.semaphores.push_back(clCreateSemaphoreWithPropertiesKHR(
+            context(),
+            semaphoreProperties,
+            NULL ));
+    }
+
+    if (gwx > 0) {
+        chain.kernel = cl::Kernel{ program, "Add1" };
+        chain.b0 = cl::Buffer{
+            context,
+            CL_MEM_ALLOC_HOST_PTR,
+            gwx * sizeof( cl_uint ) };
+        chain.b1 = cl::Buffer{
+            context,
+            CL_MEM_ALLOC_HOST_PTR,
+            gwx * sizeof( cl_uint ) };
+
+        cl_uint pattern = 0;
+        chain.queues[0].enqueueFillBuffer(chain.b0, pattern, 0, gwx * sizeof(cl_uint));
+        chain.queues[0].finish();
+
+        chain.kernel.setArg(0, chain.b1);   // dst
+        chain.kernel.setArg(1, chain.b0);   // src
+    }
+}
+
+static void enqueueHop(
+    BenchmarkChain& chain,
+    int hop,
+    size_t gwx,
+    cl_event* event)
+{
+    const size_t numQueues = chain.queues.size();
+    cl::CommandQueue& src = chain.queues[hop % numQueues];
+    cl::CommandQueue& dst = chain.queues[(hop + 1) % numQueues];
+    cl_semaphore_khr semaphore = chain.semaphores[hop % numQueues];
+
+    if (gwx > 0) {
+        src.enqueueNDRangeKernel( chain.kernel, cl::NullRange, cl::NDRange{gwx} );
+    }
+    clEnqueueSignalSemaphoresKHR(src(), 1, &semaphore, NULL, 0, NULL, NULL);
+    clEnqueueWaitSemaphoresKHR(dst(), 1, &semaphore, NULL, 0, NULL, event);
+}
+
+// Measures the latency of each hop by waiting for each hop to complete
+// before enqueueing the next hop.
+static void runLatency(
+    BenchmarkChain& chain,
+    int numHops,
+    size_t gwx)
+{
+    const size_t numQueues = chain.queues.size();
+    for (int hop = 0; hop < numHops; hop++) {
+        auto start = test_clock::now();
+
+        cl_event event = NULL;
+        enqueueHop(chain, hop, gwx, &event);
+        chain.queues[hop % numQueues].flush();
+        clWaitForEvents(1, &event);
+
+        auto end = test_clock::now();
+        std::chrono::duration<double, std::micro> elapsed = end - start;
+        chain.latencies.push_back(elapsed.count());
+
+        clReleaseEvent(event);
+    }
+    for (auto& queue : chain.queues) {
+        queue.finish();
+    }
+}
+
+// Measures throughput by enqueueing every hop before waiting for the hops
+// to complete.
+static void runThroughput(
+    BenchmarkChain& chain,
+    int numHops,
+    size_t gwx)
+{
+    for (int hop = 0; hop < numHops; hop++) {
+        enqueueHop(chain, hop, gwx, NULL);
+    }
+    for (auto& queue : chain.queues) {
+        queue.flush();
+    }
+    for (auto& queue : chain.queues) {
+        queue.finish();
+    }
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void runBenchmark(
+    cl::Context& context,
+    cl::Device& device,
+    cl::Program& program,
+    int numQueues,
+    int numHops,
+    int numThreads,
+    size_t gwx)
+{
+    printf("Benchmark: %d thread(s), %d queue(s), %d hop(s), gwx = %zu\n",
+        numThreads, numQueues, numHops, gwx);
+
+    std::vector<BenchmarkChain> chains(numThreads);
+    for (auto& chain : chains) {
+        initChain(chain, context, device, program, numQueues, gwx);
+    }
+
+    // Run every chain once to warm up.
+    for (auto& chain : chains) {
+        runThroughput(chain, numQueues, gwx);
+    }
+
+    {
+        std::vector<std::thread> threads;
+        for (auto& chain : chains) {
+            threads.emplace_back(runLatency, std::ref(chain), numHops, gwx);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    std::vector<double> latencies;
+    for (const auto& chain : chains) {
+        latencies.insert(latencies.end(), chain.latencies.begin(), chain.latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("Hop latency (us): p50 = %.2f, p90 = %.2f, p99 = %.2f, max = %.2f\n",
+        percentile(latencies, 50.0),
+        percentile(latencies, 90.0),
+        percentile(latencies, 99.0),
+        latencies.empty() ? 0.0 : latencies.back());
+
+    auto start = test_clock::now();
+    {
+        std::vector<std::thread> threads;
+        for (auto& chain : chains) {
+            threads.emplace_back(runThroughput, std::ref(chain), numHops, gwx);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    auto end = test_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end - start;
+
+    // Each hop is one semaphore signal and one semaphore wait.
+    double hopsPerSecond = (double)numHops * numThreads / elapsed_seconds.count();
+    printf("Throughput: %.0f hops/s (%.0f semaphore ops/s)\n",
+        hopsPerSecond, hopsPerSecond * 2.0);
+
+    for (auto& chain : chains) {
+        for (auto semaphore : chain.semaphores) {
+            clReleaseSemaphoreKHR(semaphore);
+        }
+    }
+}
+
 int main(
     int argc,
     char** argv )
@@ -45,6 +252,11 @@ int main(
 
     size_t gwx = 512;
 
+    bool benchmark = false;
+    int numQueues = 2;
+    int numHops = 1000;
+    int numThreads = 1;
+
     {
         bool advanced = false;
 
@@ -52,6 +264,11 @@ int main(
         op.add<popl::Value<int>>("p", "platform", "Platform Index", platformIndex, &platformIndex);
         op.add<popl::Value<int>>("d", "device", "Device Index", deviceIndex, &deviceIndex);
         op.add<popl::Value<size_t>>("", "gwx", "Global Work Size", gwx, &gwx);
+        op.add<popl::Switch>("b", "benchmark", "Run Semaphore Benchmark", &benchmark);
+        op.add<popl::Switch>("a", "advanced", "Show advanced options", &advanced);
+        op.add<popl::Value<int>, popl::Attribute::advanced>("", "queues", "Benchmark Queues", numQueues, &numQueues);
+        op.add<popl::Value<int>, popl::Attribute::advanced>("", "hops", "Benchmark Hops", numHops, &numHops);
+        op.add<popl::Value<int>, popl::Attribute::advanced>("", "threads", "Benchmark Threads", numThreads, &numThreads);
         bool printUsage = false;
         try {
             op.parse(argc, argv);
@@ -106,11 +323,30 @@ int main(
     PrintSemaphoreTypes(deviceSemaphoreTypes);
 
     cl::Context context{devices[deviceIndex]};
-    cl::CommandQueue q0{context, devices[deviceIndex]};
-    cl::CommandQueue q1{context, devices[deviceIndex]};
 
     cl::Program program{ context, kernelString };
     program.build();
+
+    if (benchmark) {
+        if (numQueues < 2 || numHops < 1 || numThreads < 1) {
+            printf("The benchmark requires at least two queues, one hop, and one thread.\n");
+            return -1;
+        }
+        runBenchmark(
+            context,
+            devices[deviceIndex],
+            program,
+            numQueues,
+            numHops,
+            numThreads,
+            gwx);
+        printf("Done.\n");
+        return 0;
+    }
+
+    cl::CommandQueue q0{context, devices[deviceIndex]};
+    cl::CommandQueue q1{context, devices[deviceIndex]};
+
     cl::Kernel kernel{ program, "Add1" };
 
     cl::Buffer b0 = cl::Buffer{